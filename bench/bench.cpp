@@ -0,0 +1,560 @@
+/**
+ * Crane's benchmark suite, built and run by `make bench`.
+ *
+ * Deterministic synthetic files (random bytes, zeros and text) are generated
+ * once per size and kept in the data directory. The core module is loaded the
+ * way `load` does it and its commands are run through their
+ * CraneCommandHandler with a pipe, exactly like the prompt runs a line, so
+ * the numbers include parsing, dispatch and the handler itself.
+ *
+ *   make bench
+ *   make bench BENCH_SIZES=1M,64M,1G,8G
+ *   ./crane-bench --sizes 1M --kinds text --time 2 --output result.json
+ *
+ * Results are written as JSON (to stdout unless --output is given), one entry
+ * per benchmark and file with the throughput and latency percentiles. Command
+ * output is discarded while benchmarks run, progress goes to stderr.
+ */
+
+#include "commands.hpp"
+#include "config.hpp"
+#include "context.hpp"
+#include "contributions.hpp"
+#include "prompt.hpp"
+#include "spans.hpp"
+#include "storage.hpp"
+#include "view.hpp"
+#include <algorithm>
+#include <chrono>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <functional>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if kUsingCraneDarwin
+#define kBenchDefaultCore "extern/core.dylib"
+#else
+#define kBenchDefaultCore "extern/core.so"
+#endif
+
+// edit mode keeps the whole file in memory, bigger files skip those benchmarks
+#define kBenchEditLimit (1ULL << 30)
+#define kBenchDumpBytes (4ULL << 20)
+#define kBenchMaxIterations 10000
+#define kBenchParseBatch 100
+
+struct BenchOptions {
+public:
+  std::vector<u64> sizes;
+  std::vector<std::string> kinds;
+  std::string dataDirectory;
+  std::string corePath;
+  std::string cranePath;
+  std::string outputPath;
+  double secondsPerBenchmark;
+
+  BenchOptions()
+    : sizes({1ULL << 20, 64ULL << 20}),
+      kinds({"random", "zeros", "text"}),
+      dataDirectory("build/bench"),
+      corePath(kBenchDefaultCore),
+      cranePath("./crane"),
+      secondsPerBenchmark(0.5) {}
+};
+
+struct BenchResult {
+public:
+  std::string benchmark;
+  std::string file;
+  // bytes processed by one iteration, 0 for pure latency benchmarks
+  u64 bytes;
+  std::vector<double> samples;
+};
+
+// xorshift64*, the same seed always produces the same files
+struct BenchRandom {
+public:
+  u64 state;
+
+  BenchRandom(u64 seed) : state(seed) {}
+
+  inline u64 next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+  }
+};
+
+static std::vector<BenchResult> results;
+static double secondsPerBenchmark;
+
+static bool parseSize(const std::string &text, u64 &size) {
+  char *end;
+  size = strtoull(text.c_str(), &end, 10);
+  switch (*end) {
+  case 'K':
+  case 'k':
+    size <<= 10;
+    end++;
+    break;
+  case 'M':
+  case 'm':
+    size <<= 20;
+    end++;
+    break;
+  case 'G':
+  case 'g':
+    size <<= 30;
+    end++;
+    break;
+  }
+
+  return *end == '\0' && size != 0;
+}
+
+static std::string formatSize(u64 size) {
+  if (size % (1ULL << 30) == 0) {
+    return std::to_string(size >> 30) + "G";
+  } else if (size % (1ULL << 20) == 0) {
+    return std::to_string(size >> 20) + "M";
+  } else if (size % (1ULL << 10) == 0) {
+    return std::to_string(size >> 10) + "K";
+  }
+  return std::to_string(size);
+}
+
+static std::vector<std::string> splitList(const std::string &text) {
+  std::vector<std::string> items;
+  size_t start = 0;
+  while (start <= text.size()) {
+    size_t comma = text.find(',', start);
+    if (comma == std::string::npos) {
+      comma = text.size();
+    }
+    if (comma > start) {
+      items.push_back(text.substr(start, comma - start));
+    }
+    start = comma + 1;
+  }
+  return items;
+}
+
+static void fillBlock(const std::string &kind, BenchRandom &random, u8 *block,
+                      size_t size) {
+  static const char *words[] = {"crane", "lorem",  "ipsum", "dolor", "sit",    "amet",
+                                "hex",   "editor", "byte",  "offset", "module", "span"};
+
+  if (kind == "zeros") {
+    memset(block, 0, size);
+  } else if (kind == "random") {
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+      u64 value = random.next();
+      memcpy(block + i, &value, 8);
+    }
+    for (size_t i = size & ~(size_t)7; i < size; i++) {
+      block[i] = (u8)random.next();
+    }
+  } else {
+    // words separated by spaces, with a line break every 60 to 80 characters
+    size_t column = 0;
+    size_t lineLength = 60 + random.next() % 21;
+    for (size_t i = 0; i < size;) {
+      if (column >= lineLength) {
+        block[i++] = '\n';
+        column = 0;
+        lineLength = 60 + random.next() % 21;
+        continue;
+      }
+
+      const char *word = words[random.next() % (sizeof(words) / sizeof(words[0]))];
+      for (size_t c = 0; word[c] != '\0' && i < size; c++, column++) {
+        block[i++] = word[c];
+      }
+      if (i < size) {
+        block[i++] = ' ';
+        column++;
+      }
+    }
+  }
+}
+
+// generates `<kind>-<size>.bin` unless a file of the right size is already there
+static std::string generateFile(const BenchOptions &options, const std::string &kind,
+                                u64 size) {
+  std::string path = options.dataDirectory + "/" + kind + "-" + formatSize(size) + ".bin";
+
+  struct stat fileStat;
+  if (stat(path.c_str(), &fileStat) == 0 && (u64)fileStat.st_size == size) {
+    return path;
+  }
+
+  fprintf(stderr, "generating %s\n", path.c_str());
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    perror(path.c_str());
+    return "";
+  }
+
+  BenchRandom random(0x6372616E65ULL + size);
+  std::vector<u8> block(1 << 20);
+  for (u64 written = 0; written < size; written += block.size()) {
+    size_t chunk = std::min<u64>(block.size(), size - written);
+    fillBlock(kind, random, block.data(), chunk);
+    if (fwrite(block.data(), 1, chunk, file) != chunk) {
+      perror(path.c_str());
+      fclose(file);
+      remove(path.c_str());
+      return "";
+    }
+  }
+
+  fclose(file);
+  return path;
+}
+
+static double elapsedNanoseconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// runs `iteration` until the time budget is used (at least once, and three
+// times unless a single run already takes several budgets)
+static bool measure(const std::string &benchmark, const std::string &file, u64 bytes,
+                    const std::function<bool(double &)> &iteration) {
+  BenchResult result{benchmark, file, bytes, {}};
+  double budget = secondsPerBenchmark * 1e9;
+  double total = 0;
+
+  while (result.samples.size() < kBenchMaxIterations) {
+    double sample;
+    if (!iteration(sample)) {
+      fprintf(stderr, "  %s on %s failed\n", benchmark.c_str(), file.c_str());
+      return false;
+    }
+
+    result.samples.push_back(sample);
+    total += sample;
+    if ((total >= budget && result.samples.size() >= 3) || total >= budget * 4) {
+      break;
+    }
+  }
+
+  std::sort(result.samples.begin(), result.samples.end());
+  fprintf(stderr, "  %-12s %-14s %6zu runs, median %.0fns\n", benchmark.c_str(),
+          file.c_str(), result.samples.size(),
+          result.samples[result.samples.size() / 2]);
+  results.push_back(result);
+  return true;
+}
+
+// runs a line the way the prompt does, every stage feeding the next through a pipe
+static bool runLine(CraneContext *context, const std::string &line) {
+  CraneCommand *command = CraneCommand::parseCommand(context, line);
+  if (command == nullptr) {
+    return false;
+  }
+
+  CranePipe pipe;
+  context->pipe = &pipe;
+
+  int res = 0;
+  for (CraneCommand *stage = command; stage != nullptr && res == 0; stage = stage->next) {
+    if (stage != command) {
+      pipe.advance();
+    }
+
+    CraneCommandEntry *entry = context->session->commandMap.find(stage->name);
+    res = entry != nullptr && entry->handler != nullptr ? entry->handler(stage, context)
+                                                         : -1;
+  }
+
+  context->pipe = nullptr;
+  delete command;
+  return res == 0;
+}
+
+static bool timeLine(CraneContext *context, const std::string &line, double &sample) {
+  auto start = std::chrono::steady_clock::now();
+  bool succeeded = runLine(context, line);
+  sample = elapsedNanoseconds(start);
+  return succeeded;
+}
+
+static void benchmarkFile(CraneContext *context, const std::string &path,
+                          const std::string &name, u64 size) {
+  if (!runLine(context, "open \"" + path + "\" bench")) {
+    fprintf(stderr, "  failed to open %s\n", path.c_str());
+    return;
+  }
+
+  BenchRandom random(size);
+  auto randomOffset = [&]() { return std::to_string(random.next() % size); };
+
+  measure("hash", name, size,
+          [&](double &sample) { return timeLine(context, "hash", sample); });
+  measure("find", name, size,
+          [&](double &sample) { return timeLine(context, "find DEADBEEF", sample); });
+
+  u64 dumped = std::min<u64>(size, kBenchDumpBytes);
+  measure("dump", name, dumped, [&](double &sample) {
+    return timeLine(context, "range 0 " + std::to_string(dumped) + " | dump", sample);
+  });
+
+  measure("byteat", name, 0, [&](double &sample) {
+    return timeLine(context, "byteat " + randomOffset(), sample);
+  });
+
+  if (size <= kBenchEditLimit) {
+    measure("mode edit", name, size, [&](double &sample) {
+      return timeLine(context, "mode edit", sample) && runLine(context, "mode normal");
+    });
+
+    runLine(context, "mode edit");
+
+    measure("write", name, 0, [&](double &sample) {
+      return timeLine(context, "write " + randomOffset() + " crane!!!", sample);
+    });
+
+    measure("insert", name, 0, [&](double &sample) {
+      return timeLine(context, "insert " + randomOffset() + " crane!!!", sample);
+    });
+
+    runLine(context, "mode normal");
+  }
+
+  runLine(context, "close");
+}
+
+static void benchmarkParse(CraneContext *context) {
+  static const char *lines[] = {
+      "dump",
+      "write 0x1000 \"hello world\" ",
+      "range 0x100 4096 | find DEADBEEF | hash crc32",
+      "columns record 0x40 100000 \"id,size,flags\" csv /tmp/out.csv",
+      "sortrecords 0 1000000 16 8 u64be &",
+  };
+
+  for (auto line : lines) {
+    std::string name = std::string(line).substr(0, std::string(line).find(' '));
+    measure("parse", name, 0, [&](double &sample) {
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < kBenchParseBatch; i++) {
+        delete CraneCommand::parseCommand(context, line);
+      }
+      sample = elapsedNanoseconds(start) / kBenchParseBatch;
+      return true;
+    });
+  }
+}
+
+// opening the module from a private copy so it's really loaded every time
+static void benchmarkLoad(const BenchOptions &options) {
+  std::string copy = options.dataDirectory + "/core-copy" +
+                     options.corePath.substr(options.corePath.rfind('.'));
+  std::string command = "cp '" + options.corePath + "' '" + copy + "'";
+  if (system(command.c_str()) != 0) {
+    return;
+  }
+
+  measure("load", "core", 0, [&](double &sample) {
+    auto start = std::chrono::steady_clock::now();
+    void *handle = dlopen(copy.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+      return false;
+    }
+
+    CraneContributionInitialiser init =
+        (CraneContributionInitialiser)dlsym(handle, "crane_init");
+    CraneCommandRegistry registry;
+    CraneContributedCommands *contrib = init();
+    for (auto entry : contrib->contributedCommands) {
+      registry.insert(entry->name, entry);
+    }
+    dlclose(handle);
+    sample = elapsedNanoseconds(start);
+    return true;
+  });
+  remove(copy.c_str());
+
+  if (access(options.cranePath.c_str(), X_OK) != 0) {
+    return;
+  }
+
+  // the whole startup, loading core from its manifest like a real session
+  measure("startup", "crane", 0, [&](double &sample) {
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+      execl(options.cranePath.c_str(), options.cranePath.c_str(), "-c", "?", nullptr);
+      _exit(127);
+    }
+
+    int status;
+    bool succeeded = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+                     WEXITSTATUS(status) == 0;
+    sample = elapsedNanoseconds(start);
+    return succeeded;
+  });
+}
+
+static double percentile(const std::vector<double> &sorted, double fraction) {
+  size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static void writeResults(FILE *out) {
+  fprintf(out, "{\n  \"crane\": \"%s\",\n  \"threads\": %zu,\n  \"results\": [",
+          kCraneVersionString, (size_t)std::thread::hardware_concurrency());
+
+  for (size_t i = 0; i < results.size(); i++) {
+    BenchResult &result = results[i];
+    double total = 0;
+    for (double sample : result.samples) {
+      total += sample;
+    }
+    double mean = total / result.samples.size();
+
+    fprintf(out, "%s\n    {\"benchmark\": \"%s\", \"file\": \"%s\", \"iterations\": %zu",
+            i ? "," : "", result.benchmark.c_str(), result.file.c_str(),
+            result.samples.size());
+    if (result.bytes != 0) {
+      fprintf(out, ", \"bytes\": %llu, \"megabytesPerSecond\": %.2f", result.bytes,
+              result.bytes / (mean / 1e9) / (1 << 20));
+    }
+    fprintf(out,
+            ", \"latencyNs\": {\"mean\": %.0f, \"p50\": %.0f, \"p90\": %.0f, "
+            "\"p99\": %.0f, \"max\": %.0f}}",
+            mean, percentile(result.samples, 0.5), percentile(result.samples, 0.9),
+            percentile(result.samples, 0.99), result.samples.back());
+  }
+
+  fprintf(out, "\n  ]\n}\n");
+}
+
+static void printUsage() {
+  fprintf(stderr,
+          "usage: crane-bench [options]\n"
+          "    --sizes <1M,64M,...>       File sizes to generate (K, M and G suffixes)\n"
+          "    --kinds <random,zeros,text>\n"
+          "    --dir <path>               Where generated files are kept\n"
+          "    --core <path>              The core module to benchmark\n"
+          "    --crane <path>             The binary used for the startup benchmark\n"
+          "    --time <seconds>           Time spent on each benchmark\n"
+          "    --output <path>            Writes the JSON results to a file\n");
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options;
+
+  for (int i = 1; i < argc; i++) {
+    std::string option(argv[i]);
+    if (i + 1 >= argc) {
+      printUsage();
+      return 1;
+    }
+
+    std::string value(argv[++i]);
+    if (option == "--sizes") {
+      options.sizes.clear();
+      for (auto &item : splitList(value)) {
+        u64 size;
+        if (!parseSize(item, size)) {
+          fprintf(stderr, "Invalid size '%s'\n", item.c_str());
+          return 1;
+        }
+        options.sizes.push_back(size);
+      }
+    } else if (option == "--kinds") {
+      options.kinds = splitList(value);
+      for (auto &kind : options.kinds) {
+        if (kind != "random" && kind != "zeros" && kind != "text") {
+          fprintf(stderr, "Unknown kind '%s'\n", kind.c_str());
+          return 1;
+        }
+      }
+    } else if (option == "--dir") {
+      options.dataDirectory = value;
+    } else if (option == "--core") {
+      options.corePath = value;
+    } else if (option == "--crane") {
+      options.cranePath = value;
+    } else if (option == "--time") {
+      options.secondsPerBenchmark = atof(value.c_str());
+    } else if (option == "--output") {
+      options.outputPath = value;
+    } else {
+      printUsage();
+      return 1;
+    }
+  }
+
+  secondsPerBenchmark = options.secondsPerBenchmark;
+  mkdir(options.dataDirectory.c_str(), 0755);
+
+  CraneContext *context = new CraneContext();
+  context->session = new CraneSession();
+  context->isInteractive = false;
+  context->scheduler = new CraneScheduler();
+  context->views = craneHostViewApi();
+
+  void *core = dlopen(options.corePath.c_str(), RTLD_NOW | RTLD_GLOBAL);
+  if (core == nullptr) {
+    fprintf(stderr, "Failed to open '%s': %s\n", options.corePath.c_str(), dlerror());
+    return 1;
+  }
+
+  CraneContributionInitialiser init = (CraneContributionInitialiser)dlsym(core, "crane_init");
+  if (init == nullptr) {
+    fprintf(stderr, "'%s' isn't a Crane module\n", options.corePath.c_str());
+    return 1;
+  }
+  for (auto entry : init()->contributedCommands) {
+    context->session->commandMap.insert(entry->name, entry);
+  }
+
+  // commands print as they would at the prompt, none of it is wanted here
+  fflush(stdout);
+  int realStdout = dup(1);
+  int devNull = open("/dev/null", O_WRONLY);
+  dup2(devNull, 1);
+  close(devNull);
+
+  fprintf(stderr, "parsing\n");
+  benchmarkParse(context);
+
+  fprintf(stderr, "loading\n");
+  benchmarkLoad(options);
+
+  for (u64 size : options.sizes) {
+    for (auto &kind : options.kinds) {
+      std::string path = generateFile(options, kind, size);
+      if (path.empty()) {
+        return 1;
+      }
+
+      std::string name = kind + "-" + formatSize(size);
+      fprintf(stderr, "%s\n", name.c_str());
+      benchmarkFile(context, path, name, size);
+    }
+  }
+
+  fflush(stdout);
+  dup2(realStdout, 1);
+  close(realStdout);
+
+  FILE *out = options.outputPath.empty() ? stdout : fopen(options.outputPath.c_str(), "w");
+  if (out == nullptr) {
+    perror(options.outputPath.c_str());
+    return 1;
+  }
+  writeResults(out);
+  if (out != stdout) {
+    fclose(out);
+    fprintf(stderr, "results written to %s\n", options.outputPath.c_str());
+  }
+
+  return 0;
+}
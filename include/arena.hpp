@@ -0,0 +1,106 @@
+#ifndef arena_hpp
+#define arena_hpp
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#define kArenaInlineSize 256
+#define kArenaChunkSize 4096
+
+/**
+ * A bump allocator for short-lived, trivially destructible objects.
+ *
+ * The first few hundred bytes live inside the arena itself so small commands
+ * never touch the heap; larger ones grow into a list of chunks which are all
+ * released at once by `reset()` or when the arena is destroyed.
+ */
+struct CraneArena {
+private:
+  struct Chunk {
+    Chunk *next;
+    size_t size;
+  };
+
+  alignas(std::max_align_t) unsigned char initial[kArenaInlineSize];
+  unsigned char *cursor;
+  unsigned char *limit;
+  Chunk *chunks;
+
+public:
+  CraneArena() : cursor(initial), limit(initial + kArenaInlineSize), chunks(nullptr) {}
+
+  CraneArena(const CraneArena &) = delete;
+  CraneArena &operator=(const CraneArena &) = delete;
+
+  ~CraneArena() { release(); }
+
+  inline void *allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+    uintptr_t aligned = ((uintptr_t)cursor + align - 1) & ~(uintptr_t)(align - 1);
+    if (aligned + size > (uintptr_t)limit) {
+      size_t chunkSize = sizeof(Chunk) + align + size;
+      if (chunkSize < kArenaChunkSize) {
+        chunkSize = kArenaChunkSize;
+      }
+
+      Chunk *chunk = (Chunk *)malloc(chunkSize);
+      if (chunk == nullptr) {
+        throw std::bad_alloc();
+      }
+
+      chunk->next = chunks;
+      chunk->size = chunkSize;
+      chunks = chunk;
+      cursor = (unsigned char *)(chunk + 1);
+      limit = (unsigned char *)chunk + chunkSize;
+      aligned = ((uintptr_t)cursor + align - 1) & ~(uintptr_t)(align - 1);
+    }
+
+    cursor = (unsigned char *)(aligned + size);
+    return (void *)aligned;
+  }
+
+  template <typename T, typename... Args>
+  inline T *make(Args &&...args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena objects are never destroyed");
+    return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  template <typename T>
+  inline T *makeArray(size_t count) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena objects are never destroyed");
+    return (T *)allocate(sizeof(T) * count, alignof(T));
+  }
+
+  // copies a string into the arena, the copy is always NUL terminated
+  inline std::string_view copy(std::string_view value) {
+    char *out = (char *)allocate(value.size() + 1, 1);
+    memcpy(out, value.data(), value.size());
+    out[value.size()] = '\0';
+    return std::string_view(out, value.size());
+  }
+
+  // frees every chunk, keeping only the inline storage
+  inline void reset() {
+    release();
+    cursor = initial;
+    limit = initial + kArenaInlineSize;
+  }
+
+private:
+  inline void release() {
+    while (chunks) {
+      Chunk *next = chunks->next;
+      free(chunks);
+      chunks = next;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef capture_hpp
+#define capture_hpp
+
+#include <string>
+
+/**
+ * Collects what commands print, per thread, while several run at once (see
+ * `foreach` and the server). While a capture is active `stdout` is a stream
+ * that appends whatever a thread prints to the string it set with
+ * `craneCaptureInto`. Threads that haven't set one still print to the console.
+ *
+ * Captures nest: `stdout` is swapped by the first `craneCaptureBegin` and put
+ * back by the last `craneCaptureEnd`.
+ */
+
+void craneCaptureBegin();
+void craneCaptureEnd();
+
+// sets where this thread's output goes (null for the console), returns the last one
+std::string *craneCaptureInto(std::string *output);
+
+#endif
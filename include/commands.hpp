@@ -14,6 +14,7 @@ typedef int (*CraneCommandHandler)(CraneCommand *, CraneContext *);
 
 enum class CraneArgumentType {
   Boolean,
+  File,
   String,
   Number
 };
@@ -47,15 +48,25 @@ public:
   std::string description;
   bool isVariadic;
   bool requiresOpenFile;
+  bool acceptsInput;
   bool shouldOverride;
+  bool isSafePerFile;
   CraneCommandHandler handler;
   CraneCommandEntry *overridenEntry;
   std::vector<CraneCommandArgument*> arguments;
+  // the module providing the command, empty for builtins. Stubs registered from
+  // a manifest have no handler, the module is loaded the first time they run
+  std::string module;
 
   CraneCommandEntry(std::string name, CraneCommandHandler handler, bool isVariadic)
     : name(name),
       isVariadic(isVariadic),
-      handler(handler) {}
+      requiresOpenFile(false),
+      acceptsInput(false),
+      shouldOverride(false),
+      isSafePerFile(false),
+      handler(handler),
+      overridenEntry(nullptr) {}
   
   inline void setCommandDescription(std::string desc) {
     this->description = desc;
@@ -65,6 +76,22 @@ public:
     this->requiresOpenFile = requiresOpenFile;
   }
 
+  // the command replaces one that's already registered (restored on `reload`)
+  inline void setShouldOverride(bool shouldOverride = true) {
+    this->shouldOverride = shouldOverride;
+  }
+
+  // the command can consume spans from a previous pipeline stage
+  inline void setAcceptsInput(bool acceptsInput = true) {
+    this->acceptsInput = acceptsInput;
+  }
+
+  // the command only touches the selected file, so `foreach` may run it on every
+  // file of a group at once
+  inline void setSafePerFile(bool isSafePerFile = true) {
+    this->isSafePerFile = isSafePerFile;
+  }
+
   inline void addArgument(std::string name, bool isOptional, CraneArgumentType type) {
     auto arg = new CraneCommandArgument(name, isOptional, type);
     arguments.push_back(arg);
@@ -4,8 +4,15 @@
 //    100000 * major +
 //      1000 * minor +
 //         1 * patch
-#define kCraneVersion 000001
-#define kCraneVersionString "0.0.1"
+#define kCraneVersion 2001
+#define kCraneVersionString "0.2.1"
+
+// the oldest module version that can still be loaded. Modules built against
+// 0.2.0 or later see the same layout of `CraneCommandEntry`, `CraneContext` and
+// `CraneOpenFile`: the host keeps its storage behind their pointers (see
+// "storage.hpp") and only appends view functions (see "view.hpp"). A version
+// that has to change that layout raises this to itself
+#define kCraneMinimumVersion 2000
 
 #define kCraneVersionMatches(major, minor, patch) \
   (major * 100000 + minor * 1000 + patch) == kCraneVersion
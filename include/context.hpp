@@ -5,17 +5,52 @@
 #include <cstdlib>
 #include <map>
 #include <string>
+#include <vector>
 
 struct CraneCommandEntry;
+struct CraneFileStorage;
+struct CraneJob;
+struct CraneMacro;
+struct CranePipe;
+struct CraneScheduler;
+struct CraneSession;
+struct CraneStats;
+struct CraneTracer;
+struct CraneViewApi;
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
 
 struct CraneOpenFile {
 public:
   std::string path;
   std::string alias;
   FILE *handle;
+  // the file's pages, extents and pieces, only the host's (see "storage.hpp"),
+  // modules read and edit the file through `CraneContext::views`
+  CraneFileStorage *storage;
+  // every open file can be edited at once, edit mode means the selected one is
+  bool isEditing;
+  // the whole edited file, only once an edit needed it in one piece (see
+  // "view.hpp"), until then edits are kept in `pages`
+  u8 *editBuffer;
+  u64 editSize;
+  // `mode edit-inplace`, `editBuffer` is a shared mapping of the file and edits
+  // can't change its size
+  bool isEditInPlace;
 
-  CraneOpenFile(std::string filePath, std::string alias, FILE *handle)
-    : path(filePath), alias(alias), handle(handle) {}
+  CraneOpenFile(std::string filePath, std::string alias, FILE *handle,
+                CraneFileStorage *storage)
+    : path(filePath),
+      alias(alias),
+      handle(handle),
+      storage(storage),
+      isEditing(false),
+      editBuffer(nullptr),
+      editSize(0),
+      isEditInPlace(false) {}
 };
 
 enum class CraneInterfaceMode {
@@ -24,31 +59,47 @@ enum class CraneInterfaceMode {
   Template,
 };
 
-typedef unsigned char u8;
-typedef unsigned short u16;
-typedef unsigned int u32;
-typedef unsigned long long u64;
-
 struct CraneContext {
 public:
   int lastCommandResult;
+  // false when running a script, commands must not prompt the user
+  bool isInteractive;
+  // asks a yes/no question at the prompt, null where nobody can answer
+  bool (*confirm)(CraneContext *context, const char *question);
   CraneOpenFile *openedFile;
-  std::map<std::string, CraneOpenFile*> fileMap;
-  std::map<std::string, void*> sharedHandleMap;
-  std::map<std::string, CraneCommandEntry*> commandMap;
+  // open files, modules, commands, templates, macros and groups, only the host's
+  // (see "storage.hpp") and shared by copies of the context
+  CraneSession *session;
+  // the macro edits are being recorded into, if any (see "macros.hpp")
+  CraneMacro *recordingMacro;
   CraneInterfaceMode interfaceMode;
-  u8 *fileBuffer;
-  size_t fileSize;
+  // set while a pipeline runs, see "spans.hpp"
+  CranePipe *pipe;
+  // the job running the current command, see "jobs.hpp"
+  CraneJob *job;
+  // shared by every command and plugin, see "scheduler.hpp"
+  CraneScheduler *scheduler;
+  // byte views of the selected file for plugins, see "view.hpp"
+  const CraneViewApi *views;
+  // per-command timings and counters, see "stats.hpp"
+  CraneStats *stats;
+  // spans and counters for `trace`, see "trace.hpp"
+  CraneTracer *tracer;
 
   CraneContext()
     : lastCommandResult(0),
+      isInteractive(true),
+      confirm(nullptr),
       openedFile(nullptr),
-      fileMap(),
-      sharedHandleMap(),
-      commandMap(),
+      session(nullptr),
+      recordingMacro(nullptr),
       interfaceMode(CraneInterfaceMode::Normal),
-      fileBuffer(nullptr),
-      fileSize(0) {}
+      pipe(nullptr),
+      job(nullptr),
+      scheduler(nullptr),
+      views(nullptr),
+      stats(nullptr),
+      tracer(nullptr) {}
 };
 
 #endif
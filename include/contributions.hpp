@@ -3,6 +3,9 @@
 
 #include "commands.hpp"
 #include "context.hpp"
+#include "layout.hpp"
+#include "scheduler.hpp"
+#include "trace.hpp"
 
 #define _concat(x, y) x ## y
 
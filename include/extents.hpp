@@ -0,0 +1,207 @@
+#ifndef extents_hpp
+#define extents_hpp
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Where a file keeps data and where it has holes, found with SEEK_DATA and
+ * SEEK_HOLE when it's opened. A hole reads as zeros without touching the disk.
+ * Scans skip holes and dumps collapse them, so a thin-provisioned image costs
+ * what it stores rather than its size.
+ *
+ * The map describes the file on disk. Whatever writes the file maps it again.
+ * Filesystems without hole reporting show every file as one extent of data.
+ */
+
+// holes are punched and zeros are looked for a filesystem block at a time
+#define kExtentBlockSize 4096
+
+struct CraneExtent {
+public:
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct CraneExtentMap {
+public:
+  // the data regions in file order, everything between them is a hole
+  std::vector<CraneExtent> data;
+  uint64_t fileSize;
+
+  CraneExtentMap() : fileSize(0) {}
+
+  inline void map(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    map(fd);
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  inline void map(int fd) {
+    data.clear();
+    fileSize = 0;
+
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+      return;
+    }
+    fileSize = fileStat.st_size;
+
+#ifdef SEEK_DATA
+    for (off_t offset = 0; (uint64_t)offset < fileSize;) {
+      off_t start = lseek(fd, offset, SEEK_DATA);
+      if (start < 0) {
+        // ENXIO means only a hole is left, anything else that holes aren't known
+        if (errno != ENXIO) {
+          data = {{0, fileSize}};
+        }
+        break;
+      }
+
+      off_t end = lseek(fd, start, SEEK_HOLE);
+      if (end < 0) {
+        end = fileSize;
+      }
+      data.push_back({(uint64_t)start, (uint64_t)end - start});
+      offset = end;
+    }
+#else
+    if (fileSize != 0) {
+      data = {{0, fileSize}};
+    }
+#endif
+  }
+
+  inline bool isSparse() const { return dataSize() != fileSize; }
+
+  inline uint64_t dataSize() const {
+    uint64_t total = 0;
+    for (auto &extent : data) {
+      total += extent.size;
+    }
+    return total;
+  }
+
+  // whether all of `size` bytes at `offset` are inside the file and hole
+  inline bool isHole(uint64_t offset, uint64_t size) const {
+    if (offset + size > fileSize) {
+      return false;
+    }
+
+    auto next = std::upper_bound(
+        data.begin(), data.end(), offset,
+        [](uint64_t at, const CraneExtent &extent) { return at < extent.offset; });
+    if (next != data.begin()) {
+      auto previous = std::prev(next);
+      if (previous->offset + previous->size > offset) {
+        return false;
+      }
+    }
+    return next == data.end() || next->offset >= offset + size;
+  }
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-function"
+inline static bool craneIsZero(const uint8_t *data, uint64_t size) {
+  return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+/**
+ * Writes `size` bytes at `offset`. `source` maps the file the bytes were read
+ * from, at `sourceOffset`: blocks of zeros that were holes there become holes
+ * again, so saving an image keeps it sparse. Zeros that were data stay data, and
+ * without a `source` everything is written. When the filesystem can't punch
+ * holes the zeros are written. Returns false if a write failed.
+ */
+inline static bool craneWriteSparse(int fd, const uint8_t *data, uint64_t size,
+                                    uint64_t offset, const CraneExtentMap *source,
+                                    uint64_t sourceOffset, uint64_t *written) {
+  auto isHole = [&](uint64_t at, uint64_t length) {
+    return source != nullptr && length == kExtentBlockSize &&
+           source->isHole(sourceOffset + at, length) && craneIsZero(data + at, length);
+  };
+
+  uint64_t done = 0;
+  while (done < size) {
+    // runs end on block boundaries of the file, so whole blocks become holes
+    uint64_t position = offset + done;
+    uint64_t blockEnd = (position / kExtentBlockSize + 1) * kExtentBlockSize;
+    uint64_t length = std::min<uint64_t>(blockEnd - position, size - done);
+    bool isRunHole = isHole(done, length);
+
+    uint64_t runEnd = done + length;
+    while (runEnd < size) {
+      uint64_t next = std::min<uint64_t>(kExtentBlockSize, size - runEnd);
+      if (isHole(runEnd, next) != isRunHole) {
+        break;
+      }
+      runEnd += next;
+    }
+
+    bool isPunched = false;
+#if !kUsingCraneDarwin
+    if (isRunHole) {
+      isPunched = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, position,
+                            runEnd - done) == 0;
+    }
+#endif
+
+    if (!isPunched) {
+      for (uint64_t at = done; at < runEnd;) {
+        ssize_t count = pwrite(fd, data + at, runEnd - at, offset + at);
+        if (count < 0 && errno == EINTR) {
+          continue;
+        }
+        if (count <= 0) {
+          return false;
+        }
+        at += count;
+        *written += count;
+      }
+    }
+
+    done = runEnd;
+  }
+
+  return true;
+}
+
+// zeros `size` bytes at `offset`, as a hole when the filesystem can punch one
+inline static bool craneZeroRange(int fd, uint64_t offset, uint64_t size,
+                                  uint64_t *written) {
+#if !kUsingCraneDarwin
+  if (size == 0 ||
+      fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) {
+    return true;
+  }
+#endif
+
+  static const uint8_t zeros[kExtentBlockSize] = {};
+  while (size > 0) {
+    ssize_t count = pwrite(fd, zeros, std::min<uint64_t>(size, sizeof(zeros)), offset);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    offset += count;
+    size -= count;
+    *written += count;
+  }
+
+  return true;
+}
+#pragma clang diagnostic pop
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef jobs_hpp
+#define jobs_hpp
+
+#include "context.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct CraneCommand;
+
+enum class CraneJobState {
+  Queued,
+  Running,
+  Finished
+};
+
+/**
+ * Every running command has a job: background jobs started with a trailing
+ * '&' and the command running in the foreground (which Ctrl-C cancels).
+ *
+ * Handlers reach their job through `context->job`. Long running handlers
+ * should poll `craneShouldStop` between chunks of work and return early when
+ * it's true, and report how far along they are with `craneReportProgress`.
+ */
+struct CraneJob {
+public:
+  u32 id;
+  std::string description;
+  std::atomic<CraneJobState> state;
+  std::atomic<bool> cancelled;
+  std::atomic<u64> progressDone;
+  std::atomic<u64> progressTotal;
+  // counted by `craneCountRead`/`craneCountWritten`, see "stats.hpp"
+  std::atomic<u64> bytesRead;
+  std::atomic<u64> bytesWritten;
+  int result;
+
+  // owned by the job while it runs in the background
+  CraneCommand *command;
+  CraneContext *context;
+
+  CraneJob(u32 id, std::string description)
+    : id(id),
+      description(description),
+      state(CraneJobState::Queued),
+      cancelled(false),
+      progressDone(0),
+      progressTotal(0),
+      bytesRead(0),
+      bytesWritten(0),
+      result(0),
+      command(nullptr),
+      context(nullptr) {}
+
+  // only stores to an atomic, so this is safe to call from a signal handler
+  inline void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+
+  inline bool isCancelled() const { return cancelled.load(std::memory_order_relaxed); }
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-function"
+inline static bool craneShouldStop(CraneContext *context) {
+  return context->job != nullptr && context->job->isCancelled();
+}
+
+inline static void craneReportProgress(CraneContext *context, u64 done, u64 total) {
+  if (context->job != nullptr) {
+    context->job->progressTotal.store(total, std::memory_order_relaxed);
+    context->job->progressDone.store(done, std::memory_order_relaxed);
+  }
+}
+#pragma clang diagnostic pop
+
+typedef int (*CraneJobRunner)(CraneCommand *, CraneContext *);
+
+/**
+ * Runs background jobs on a fixed set of worker threads.
+ *
+ * Each job gets its own copy of the context with every open file reopened, so
+ * jobs never share a FILE position with the prompt or with each other. The
+ * read end of `notifyFd()` becomes readable whenever a job finishes, so the
+ * prompt can wait on it next to stdin.
+ */
+struct CraneJobPool {
+public:
+  CraneJobPool(CraneJobRunner runner);
+  ~CraneJobPool();
+
+  CraneJobPool(const CraneJobPool &) = delete;
+  CraneJobPool &operator=(const CraneJobPool &) = delete;
+
+  // queues a command (taking ownership of it) to run on a copy of `context`
+  CraneJob *submit(CraneCommand *command, CraneContext *context);
+
+  // jobs that haven't been collected yet, oldest first
+  std::vector<CraneJob *> snapshot();
+  CraneJob *find(u32 id);
+
+  // removes finished jobs from the pool, the caller deletes them
+  std::vector<CraneJob *> collectFinished();
+
+  // waits for `job` (or every job when null), giving up when `waiter` is cancelled
+  bool wait(CraneJob *job, CraneContext *waiter);
+
+  inline int notifyFd() const { return notifyPipe[0]; }
+
+private:
+  CraneJobRunner runner;
+  std::mutex lock;
+  std::condition_variable queued;
+  std::condition_variable finished;
+  std::vector<CraneJob *> jobs;
+  std::vector<CraneJob *> queue;
+  std::vector<std::thread> workers;
+  u32 nextId;
+  bool stopping;
+  int notifyPipe[2];
+
+  void work();
+};
+
+#endif
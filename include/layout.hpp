@@ -0,0 +1,275 @@
+#ifndef layout_hpp
+#define layout_hpp
+
+#include "context.hpp"
+#include "view.hpp"
+#include <cstring>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+
+/**
+ * Compile-time record layouts for plugins.
+ *
+ * A layout is a list of fields, each with a type, byte order and an optional
+ * fixed element count. Offsets and the total size are computed at compile time
+ * so they can be checked with static_assert, and every accessor compiles down
+ * to a load plus (when needed) a byte swap:
+ *
+ *   using ElfIdent = CraneLayout<
+ *     CraneField<u32, CraneEndian::Big>,   // magic
+ *     CraneField<u8>,                      // class
+ *     CraneField<u8>,                      // data
+ *     CraneArray<u8, 12>>;                 // padding
+ *   enum { kIdentMagic, kIdentClass, kIdentData, kIdentPadding };
+ *
+ *   static_assert(ElfIdent::offsetOf<kIdentData> == 5, "");
+ *   static_assert(ElfIdent::size == 18, "");
+ *
+ *   CraneRecord<ElfIdent> ident;
+ *   if (ElfIdent::at(context, 0, ident) && ident.get<kIdentMagic>() == 0x7F454C46)
+ *     ...
+ *
+ * The bounds check happens once when a record (or an array of records) is
+ * taken from a buffer, after which field access needs no checks at all.
+ *
+ * The context overloads go through `context->views` (see "view.hpp"), so they
+ * work in and out of edit mode. `at` reads the record's bytes into the record
+ * itself, `array` maps the whole file and keeps the view until the array and
+ * its copies are gone. Records taken from an array are only valid while it is.
+ */
+
+enum class CraneEndian {
+  Little,
+  Big
+};
+
+template <typename T>
+inline T craneByteSwap(T value) {
+  static_assert(std::is_integral<T>::value, "only integers can be byte swapped");
+
+  if constexpr (sizeof(T) == 1) {
+    return value;
+  } else if constexpr (sizeof(T) == 2) {
+    return (T)__builtin_bswap16((u16)value);
+  } else if constexpr (sizeof(T) == 4) {
+    return (T)__builtin_bswap32((u32)value);
+  } else {
+    return (T)__builtin_bswap64((u64)value);
+  }
+}
+
+template <typename T, CraneEndian Endian>
+inline T craneLoad(const u8 *ptr) {
+  static_assert(std::is_arithmetic<T>::value, "fields must be integers or floats");
+
+  constexpr bool needsSwap =
+      (Endian == CraneEndian::Big) == (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+  if constexpr (std::is_floating_point<T>::value) {
+    using Bits = typename std::conditional<sizeof(T) == 4, u32, u64>::type;
+    Bits bits = craneLoad<Bits, Endian>(ptr);
+    T value;
+    memcpy(&value, &bits, sizeof(T));
+    return value;
+  } else {
+    T value;
+    memcpy(&value, ptr, sizeof(T));
+    if constexpr (needsSwap) {
+      value = craneByteSwap(value);
+    }
+    return value;
+  }
+}
+
+template <typename T, CraneEndian Endian = CraneEndian::Little, size_t Count = 1>
+struct CraneField {
+  static_assert(Count > 0, "fields need at least one element");
+
+  using type = T;
+  static constexpr CraneEndian endian = Endian;
+  static constexpr size_t count = Count;
+  static constexpr size_t size = sizeof(T) * Count;
+  static constexpr bool isArray = Count > 1;
+};
+
+template <typename T, size_t Count, CraneEndian Endian = CraneEndian::Little>
+using CraneArray = CraneField<T, Endian, Count>;
+
+template <typename Layout>
+struct CraneRecord;
+
+template <typename Layout>
+struct CraneRecordArray;
+
+template <typename... Fields>
+struct CraneLayout {
+private:
+  static constexpr size_t sizes[] = {Fields::size...};
+
+  static constexpr size_t computeOffset(size_t index) {
+    size_t offset = 0;
+    for (size_t i = 0; i < index; i++) {
+      offset += sizes[i];
+    }
+    return offset;
+  }
+
+public:
+  static_assert(sizeof...(Fields) > 0, "layouts need at least one field");
+
+  static constexpr size_t fieldCount = sizeof...(Fields);
+  static constexpr size_t size = (Fields::size + ...);
+
+  template <size_t Index>
+  using field = typename std::tuple_element<Index, std::tuple<Fields...>>::type;
+
+  template <size_t Index>
+  static constexpr size_t offsetOf = computeOffset(Index);
+
+  // takes a record from `buffer`, failing if it doesn't fit in `bufferSize`
+  static inline bool at(const u8 *buffer, size_t bufferSize, size_t offset,
+                        CraneRecord<CraneLayout> &record) {
+    if (buffer == nullptr || offset > bufferSize || bufferSize - offset < size) {
+      return false;
+    }
+
+    record.data = buffer + offset;
+    return true;
+  }
+
+  static inline bool at(CraneContext *context, size_t offset,
+                        CraneRecord<CraneLayout> &record) {
+    const CraneViewApi *views = context->views;
+    CraneView *view = views->acquire(context);
+    if (view == nullptr) {
+      return false;
+    }
+
+    bool isRead = views->read(view, offset, record.storage, size) == size;
+    views->release(view);
+    if (isRead) {
+      record.data = record.storage;
+    }
+    return isRead;
+  }
+
+  // takes up to `count` consecutive records, clamped to what fits in the buffer
+  static inline CraneRecordArray<CraneLayout> array(const u8 *buffer, size_t bufferSize,
+                                                    size_t offset, size_t count) {
+    if (buffer == nullptr || offset > bufferSize) {
+      return {nullptr, 0};
+    }
+
+    size_t available = (bufferSize - offset) / size;
+    return {buffer + offset, count < available ? count : available};
+  }
+
+  static inline CraneRecordArray<CraneLayout> array(CraneContext *context, size_t offset,
+                                                    size_t count) {
+    const CraneViewApi *views = context->views;
+    CraneView *view = views->acquire(context);
+    CraneViewSegment segment;
+    if (view == nullptr) {
+      return {nullptr, 0};
+    } else if (!views->map(view, &segment)) {
+      views->release(view);
+      return {nullptr, 0};
+    }
+
+    auto records = array(segment.data, segment.size, offset, count);
+    records.view.reset(view, views->release);
+    return records;
+  }
+};
+
+template <typename Layout>
+struct CraneRecord {
+public:
+  const u8 *data;
+  // the bytes of a record read through a context, `data` points here then
+  u8 storage[Layout::size];
+
+  CraneRecord() : data(nullptr) {}
+  CraneRecord(const CraneRecord &other) { *this = other; }
+
+  inline CraneRecord &operator=(const CraneRecord &other) {
+    if (this == &other) {
+      return *this;
+    }
+
+    data = other.data;
+    if (other.data == other.storage) {
+      memcpy(storage, other.storage, Layout::size);
+      data = storage;
+    }
+    return *this;
+  }
+
+  template <size_t Index>
+  inline typename Layout::template field<Index>::type get() const {
+    using Field = typename Layout::template field<Index>;
+    static_assert(!Field::isArray, "array fields need an element index");
+
+    return craneLoad<typename Field::type, Field::endian>(data +
+                                                          Layout::template offsetOf<Index>);
+  }
+
+  template <size_t Index, size_t Element>
+  inline typename Layout::template field<Index>::type get() const {
+    using Field = typename Layout::template field<Index>;
+    static_assert(Element < Field::count, "array element out of bounds");
+
+    return craneLoad<typename Field::type, Field::endian>(
+        data + Layout::template offsetOf<Index> + Element * sizeof(typename Field::type));
+  }
+
+  template <size_t Index>
+  inline bool get(size_t element, typename Layout::template field<Index>::type &out) const {
+    using Field = typename Layout::template field<Index>;
+    if (element >= Field::count) {
+      return false;
+    }
+
+    out = craneLoad<typename Field::type, Field::endian>(
+        data + Layout::template offsetOf<Index> + element * sizeof(typename Field::type));
+    return true;
+  }
+
+  // raw bytes of a field, e.g. for fixed-size strings
+  template <size_t Index>
+  inline const u8 *bytes() const {
+    return data + Layout::template offsetOf<Index>;
+  }
+};
+
+template <typename Layout>
+struct CraneRecordArray {
+public:
+  const u8 *data;
+  size_t count;
+  // the view `data` was mapped from, released with the last copy of the array
+  std::shared_ptr<CraneView> view;
+
+  inline CraneRecord<Layout> operator[](size_t index) const {
+    CraneRecord<Layout> record;
+    record.data = data + index * Layout::size;
+    return record;
+  }
+
+  inline size_t size() const { return count; }
+
+  // decodes one scalar field of every record into a contiguous column
+  template <size_t Index>
+  inline void decode(typename Layout::template field<Index>::type *out) const {
+    using Field = typename Layout::template field<Index>;
+    static_assert(!Field::isArray, "array fields need an element index");
+
+    const u8 *ptr = data + Layout::template offsetOf<Index>;
+    for (size_t i = 0; i < count; i++) {
+      out[i] = craneLoad<typename Field::type, Field::endian>(ptr + i * Layout::size);
+    }
+  }
+};
+
+#endif
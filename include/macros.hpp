@@ -0,0 +1,251 @@
+#ifndef macros_hpp
+#define macros_hpp
+
+#include "context.hpp"
+#include <cstring>
+#include <string>
+#include <vector>
+
+// a removal length meaning "everything up to the end of the file"
+#define kMacroToEnd ((u64)-1)
+
+/**
+ * A single step of a compiled macro: `removed` bytes of the original file at
+ * `offset` are replaced by `bytes`. Operations in a plan are sorted by offset
+ * and never overlap, so a plan is applied in one pass over the target.
+ */
+struct CraneMacroOperation {
+public:
+  u64 offset;
+  u64 removed;
+  std::string bytes;
+};
+
+/**
+ * Macros record the edits made to the selected file and replay them on others.
+ *
+ * While recording, the file is described as a list of pieces in their current
+ * order: ranges of the original file and literal bytes written by the user.
+ * Edits only split and replace pieces, so overlapping writes and writes over
+ * earlier inserts collapse into a single literal. `compile()` flattens the
+ * pieces into a plan of operations on original offsets.
+ */
+struct CraneMacro {
+public:
+  std::string name;
+  std::vector<CraneMacroOperation> plan;
+  size_t editCount;
+
+  CraneMacro(std::string name) : name(name), editCount(0) {
+    pieces.push_back({false, 0, kMacroToEnd, ""});
+  }
+
+  inline void write(u64 offset, const u8 *data, size_t size) {
+    replacePieces(offset, size, std::string((const char *)data, size));
+    editCount++;
+  }
+
+  inline void insert(u64 offset, const u8 *data, size_t size) {
+    replacePieces(offset, 0, std::string((const char *)data, size));
+    editCount++;
+  }
+
+  inline void replace(u64 offset, u64 removed, const u8 *data, size_t size) {
+    replacePieces(offset, removed, std::string((const char *)data, size));
+    editCount++;
+  }
+
+  inline void truncate(u64 offset) {
+    size_t index = split(offset);
+    pieces.erase(pieces.begin() + index, pieces.end());
+    editCount++;
+  }
+
+  inline void compile() {
+    plan.clear();
+
+    // `cursor` is the first byte of the original not yet kept or replaced
+    u64 cursor = 0;
+    bool hasPending = false;
+    CraneMacroOperation pending{0, 0, ""};
+
+    for (auto &piece : pieces) {
+      if (piece.isLiteral) {
+        if (!hasPending) {
+          pending = {cursor, 0, ""};
+          hasPending = true;
+        }
+        pending.bytes += piece.bytes;
+        continue;
+      }
+
+      if (piece.start != cursor && !hasPending) {
+        pending = {cursor, 0, ""};
+        hasPending = true;
+      }
+
+      if (hasPending) {
+        pending.removed = piece.start - pending.offset;
+        plan.push_back(pending);
+        hasPending = false;
+      }
+
+      if (piece.length == kMacroToEnd) {
+        return;
+      }
+      cursor = piece.start + piece.length;
+    }
+
+    // the recorded file was truncated, the rest of the target goes too
+    if (!hasPending) {
+      pending = {cursor, 0, ""};
+    }
+    pending.removed = kMacroToEnd;
+    plan.push_back(pending);
+  }
+
+  // true when every operation overwrites bytes, so targets can be patched in place
+  inline bool isInPlace() const {
+    for (auto &operation : plan) {
+      if (operation.removed != operation.bytes.size()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  inline u64 outputSize(u64 inputSize) const {
+    u64 size = 0;
+    u64 cursor = 0;
+    for (auto &operation : plan) {
+      size += operation.offset - cursor + operation.bytes.size();
+      if (operation.removed == kMacroToEnd) {
+        return size;
+      }
+      cursor = operation.offset + operation.removed;
+    }
+
+    return cursor < inputSize ? size + inputSize - cursor : size;
+  }
+
+  // writes `outputSize(inputSize)` bytes to `output`, gaps past the end of a
+  // shorter target are zero filled like `write` does
+  inline void apply(const u8 *input, u64 inputSize, u8 *output) const {
+    u64 cursor = 0;
+    for (auto &operation : plan) {
+      output = copyOriginal(input, inputSize, cursor, operation.offset, output);
+      memcpy(output, operation.bytes.data(), operation.bytes.size());
+      output += operation.bytes.size();
+
+      if (operation.removed == kMacroToEnd) {
+        return;
+      }
+      cursor = operation.offset + operation.removed;
+    }
+
+    if (cursor < inputSize) {
+      copyOriginal(input, inputSize, cursor, inputSize, output);
+    }
+  }
+
+private:
+  struct Piece {
+    bool isLiteral;
+    // the original range, length is kMacroToEnd for the open-ended tail
+    u64 start;
+    u64 length;
+    std::string bytes;
+  };
+
+  std::vector<Piece> pieces;
+
+  static inline u8 *copyOriginal(const u8 *input, u64 inputSize, u64 from, u64 to,
+                                 u8 *output) {
+    u64 available = from < inputSize ? (to < inputSize ? to : inputSize) - from : 0;
+    memcpy(output, input + from, available);
+    memset(output + available, 0, to - from - available);
+    return output + (to - from);
+  }
+
+  static inline u64 pieceLength(const Piece &piece) {
+    return piece.isLiteral ? piece.bytes.size() : piece.length;
+  }
+
+  // makes sure a piece starts at `position`, returning its index
+  inline size_t split(u64 position) {
+    u64 cursor = 0;
+    for (size_t i = 0; i < pieces.size(); i++) {
+      if (position == cursor) {
+        return i;
+      }
+
+      u64 length = pieceLength(pieces[i]);
+      if (length == kMacroToEnd || position < cursor + length) {
+        u64 at = position - cursor;
+        Piece tail = pieces[i];
+
+        if (tail.isLiteral) {
+          tail.bytes = pieces[i].bytes.substr(at);
+          pieces[i].bytes.resize(at);
+        } else {
+          tail.start += at;
+          if (tail.length != kMacroToEnd) {
+            tail.length -= at;
+          }
+          pieces[i].length = at;
+        }
+
+        pieces.insert(pieces.begin() + i + 1, tail);
+        return i + 1;
+      }
+
+      cursor += length;
+    }
+
+    // past the end of a truncated file, the gap reads as zeros
+    if (position > cursor) {
+      pieces.push_back({true, 0, 0, std::string(position - cursor, '\0')});
+    }
+    return pieces.size();
+  }
+
+  inline void replacePieces(u64 position, u64 length, std::string bytes) {
+    size_t first = split(position);
+    size_t last = split(position + length);
+
+    pieces.erase(pieces.begin() + first, pieces.begin() + last);
+    if (!bytes.empty()) {
+      pieces.insert(pieces.begin() + first, {true, 0, 0, bytes});
+    }
+
+    merge();
+  }
+
+  inline void merge() {
+    std::vector<Piece> merged;
+    for (auto &piece : pieces) {
+      if (pieceLength(piece) == 0) {
+        continue;
+      }
+
+      if (!merged.empty()) {
+        Piece &last = merged.back();
+        if (last.isLiteral && piece.isLiteral) {
+          last.bytes += piece.bytes;
+          continue;
+        }
+
+        if (!last.isLiteral && !piece.isLiteral && last.start + last.length == piece.start) {
+          last.length = piece.length == kMacroToEnd ? kMacroToEnd : last.length + piece.length;
+          continue;
+        }
+      }
+
+      merged.push_back(piece);
+    }
+
+    pieces.swap(merged);
+  }
+};
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef manifest_hpp
+#define manifest_hpp
+
+#include "commands.hpp"
+#include <string>
+#include <vector>
+
+#define kManifestFormatVersion 2
+#define kManifestExtension ".manifest"
+
+/**
+ * A manifest caches what a module contributes (command names, flags and
+ * argument metadata) next to the module itself, e.g. `extern/core.so.manifest`.
+ * It's written whenever a module is loaded and has no up to date manifest, and
+ * lets later sessions register stub commands without opening the module.
+ *
+ * A manifest is only used while the module's size and modification time, and
+ * the host's version, are the same as when it was written.
+ */
+
+// the stub entries of a module, false when there is no usable manifest
+bool craneReadManifest(const std::string &modulePath,
+                       std::vector<CraneCommandEntry *> &entries);
+
+void craneWriteManifest(const std::string &modulePath, int moduleVersion,
+                        const std::vector<CraneCommandEntry *> &entries);
+
+#endif
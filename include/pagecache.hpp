@@ -0,0 +1,477 @@
+#ifndef pagecache_hpp
+#define pagecache_hpp
+
+#include "extents.hpp"
+#include "view.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * The pages of an open file, read with pread and kept within a fixed budget so
+ * an image far larger than memory can be browsed and patched. Views of the file
+ * (see "view.hpp") read through it.
+ *
+ * Clean pages are evicted least recently used first, except while a view has
+ * them pinned. A miss right after the previous one starts a readahead window
+ * that doubles up to `kPageCacheReadahead` pages, all read with one preadv.
+ *
+ * Edits live here too: a written page becomes dirty and stays until it's
+ * flushed or the edits are discarded, so patching a few bytes costs a page
+ * each instead of a copy of the file. Truncating only records where the file
+ * now ends, bytes past that read as zeros until `flush` cuts the file.
+ */
+
+#define kPageCacheShift 16
+#define kPageCacheSize (1ULL << kPageCacheShift)
+#define kPageCacheReadahead 32
+#define kPageCacheNoTruncation UINT64_MAX
+
+// per open file, dirty pages don't count against it
+#ifndef kPageCacheBudget
+#define kPageCacheBudget (64ULL << 20)
+#endif
+
+struct CranePage {
+public:
+  uint64_t index;
+  uint32_t pins;
+  bool isDirty;
+  // dropped from the cache while pinned, the last release frees it
+  bool isDetached;
+  std::list<CranePage *>::iterator lru;
+  std::unique_ptr<uint8_t[]> data;
+
+  CranePage(uint64_t index)
+    : index(index), pins(0), isDirty(false), isDetached(false),
+      data(new uint8_t[kPageCacheSize]) {}
+};
+
+struct CranePageCache {
+public:
+  CranePageCache(const std::string &path)
+    : path(path),
+      fd(-1),
+      diskSize(0),
+      truncatedAt(kPageCacheNoTruncation),
+      cleanCount(0),
+      lastMiss(UINT64_MAX),
+      window(1),
+      accessHint(CraneViewAccessNormal) {}
+
+  ~CranePageCache() {
+    for (auto &entry : pages) {
+      delete entry.second;
+    }
+
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  CranePageCache(const CranePageCache &) = delete;
+  CranePageCache &operator=(const CranePageCache &) = delete;
+
+  // the page at `index` (page sized, zero filled past the end), pinned until
+  // `release`, NULL when the file can't be read
+  inline CranePage *acquire(uint64_t index) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = pages.find(index);
+    if (found != pages.end()) {
+      CranePage *page = found->second;
+      if (!page->isDirty) {
+        lru.splice(lru.begin(), lru, page->lru);
+      }
+      page->pins++;
+      return page;
+    }
+
+    if (!openFile()) {
+      return nullptr;
+    }
+
+    // sequential misses grow the window, anything else starts over
+    uint64_t count = 1;
+    if (accessHint == CraneViewAccessSequential) {
+      count = kPageCacheReadahead;
+    } else if (accessHint != CraneViewAccessRandom && index == lastMiss + 1) {
+      window = std::min<uint64_t>(window * 2, kPageCacheReadahead);
+      count = window;
+    } else {
+      window = 1;
+    }
+
+    // never past the end of the file or over pages that are already cached
+    uint64_t lastPage = diskSize == 0 ? 0 : (diskSize - 1) >> kPageCacheShift;
+    count = index >= lastPage ? 1 : std::min<uint64_t>(count, lastPage - index + 1);
+    for (uint64_t i = 1; i < count; i++) {
+      if (pages.count(index + i)) {
+        count = i;
+        break;
+      }
+    }
+
+    std::vector<CranePage *> loaded;
+    if (!loadPages(index, count, loaded)) {
+      return nullptr;
+    }
+    lastMiss = index + count - 1;
+
+    // the requested page ends up most recently used, readahead right behind it
+    for (auto it = loaded.rbegin(); it != loaded.rend(); it++) {
+      insertClean(*it);
+    }
+    loaded[0]->pins++;
+
+    evict();
+    return loaded[0];
+  }
+
+  inline void release(CranePage *page) {
+    std::lock_guard<std::mutex> guard(lock);
+    page->pins--;
+    if (page->isDetached && page->pins == 0) {
+      delete page;
+    }
+  }
+
+  // copies up to `size` bytes at `offset`, returns how many were copied
+  inline uint64_t read(uint64_t offset, void *out, uint64_t size) {
+    uint8_t *cursor = (uint8_t *)out;
+    uint64_t copied = 0;
+
+    while (copied < size) {
+      CranePage *page = acquire(offset >> kPageCacheShift);
+      if (page == nullptr) {
+        break;
+      }
+
+      uint64_t within = offset & (kPageCacheSize - 1);
+      uint64_t chunk = std::min<uint64_t>(kPageCacheSize - within, size - copied);
+      memcpy(cursor, page->data.get() + within, chunk);
+      release(page);
+
+      cursor += chunk;
+      offset += chunk;
+      copied += chunk;
+    }
+
+    return copied;
+  }
+
+  inline void advise(uint64_t offset, uint64_t size, CraneViewAccess hint) {
+    std::lock_guard<std::mutex> guard(lock);
+    accessHint = hint;
+    window = 1;
+
+#if !kUsingCraneDarwin
+    if (hint == CraneViewAccessWillNeed && openFile()) {
+      posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+    }
+#endif
+  }
+
+  // overwrites bytes, past the end of the file as well, false when a page that
+  // is only partly written can't be read
+  inline bool write(uint64_t offset, const void *data, uint64_t size) {
+    std::lock_guard<std::mutex> guard(lock);
+    const uint8_t *cursor = (const uint8_t *)data;
+
+    while (size != 0) {
+      uint64_t index = offset >> kPageCacheShift;
+      uint64_t within = offset & (kPageCacheSize - 1);
+      uint64_t chunk = std::min<uint64_t>(kPageCacheSize - within, size);
+
+      CranePage *page = dirtyPage(index, chunk == kPageCacheSize);
+      if (page == nullptr) {
+        return false;
+      }
+
+      memcpy(page->data.get() + within, cursor, chunk);
+      cursor += chunk;
+      offset += chunk;
+      size -= chunk;
+    }
+
+    return true;
+  }
+
+  inline void truncate(uint64_t size) {
+    std::lock_guard<std::mutex> guard(lock);
+    truncatedAt = std::min(truncatedAt, size);
+
+    for (auto it = pages.begin(); it != pages.end();) {
+      CranePage *page = it->second;
+      uint64_t start = page->index << kPageCacheShift;
+
+      if (start >= size) {
+        it = pages.erase(it);
+        drop(page);
+        continue;
+      }
+
+      if (start + kPageCacheSize > size) {
+        memset(page->data.get() + (size - start), 0, start + kPageCacheSize - size);
+      }
+      it++;
+    }
+  }
+
+  inline bool isDirty() {
+    std::lock_guard<std::mutex> guard(lock);
+    return truncatedAt != kPageCacheNoTruncation || pages.size() != cleanCount;
+  }
+
+  // true when some of the bytes in the range differ from the file on disk
+  inline bool isDirty(uint64_t offset, uint64_t size) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!openFile() || offset + size > diskSize || offset + size > truncatedAt) {
+      return true;
+    }
+
+    for (auto &entry : pages) {
+      uint64_t start = entry.first << kPageCacheShift;
+      if (entry.second->isDirty && start < offset + size &&
+          start + kPageCacheSize > offset) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Writes the edits to `out` (opened for writing) and sizes it to `size`, the
+   * written pages stay cached as clean ones. `extents` maps the file as it was
+   * before. Returns false if anything failed.
+   */
+  inline bool flush(int out, uint64_t size, const CraneExtentMap &extents,
+                    uint64_t *written) {
+    std::lock_guard<std::mutex> guard(lock);
+    *written = 0;
+
+    // cut first, bytes between the truncation and the new end become zeros
+    if (truncatedAt != kPageCacheNoTruncation && ftruncate(out, truncatedAt) != 0) {
+      return false;
+    }
+
+    std::vector<CranePage *> dirty;
+    for (auto &entry : pages) {
+      if (entry.second->isDirty) {
+        dirty.push_back(entry.second);
+      }
+    }
+    std::sort(dirty.begin(), dirty.end(),
+              [](CranePage *a, CranePage *b) { return a->index < b->index; });
+
+    for (auto page : dirty) {
+      uint64_t start = page->index << kPageCacheShift;
+      if (start >= size) {
+        continue;
+      }
+
+      // zeros aren't written over holes, editing a sparse file keeps it sparse
+      uint64_t length = std::min<uint64_t>(kPageCacheSize, size - start);
+      if (!craneWriteSparse(out, page->data.get(), length, start, &extents, start,
+                            written)) {
+        return false;
+      }
+    }
+
+    if (ftruncate(out, size) != 0) {
+      return false;
+    }
+
+    for (auto page : dirty) {
+      page->isDirty = false;
+      insertClean(page);
+    }
+    truncatedAt = kPageCacheNoTruncation;
+    diskSize = size;
+
+    evict();
+    return true;
+  }
+
+  // forgets every page, edits included, for when the file changed underneath
+  inline void invalidate() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &entry : pages) {
+      drop(entry.second);
+    }
+
+    pages.clear();
+    lru.clear();
+    cleanCount = 0;
+    truncatedAt = kPageCacheNoTruncation;
+    lastMiss = UINT64_MAX;
+
+    struct stat fileStat;
+    if (fd >= 0 && fstat(fd, &fileStat) == 0) {
+      diskSize = fileStat.st_size;
+    }
+  }
+
+  // forgets every page and the file itself, for when another was renamed over it
+  inline void reopen() {
+    invalidate();
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+private:
+  std::string path;
+  int fd;
+  uint64_t diskSize;
+  // the smallest size the file was truncated to since the last flush
+  uint64_t truncatedAt;
+  std::mutex lock;
+  std::unordered_map<uint64_t, CranePage *> pages;
+  // clean pages, most recently used first
+  std::list<CranePage *> lru;
+  size_t cleanCount;
+  uint64_t lastMiss;
+  uint64_t window;
+  CraneViewAccess accessHint;
+
+  inline bool openFile() {
+    if (fd >= 0) {
+      return true;
+    }
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0) {
+      diskSize = fileStat.st_size;
+    }
+    return true;
+  }
+
+  // reads `count` consecutive pages with a single call
+  inline bool loadPages(uint64_t index, uint64_t count, std::vector<CranePage *> &loaded) {
+    std::vector<iovec> vectors;
+    for (uint64_t i = 0; i < count; i++) {
+      loaded.push_back(new CranePage(index + i));
+      vectors.push_back({loaded.back()->data.get(), kPageCacheSize});
+    }
+
+    uint64_t start = index << kPageCacheShift;
+    uint64_t got = 0;
+    while (got < count * kPageCacheSize) {
+      ssize_t res = preadv(fd, vectors.data(), vectors.size(), start + got);
+      if (res < 0) {
+        for (auto page : loaded) {
+          delete page;
+        }
+        loaded.clear();
+        return false;
+      }
+      if (res == 0) {
+        break;
+      }
+
+      // short reads resume where they stopped
+      got += res;
+      size_t skipped = 0;
+      while (skipped < vectors.size() && (uint64_t)res >= vectors[skipped].iov_len) {
+        res -= vectors[skipped++].iov_len;
+      }
+      vectors.erase(vectors.begin(), vectors.begin() + skipped);
+      if (!vectors.empty()) {
+        vectors[0].iov_base = (uint8_t *)vectors[0].iov_base + res;
+        vectors[0].iov_len -= res;
+      }
+    }
+
+    // past the end of the file, or of a pending truncation, reads as zeros
+    uint64_t end = std::min(start + got, truncatedAt);
+    for (auto page : loaded) {
+      uint64_t pageStart = page->index << kPageCacheShift;
+      uint64_t valid = end > pageStart ? std::min<uint64_t>(end - pageStart, kPageCacheSize) : 0;
+      memset(page->data.get() + valid, 0, kPageCacheSize - valid);
+    }
+
+    return true;
+  }
+
+  // the page at `index` made dirty, not read first when it's about to be overwritten
+  inline CranePage *dirtyPage(uint64_t index, bool isOverwritten) {
+    auto found = pages.find(index);
+    if (found != pages.end()) {
+      CranePage *page = found->second;
+      if (!page->isDirty) {
+        lru.erase(page->lru);
+        cleanCount--;
+        page->isDirty = true;
+      }
+      return page;
+    }
+
+    std::vector<CranePage *> loaded;
+    if (isOverwritten) {
+      loaded.push_back(new CranePage(index));
+    } else if (!openFile() || !loadPages(index, 1, loaded)) {
+      return nullptr;
+    }
+
+    CranePage *page = loaded[0];
+    page->isDirty = true;
+    pages[index] = page;
+    return page;
+  }
+
+  inline void insertClean(CranePage *page) {
+    pages[page->index] = page;
+    lru.push_front(page);
+    page->lru = lru.begin();
+    cleanCount++;
+  }
+
+  // frees a page that was taken out of `pages`, or leaves it to its last pin
+  inline void drop(CranePage *page) {
+    if (!page->isDirty) {
+      lru.erase(page->lru);
+      cleanCount--;
+    }
+
+    if (page->pins != 0) {
+      page->isDetached = true;
+    } else {
+      delete page;
+    }
+  }
+
+  inline void evict() {
+    auto it = lru.end();
+    while (cleanCount * kPageCacheSize > kPageCacheBudget && it != lru.begin()) {
+      CranePage *page = *--it;
+      if (page->pins != 0) {
+        continue;
+      }
+
+      it = lru.erase(it);
+      pages.erase(page->index);
+      cleanCount--;
+      delete page;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,489 @@
+#ifndef pieces_hpp
+#define pieces_hpp
+
+#include "extents.hpp"
+#include "pagecache.hpp"
+#include "replace.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * An edited file as a list of pieces, once `splice` or `insertfile` put a
+ * range of another file into it. A spliced range is only referenced, so
+ * assembling an image out of multi-gigabyte parts costs no memory for them.
+ * Edits made afterwards split pieces and add the written bytes as new ones.
+ *
+ * `save` copies file ranges with copy_file_range, which filesystems that can
+ * share blocks (btrfs, XFS) turn into a reflink, and leaves the holes of
+ * sparse sources as holes. Ranges of the edited file itself stay where they
+ * are when nothing moved them. Otherwise the new contents are assembled in a
+ * temporary file next to it that replaces it (see "replace.hpp"), so no write
+ * lands on bytes still to be read and a failed save leaves the file as it was.
+ *
+ * Sources are read when the file is saved, so a file with ranges spliced into
+ * another one can't be edited until that one is saved (see `references`).
+ */
+
+// copies that can't use copy_file_range go through a buffer this big
+#define kPieceCopyBlock (1ULL << 20)
+
+enum class CranePieceKind {
+  // the edited file as it was when the table started, unsaved edits included
+  Base,
+  File,
+  Bytes,
+  Zeros,
+};
+
+// a file ranges are spliced from, held open so renaming it doesn't matter
+struct CranePieceSource {
+public:
+  std::string path;
+  int fd;
+  CraneExtentMap extents;
+  dev_t device;
+  ino_t inode;
+
+  CranePieceSource(const std::string &path)
+    : path(path), fd(::open(path.c_str(), O_RDONLY)), extents(), device(0), inode(0) {
+    struct stat fileStat;
+    if (fd >= 0 && fstat(fd, &fileStat) == 0) {
+      device = fileStat.st_dev;
+      inode = fileStat.st_ino;
+    }
+  }
+
+  ~CranePieceSource() {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  CranePieceSource(const CranePieceSource &) = delete;
+  CranePieceSource &operator=(const CranePieceSource &) = delete;
+};
+
+struct CranePiece {
+public:
+  CranePieceKind kind;
+  // where the piece starts in the base file, `source` or `bytes`
+  uint64_t offset;
+  uint64_t size;
+  std::shared_ptr<CranePieceSource> source;
+  std::shared_ptr<const uint8_t> bytes;
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-function"
+/**
+ * Copies `size` bytes between files, in the kernel where it can and through a
+ * buffer where it can't. Past the end of `in` reads as zeros.
+ */
+inline static bool craneCopyRange(int in, uint64_t inOffset, int out, uint64_t outOffset,
+                                  uint64_t size, uint64_t *written) {
+#if !kUsingCraneDarwin
+  while (size > 0) {
+    loff_t from = inOffset;
+    loff_t to = outOffset;
+    ssize_t count = copy_file_range(in, &from, out, &to, size, 0);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    // unsupported across these files, or the end of `in`
+    if (count <= 0) {
+      break;
+    }
+    inOffset += count;
+    outOffset += count;
+    size -= count;
+    *written += count;
+  }
+#endif
+
+  if (size == 0) {
+    return true;
+  }
+
+  uint64_t bufferSize = std::min<uint64_t>(size, kPieceCopyBlock);
+  std::unique_ptr<uint8_t[]> buffer(new uint8_t[bufferSize]);
+  while (size > 0) {
+    uint64_t chunk = std::min<uint64_t>(size, kPieceCopyBlock);
+    ssize_t count = pread(in, buffer.get(), chunk, inOffset);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0) {
+      return false;
+    }
+    if (count == 0) {
+      memset(buffer.get(), 0, chunk);
+      count = chunk;
+    }
+
+    if (!craneWriteSparse(out, buffer.get(), count, outOffset, nullptr, 0, written)) {
+      return false;
+    }
+    inOffset += count;
+    outOffset += count;
+    size -= count;
+  }
+
+  return true;
+}
+#pragma clang diagnostic pop
+
+struct CranePieceTable {
+public:
+  std::vector<CranePiece> pieces;
+
+  CranePieceTable() : base(nullptr) {}
+
+  inline bool isActive() const { return base != nullptr; }
+
+  /**
+   * Starts from the edited file's `size` bytes as kept in `pages`, or as
+   * `buffer` when it was loaded whole, which the table then owns.
+   */
+  inline void begin(CranePageCache *pages, const std::string &path, uint64_t size,
+                    uint8_t *buffer) {
+    base = pages;
+    baseSource = std::make_shared<CranePieceSource>(path);
+    pieces.clear();
+
+    if (buffer != nullptr) {
+      std::shared_ptr<const uint8_t> bytes(buffer, std::default_delete<uint8_t[]>());
+      pieces.push_back({CranePieceKind::Bytes, 0, size, nullptr, bytes});
+    } else if (size != 0) {
+      pieces.push_back({CranePieceKind::Base, 0, size, nullptr, nullptr});
+    }
+  }
+
+  inline void clear() {
+    pieces.clear();
+    base = nullptr;
+    baseSource.reset();
+  }
+
+  // true when ranges of the file `fileStat` describes are spliced in
+  inline bool references(const struct stat &fileStat) const {
+    for (auto &piece : pieces) {
+      if (piece.kind == CranePieceKind::File && piece.source->device == fileStat.st_dev &&
+          piece.source->inode == fileStat.st_ino) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  inline uint64_t size() const {
+    uint64_t total = 0;
+    for (auto &piece : pieces) {
+      total += piece.size;
+    }
+    return total;
+  }
+
+  // the pieces covering `size` bytes at `offset`, to insert them somewhere else
+  inline std::vector<CranePiece> slice(uint64_t offset, uint64_t size) const {
+    std::vector<CranePiece> out;
+    uint64_t start = 0;
+    for (auto &piece : pieces) {
+      uint64_t end = start + piece.size;
+      uint64_t from = std::max<uint64_t>(start, offset);
+      uint64_t to = std::min<uint64_t>(end, offset + size);
+      if (from < to) {
+        CranePiece part = piece;
+        part.offset += from - start;
+        part.size = to - from;
+        out.push_back(part);
+      }
+      start = end;
+    }
+    return out;
+  }
+
+  // puts `inserted` at `offset`, a gap past the end reads as zeros
+  inline void insert(uint64_t offset, const std::vector<CranePiece> &inserted) {
+    size_t index = split(offset);
+    pieces.insert(pieces.begin() + index, inserted.begin(), inserted.end());
+  }
+
+  // replaces `removed` bytes at `offset` (clamped to the end) with a copy of `data`
+  inline void replace(uint64_t offset, uint64_t removed, const uint8_t *data,
+                      uint64_t size) {
+    size_t first = split(offset);
+    removed = std::min<uint64_t>(removed, this->size() - offset);
+    size_t last = split(offset + removed);
+    pieces.erase(pieces.begin() + first, pieces.begin() + last);
+
+    if (size != 0) {
+      uint8_t *copy = new uint8_t[size];
+      memcpy(copy, data, size);
+      std::shared_ptr<const uint8_t> bytes(copy, std::default_delete<uint8_t[]>());
+      pieces.insert(pieces.begin() + first,
+                    CranePiece{CranePieceKind::Bytes, 0, size, nullptr, bytes});
+    }
+  }
+
+  inline void truncate(uint64_t offset) {
+    size_t index = split(offset);
+    pieces.erase(pieces.begin() + index, pieces.end());
+  }
+
+  // copies up to `size` bytes at `offset`, returns how many were copied
+  inline uint64_t read(uint64_t offset, void *out, uint64_t size) {
+    uint8_t *cursor = (uint8_t *)out;
+    uint64_t copied = 0;
+    uint64_t start = 0;
+
+    for (auto &piece : pieces) {
+      uint64_t end = start + piece.size;
+      if (copied < size && offset + copied < end) {
+        uint64_t within = offset + copied - start;
+        uint64_t chunk = std::min<uint64_t>(piece.size - within, size - copied);
+        if (!readPiece(piece, piece.offset + within, cursor + copied, chunk)) {
+          break;
+        }
+        copied += chunk;
+      }
+      start = end;
+    }
+
+    return copied;
+  }
+
+  /**
+   * The bytes at `offset` up to the end of their piece, pointing straight at
+   * written bytes and read into `scratch` (at most `scratchSize`) otherwise.
+   * Returns how many there are, 0 past the end or when they can't be read.
+   */
+  inline uint64_t segment(uint64_t offset, uint8_t *scratch, uint64_t scratchSize,
+                          const uint8_t **out) {
+    uint64_t start = 0;
+    for (auto &piece : pieces) {
+      uint64_t end = start + piece.size;
+      if (offset < end) {
+        uint64_t within = offset - start;
+        if (piece.kind == CranePieceKind::Bytes) {
+          *out = piece.bytes.get() + piece.offset + within;
+          return piece.size - within;
+        }
+
+        uint64_t chunk = std::min<uint64_t>(piece.size - within, scratchSize);
+        if (!readPiece(piece, piece.offset + within, scratch, chunk)) {
+          return 0;
+        }
+        *out = scratch;
+        return chunk;
+      }
+      start = end;
+    }
+    return 0;
+  }
+
+  /**
+   * Writes the pieces to `out`, the edited file opened for writing, and sizes
+   * it to match. When ranges of the file moved, a new file is renamed over it
+   * instead and `isReplaced` is set, `out` then refers to the old one. Returns
+   * false if anything failed.
+   */
+  inline bool save(int out, bool *isReplaced, uint64_t *written) {
+    *written = 0;
+    *isReplaced = false;
+    uint64_t total = size();
+
+    struct stat outStat;
+    if (fstat(out, &outStat) != 0) {
+      return false;
+    }
+
+    // sources are looked at again, they may have changed since they were spliced
+    for (auto &piece : pieces) {
+      if (piece.kind == CranePieceKind::File) {
+        piece.source->extents.map(piece.source->fd);
+      }
+    }
+    baseSource->extents.map(baseSource->fd);
+
+    bool isMoved = false;
+    uint64_t at = 0;
+    for (auto &piece : pieces) {
+      isMoved = isMoved || (piece.kind == CranePieceKind::Base && piece.offset != at);
+      at += piece.size;
+    }
+
+    // nothing of the file moved, everything else goes around what stays
+    if (!isMoved) {
+      if (ftruncate(out, total) != 0) {
+        return false;
+      }
+
+      at = 0;
+      uint64_t oldSize = std::min<uint64_t>(outStat.st_size, total);
+      for (auto &piece : pieces) {
+        bool isKept = piece.kind == CranePieceKind::Base &&
+                      !base->isDirty(piece.offset, piece.size);
+        if (!isKept && !writePiece(out, piece, at, oldSize, written)) {
+          return false;
+        }
+        at += piece.size;
+      }
+      return true;
+    }
+
+    // the new file starts empty, so whatever isn't written stays a hole
+    CraneReplacement replacement(baseSource->path);
+    bool isWritten = replacement.open() && ftruncate(replacement.fd, total) == 0;
+    at = 0;
+    for (auto &piece : pieces) {
+      isWritten = isWritten && writePiece(replacement.fd, piece, at, 0, written);
+      at += piece.size;
+    }
+
+    *isReplaced = isWritten && replacement.commit();
+    return *isReplaced;
+  }
+
+private:
+  CranePageCache *base;
+  std::shared_ptr<CranePieceSource> baseSource;
+
+  // the index of the piece starting at `offset`, splitting the one around it
+  inline size_t split(uint64_t offset) {
+    uint64_t start = 0;
+    for (size_t i = 0; i < pieces.size(); i++) {
+      if (start == offset) {
+        return i;
+      }
+
+      uint64_t end = start + pieces[i].size;
+      if (offset < end) {
+        CranePiece tail = pieces[i];
+        tail.offset += offset - start;
+        tail.size = end - offset;
+        pieces[i].size = offset - start;
+        pieces.insert(pieces.begin() + i + 1, tail);
+        return i + 1;
+      }
+      start = end;
+    }
+
+    if (offset > start) {
+      pieces.push_back({CranePieceKind::Zeros, 0, offset - start, nullptr, nullptr});
+    }
+    return pieces.size();
+  }
+
+  inline bool readPiece(const CranePiece &piece, uint64_t offset, uint8_t *out,
+                        uint64_t size) {
+    switch (piece.kind) {
+    case CranePieceKind::Base:
+      return base->read(offset, out, size) == size;
+    case CranePieceKind::Bytes:
+      memcpy(out, piece.bytes.get() + offset, size);
+      return true;
+    case CranePieceKind::Zeros:
+      memset(out, 0, size);
+      return true;
+    case CranePieceKind::File:
+      break;
+    }
+
+    // a source that got shorter since reads as zeros past its end
+    uint64_t done = 0;
+    while (done < size) {
+      ssize_t count = pread(piece.source->fd, out + done, size - done, offset + done);
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count < 0) {
+        return false;
+      }
+      if (count == 0) {
+        memset(out + done, 0, size - done);
+        break;
+      }
+      done += count;
+    }
+    return true;
+  }
+
+  // zeros what's below `oldSize` in the range, past it `out` reads as zeros already
+  inline bool zeroRange(int out, uint64_t offset, uint64_t size, uint64_t oldSize,
+                        uint64_t *written) {
+    if (offset >= oldSize) {
+      return true;
+    }
+    size = std::min<uint64_t>(size, oldSize - offset);
+    return craneZeroRange(out, offset, size, written);
+  }
+
+  // copies the data of `source` and zeros its holes
+  inline bool copySource(CranePieceSource &source, uint64_t offset, uint64_t size,
+                         int out, uint64_t at, uint64_t oldSize, uint64_t *written) {
+    uint64_t cursor = offset;
+    uint64_t end = offset + size;
+
+    for (auto &extent : source.extents.data) {
+      uint64_t from = std::max<uint64_t>(extent.offset, cursor);
+      uint64_t to = std::min<uint64_t>(extent.offset + extent.size, end);
+      if (from >= to) {
+        continue;
+      }
+
+      uint64_t gapAt = at + (cursor - offset);
+      uint64_t dataAt = at + (from - offset);
+      if (!zeroRange(out, gapAt, from - cursor, oldSize, written) ||
+          !craneCopyRange(source.fd, from, out, dataAt, to - from, written)) {
+        return false;
+      }
+      cursor = to;
+    }
+
+    return zeroRange(out, at + (cursor - offset), end - cursor, oldSize, written);
+  }
+
+  inline bool writePiece(int out, const CranePiece &piece, uint64_t at, uint64_t oldSize,
+                         uint64_t *written) {
+    switch (piece.kind) {
+    case CranePieceKind::Bytes:
+      return craneWriteSparse(out, piece.bytes.get() + piece.offset, piece.size, at,
+                              nullptr, 0, written);
+    case CranePieceKind::Zeros:
+      return zeroRange(out, at, piece.size, oldSize, written);
+    case CranePieceKind::File:
+      return copySource(*piece.source, piece.offset, piece.size, out, at, oldSize,
+                        written);
+    case CranePieceKind::Base:
+      break;
+    }
+
+    if (!base->isDirty(piece.offset, piece.size)) {
+      return copySource(*baseSource, piece.offset, piece.size, out, at, oldSize, written);
+    }
+
+    // unsaved edits are only in the pages
+    std::unique_ptr<uint8_t[]> buffer(
+        new uint8_t[std::min<uint64_t>(piece.size, kPieceCopyBlock)]);
+    for (uint64_t done = 0; done < piece.size;) {
+      uint64_t chunk = std::min<uint64_t>(piece.size - done, kPieceCopyBlock);
+      if (base->read(piece.offset + done, buffer.get(), chunk) != chunk ||
+          !craneWriteSparse(out, buffer.get(), chunk, at + done, &baseSource->extents,
+                            piece.offset + done, written)) {
+        return false;
+      }
+      done += chunk;
+    }
+    return true;
+  }
+};
+
+#endif
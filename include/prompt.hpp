@@ -4,8 +4,12 @@
 #include <iostream>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <initializer_list>
 #include <string>
+#include <string_view>
 #include <vector>
+#include "arena.hpp"
 #include "commands.hpp"
 
 #define kColorRed "\033[31m"
@@ -19,29 +23,97 @@
 #define kColorBold "\033[1m"
 
 struct CraneContext;
+enum class CraneInterfaceMode;
 
+std::string generatePrompt(CraneContext *context);
+// the same prompt without a context, `alias` is empty when no file is selected
+std::string generatePrompt(CraneInterfaceMode mode, const std::string &alias,
+                           int lastResult);
+
+/**
+ * Arguments point into their command's arena. The tokenizer writes every token
+ * back into the arena copy of the line with a terminating NUL, so `value.data()`
+ * can always be handed to C APIs.
+ */
 struct CraneArgument {
-  std::string value;
+  std::string_view value;
   CraneArgumentType type;
 
-  CraneArgument(std::string value, CraneArgumentType type)
+  CraneArgument(std::string_view value, CraneArgumentType type)
     : value(value),
       type(type) {}
-  
-  CraneArgument(std::string value)
+
+  CraneArgument(std::string_view value)
     : value(value),
       type(CraneArgumentType::String) {}
 };
 
+struct CraneArgumentList {
+public:
+  CraneArgument **items;
+  size_t count;
+  size_t capacity;
+
+  CraneArgumentList() : items(nullptr), count(0), capacity(0) {}
+
+  inline void push_back(CraneArena &arena, CraneArgument *argument) {
+    if (count == capacity) {
+      // the old array is simply left behind in the arena
+      size_t newCapacity = capacity ? capacity * 2 : 8;
+      CraneArgument **newItems = arena.makeArray<CraneArgument *>(newCapacity);
+      if (count) {
+        memcpy(newItems, items, count * sizeof(CraneArgument *));
+      }
+      items = newItems;
+      capacity = newCapacity;
+    }
+
+    items[count++] = argument;
+  }
+
+  inline size_t size() const { return count; }
+  inline CraneArgument *operator[](size_t index) const { return items[index]; }
+  inline CraneArgument **begin() const { return items; }
+  inline CraneArgument **end() const { return items + count; }
+};
+
+/**
+ * A parsed command line. The command owns an arena holding a single copy of
+ * the line and all of its arguments, everything is released with the command.
+ * Later pipeline stages point into the first stage's copy of the line.
+ */
 struct CraneCommand {
 public:
-  std::string name;
-  std::vector<CraneArgument*> arguments;
-  CraneCommand(std::string name, std::vector<CraneArgument*> arguments)
-    : name(name), arguments(arguments) {}
+  CraneArena arena;
+  std::string_view name;
+  CraneArgumentList arguments;
+  // the next stage of a pipeline ('a | b'), owned by this command
+  CraneCommand *next;
+  // the line ended with '&' and runs as a background job
+  bool isBackground;
+
+  CraneCommand() : next(nullptr), isBackground(false) {}
+
+  CraneCommand(std::string_view name, std::initializer_list<std::string_view> arguments)
+    : name(arena.copy(name)), next(nullptr), isBackground(false) {
+    for (auto &argument : arguments) {
+      addArgument(argument, CraneArgumentType::String);
+    }
+  }
+
+  ~CraneCommand() { delete next; }
+
+  inline CraneArgument *addArgument(std::string_view value, CraneArgumentType type) {
+    CraneArgument *argument = arena.make<CraneArgument>(arena.copy(value), type);
+    arguments.push_back(arena, argument);
+    return argument;
+  }
 
-  static CraneCommand *fromUser(CraneContext *context);
-  static CraneCommand *parseCommand(CraneContext *context, std::string buffer);
+  // parses (and frees) a line handed over by readline, EOF becomes 'exit'
+  static CraneCommand *fromLine(CraneContext *context, char *line);
+  static CraneCommand *parseCommand(CraneContext *context, std::string_view buffer);
+  // splits on unquoted ';' and newlines, leaving out blank lines and '#' comments
+  static std::vector<std::string_view> splitLines(std::string_view commands);
 };
 
 #endif
@@ -0,0 +1,488 @@
+#ifndef readstream_hpp
+#define readstream_hpp
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#if !kUsingCraneDarwin
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Reads a range of a file front to back, for scans that look at every byte
+ * once. Up to `queueDepth` large reads are kept in flight, so a cold file
+ * streams at the device's bandwidth rather than one request's latency at a
+ * time.
+ *
+ *   CraneReadStream stream(path, 0, kReadStreamToEnd, context->session->readOptions);
+ *   CraneReadBlock block;
+ *   while (stream.next(&block)) {
+ *     ... block.data, block.size, block.offset ...
+ *   }
+ *   if (stream.hasFailed()) ...
+ *
+ * Blocks come back in order. Each stays valid until the next call to `next`,
+ * and its buffer then goes to the read `queueDepth` blocks ahead. Reads are
+ * submitted through io_uring where the kernel has it. Otherwise a few threads
+ * pread them. With `isDirect` the file is read with O_DIRECT, so a scan doesn't
+ * push everything else out of the kernel's cache. Filesystems that refuse
+ * O_DIRECT are read normally.
+ */
+
+#define kReadStreamToEnd UINT64_MAX
+#define kReadStreamDepth 16
+#define kReadStreamBlockSize (1U << 20)
+#define kReadStreamMaxBlockSize (64U << 20)
+#define kReadStreamThreads 4
+// O_DIRECT needs offsets, sizes and buffers aligned to the device's blocks
+#define kReadStreamAlignment 4096
+
+enum class CraneReadEngine {
+  Auto,
+  Uring,
+  Threads,
+  // scans don't stream at all, they read a mapping of the file
+  Mapped,
+};
+
+struct CraneReadOptions {
+public:
+  CraneReadEngine engine;
+  uint32_t queueDepth;
+  uint32_t blockSize;
+  bool isDirect;
+
+  CraneReadOptions()
+    : engine(CraneReadEngine::Auto),
+      queueDepth(kReadStreamDepth),
+      blockSize(kReadStreamBlockSize),
+      isDirect(false) {}
+};
+
+struct CraneReadBlock {
+public:
+  const uint8_t *data;
+  uint64_t size;
+  // where `data` starts in the file
+  uint64_t offset;
+};
+
+struct CraneReadStream {
+public:
+  CraneReadStream(const std::string &path, uint64_t offset, uint64_t size,
+                  const CraneReadOptions &options)
+    : fd(-1),
+      isDirect(false),
+      isFailed(false),
+      usesRing(false),
+      begin(offset),
+      start(0),
+      end(0),
+      blockSize(0),
+      blockCount(0),
+      current(0),
+      stopping(false) {
+#if !kUsingCraneDarwin
+    if (options.isDirect) {
+      fd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+      isDirect = fd >= 0;
+    }
+#endif
+    if (fd < 0) {
+      fd = ::open(path.c_str(), O_RDONLY);
+    }
+
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+      isFailed = true;
+      return;
+    }
+
+    // the first block starts aligned, `next` skips the bytes before `offset`
+    uint64_t fileSize = fileStat.st_size;
+    begin = std::min(offset, fileSize);
+    end = fileSize - begin < size ? fileSize : begin + size;
+    start = begin & ~(uint64_t)(kReadStreamAlignment - 1);
+
+    blockSize = std::min<uint64_t>(std::max<uint64_t>(options.blockSize, 1),
+                                   kReadStreamMaxBlockSize);
+    blockSize = (blockSize + kReadStreamAlignment - 1) & ~(uint64_t)(kReadStreamAlignment - 1);
+    blockCount = (end - start + blockSize - 1) / blockSize;
+    if (begin == end) {
+      blockCount = 0;
+    }
+
+    uint64_t depth = std::min<uint64_t>(std::max<uint32_t>(options.queueDepth, 1), blockCount);
+    for (uint64_t i = 0; i < depth; i++) {
+      void *buffer = nullptr;
+      if (posix_memalign(&buffer, kReadStreamAlignment, blockSize) != 0) {
+        isFailed = true;
+        return;
+      }
+      slots.emplace_back();
+      slots.back().buffer = (uint8_t *)buffer;
+    }
+
+    if (depth == 0) {
+      return;
+    }
+
+#if !kUsingCraneDarwin
+    if (options.engine != CraneReadEngine::Threads) {
+      usesRing = setupRing(depth);
+    }
+#endif
+
+    if (!usesRing) {
+      size_t threadCount = std::min<uint64_t>(depth, kReadStreamThreads);
+      for (size_t i = 0; i < threadCount; i++) {
+        readers.emplace_back(&CraneReadStream::readLoop, this);
+      }
+    }
+
+    for (uint64_t i = 0; i < depth; i++) {
+      submit(i);
+    }
+  }
+
+  ~CraneReadStream() {
+    // nothing may still be reading into the buffers when they're freed
+    if (!readers.empty()) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+      }
+      readable.notify_all();
+      for (auto &reader : readers) {
+        reader.join();
+      }
+    }
+
+#if !kUsingCraneDarwin
+    if (usesRing) {
+      while (inFlight != 0 && enter(unsubmitted, 1, IORING_ENTER_GETEVENTS) >= 0) {
+        reap();
+      }
+      closeRing();
+    }
+#endif
+
+    for (auto &slot : slots) {
+      free(slot.buffer);
+    }
+
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  CraneReadStream(const CraneReadStream &) = delete;
+  CraneReadStream &operator=(const CraneReadStream &) = delete;
+
+  // the next block of the range, false at its end or when a read failed
+  inline bool next(CraneReadBlock *out) {
+    if (isFailed || current >= blockCount) {
+      return false;
+    }
+
+    // the block handed out last is done with, its buffer reads further ahead
+    if (current != 0 && current - 1 + slots.size() < blockCount) {
+      submit(current - 1 + slots.size());
+    }
+
+    Slot &slot = slots[current % slots.size()];
+    if (!waitFor(slot) || !finish(slot)) {
+      isFailed = true;
+      return false;
+    }
+
+    uint64_t skip = current == 0 ? begin - start : 0;
+    out->data = slot.buffer + skip;
+    out->size = blockLength(current) - skip;
+    out->offset = slot.offset + skip;
+    current++;
+    return true;
+  }
+
+  inline bool hasFailed() const { return isFailed; }
+
+  // how many bytes the stream hands out in total
+  inline uint64_t size() const { return end - begin; }
+
+  inline const char *engineName() const { return usesRing ? "io_uring" : "threads"; }
+
+private:
+  struct Slot {
+    uint8_t *buffer = nullptr;
+    uint64_t offset = 0;
+    // the bytes wanted, and what's asked for to get them
+    uint64_t length = 0;
+    uint64_t request = 0;
+    // bytes read, or -errno
+    int64_t result = 0;
+    bool isDone = false;
+  };
+
+  int fd;
+  bool isDirect;
+  bool isFailed;
+  bool usesRing;
+  uint64_t begin;
+  uint64_t start;
+  uint64_t end;
+  uint64_t blockSize;
+  uint64_t blockCount;
+  // the block `next` hands out next
+  uint64_t current;
+  std::vector<Slot> slots;
+
+  // the pread fallback
+  std::vector<std::thread> readers;
+  std::deque<Slot *> queue;
+  std::mutex lock;
+  std::condition_variable readable;
+  std::condition_variable completed;
+  bool stopping;
+
+#if !kUsingCraneDarwin
+  int ring = -1;
+  void *sqRing = MAP_FAILED;
+  void *cqRing = MAP_FAILED;
+  io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+  size_t sqRingSize = 0;
+  size_t cqRingSize = 0;
+  size_t sqesSize = 0;
+  unsigned *sqTail = nullptr;
+  unsigned *sqMask = nullptr;
+  unsigned *sqArray = nullptr;
+  unsigned *cqHead = nullptr;
+  unsigned *cqTail = nullptr;
+  unsigned *cqMask = nullptr;
+  io_uring_cqe *cqes = nullptr;
+  unsigned unsubmitted = 0;
+  unsigned inFlight = 0;
+#endif
+
+  inline uint64_t blockLength(uint64_t block) const {
+    uint64_t offset = start + block * blockSize;
+    return std::min(blockSize, end - offset);
+  }
+
+  inline void submit(uint64_t block) {
+    Slot &slot = slots[block % slots.size()];
+    slot.offset = start + block * blockSize;
+    slot.length = blockLength(block);
+    slot.result = 0;
+    slot.isDone = false;
+
+    // direct reads are whole device blocks, the last one is cut short by EOF
+    slot.request = slot.length;
+    if (isDirect) {
+      slot.request = (slot.length + kReadStreamAlignment - 1) &
+                     ~(uint64_t)(kReadStreamAlignment - 1);
+    }
+
+#if !kUsingCraneDarwin
+    if (usesRing) {
+      unsigned tail = *sqTail;
+      unsigned index = tail & *sqMask;
+      io_uring_sqe *sqe = &sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = fd;
+      sqe->off = slot.offset;
+      sqe->addr = (uint64_t)slot.buffer;
+      sqe->len = slot.request;
+      sqe->user_data = block % slots.size();
+      sqArray[index] = index;
+      __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+      unsubmitted++;
+      inFlight++;
+      return;
+    }
+#endif
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      queue.push_back(&slot);
+    }
+    readable.notify_one();
+  }
+
+  inline bool waitFor(Slot &slot) {
+#if !kUsingCraneDarwin
+    if (usesRing) {
+      reap();
+      while (!slot.isDone) {
+        if (enter(unsubmitted, 1, IORING_ENTER_GETEVENTS) < 0) {
+          return false;
+        }
+        reap();
+      }
+      return true;
+    }
+#endif
+
+    std::unique_lock<std::mutex> guard(lock);
+    completed.wait(guard, [&slot] { return slot.isDone; });
+    return true;
+  }
+
+  // short and failed reads are finished with plain preads
+  inline bool finish(Slot &slot) {
+    uint64_t got = slot.result > 0 ? slot.result : 0;
+
+    while (got < slot.length) {
+      ssize_t count = pread(fd, slot.buffer + got, slot.request - got, slot.offset + got);
+#if !kUsingCraneDarwin
+      if (count < 0 && errno == EINVAL && isDirect) {
+        // the filesystem took O_DIRECT at open but not for this read
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        isDirect = false;
+        continue;
+      }
+#endif
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count <= 0) {
+        return false;
+      }
+      got += count;
+    }
+
+    return true;
+  }
+
+  inline void readLoop() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+      readable.wait(guard, [this] { return stopping || !queue.empty(); });
+      if (stopping) {
+        return;
+      }
+
+      Slot *slot = queue.front();
+      queue.pop_front();
+      guard.unlock();
+
+      ssize_t count = pread(fd, slot->buffer, slot->request, slot->offset);
+      int64_t result = count < 0 ? -errno : count;
+
+      guard.lock();
+      slot->result = result;
+      slot->isDone = true;
+      completed.notify_all();
+    }
+  }
+
+#if !kUsingCraneDarwin
+  inline bool setupRing(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring < 0) {
+      return false;
+    }
+
+    // IORING_OP_READ came with the same kernel (5.6) as this feature
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+      closeRing();
+      return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool isSingleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (isSingleMap) {
+      sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring, IORING_OFF_SQ_RING);
+    if (sqRing != MAP_FAILED && !isSingleMap) {
+      cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    }
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe *)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+
+    void *cq = isSingleMap ? sqRing : cqRing;
+    if (sqRing == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+      closeRing();
+      return false;
+    }
+
+    uint8_t *sq = (uint8_t *)sqRing;
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+    cqHead = (unsigned *)((uint8_t *)cq + params.cq_off.head);
+    cqTail = (unsigned *)((uint8_t *)cq + params.cq_off.tail);
+    cqMask = (unsigned *)((uint8_t *)cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)((uint8_t *)cq + params.cq_off.cqes);
+    return true;
+  }
+
+  inline void closeRing() {
+    if (sqes != MAP_FAILED) {
+      munmap(sqes, sqesSize);
+    }
+    if (cqRing != MAP_FAILED) {
+      munmap(cqRing, cqRingSize);
+    }
+    if (sqRing != MAP_FAILED) {
+      munmap(sqRing, sqRingSize);
+    }
+    if (ring >= 0) {
+      ::close(ring);
+    }
+  }
+
+  // submits what's queued, and waits for `minComplete` reads to finish
+  inline int enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    while (true) {
+      int submitted =
+          syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags, nullptr, 0);
+      if (submitted >= 0) {
+        unsubmitted -= submitted;
+        return submitted;
+      }
+      if (errno != EINTR) {
+        return -1;
+      }
+    }
+  }
+
+  inline void reap() {
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+      io_uring_cqe &cqe = cqes[head & *cqMask];
+      Slot &slot = slots[cqe.user_data];
+      slot.result = cqe.res;
+      slot.isDone = true;
+      inFlight--;
+    }
+
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  }
+#endif
+};
+
+#endif
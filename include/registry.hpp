@@ -0,0 +1,247 @@
+#ifndef registry_hpp
+#define registry_hpp
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct CraneCommandEntry;
+
+// erased names are only reclaimed once they are this many bytes of the pool and
+// at least half of it
+#define kRegistryCompactMinimum 1024
+
+/**
+ * The command registry maps command names to entries.
+ *
+ * Names are interned into a single character pool and dispatch goes through a
+ * flat open-addressing table (linear probing, kept at most half full), so a
+ * lookup is one hash and usually a single probe. A prefix trie over the same
+ * names serves tab completion and sorted listings without scanning the table.
+ * Erasing leaves its name in the pool and its trie nodes behind, both are
+ * rebuilt from the live names once enough of the pool is dead.
+ */
+struct CraneCommandRegistry {
+private:
+  struct Slot {
+    uint64_t hash;
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    CraneCommandEntry *entry;
+  };
+
+  struct TrieNode {
+    // children are kept sorted by their edge character
+    std::vector<std::pair<char, uint32_t>> children;
+    CraneCommandEntry *entry;
+  };
+
+  std::vector<Slot> slots;
+  std::string namePool;
+  std::vector<TrieNode> trie;
+  size_t count;
+  // bytes of the pool that belong to erased names
+  size_t deadBytes;
+
+  static inline uint64_t hashName(std::string_view name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : name) {
+      hash ^= (unsigned char)c;
+      hash *= 0x100000001b3ULL;
+    }
+    return hash;
+  }
+
+  inline std::string_view slotName(const Slot &slot) const {
+    return std::string_view(namePool.data() + slot.nameOffset, slot.nameLength);
+  }
+
+  inline size_t probe(std::string_view name, uint64_t hash) const {
+    size_t mask = slots.size() - 1;
+    size_t index = hash & mask;
+    while (slots[index].entry != nullptr) {
+      if (slots[index].hash == hash && slotName(slots[index]) == name) {
+        return index;
+      }
+      index = (index + 1) & mask;
+    }
+    return index;
+  }
+
+  inline void grow() {
+    std::vector<Slot> old;
+    old.swap(slots);
+    slots.assign(old.size() * 2, Slot{0, 0, 0, nullptr});
+
+    for (auto &slot : old) {
+      if (slot.entry != nullptr) {
+        slots[probe(slotName(slot), slot.hash)] = slot;
+      }
+    }
+  }
+
+  inline uint32_t trieNode(std::string_view name, bool create) {
+    uint32_t node = 0;
+    for (char c : name) {
+      auto &children = trie[node].children;
+      auto it = children.begin();
+      while (it != children.end() && it->first < c) {
+        it++;
+      }
+
+      if (it != children.end() && it->first == c) {
+        node = it->second;
+        continue;
+      }
+
+      if (!create) {
+        return UINT32_MAX;
+      }
+
+      uint32_t child = trie.size();
+      children.insert(it, {c, child});
+      trie.push_back(TrieNode{{}, nullptr});
+      node = child;
+    }
+
+    return node;
+  }
+
+  inline void compact() {
+    std::string pool;
+    pool.reserve(namePool.size() - deadBytes);
+    trie.assign(1, TrieNode{{}, nullptr});
+
+    for (auto &slot : slots) {
+      if (slot.entry == nullptr) {
+        continue;
+      }
+
+      std::string_view name = slotName(slot);
+      trie[trieNode(name, true)].entry = slot.entry;
+      slot.nameOffset = (uint32_t)pool.size();
+      pool.append(name);
+    }
+
+    namePool.swap(pool);
+    deadBytes = 0;
+  }
+
+  inline void collect(uint32_t node, std::string &prefix,
+                      std::vector<std::pair<std::string, CraneCommandEntry *>> &out,
+                      size_t limit) const {
+    if (out.size() >= limit) {
+      return;
+    }
+
+    if (trie[node].entry != nullptr) {
+      out.push_back({prefix, trie[node].entry});
+    }
+
+    for (auto &child : trie[node].children) {
+      prefix.push_back(child.first);
+      collect(child.second, prefix, out, limit);
+      prefix.pop_back();
+    }
+  }
+
+public:
+  CraneCommandRegistry()
+    : slots(64, Slot{0, 0, 0, nullptr}),
+      trie(1, TrieNode{{}, nullptr}),
+      count(0),
+      deadBytes(0) {}
+
+  inline size_t size() const { return count; }
+
+  inline CraneCommandEntry *find(std::string_view name) const {
+    return slots[probe(name, hashName(name))].entry;
+  }
+
+  // registers `entry` under `name`, returning the entry it replaced (if any)
+  inline CraneCommandEntry *insert(std::string_view name, CraneCommandEntry *entry) {
+    uint64_t hash = hashName(name);
+    size_t index = probe(name, hash);
+    CraneCommandEntry *previous = slots[index].entry;
+
+    if (previous == nullptr) {
+      if ((count + 1) * 2 > slots.size()) {
+        grow();
+        index = probe(name, hash);
+      }
+
+      slots[index] = Slot{hash, (uint32_t)namePool.size(), (uint32_t)name.size(), entry};
+      namePool.append(name);
+      count++;
+    } else {
+      slots[index].entry = entry;
+    }
+
+    trie[trieNode(name, true)].entry = entry;
+    return previous;
+  }
+
+  inline CraneCommandEntry *erase(std::string_view name) {
+    size_t mask = slots.size() - 1;
+    size_t index = probe(name, hashName(name));
+    CraneCommandEntry *previous = slots[index].entry;
+    if (previous == nullptr) {
+      return nullptr;
+    }
+
+    // backward shift deletion keeps every probe sequence unbroken
+    size_t hole = index;
+    size_t next = (hole + 1) & mask;
+    while (slots[next].entry != nullptr) {
+      size_t home = slots[next].hash & mask;
+      if (((next - home) & mask) >= ((next - hole) & mask)) {
+        slots[hole] = slots[next];
+        hole = next;
+      }
+      next = (next + 1) & mask;
+    }
+    slots[hole] = Slot{0, 0, 0, nullptr};
+    count--;
+
+    trie[trieNode(name, false)].entry = nullptr;
+    deadBytes += name.size();
+    if (deadBytes >= kRegistryCompactMinimum && deadBytes * 2 >= namePool.size()) {
+      compact();
+    }
+    return previous;
+  }
+
+  // every command starting with `prefix`, in lexicographic order
+  inline std::vector<std::pair<std::string, CraneCommandEntry *>>
+  complete(std::string_view prefix, size_t limit = SIZE_MAX) const {
+    std::vector<std::pair<std::string, CraneCommandEntry *>> out;
+    uint32_t node = 0;
+
+    for (char c : prefix) {
+      uint32_t next = UINT32_MAX;
+      for (auto &child : trie[node].children) {
+        if (child.first == c) {
+          next = child.second;
+          break;
+        }
+      }
+
+      if (next == UINT32_MAX) {
+        return out;
+      }
+      node = next;
+    }
+
+    std::string name(prefix);
+    collect(node, name, out, limit);
+    return out;
+  }
+
+  inline std::vector<std::pair<std::string, CraneCommandEntry *>> entries() const {
+    return complete("");
+  }
+};
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef replace_hpp
+#define replace_hpp
+
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Rewriting a whole file goes through a temporary file in the same directory.
+ * Once it's complete and on disk it's renamed over the original, so a write
+ * that fails or is interrupted leaves the old contents in place.
+ *
+ * The new file gets the old one's permissions, and its owner where that's
+ * allowed. Hard links to the old file keep the old contents.
+ *
+ *   CraneReplacement replacement(path);
+ *   if (!replacement.open() || !write(replacement.fd) || !replacement.commit()) {
+ *     // nothing changed, the temporary file is gone
+ *   }
+ */
+struct CraneReplacement {
+public:
+  std::string path;
+  int fd;
+
+  CraneReplacement(const std::string &path) : path(path), fd(-1) {}
+  ~CraneReplacement() { abandon(); }
+
+  CraneReplacement(const CraneReplacement &) = delete;
+  CraneReplacement &operator=(const CraneReplacement &) = delete;
+
+  // creates the temporary file, false when it can't be
+  inline bool open() {
+    // a symlink keeps pointing at the file, which is what gets replaced
+    char resolved[PATH_MAX];
+    if (realpath(path.c_str(), resolved) != nullptr) {
+      path = resolved;
+    }
+
+    temporaryPath = path + ".crane-XXXXXX";
+    fd = mkstemp(&temporaryPath[0]);
+    if (fd < 0) {
+      temporaryPath.clear();
+      return false;
+    }
+
+    struct stat fileStat;
+    if (stat(path.c_str(), &fileStat) == 0) {
+      fchmod(fd, fileStat.st_mode & 07777);
+      (void)!fchown(fd, fileStat.st_uid, fileStat.st_gid);
+    }
+    return true;
+  }
+
+  // flushes the new contents to disk and renames them over `path`
+  inline bool commit() {
+    bool isCommitted = fsync(fd) == 0;
+    isCommitted = ::close(fd) == 0 && isCommitted;
+    fd = -1;
+    isCommitted = isCommitted && rename(temporaryPath.c_str(), path.c_str()) == 0;
+    if (!isCommitted) {
+      abandon();
+      return false;
+    }
+    temporaryPath.clear();
+
+    // the rename itself is only durable once the directory is
+    std::string directory = path.substr(0, path.rfind('/') + 1);
+    int directoryFd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+    if (directoryFd >= 0) {
+      fsync(directoryFd);
+      ::close(directoryFd);
+    }
+    return true;
+  }
+
+  // drops the temporary file, the original is left as it was
+  inline void abandon() {
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    if (!temporaryPath.empty()) {
+      unlink(temporaryPath.c_str());
+      temporaryPath.clear();
+    }
+  }
+
+private:
+  std::string temporaryPath;
+};
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef scheduler_hpp
+#define scheduler_hpp
+
+#include "context.hpp"
+#include "trace.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct CraneScheduler;
+
+/**
+ * A set of tasks that can be waited on together. Tasks may start more tasks in
+ * the same or another group, `wait()` runs queued work itself instead of
+ * blocking so nested groups can't deadlock the pool. Once there's nothing left
+ * to run it sleeps until the group gets another task or its last one is done.
+ */
+struct CraneTaskGroup {
+public:
+  CraneTaskGroup(CraneScheduler *scheduler) : scheduler(scheduler), pending(0) {}
+
+  CraneTaskGroup(const CraneTaskGroup &) = delete;
+  CraneTaskGroup &operator=(const CraneTaskGroup &) = delete;
+
+  ~CraneTaskGroup() { wait(); }
+
+  template <typename Fn>
+  inline void run(Fn fn);
+
+  inline void wait();
+
+private:
+  friend struct CraneScheduler;
+
+  CraneScheduler *scheduler;
+  std::atomic<size_t> pending;
+  // taken by the last task when it finishes, so `wait()` can't return (and the
+  // group go away) while it's still notifying
+  std::mutex lock;
+  std::condition_variable idle;
+
+  inline void finish();
+};
+
+/**
+ * The task scheduler shared by every command, reachable as `context->scheduler`.
+ *
+ * There is one worker per hardware thread minus one, the thread waiting on a
+ * group makes up the last one. Each worker owns a deque: it pushes and pops
+ * its own tasks at the back and steals from the front of the others when it
+ * runs dry. Tasks started outside the pool go to a shared injection queue.
+ *
+ *   context->scheduler->parallelFor(0, size, 1 << 20, [&](u64 begin, u64 end) {
+ *     ...
+ *   });
+ *
+ *   u64 zeros = context->scheduler->parallelReduce<u64>(
+ *       0, size, 1 << 20, 0,
+ *       [&](u64 begin, u64 end) { return (u64)std::count(data + begin, data + end, 0); },
+ *       [](u64 a, u64 b) { return a + b; });
+ */
+struct CraneScheduler {
+public:
+  CraneScheduler(size_t workerCount = defaultWorkerCount())
+    : queuedTasks(0), sleepers(0), stopping(false) {
+    for (size_t i = 0; i < workerCount; i++) {
+      workers.emplace_back(new Worker());
+    }
+
+    // ids are recorded before any thread can look itself up
+    std::lock_guard<std::mutex> guard(sleepLock);
+    for (size_t i = 0; i < workerCount; i++) {
+      workers[i]->thread = std::thread(&CraneScheduler::work, this, i);
+      workers[i]->id = workers[i]->thread.get_id();
+    }
+  }
+
+  CraneScheduler(const CraneScheduler &) = delete;
+  CraneScheduler &operator=(const CraneScheduler &) = delete;
+
+  ~CraneScheduler() {
+    {
+      std::lock_guard<std::mutex> guard(sleepLock);
+      stopping.store(true);
+    }
+    wakeup.notify_all();
+
+    for (auto &worker : workers) {
+      worker->thread.join();
+    }
+  }
+
+  static inline size_t defaultWorkerCount() {
+    size_t threads = std::thread::hardware_concurrency();
+    return threads > 1 ? threads - 1 : 0;
+  }
+
+  // how many threads can run tasks at once, counting the waiting thread
+  inline size_t threadCount() const { return workers.size() + 1; }
+
+  // calls fn(begin, end) over [begin, end) split into multiples of `grain`
+  template <typename Fn>
+  inline void parallelFor(u64 begin, u64 end, u64 grain, Fn fn) {
+    if (end <= begin) {
+      return;
+    }
+
+    grain = chunkGrain(begin, end, grain);
+    if (end - begin <= grain) {
+      fn(begin, end);
+      return;
+    }
+
+    CraneTaskGroup group(this);
+    for (u64 start = begin; start < end; start += grain) {
+      u64 stop = end - start > grain ? start + grain : end;
+      group.run([&fn, start, stop] { fn(start, stop); });
+    }
+    group.wait();
+  }
+
+  // maps every chunk to a T, then folds the results in order with `combine`,
+  // which is handed the running result as an rvalue
+  template <typename T, typename Map, typename Combine>
+  inline T parallelReduce(u64 begin, u64 end, u64 grain, T identity, Map map,
+                          Combine combine) {
+    if (end <= begin) {
+      return identity;
+    }
+
+    grain = chunkGrain(begin, end, grain);
+    size_t chunks = (end - begin + grain - 1) / grain;
+    std::vector<T> results(chunks, identity);
+
+    parallelFor(0, chunks, 1, [&](u64 first, u64 last) {
+      for (u64 i = first; i < last; i++) {
+        u64 start = begin + i * grain;
+        results[i] = map(start, end - start > grain ? start + grain : end);
+      }
+    });
+
+    T result = identity;
+    for (auto &value : results) {
+      result = combine(std::move(result), value);
+    }
+    return result;
+  }
+
+private:
+  friend struct CraneTaskGroup;
+
+  struct Task {
+    std::function<void()> run;
+    CraneTaskGroup *group;
+  };
+
+  struct Worker {
+    std::mutex lock;
+    std::deque<Task> tasks;
+    std::thread thread;
+    std::thread::id id;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::mutex injectLock;
+  std::deque<Task> injected;
+  std::atomic<size_t> queuedTasks;
+  std::atomic<size_t> sleepers;
+  std::atomic<bool> stopping;
+  std::mutex sleepLock;
+  std::condition_variable wakeup;
+
+  // a few chunks per thread leaves room for stealing when chunks are uneven
+  inline u64 chunkGrain(u64 begin, u64 end, u64 grain) const {
+    grain = grain == 0 ? 1 : grain;
+    u64 maxChunks = threadCount() * 4;
+    u64 chunks = (end - begin + grain - 1) / grain;
+    if (chunks > maxChunks) {
+      grain *= (chunks + maxChunks - 1) / maxChunks;
+    }
+    return grain;
+  }
+
+  // the calling thread's worker index, or -1 outside the pool (plugins have
+  // their own copy of any thread_local, so the ids are compared instead)
+  inline long currentWorker() const {
+    std::thread::id self = std::this_thread::get_id();
+    for (size_t i = 0; i < workers.size(); i++) {
+      if (workers[i]->id == self) {
+        return (long)i;
+      }
+    }
+    return -1;
+  }
+
+  inline void push(Task task) {
+    // counted before it's visible, so a thread that takes it never sees the
+    // count at zero
+    queuedTasks.fetch_add(1);
+
+    long index = currentWorker();
+    if (index >= 0) {
+      std::lock_guard<std::mutex> guard(workers[index]->lock);
+      workers[index]->tasks.push_back(std::move(task));
+    } else {
+      std::lock_guard<std::mutex> guard(injectLock);
+      injected.push_back(std::move(task));
+    }
+
+    wakeSleeper();
+  }
+
+  inline void wakeSleeper() {
+    if (sleepers.load() > 0) {
+      std::lock_guard<std::mutex> guard(sleepLock);
+      wakeup.notify_one();
+    }
+  }
+
+  inline bool take(long index, Task &task) {
+    if (queuedTasks.load() == 0) {
+      return false;
+    }
+
+    // newest of our own first, it's the most likely to still be in cache
+    if (index >= 0) {
+      std::lock_guard<std::mutex> guard(workers[index]->lock);
+      if (!workers[index]->tasks.empty()) {
+        task = std::move(workers[index]->tasks.back());
+        workers[index]->tasks.pop_back();
+        queuedTasks.fetch_sub(1);
+        return true;
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(injectLock);
+      if (!injected.empty()) {
+        task = std::move(injected.front());
+        injected.pop_front();
+        queuedTasks.fetch_sub(1);
+        return true;
+      }
+    }
+
+    // steal the oldest task of another worker, those tend to be the biggest
+    size_t count = workers.size();
+    size_t start = index >= 0 ? (size_t)index + 1 : 0;
+    for (size_t i = 0; i < count; i++) {
+      Worker &victim = *workers[(start + i) % count];
+      std::unique_lock<std::mutex> guard(victim.lock, std::try_to_lock);
+      if (guard.owns_lock() && !victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        queuedTasks.fetch_sub(1);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  inline bool runOne(long index) {
+    Task task;
+    if (!take(index, task)) {
+      return false;
+    }
+
+    // the rest of a burst is spread out before this task keeps us busy
+    if (queuedTasks.load() > 0) {
+      wakeSleeper();
+    }
+
+    task.run();
+    task.group->finish();
+    return true;
+  }
+
+  inline void work(size_t index) {
+    // wait for the constructor to finish recording thread ids
+    { std::lock_guard<std::mutex> guard(sleepLock); }
+
+    char name[16];
+    snprintf(name, sizeof(name), "scheduler %zu", index);
+    craneNameThread(name);
+
+    while (!stopping.load()) {
+      if (runOne((long)index)) {
+        continue;
+      }
+
+      // `push` counts the task before it looks for sleepers and a sleeper is
+      // counted before it looks for tasks, so one of them always sees the other
+      std::unique_lock<std::mutex> guard(sleepLock);
+      sleepers.fetch_add(1);
+      wakeup.wait(guard, [this] { return stopping.load() || queuedTasks.load() > 0; });
+      sleepers.fetch_sub(1);
+    }
+  }
+};
+
+template <typename Fn>
+inline void CraneTaskGroup::run(Fn fn) {
+  pending.fetch_add(1);
+  scheduler->push({std::function<void()>(std::move(fn)), this});
+
+  // a waiter with nothing to run may be asleep, it can take this one
+  std::lock_guard<std::mutex> guard(lock);
+  idle.notify_all();
+}
+
+inline void CraneTaskGroup::finish() {
+  std::lock_guard<std::mutex> guard(lock);
+  if (pending.fetch_sub(1) == 1) {
+    idle.notify_all();
+  }
+}
+
+inline void CraneTaskGroup::wait() {
+  long index = scheduler->currentWorker();
+  while (pending.load() != 0) {
+    if (scheduler->runOne(index)) {
+      continue;
+    }
+
+    // the group's remaining tasks are running on other threads
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [this] {
+      return pending.load() == 0 || scheduler->queuedTasks.load() > 0;
+    });
+  }
+
+  // the last task may still hold the lock while it notifies
+  std::lock_guard<std::mutex> guard(lock);
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef server_hpp
+#define server_hpp
+
+#include "context.hpp"
+#include "jobs.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * `crane --serve <socket>` keeps one session resident and serves local clients
+ * over a Unix socket. The session holds the open files with their page caches,
+ * extent maps and edit sessions, plus the loaded modules. Repeated queries skip
+ * startup and opening files. `crane --connect <socket>` is the client.
+ *
+ * Each line a client sends is split like a batch line. Its commands run in
+ * order until one fails. The reply is a header, "<result> <mode> <length>
+ * <alias>", followed by the `length` bytes the commands printed. The mode and
+ * alias are the client's, so the client can show the usual prompt.
+ *
+ * Every client has its own selected file, mode and macro recording. One thread
+ * waits on the sockets and hands complete lines to a pool of workers:
+ *  - commands that change the session (open, close, load, macro, save,
+ *    mode, ...) run alone
+ *  - anything else runs next to other clients' commands. A file in an edit
+ *    session takes one command at a time, others are read by many at once
+ *
+ * Either way a command runs on the client's own context, which shares the
+ * session with the server's and only has the client's selected file, mode,
+ * macro and last result of its own.
+ *
+ * Hanging up cancels the command a client has running.
+ */
+
+// longest line a client can send, anything longer drops the client
+#define kServerLineLimit (1 << 20)
+// commands block their worker while they scan, so small machines get a few more
+#define kServerMinWorkers 4
+
+struct CraneServerClient;
+
+struct CraneServer {
+public:
+  CraneServer(CraneContext *context, CraneJobRunner runner);
+  ~CraneServer();
+
+  CraneServer(const CraneServer &) = delete;
+  CraneServer &operator=(const CraneServer &) = delete;
+
+  // listens on `path` and serves clients until `stop()`, non-zero if it couldn't listen
+  int serve(const char *path);
+
+  // only stores to an atomic and writes to a pipe, so it's safe in a signal handler
+  void stop();
+
+private:
+  CraneContext *context;
+  CraneJobRunner runner;
+  // held shared by commands running next to others, exclusively by session commands
+  std::shared_mutex session;
+  std::mutex fileLocksLock;
+  std::unordered_map<CraneOpenFile *, std::unique_ptr<std::shared_mutex>> fileLocks;
+  std::mutex lock;
+  std::condition_variable queued;
+  std::vector<std::shared_ptr<CraneServerClient>> queue;
+  std::vector<std::thread> workers;
+  bool stopping;
+  std::atomic<bool> stopRequested;
+  int wakePipe[2];
+
+  void work();
+  int runLine(CraneServerClient *client, std::string_view line);
+  int runShared(CraneServerClient *client, CraneCommand *command);
+  int runExclusive(CraneServerClient *client, CraneCommand *command);
+  std::shared_mutex *fileLock(CraneOpenFile *file);
+  void wake();
+};
+
+/**
+ * The client: sends `commands` (split into lines), the lines of `script` ("-"
+ * for stdin) or lines typed at a prompt to the server at `path`, and prints
+ * the replies. Stops at the first line that fails, like batch mode.
+ */
+int craneConnect(const char *path, const char *commands, const char *script);
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef spans_hpp
+#define spans_hpp
+
+#include "context.hpp"
+#include "view.hpp"
+#include <cstdio>
+#include <vector>
+
+/**
+ * A span is a view of bytes handed from one pipeline stage to the next. Spans
+ * taken from the selected file point straight into the host's storage through
+ * a byte view (see "view.hpp"), only transforms allocate new bytes. Edits kept
+ * in a file's pages or pieces aren't contiguous, stages read those a segment at
+ * a time instead.
+ */
+struct CraneSpan {
+  const u8 *data;
+  size_t size;
+  // where the bytes came from in the source file, for display
+  u64 offset;
+};
+
+/**
+ * State shared by the stages of a single `a | b | c` pipeline. Views and
+ * transformed buffers live until the whole pipeline has finished.
+ */
+struct CranePipe {
+public:
+  std::vector<CraneSpan> input;
+  std::vector<CraneSpan> output;
+  bool hasInput;
+
+  CranePipe()
+    : hasInput(false),
+      view(nullptr),
+      viewApi(nullptr),
+      viewFile(nullptr),
+      viewMode(CraneInterfaceMode::Normal) {}
+
+  CranePipe(const CranePipe &) = delete;
+  CranePipe &operator=(const CranePipe &) = delete;
+
+  ~CranePipe() {
+    if (view != nullptr) {
+      viewApi->release(view);
+    }
+
+    for (auto buffer : buffers) {
+      delete[] buffer;
+    }
+  }
+
+  // the output of the previous stage becomes the input of the next one
+  inline void advance() {
+    input.swap(output);
+    output.clear();
+    hasInput = true;
+  }
+
+  inline void emit(const u8 *data, size_t size, u64 offset) {
+    output.push_back({data, size, offset});
+  }
+
+  // bytes owned by the pipeline, for stages that transform their input
+  inline u8 *allocate(size_t size) {
+    u8 *buffer = new u8[size];
+    buffers.push_back(buffer);
+    return buffer;
+  }
+
+  inline size_t inputSize() const {
+    size_t total = 0;
+    for (auto &span : input) {
+      total += span.size;
+    }
+    return total;
+  }
+
+  // false while the selected file's edits are only in its pages or pieces
+  inline bool isSelectedContiguous(CraneContext *context) const {
+    CraneOpenFile *file = context->openedFile;
+    return !file->isEditing || file->editBuffer != nullptr;
+  }
+
+  /**
+   * The contents of the selected file as one piece without copying them, a
+   * mapping of the file or, in edit mode, the edit buffer. Only for contiguous
+   * files, mapping one edited in pages would load all of it.
+   */
+  inline bool selectedBytes(CraneContext *context, const u8 **data, size_t *size) {
+    CraneViewSegment segment;
+    if (!isSelectedContiguous(context) || !selectView(context) ||
+        !viewApi->map(view, &segment)) {
+      return false;
+    }
+
+    *data = segment.data;
+    *size = segment.size;
+    return true;
+  }
+
+  /**
+   * Calls `consume` with every segment of the selected file in order, until it
+   * returns false. A segment is only valid during its call. Returns false if a
+   * segment couldn't be read.
+   */
+  template <typename Fn>
+  inline bool selectedSegments(CraneContext *context, Fn consume) {
+    if (!selectView(context)) {
+      return false;
+    }
+
+    u64 size = viewApi->size(view);
+    CraneViewSegment segment;
+    for (u64 offset = 0; offset < size; offset += segment.size) {
+      if (!viewApi->segment(view, offset, &segment)) {
+        return false;
+      }
+      if (!consume(CraneSpan{segment.data, segment.size, segment.offset})) {
+        break;
+      }
+    }
+    return true;
+  }
+
+  // copies up to `size` bytes of the selected file at `offset`
+  inline u64 readSelected(CraneContext *context, u64 offset, u8 *out, u64 size) {
+    return selectView(context) ? viewApi->read(view, offset, out, size) : 0;
+  }
+
+private:
+  inline bool selectView(CraneContext *context) {
+    if (view == nullptr || viewFile != context->openedFile ||
+        viewMode != context->interfaceMode) {
+      if (view != nullptr) {
+        viewApi->release(view);
+      }
+
+      viewApi = context->views;
+      view = viewApi->acquire(context);
+      viewFile = context->openedFile;
+      viewMode = context->interfaceMode;
+    }
+    return view != nullptr;
+  }
+
+  CraneView *view;
+  const CraneViewApi *viewApi;
+  CraneOpenFile *viewFile;
+  CraneInterfaceMode viewMode;
+  std::vector<u8 *> buffers;
+};
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef stats_hpp
+#define stats_hpp
+
+#include "context.hpp"
+#include "jobs.hpp"
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Every command that runs is measured: wall time, CPU time of the thread
+ * running it, bytes it read and wrote and the allocations it made on that
+ * thread. The totals are kept per command name in `context->stats` and shown
+ * by the `stats` command.
+ *
+ * Wall times also go into a log-linear histogram (four buckets per power of
+ * two, so within 25%) from which percentiles are estimated. Recording a
+ * command costs a few clock reads and an uncontended lock, which is why it's
+ * always on.
+ *
+ * Allocations are counted by the host's `operator new`, I/O has to be counted
+ * by the code doing it (bytes scanned from a mapping of the file count as
+ * read too):
+ *
+ *   ssize_t got = pread(fd, buffer, size, offset);
+ *   craneCountRead(context, got > 0 ? got : 0);
+ */
+
+#define kStatsSubBucketBits 2
+#define kStatsBuckets (64 << kStatsSubBucketBits)
+
+struct CraneCommandSample {
+public:
+  u64 wallNanoseconds;
+  u64 cpuNanoseconds;
+  u64 bytesRead;
+  u64 bytesWritten;
+  u64 allocations;
+  u64 allocatedBytes;
+  bool failed;
+};
+
+struct CraneCommandStats {
+public:
+  u64 calls;
+  u64 failures;
+  u64 wallNanoseconds;
+  u64 maxWallNanoseconds;
+  u64 cpuNanoseconds;
+  u64 bytesRead;
+  u64 bytesWritten;
+  u64 allocations;
+  u64 allocatedBytes;
+  u64 histogram[kStatsBuckets];
+
+  CraneCommandStats()
+    : calls(0),
+      failures(0),
+      wallNanoseconds(0),
+      maxWallNanoseconds(0),
+      cpuNanoseconds(0),
+      bytesRead(0),
+      bytesWritten(0),
+      allocations(0),
+      allocatedBytes(0),
+      histogram() {}
+
+  static inline size_t bucketOf(u64 nanoseconds) {
+    if (nanoseconds < (1 << kStatsSubBucketBits)) {
+      return nanoseconds;
+    }
+
+    int exponent = 63 - __builtin_clzll(nanoseconds);
+    int shift = exponent - kStatsSubBucketBits;
+    u64 sub = (nanoseconds >> shift) & ((1 << kStatsSubBucketBits) - 1);
+    return ((size_t)(shift + 1) << kStatsSubBucketBits) + sub;
+  }
+
+  // the smallest value that falls in `bucket`
+  static inline u64 bucketStart(size_t bucket) {
+    if (bucket < (1 << kStatsSubBucketBits)) {
+      return bucket;
+    }
+
+    int shift = (bucket >> kStatsSubBucketBits) - 1;
+    u64 sub = bucket & ((1 << kStatsSubBucketBits) - 1);
+    return ((1ULL << kStatsSubBucketBits) + sub) << shift;
+  }
+
+  inline void record(const CraneCommandSample &sample) {
+    calls++;
+    failures += sample.failed;
+    wallNanoseconds += sample.wallNanoseconds;
+    maxWallNanoseconds = std::max(maxWallNanoseconds, sample.wallNanoseconds);
+    cpuNanoseconds += sample.cpuNanoseconds;
+    bytesRead += sample.bytesRead;
+    bytesWritten += sample.bytesWritten;
+    allocations += sample.allocations;
+    allocatedBytes += sample.allocatedBytes;
+    histogram[bucketOf(sample.wallNanoseconds)]++;
+  }
+
+  // an upper bound for the wall time of `fraction` of the calls
+  inline u64 percentile(double fraction) const {
+    u64 wanted = (u64)(fraction * calls + 0.5);
+    u64 seen = 0;
+    for (size_t bucket = 0; bucket < kStatsBuckets; bucket++) {
+      seen += histogram[bucket];
+      if (seen >= wanted && seen != 0) {
+        return bucket + 1 < kStatsBuckets
+                   ? std::min(bucketStart(bucket + 1) - 1, maxWallNanoseconds)
+                   : maxWallNanoseconds;
+      }
+    }
+    return maxWallNanoseconds;
+  }
+};
+
+/**
+ * The totals of every command, shared by the prompt and background jobs.
+ */
+struct CraneStats {
+public:
+  inline void record(const std::string &command, const CraneCommandSample &sample) {
+    std::lock_guard<std::mutex> guard(lock);
+    commands[command].record(sample);
+  }
+
+  inline void reset() {
+    std::lock_guard<std::mutex> guard(lock);
+    commands.clear();
+  }
+
+  inline std::vector<std::pair<std::string, CraneCommandStats>> snapshot() {
+    std::lock_guard<std::mutex> guard(lock);
+    return std::vector<std::pair<std::string, CraneCommandStats>>(commands.begin(),
+                                                                   commands.end());
+  }
+
+private:
+  std::mutex lock;
+  std::unordered_map<std::string, CraneCommandStats> commands;
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-function"
+inline static void craneCountRead(CraneContext *context, u64 bytes) {
+  if (context->job != nullptr) {
+    context->job->bytesRead.fetch_add(bytes, std::memory_order_relaxed);
+  }
+}
+
+inline static void craneCountWritten(CraneContext *context, u64 bytes) {
+  if (context->job != nullptr) {
+    context->job->bytesWritten.fetch_add(bytes, std::memory_order_relaxed);
+  }
+}
+#pragma clang diagnostic pop
+
+/**
+ * Measures one command on the thread running it (host only, see src/stats.cpp).
+ */
+struct CraneStatsProbe {
+public:
+  CraneStatsProbe(CraneContext *context);
+
+  // records the command into `context->stats`
+  void finish(CraneContext *context, const std::string &command, int result);
+
+private:
+  timespec wallStart;
+  timespec cpuStart;
+  u64 bytesRead;
+  u64 bytesWritten;
+  u64 allocations;
+  u64 allocatedBytes;
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef storage_hpp
+#define storage_hpp
+
+#include "context.hpp"
+#include "extents.hpp"
+#include "pagecache.hpp"
+#include "pieces.hpp"
+#include "readstream.hpp"
+#include "registry.hpp"
+#include <map>
+#include <string>
+#include <vector>
+
+struct CraneMacro;
+struct CraneTemplate;
+
+/**
+ * What the host keeps behind the pointers of `CraneOpenFile` and
+ * `CraneContext`: the pages, extents and pieces of each open file, and what the
+ * whole session has. Modules only see those pointers and reach the selected
+ * file through `context->views` (see "view.hpp"), so how files are cached,
+ * edited and read can change without changing the layout of anything a module
+ * was built against. Only the host and the core module include this.
+ */
+
+struct CraneFileStorage {
+public:
+  // what's been read of the file and, while it's edited, the edits to it
+  CranePageCache pages;
+  // where the file on disk has data and where it has holes
+  CraneExtentMap extents;
+  // once a range of another file was spliced in, the edited file is a list of
+  // pieces and edits are kept there instead (see "pieces.hpp")
+  CranePieceTable pieces;
+
+  CraneFileStorage(const std::string &path) : pages(path), extents(), pieces() {
+    extents.map(path);
+  }
+};
+
+struct CraneSession {
+public:
+  std::map<std::string, CraneOpenFile *> fileMap;
+  // loaded modules by path, null for those only registered from a manifest
+  std::map<std::string, void *> sharedHandleMap;
+  CraneCommandRegistry commandMap;
+  std::map<std::string, CraneTemplate *> templateMap;
+  std::map<std::string, CraneMacro *> macroMap;
+  // named sets of open files (by alias) that `foreach` runs commands on
+  std::map<std::string, std::vector<std::string>> groupMap;
+  // how whole-file scans read the selected file, set with `io`
+  CraneReadOptions readOptions;
+
+  CraneSession()
+    : fileMap(),
+      sharedHandleMap(),
+      commandMap(),
+      templateMap(),
+      macroMap(),
+      groupMap(),
+      readOptions() {}
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-function"
+// an open file with storage of its own, freed with `craneDeleteOpenFile`
+inline static CraneOpenFile *craneNewOpenFile(const std::string &path,
+                                              const std::string &alias, FILE *handle) {
+  return new CraneOpenFile(path, alias, handle, new CraneFileStorage(path));
+}
+
+inline static void craneDeleteOpenFile(CraneOpenFile *file) {
+  delete file->storage;
+  delete file;
+}
+#pragma clang diagnostic pop
+
+#endif
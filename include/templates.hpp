@@ -1,14 +1,832 @@
 #ifndef templates_hpp
 #define templates_hpp
 
+#include "context.hpp"
+#include "view.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <vector>
-#include <cstdlib>
+
+/**
+ * Templates describe a binary structure with a small C-like language:
+ *
+ *   u32 magic;                  # scalar fields, little endian by default
+ *   u16be count;                # 'be'/'le' suffixes select the byte order
+ *   char name[16];              # fixed arrays
+ *   u32 entries[count * 2];     # arrays sized by earlier fields
+ *   if (flags & 1) { u64 extra; }
+ *   @0x40 u32 tail;             # explicit offset from the template base
+ *
+ * A template is compiled once into a flat table of fields. Every field knows
+ * its decoder, its element size and, when nothing before it is dynamic, its
+ * offset. Counts, conditions and explicit offsets are kept as small postfix
+ * programs so applying a template only reads the bytes it has to.
+ */
+
+enum class CraneTemplateType {
+  U8,
+  U16,
+  U32,
+  U64,
+  I8,
+  I16,
+  I32,
+  I64,
+  F32,
+  F64,
+  Char
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-variable"
+static const char *CraneTemplateTypeNames[] = {
+  "u8", "u16", "u32", "u64", "i8", "i16", "i32", "i64", "f32", "f64", "char"
+};
+#pragma clang diagnostic pop
+
+enum class CraneTemplateOpcode {
+  Push,
+  Load,
+  Negate,
+  Not,
+  Multiply,
+  Divide,
+  Modulo,
+  Add,
+  Subtract,
+  ShiftLeft,
+  ShiftRight,
+  Less,
+  LessEqual,
+  Greater,
+  GreaterEqual,
+  Equal,
+  NotEqual,
+  BitAnd,
+  BitXor,
+  BitOr,
+  And,
+  Or
+};
+
+struct CraneTemplateOp {
+  CraneTemplateOpcode code;
+  u64 operand;
+};
+
+#define kTemplateNoExpr -1
+// deepest an expression, or the nesting of 'if' blocks, may go
+#define kTemplateMaxDepth 64
+
+struct CraneTemplateField {
+public:
+  std::string name;
+  CraneTemplateType type;
+  u32 size;
+  bool bigEndian;
+  bool isArray;
+  u64 count;
+  int countExpr;
+  int conditionExpr;
+  int offsetExpr;
+  bool hasStaticOffset;
+  u64 staticOffset;
+
+  CraneTemplateField(std::string name, CraneTemplateType type, u32 size, bool bigEndian)
+    : name(name),
+      type(type),
+      size(size),
+      bigEndian(bigEndian),
+      isArray(false),
+      count(1),
+      countExpr(kTemplateNoExpr),
+      conditionExpr(kTemplateNoExpr),
+      offsetExpr(kTemplateNoExpr),
+      hasStaticOffset(false),
+      staticOffset(0) {}
+
+  inline bool isInteger() const {
+    return type != CraneTemplateType::F32 && type != CraneTemplateType::F64;
+  }
+
+  inline bool isSigned() const {
+    return type >= CraneTemplateType::I8 && type <= CraneTemplateType::I64;
+  }
+};
 
 struct CraneTemplate {
+public:
   std::string name;
   std::string description;
-  // std::vector<CraneTemplateSection>
+  std::vector<CraneTemplateField> fields;
+  std::vector<std::vector<CraneTemplateOp>> expressions;
+  // set when every field has a static offset and count, i.e. the template
+  // can be stamped out as an array of identical records
+  bool isFixedSize;
+  u64 fixedSize;
+
+  CraneTemplate(std::string name) : name(name), isFixedSize(false), fixedSize(0) {}
+
+  inline int findField(const std::string &fieldName) const {
+    for (size_t i = 0; i < fields.size(); i++) {
+      if (fields[i].name == fieldName) {
+        return (int)i;
+      }
+    }
+
+    return -1;
+  }
+
+  static CraneTemplate *compile(std::string name, const std::string &source,
+                                std::string &error);
+};
+
+/**
+ * Decodes a scalar from raw bytes, sign-extending signed types and bit-casting
+ * floats. Floats are returned through `asDouble`.
+ */
+inline u64 craneTemplateDecode(const CraneTemplateField &field, const u8 *bytes,
+                               double *asDouble = nullptr) {
+  u64 raw = 0;
+  switch (field.size) {
+  case 1:
+    raw = bytes[0];
+    break;
+  case 2: {
+    u16 v;
+    memcpy(&v, bytes, 2);
+    raw = field.bigEndian ? __builtin_bswap16(v) : v;
+    break;
+  }
+  case 4: {
+    u32 v;
+    memcpy(&v, bytes, 4);
+    raw = field.bigEndian ? __builtin_bswap32(v) : v;
+    break;
+  }
+  case 8: {
+    u64 v;
+    memcpy(&v, bytes, 8);
+    raw = field.bigEndian ? __builtin_bswap64(v) : v;
+    break;
+  }
+  }
+
+  if (field.type == CraneTemplateType::F32) {
+    float f;
+    u32 bits = (u32)raw;
+    memcpy(&f, &bits, 4);
+    if (asDouble) {
+      *asDouble = f;
+    }
+    return (u64)(long long)f;
+  } else if (field.type == CraneTemplateType::F64) {
+    double d;
+    memcpy(&d, &raw, 8);
+    if (asDouble) {
+      *asDouble = d;
+    }
+    return (u64)(long long)d;
+  }
+
+  if (field.isSigned() && field.size < 8) {
+    u64 signBit = 1ULL << (field.size * 8 - 1);
+    raw = (raw ^ signBit) - signBit;
+  }
+
+  if (asDouble) {
+    *asDouble = field.isSigned() ? (double)(long long)raw : (double)raw;
+  }
+
+  return raw;
+}
+
+/**
+ * Reads bytes for a template through a view of the selected file, the file's
+ * page cache means only the pages that were actually requested are read.
+ */
+struct CraneTemplateSource {
+public:
+  u64 size;
+
+  CraneTemplateSource(CraneContext *context)
+    : size(0), views(context->views), view(views->acquire(context)) {
+    if (view != nullptr) {
+      size = views->size(view);
+    }
+  }
+
+  ~CraneTemplateSource() { views->release(view); }
+
+  CraneTemplateSource(const CraneTemplateSource &) = delete;
+  CraneTemplateSource &operator=(const CraneTemplateSource &) = delete;
+
+  inline bool read(u64 offset, void *dst, u64 length) {
+    if (offset > size || length > size - offset) {
+      return false;
+    }
+
+    return views->read(view, offset, dst, length) == length;
+  }
+
+private:
+  const CraneViewApi *views;
+  CraneView *view;
+};
+
+/**
+ * A template applied at a base offset. Field layout is resolved front to back
+ * on demand and scalar values are only decoded when they are displayed or
+ * referenced by a count, condition or offset expression.
+ */
+struct CraneTemplateInstance {
+public:
+  struct Layout {
+    bool isPresent;
+    u64 offset;
+    u64 count;
+  };
+
+  CraneTemplate *tmpl;
+  CraneTemplateSource *source;
+  u64 base;
+  std::vector<Layout> layouts;
+  std::vector<bool> hasValue;
+  std::vector<u64> values;
+  std::string error;
+
+  CraneTemplateInstance(CraneTemplate *tmpl, CraneTemplateSource *source, u64 base)
+    : tmpl(tmpl),
+      source(source),
+      base(base),
+      hasValue(tmpl->fields.size(), false),
+      values(tmpl->fields.size(), 0) {}
+
+  inline bool value(size_t index, u64 &out) {
+    if (hasValue[index]) {
+      out = values[index];
+      return true;
+    }
+
+    if (!resolve(index)) {
+      return false;
+    }
+
+    CraneTemplateField &field = tmpl->fields[index];
+    if (!layouts[index].isPresent) {
+      out = 0;
+    } else {
+      u8 bytes[8];
+      if (!source->read(layouts[index].offset, bytes, field.size)) {
+        error = "field '" + field.name + "' is out of bounds";
+        return false;
+      }
+      out = craneTemplateDecode(field, bytes);
+    }
+
+    hasValue[index] = true;
+    values[index] = out;
+    return true;
+  }
+
+  inline bool evaluate(int exprIndex, u64 &out) {
+    u64 stack[kTemplateMaxDepth];
+    size_t depth = 0;
+
+    for (auto &op : tmpl->expressions[exprIndex]) {
+      if (op.code == CraneTemplateOpcode::Push) {
+        stack[depth++] = op.operand;
+        continue;
+      } else if (op.code == CraneTemplateOpcode::Load) {
+        if (!value(op.operand, stack[depth])) {
+          return false;
+        }
+        depth++;
+        continue;
+      } else if (op.code == CraneTemplateOpcode::Negate) {
+        stack[depth - 1] = -stack[depth - 1];
+        continue;
+      } else if (op.code == CraneTemplateOpcode::Not) {
+        stack[depth - 1] = !stack[depth - 1];
+        continue;
+      }
+
+      u64 rhs = stack[--depth];
+      u64 &lhs = stack[depth - 1];
+      switch (op.code) {
+      case CraneTemplateOpcode::Multiply: lhs *= rhs; break;
+      case CraneTemplateOpcode::Divide:
+      case CraneTemplateOpcode::Modulo:
+        if (rhs == 0) {
+          error = "division by zero";
+          return false;
+        }
+        lhs = op.code == CraneTemplateOpcode::Divide ? lhs / rhs : lhs % rhs;
+        break;
+      case CraneTemplateOpcode::Add: lhs += rhs; break;
+      case CraneTemplateOpcode::Subtract: lhs -= rhs; break;
+      case CraneTemplateOpcode::ShiftLeft: lhs = rhs < 64 ? lhs << rhs : 0; break;
+      case CraneTemplateOpcode::ShiftRight: lhs = rhs < 64 ? lhs >> rhs : 0; break;
+      case CraneTemplateOpcode::Less: lhs = (long long)lhs < (long long)rhs; break;
+      case CraneTemplateOpcode::LessEqual: lhs = (long long)lhs <= (long long)rhs; break;
+      case CraneTemplateOpcode::Greater: lhs = (long long)lhs > (long long)rhs; break;
+      case CraneTemplateOpcode::GreaterEqual: lhs = (long long)lhs >= (long long)rhs; break;
+      case CraneTemplateOpcode::Equal: lhs = lhs == rhs; break;
+      case CraneTemplateOpcode::NotEqual: lhs = lhs != rhs; break;
+      case CraneTemplateOpcode::BitAnd: lhs &= rhs; break;
+      case CraneTemplateOpcode::BitXor: lhs ^= rhs; break;
+      case CraneTemplateOpcode::BitOr: lhs |= rhs; break;
+      case CraneTemplateOpcode::And: lhs = lhs && rhs; break;
+      case CraneTemplateOpcode::Or: lhs = lhs || rhs; break;
+      default: break;
+      }
+    }
+
+    out = stack[0];
+    return true;
+  }
+
+  // resolves the offset, count and presence of every field up to `index`
+  inline bool resolve(size_t index) {
+    while (layouts.size() <= index) {
+      size_t i = layouts.size();
+      CraneTemplateField &field = tmpl->fields[i];
+      Layout layout = {true, 0, field.count};
+
+      if (field.conditionExpr != kTemplateNoExpr) {
+        u64 condition;
+        if (!evaluate(field.conditionExpr, condition)) {
+          return false;
+        }
+        layout.isPresent = condition != 0;
+      }
+
+      if (field.offsetExpr != kTemplateNoExpr) {
+        u64 offset;
+        if (!evaluate(field.offsetExpr, offset)) {
+          return false;
+        }
+        layout.offset = base + offset;
+      } else if (field.hasStaticOffset) {
+        layout.offset = base + field.staticOffset;
+      } else if (i == 0) {
+        layout.offset = base;
+      } else {
+        Layout &prev = layouts[i - 1];
+        CraneTemplateField &prevField = tmpl->fields[i - 1];
+        u64 size;
+        layout.offset = prev.offset;
+        if (prev.isPresent &&
+            (__builtin_mul_overflow(prev.count, (u64)prevField.size, &size) ||
+             __builtin_add_overflow(layout.offset, size, &layout.offset))) {
+          error = "field '" + prevField.name + "' is out of bounds";
+          return false;
+        }
+      }
+
+      if (layout.isPresent && field.countExpr != kTemplateNoExpr) {
+        if (!evaluate(field.countExpr, layout.count)) {
+          return false;
+        }
+      }
+
+      layouts.push_back(layout);
+    }
+
+    return true;
+  }
+};
+
+/**
+ * Template compiler: a recursive descent parser emitting postfix expressions
+ */
+struct CraneTemplateCompiler {
+public:
+  const std::string &source;
+  size_t position;
+  int line;
+  std::string token;
+  bool isNumber;
+  CraneTemplate *tmpl;
+  std::vector<int> conditions;
+  int nesting;
+  std::string error;
+
+  CraneTemplateCompiler(const std::string &source, CraneTemplate *tmpl)
+    : source(source), position(0), line(1), isNumber(false), tmpl(tmpl), nesting(0) {}
+
+  inline bool fail(std::string message) {
+    if (error.empty()) {
+      error = "line " + std::to_string(line) + ": " + message;
+    }
+    return false;
+  }
+
+  inline void next() {
+    // skip whitespace and comments
+    while (position < source.size()) {
+      char c = source[position];
+      if (c == '\n') {
+        line++;
+        position++;
+      } else if (isspace(c)) {
+        position++;
+      } else if (c == '#' || (c == '/' && position + 1 < source.size() &&
+                              source[position + 1] == '/')) {
+        while (position < source.size() && source[position] != '\n') {
+          position++;
+        }
+      } else {
+        break;
+      }
+    }
+
+    token.clear();
+    isNumber = false;
+    if (position >= source.size()) {
+      return;
+    }
+
+    char c = source[position];
+    if (isalnum(c) || c == '_') {
+      isNumber = isdigit(c);
+      while (position < source.size() &&
+             (isalnum(source[position]) || source[position] == '_')) {
+        token.push_back(source[position++]);
+      }
+      return;
+    }
+
+    static const char *pairs[] = {"<<", ">>", "<=", ">=", "==", "!=", "&&", "||"};
+    for (auto pair : pairs) {
+      if (source.compare(position, 2, pair) == 0) {
+        token = pair;
+        position += 2;
+        return;
+      }
+    }
+
+    token.push_back(c);
+    position++;
+  }
+
+  inline bool expect(const char *expected) {
+    if (token != expected) {
+      return fail("expected '" + std::string(expected) + "' but found '" + token + "'");
+    }
+    next();
+    return true;
+  }
+
+  inline int precedence(const std::string &op, CraneTemplateOpcode &code) {
+    static const std::pair<const char *, std::pair<int, CraneTemplateOpcode>> table[] = {
+        {"*", {10, CraneTemplateOpcode::Multiply}},
+        {"/", {10, CraneTemplateOpcode::Divide}},
+        {"%", {10, CraneTemplateOpcode::Modulo}},
+        {"+", {9, CraneTemplateOpcode::Add}},
+        {"-", {9, CraneTemplateOpcode::Subtract}},
+        {"<<", {8, CraneTemplateOpcode::ShiftLeft}},
+        {">>", {8, CraneTemplateOpcode::ShiftRight}},
+        {"<", {7, CraneTemplateOpcode::Less}},
+        {"<=", {7, CraneTemplateOpcode::LessEqual}},
+        {">", {7, CraneTemplateOpcode::Greater}},
+        {">=", {7, CraneTemplateOpcode::GreaterEqual}},
+        {"==", {6, CraneTemplateOpcode::Equal}},
+        {"!=", {6, CraneTemplateOpcode::NotEqual}},
+        {"&", {5, CraneTemplateOpcode::BitAnd}},
+        {"^", {4, CraneTemplateOpcode::BitXor}},
+        {"|", {3, CraneTemplateOpcode::BitOr}},
+        {"&&", {2, CraneTemplateOpcode::And}},
+        {"||", {1, CraneTemplateOpcode::Or}},
+    };
+
+    for (auto &entry : table) {
+      if (op == entry.first) {
+        code = entry.second.second;
+        return entry.second.first;
+      }
+    }
+
+    return -1;
+  }
+
+  inline bool parsePrimary(std::vector<CraneTemplateOp> &ops) {
+    if (token == "(" || token == "-" || token == "!") {
+      // parentheses and unary operators recurse, bound them before the stack is
+      if (nesting >= kTemplateMaxDepth) {
+        return fail("expression is too deeply nested");
+      }
+
+      nesting++;
+      bool isParsed = parseNested(ops);
+      nesting--;
+      return isParsed;
+    } else if (isNumber) {
+      char *end;
+      u64 value = strtoull(token.c_str(), &end, 0);
+      if (*end != '\0') {
+        return fail("invalid number '" + token + "'");
+      }
+      ops.push_back({CraneTemplateOpcode::Push, value});
+      next();
+      return true;
+    } else if (!token.empty() && (isalpha(token[0]) || token[0] == '_')) {
+      int index = tmpl->findField(token);
+      if (index < 0) {
+        return fail("unknown field '" + token + "'");
+      }
+
+      CraneTemplateField &field = tmpl->fields[index];
+      if (field.isArray || !field.isInteger()) {
+        return fail("field '" + token + "' is not an integer scalar");
+      }
+
+      ops.push_back({CraneTemplateOpcode::Load, (u64)index});
+      next();
+      return true;
+    }
+
+    return fail("unexpected '" + token + "' in expression");
+  }
+
+  inline bool parseNested(std::vector<CraneTemplateOp> &ops) {
+    if (token == "(") {
+      next();
+      if (!parseExpression(ops, 0)) {
+        return false;
+      }
+      return expect(")");
+    }
+
+    CraneTemplateOpcode code =
+        token == "-" ? CraneTemplateOpcode::Negate : CraneTemplateOpcode::Not;
+    next();
+    if (!parsePrimary(ops)) {
+      return false;
+    }
+    ops.push_back({code, 0});
+    return true;
+  }
+
+  inline bool parseExpression(std::vector<CraneTemplateOp> &ops, int minPrecedence) {
+    if (!parsePrimary(ops)) {
+      return false;
+    }
+
+    CraneTemplateOpcode code;
+    int prec;
+    while ((prec = precedence(token, code)) >= minPrecedence) {
+      next();
+      if (!parseExpression(ops, prec + 1)) {
+        return false;
+      }
+      ops.push_back({code, 0});
+    }
+
+    return true;
+  }
+
+  inline int addExpression(std::vector<CraneTemplateOp> ops) {
+    // a deeper expression than the evaluator's stack is refused up front
+    int depth = 0, maxDepth = 0;
+    for (auto &op : ops) {
+      if (op.code == CraneTemplateOpcode::Push || op.code == CraneTemplateOpcode::Load) {
+        depth++;
+      } else if (op.code != CraneTemplateOpcode::Negate &&
+                 op.code != CraneTemplateOpcode::Not) {
+        depth--;
+      }
+      maxDepth = std::max(maxDepth, depth);
+    }
+
+    if (maxDepth > kTemplateMaxDepth) {
+      fail("expression is too deeply nested");
+      return kTemplateNoExpr;
+    }
+
+    tmpl->expressions.push_back(ops);
+    return (int)tmpl->expressions.size() - 1;
+  }
+
+  inline bool parseType(CraneTemplateType &type, u32 &size, bool &bigEndian) {
+    static const std::pair<const char *, std::pair<CraneTemplateType, u32>> types[] = {
+        {"u8", {CraneTemplateType::U8, 1}},    {"u16", {CraneTemplateType::U16, 2}},
+        {"u32", {CraneTemplateType::U32, 4}},  {"u64", {CraneTemplateType::U64, 8}},
+        {"i8", {CraneTemplateType::I8, 1}},    {"i16", {CraneTemplateType::I16, 2}},
+        {"i32", {CraneTemplateType::I32, 4}},  {"i64", {CraneTemplateType::I64, 8}},
+        {"f32", {CraneTemplateType::F32, 4}},  {"f64", {CraneTemplateType::F64, 8}},
+        {"char", {CraneTemplateType::Char, 1}},
+    };
+
+    std::string name = token;
+    bigEndian = false;
+    if (name.size() > 2 && (name.compare(name.size() - 2, 2, "be") == 0 ||
+                            name.compare(name.size() - 2, 2, "le") == 0)) {
+      bigEndian = name[name.size() - 2] == 'b';
+      name.resize(name.size() - 2);
+    }
+
+    for (auto &entry : types) {
+      if (name == entry.first) {
+        type = entry.second.first;
+        size = entry.second.second;
+        next();
+        return true;
+      }
+    }
+
+    return fail("unknown type '" + token + "'");
+  }
+
+  inline bool currentCondition(int &expr) {
+    expr = kTemplateNoExpr;
+    if (conditions.empty()) {
+      return true;
+    }
+
+    // nested conditions are flattened into a single conjunction per field
+    std::vector<CraneTemplateOp> ops;
+    for (size_t i = 0; i < conditions.size(); i++) {
+      auto &cond = tmpl->expressions[conditions[i]];
+      ops.insert(ops.end(), cond.begin(), cond.end());
+      if (i > 0) {
+        ops.push_back({CraneTemplateOpcode::And, 0});
+      }
+    }
+
+    expr = conditions.size() == 1 ? conditions[0] : addExpression(ops);
+    return expr != kTemplateNoExpr;
+  }
+
+  inline bool parseDeclaration() {
+    if (token == "if") {
+      next();
+      if (!expect("(")) {
+        return false;
+      }
+
+      if (conditions.size() >= kTemplateMaxDepth) {
+        return fail("'if' blocks are too deeply nested");
+      }
+
+      std::vector<CraneTemplateOp> ops;
+      if (!parseExpression(ops, 0) || !expect(")") || !expect("{")) {
+        return false;
+      }
+
+      int condition = addExpression(ops);
+      if (condition == kTemplateNoExpr) {
+        return false;
+      }
+      conditions.push_back(condition);
+      while (token != "}") {
+        if (token.empty()) {
+          return fail("expected '}' before end of template");
+        }
+        if (!parseDeclaration()) {
+          return false;
+        }
+      }
+      conditions.pop_back();
+      next();
+      return true;
+    }
+
+    int offsetExpr = kTemplateNoExpr;
+    if (token == "@") {
+      next();
+      std::vector<CraneTemplateOp> ops;
+      if (!parsePrimary(ops)) {
+        return false;
+      }
+      offsetExpr = addExpression(ops);
+      if (offsetExpr == kTemplateNoExpr) {
+        return false;
+      }
+    }
+
+    CraneTemplateType type;
+    u32 size;
+    bool bigEndian;
+    if (!parseType(type, size, bigEndian)) {
+      return false;
+    }
+
+    if (token.empty() || isNumber || !(isalpha(token[0]) || token[0] == '_')) {
+      return fail("expected a field name but found '" + token + "'");
+    }
+
+    if (tmpl->findField(token) >= 0) {
+      return fail("duplicate field '" + token + "'");
+    }
+
+    CraneTemplateField field(token, type, size, bigEndian);
+    field.offsetExpr = offsetExpr;
+    if (!currentCondition(field.conditionExpr)) {
+      return false;
+    }
+    next();
+
+    if (token == "[") {
+      next();
+      std::vector<CraneTemplateOp> ops;
+      if (!parseExpression(ops, 0) || !expect("]")) {
+        return false;
+      }
+
+      field.isArray = true;
+      if (ops.size() == 1 && ops[0].code == CraneTemplateOpcode::Push) {
+        field.count = ops[0].operand;
+      } else {
+        field.countExpr = addExpression(ops);
+        if (field.countExpr == kTemplateNoExpr) {
+          return false;
+        }
+      }
+    }
+
+    if (!expect(";")) {
+      return false;
+    }
+
+    tmpl->fields.push_back(field);
+    return true;
+  }
+
+  inline bool compile() {
+    next();
+    while (!token.empty()) {
+      if (!parseDeclaration()) {
+        return false;
+      }
+    }
+
+    if (tmpl->fields.empty()) {
+      return fail("template has no fields");
+    }
+
+    // precompute offsets up to the first field whose position depends on data
+    u64 offset = 0;
+    bool isStatic = true;
+    for (auto &field : tmpl->fields) {
+      if (field.offsetExpr != kTemplateNoExpr) {
+        auto &ops = tmpl->expressions[field.offsetExpr];
+        isStatic = ops.size() == 1 && ops[0].code == CraneTemplateOpcode::Push;
+        if (isStatic) {
+          offset = ops[0].operand;
+          field.offsetExpr = kTemplateNoExpr;
+        }
+      }
+
+      field.hasStaticOffset = isStatic;
+      field.staticOffset = isStatic ? offset : 0;
+
+      if (field.countExpr != kTemplateNoExpr || field.conditionExpr != kTemplateNoExpr) {
+        isStatic = false;
+      }
+
+      // a field whose end doesn't fit in 64 bits would wrap the offsets after it
+      u64 size;
+      if (__builtin_mul_overflow(field.count, (u64)field.size, &size) ||
+          __builtin_add_overflow(offset, size, &offset)) {
+        error = "field '" + field.name + "' is too large";
+        return false;
+      }
+    }
+
+    // every static field's end was checked above, none of these can overflow
+    tmpl->isFixedSize = true;
+    tmpl->fixedSize = 0;
+    for (auto &field : tmpl->fields) {
+      if (!field.hasStaticOffset || field.countExpr != kTemplateNoExpr ||
+          field.conditionExpr != kTemplateNoExpr) {
+        tmpl->isFixedSize = false;
+        break;
+      }
+      tmpl->fixedSize =
+          std::max(tmpl->fixedSize, field.staticOffset + field.count * field.size);
+    }
+
+    return error.empty();
+  }
 };
 
+inline CraneTemplate *CraneTemplate::compile(std::string name, const std::string &source,
+                                             std::string &error) {
+  CraneTemplate *tmpl = new CraneTemplate(name);
+  CraneTemplateCompiler compiler(source, tmpl);
+
+  if (!compiler.compile()) {
+    error = compiler.error;
+    delete tmpl;
+    return nullptr;
+  }
+
+  tmpl->description = source;
+  return tmpl;
+}
+
 #endif
@@ -0,0 +1,198 @@
+#ifndef trace_hpp
+#define trace_hpp
+
+#include "context.hpp"
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+/**
+ * Tracing for the host and plugins, exported as Chrome trace JSON (which
+ * Perfetto and chrome://tracing load) with `trace start` / `trace dump <file>`.
+ *
+ *   craneTraceSpan(context, "parse header");       // until the end of the scope
+ *   craneTraceBegin(context, "read");               // or explicitly
+ *   craneTraceEnd(context, "read");
+ *   craneTraceCounter(context, "bytes left", left);
+ *
+ * Each thread writes into its own ring buffer, the owner is the only writer so
+ * recording an event is a copy and a store. When the ring is full the oldest
+ * events are overwritten. Names are copied into the event, so they can be
+ * temporaries and survive the module that recorded them being reloaded.
+ *
+ * While tracing is stopped every macro is a load and a branch.
+ */
+
+#define kTraceBufferEvents (1 << 16)
+#define kTraceNameSize 47
+
+struct CraneTraceEvent {
+public:
+  u64 timestamp;
+  // the duration of complete ('X') events, the value of counters ('C')
+  long long value;
+  char phase;
+  char name[kTraceNameSize];
+};
+
+/**
+ * One thread's events. Indexes only grow, the event at `index` lives in slot
+ * `index % kTraceBufferEvents` until it's overwritten.
+ */
+struct CraneTraceBuffer {
+public:
+  std::thread::id thread;
+  u32 id;
+  std::string threadName;
+  std::atomic<u64> head;
+  std::unique_ptr<CraneTraceEvent[]> events;
+
+  CraneTraceBuffer(std::thread::id thread, u32 id, std::string threadName)
+    : thread(thread),
+      id(id),
+      threadName(threadName),
+      head(0),
+      events(new CraneTraceEvent[kTraceBufferEvents]) {}
+
+  inline void push(char phase, const char *name, u64 timestamp, long long value) {
+    u64 index = head.load(std::memory_order_relaxed);
+    CraneTraceEvent &event = events[index & (kTraceBufferEvents - 1)];
+    event.timestamp = timestamp;
+    event.value = value;
+    event.phase = phase;
+    strncpy(event.name, name, kTraceNameSize - 1);
+    event.name[kTraceNameSize - 1] = '\0';
+    head.store(index + 1, std::memory_order_release);
+  }
+};
+
+struct CraneTracer {
+public:
+  std::atomic<bool> isEnabled;
+  // events before this (ns since the tracer was made) are left out of dumps
+  std::atomic<u64> startedAt;
+
+  CraneTracer() : isEnabled(false), startedAt(0) {
+    clock_gettime(CLOCK_MONOTONIC, &origin);
+  }
+
+  CraneTracer(const CraneTracer &) = delete;
+  CraneTracer &operator=(const CraneTracer &) = delete;
+
+  inline u64 now() const {
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64)(time.tv_sec - origin.tv_sec) * 1000000000ULL + time.tv_nsec -
+           origin.tv_nsec;
+  }
+
+  inline void record(char phase, const char *name, u64 timestamp, long long value) {
+    if (isEnabled.load(std::memory_order_relaxed)) {
+      threadBuffer()->push(phase, name, timestamp, value);
+    }
+  }
+
+  // the calling thread's buffer, made the first time the thread records something
+  inline CraneTraceBuffer *threadBuffer() {
+    // each module has its own copy of a thread_local, the buffers are shared
+    static thread_local CraneTracer *cachedTracer = nullptr;
+    static thread_local CraneTraceBuffer *cachedBuffer = nullptr;
+    if (cachedTracer == this) {
+      return cachedBuffer;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::thread::id self = std::this_thread::get_id();
+    CraneTraceBuffer *buffer = nullptr;
+    for (auto &existing : buffers) {
+      if (existing->thread == self) {
+        buffer = existing.get();
+      }
+    }
+
+    if (buffer == nullptr) {
+      char name[32] = "";
+      pthread_getname_np(pthread_self(), name, sizeof(name));
+      buffers.emplace_back(new CraneTraceBuffer(self, buffers.size() + 1, name));
+      buffer = buffers.back().get();
+    }
+
+    cachedTracer = this;
+    cachedBuffer = buffer;
+    return buffer;
+  }
+
+  // writes everything recorded since `startedAt` as Chrome trace JSON (host only)
+  bool dump(FILE *out, u64 *eventCount);
+
+private:
+  timespec origin;
+  std::mutex lock;
+  std::vector<std::unique_ptr<CraneTraceBuffer>> buffers;
+};
+
+/**
+ * Records a complete event covering its lifetime.
+ */
+struct CraneTraceScope {
+public:
+  CraneTraceScope(CraneContext *context, const char *name)
+    : tracer(context->tracer != nullptr &&
+                     context->tracer->isEnabled.load(std::memory_order_relaxed)
+                 ? context->tracer
+                 : nullptr),
+      name(name),
+      start(tracer != nullptr ? tracer->now() : 0) {}
+
+  ~CraneTraceScope() {
+    if (tracer != nullptr) {
+      tracer->record('X', name, start, tracer->now() - start);
+    }
+  }
+
+  CraneTraceScope(const CraneTraceScope &) = delete;
+  CraneTraceScope &operator=(const CraneTraceScope &) = delete;
+
+private:
+  CraneTracer *tracer;
+  const char *name;
+  u64 start;
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-function"
+// names the calling thread, traces label each thread's events with it
+inline static void craneNameThread(const char *name) {
+#if kUsingCraneDarwin
+  pthread_setname_np(name);
+#else
+  pthread_setname_np(pthread_self(), name);
+#endif
+}
+
+inline static void craneTraceEvent(CraneContext *context, char phase, const char *name,
+                                   long long value) {
+  CraneTracer *tracer = context->tracer;
+  if (tracer != nullptr && tracer->isEnabled.load(std::memory_order_relaxed)) {
+    tracer->record(phase, name, tracer->now(), value);
+  }
+}
+#pragma clang diagnostic pop
+
+#define _traceConcat(x, y) x##y
+#define _traceScopeName(line) _traceConcat(craneTraceScope, line)
+
+#define craneTraceSpan(context, name)                                                   \
+  CraneTraceScope _traceScopeName(__LINE__)((context), (name))
+#define craneTraceBegin(context, name) craneTraceEvent((context), 'B', (name), 0)
+#define craneTraceEnd(context, name) craneTraceEvent((context), 'E', (name), 0)
+#define craneTraceCounter(context, name, value)                                         \
+  craneTraceEvent((context), 'C', (name), (long long)(value))
+
+#endif
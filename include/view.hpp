@@ -0,0 +1,102 @@
+#ifndef view_hpp
+#define view_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The byte view interface (plugin API v2).
+ *
+ * Instead of reaching into an open file's edit buffer or reading its `FILE`,
+ * plugins ask the host for a view of the selected file through
+ * `context->views`. The table only uses C types so it stays stable while the
+ * host changes how files are stored (edit buffer, mapping, piece table...).
+ *
+ * Contents are handed out as contiguous segments that point straight into the
+ * host's storage, iterate them like this:
+ *
+ *   CraneView *view = context->views->acquire(context);
+ *   CraneViewSegment segment;
+ *   for (uint64_t offset = 0; context->views->segment(view, offset, &segment);
+ *        offset += segment.size) {
+ *     consume(segment.data, segment.size);
+ *   }
+ *   context->views->release(view);
+ *
+ * Files are read through a page cache, so segments are usually a page long.
+ * A segment stays valid until the next `segment` call on the same view, the
+ * view is released or an edit is committed. `map` gives the whole content as
+ * one segment instead, by mapping the file or, in edit mode, by loading it.
+ *
+ * Edits are made in transactions: every `replace` uses the offsets of the
+ * content as it looks after the previous replaces, and `commit` applies them
+ * all at once (edit mode only). Overwrites, appends and truncations are kept
+ * as dirty pages, anything that moves bytes loads the whole file first.
+ *
+ * `version` and `structSize` tell plugins what the host provides, functions
+ * are only ever appended to the table.
+ */
+
+#define kCraneViewApiVersion 3
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct CraneContext;
+typedef struct CraneView CraneView;
+typedef struct CraneViewEdit CraneViewEdit;
+
+typedef struct CraneViewSegment {
+  const uint8_t *data;
+  uint64_t size;
+  // offset of `data` in the file
+  uint64_t offset;
+} CraneViewSegment;
+
+#define kCraneViewToEnd UINT64_MAX
+
+typedef enum CraneViewAccess {
+  CraneViewAccessNormal = 0,
+  CraneViewAccessSequential = 1,
+  CraneViewAccessRandom = 2,
+  CraneViewAccessWillNeed = 3
+} CraneViewAccess;
+
+typedef struct CraneViewApi {
+  uint32_t version;
+  uint32_t structSize;
+
+  // a view of the selected file, NULL when there is none or it can't be read
+  CraneView *(*acquire)(struct CraneContext *context);
+  void (*release)(CraneView *view);
+  uint64_t (*size)(const CraneView *view);
+
+  // the contiguous bytes starting at `offset`, returns 0 past the end
+  int (*segment)(CraneView *view, uint64_t offset, CraneViewSegment *out);
+  // copies up to `size` bytes at `offset`, returns how many were copied
+  uint64_t (*read)(CraneView *view, uint64_t offset, void *out, uint64_t size);
+  void (*prefetch)(CraneView *view, uint64_t offset, uint64_t size, CraneViewAccess access);
+
+  // NULL unless the selected file is in edit mode
+  CraneViewEdit *(*beginEdit)(CraneView *view);
+  // `removed` can be kCraneViewToEnd to drop everything from `offset` on
+  int (*replace)(CraneViewEdit *edit, uint64_t offset, uint64_t removed, const void *bytes,
+                 uint64_t size);
+  // both end the transaction, commit returns 0 on success
+  int (*commit)(CraneViewEdit *edit);
+  void (*abort)(CraneViewEdit *edit);
+
+  // version 3: the whole content as a single segment, valid until the view is
+  // released or an edit is committed, returns 0 when it can't be provided
+  int (*map)(CraneView *view, CraneViewSegment *out);
+} CraneViewApi;
+
+#ifdef __cplusplus
+}
+#endif
+
+// implemented by the host (src/view.cpp), plugins use `context->views`
+const CraneViewApi *craneHostViewApi();
+
+#endif
@@ -2,22 +2,39 @@
 #include "config.hpp"
 #include "context.hpp"
 #include "contributions.hpp"
+#include "jobs.hpp"
+#include "macros.hpp"
 #include "prompt.hpp"
+#include "replace.hpp"
+#include "spans.hpp"
+#include "stats.hpp"
+#include "storage.hpp"
+#include "templates.hpp"
 #include <_ctype.h>
+#include <algorithm>
 #include <cctype>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
-#include <readline/readline.h>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
-contributableCommand(open) {
-  if (context->interfaceMode == CraneInterfaceMode::Edit) {
-    printf("Cannot open a file in edit mode\n");
-    return 1;
+// edit mode follows the selection, it's on while the selected file is edited
+static void selectOpenFile(CraneContext *context, CraneOpenFile *file) {
+  context->openedFile = file;
+  if (file != nullptr && file->isEditing) {
+    context->interfaceMode = CraneInterfaceMode::Edit;
+  } else if (context->interfaceMode == CraneInterfaceMode::Edit) {
+    context->interfaceMode = CraneInterfaceMode::Normal;
   }
+}
 
-  std::string filePath = command->arguments[0]->value;
-  std::string fileAlias = command->arguments[1]->value;
+contributableCommand(openFile) {
+  std::string filePath(command->arguments[0]->value);
+  std::string fileAlias(command->arguments[1]->value);
 
   // check if the file exists
   struct stat fileStat;
@@ -33,7 +50,7 @@ contributableCommand(open) {
   }
 
   // check if the file is already open
-  if (context->fileMap.find(fileAlias) != context->fileMap.end()) {
+  if (context->session->fileMap.find(fileAlias) != context->session->fileMap.end()) {
     printf("File '%s' is already open\n", fileAlias.c_str());
     return 0;
   }
@@ -46,20 +63,17 @@ contributableCommand(open) {
   }
 
   // add the file to the file map
-  context->fileMap[fileAlias] = new CraneOpenFile(filePath, fileAlias, file);
+  context->session->fileMap[fileAlias] = craneNewOpenFile(filePath, fileAlias, file);
 
   if (context->openedFile == nullptr) {
-    context->openedFile = context->fileMap[fileAlias];
-  } else {
-    printf("A file is already selected, would you like to unselect it? (y/n) ");
-    char *answer = readline("");
-    if (answer && (answer[0] == 'y' || answer[0] == 'Y')) {
-      context->openedFile = context->fileMap[fileAlias];
+    selectOpenFile(context, context->session->fileMap[fileAlias]);
+  } else if (context->isInteractive && context->confirm != nullptr) {
+    if (context->confirm(context, "A file is already selected, "
+                                  "would you like to unselect it? (y/n) ")) {
+      selectOpenFile(context, context->session->fileMap[fileAlias]);
     }
 
-    free(answer);
-
-    if (context->openedFile != context->fileMap[fileAlias]) {
+    if (context->openedFile != context->session->fileMap[fileAlias]) {
       printf("To select this file later, use 'select %s'\n", fileAlias.c_str());
     }
   }
@@ -69,29 +83,30 @@ contributableCommand(open) {
   return 0;
 }
 
-contributableCommand(select) {
-  if (context->interfaceMode == CraneInterfaceMode::Edit) {
-    printf("Cannot select a file in edit mode\n");
-    return 1;
-  }
-
+// edited files keep their edits while another one is selected
+contributableCommand(selectFile) {
   if (command->arguments.size() == 0) {
+    if (context->openedFile == nullptr) {
+      printf("No file is selected\n");
+      return 1;
+    }
+
     printf("Unselecting file '%s' (%s)\n", context->openedFile->alias.c_str(),
            context->openedFile->path.c_str());
-    context->openedFile = nullptr;
+    selectOpenFile(context, nullptr);
     return 0;
   }
 
-  std::string fileAlias = command->arguments[0]->value;
+  std::string fileAlias(command->arguments[0]->value);
 
   // check if the file is already open
-  if (context->fileMap.find(fileAlias) == context->fileMap.end()) {
+  if (context->session->fileMap.find(fileAlias) == context->session->fileMap.end()) {
     printf("File '%s' is not open\n", fileAlias.c_str());
     return 1;
   }
 
   // check if the file is already selected
-  if (context->openedFile == context->fileMap[fileAlias]) {
+  if (context->openedFile == context->session->fileMap[fileAlias]) {
     printf("File '%s' is already selected\n", fileAlias.c_str());
     return 0;
   }
@@ -103,79 +118,110 @@ contributableCommand(select) {
   }
 
   // select the new file
-  context->openedFile = context->fileMap[fileAlias];
-  printf("Selected file '%s' (%s)\n", context->openedFile->alias.c_str(),
-         context->openedFile->path.c_str());
+  selectOpenFile(context, context->session->fileMap[fileAlias]);
+  printf("Selected file '%s' (%s)%s\n", context->openedFile->alias.c_str(),
+         context->openedFile->path.c_str(),
+         context->openedFile->isEditing ? ", editing" : "");
 
   return 0;
 }
 
-contributableCommand(close) {
-  if (context->interfaceMode == CraneInterfaceMode::Edit) {
-    printf("Cannot close a file while in edit mode\n");
-    return 1;
+// files with an edit session have to leave it first, it may hold unsaved edits
+static bool isBeingEdited(CraneOpenFile *file) {
+  if (file->isEditing) {
+    printf("File '%s' is being edited, 'save' it and switch to 'normal' first\n",
+           file->alias.c_str());
   }
+  return file->isEditing;
+}
 
+contributableCommand(closeFile) {
   if (command->arguments.size() == 0) {
     if (context->openedFile == nullptr) {
       printf("No file is selected\n");
       return 1;
     }
 
+    if (isBeingEdited(context->openedFile)) {
+      return 1;
+    }
+
     printf("Closing file '%s'\n", context->openedFile->alias.c_str());
-    delete context->fileMap[context->openedFile->alias];
-    context->fileMap.erase(context->openedFile->alias);
+    fclose(context->openedFile->handle);
+    craneDeleteOpenFile(context->session->fileMap[context->openedFile->alias]);
+    context->session->fileMap.erase(context->openedFile->alias);
     context->openedFile = nullptr;
     return 0;
   }
 
-  std::string fileAlias = command->arguments[0]->value;
+  std::string fileAlias(command->arguments[0]->value);
 
   if (fileAlias == "all") {
-    for (auto it = context->fileMap.begin(); it != context->fileMap.end(); it++) {
-      printf("Closing file '%s'\n", it->first.c_str());
-      delete it->second;
+    for (auto &file : context->session->fileMap) {
+      if (isBeingEdited(file.second)) {
+        return 1;
+      }
     }
 
-    context->fileMap.clear();
+    for (auto &file : context->session->fileMap) {
+      printf("Closing file '%s'\n", file.first.c_str());
+      fclose(file.second->handle);
+      craneDeleteOpenFile(file.second);
+    }
+
+    context->session->fileMap.clear();
     context->openedFile = nullptr;
     return 0;
   }
 
   // check if the file is already open
-  if (context->fileMap.find(fileAlias) == context->fileMap.end()) {
+  if (context->session->fileMap.find(fileAlias) == context->session->fileMap.end()) {
     printf("File '%s' is not open\n", fileAlias.c_str());
     return 1;
   }
 
   // check if the file is already selected
-  if (context->openedFile == context->fileMap[fileAlias]) {
+  if (context->openedFile == context->session->fileMap[fileAlias]) {
     printf("File '%s' is currently selected, unselect it first or use 'close' with no "
            "arguments to close this file\n",
            fileAlias.c_str());
     return 1;
   }
 
+  if (isBeingEdited(context->session->fileMap[fileAlias])) {
+    return 1;
+  }
+
   // close the file
   printf("Closing file '%s'\n", fileAlias.c_str());
-  fclose(context->fileMap[fileAlias]->handle);
-  delete context->fileMap[fileAlias];
-  context->fileMap.erase(fileAlias);
+  fclose(context->session->fileMap[fileAlias]->handle);
+  craneDeleteOpenFile(context->session->fileMap[fileAlias]);
+  context->session->fileMap.erase(fileAlias);
 
   return 0;
 }
 
 contributableCommand(files) {
   printf("All Open Files:\n");
-  for (auto &file : context->fileMap) {
+  for (auto &file : context->session->fileMap) {
     printf("  %s (%s)", file.second->alias.c_str(), file.second->path.c_str());
     if (context->openedFile == file.second) {
       printf(" - selected");
     }
 
-    if (context->interfaceMode == CraneInterfaceMode::Edit &&
-        context->openedFile == file.second) {
-      printf(" - editing (%zu bytes)", context->fileSize);
+    if (file.second->isEditing) {
+      printf(" - editing%s (%llu bytes)", file.second->isEditInPlace ? " in place" : "",
+             file.second->editSize);
+    }
+
+    if (file.second->storage->pieces.isActive()) {
+      printf(" - %zu pieces", file.second->storage->pieces.pieces.size());
+    }
+
+    CraneExtentMap &extents = file.second->storage->extents;
+    if (extents.isSparse()) {
+      printf(" - sparse (%llu of %llu bytes are data)",
+             (unsigned long long)extents.dataSize(), (unsigned long long)extents.fileSize);
     }
 
     printf("\n");
@@ -186,195 +232,439 @@ contributableCommand(files) {
 
 #define kHexDumpWidth 16
 
-contributableCommand(dump) {
-  printf("Dumping file '%s' (%s) as %s:\n\n", context->openedFile->alias.c_str(),
-         context->openedFile->path.c_str(), command->arguments[0]->value.c_str());
+#define kHexDumpCheckRows 4096
 
+// bytes scanned outside of edit mode come from the file's pages or a mapping of
+// it, so they count as read (see "stats.hpp")
+static void countScanned(CraneContext *context, u64 bytes) {
   if (context->interfaceMode != CraneInterfaceMode::Edit) {
-    // read file size
-    fseek(context->openedFile->handle, 0, SEEK_END);
-    context->fileSize = ftell(context->openedFile->handle);
-    fseek(context->openedFile->handle, 0, SEEK_SET);
-
-    // read the file
-    context->fileBuffer = new u8[context->fileSize];
-    fread(context->fileBuffer, 1, context->fileSize, context->openedFile->handle);
-  }
-
-  // format and print the file
-  std::string format = command->arguments[0]->value;
-
-  if (format == "hex") {
-    // a hex dump looks like this:
-    /*
-     *
-     * 4C 6F 72 65 6D 20 49 73 70 75            Lorem Ipsu
-     * 6D 20 44 6F 6C 6F 72 20 53 69            m Dolor Si
-     * 74 20 41 6D 65 74 .. .. .. ..            t Amet....
-     *                   |                            ^^^^ placeholder characters for
-     *                   |                                 non-printable chars
-     *                   ^^ this means that there
-     *                      is a gap of 4 bytes
-     *
-     */
-
-    std::vector<std::pair<u8 *, size_t>> chunks;
-
-    // split the file into chunks of kHexDumpWidth bytes,
-    // anything less then kHexDumpWidth bytes will have a size associated with it
-    for (size_t i = 0; i < context->fileSize; i += kHexDumpWidth) {
-      u8 *ptr = context->fileBuffer + i;
-      // if the chunk is less then kHexDumpWidth bytes,
-      // then the size is the remaining bytes
-      size_t size =
-          (i + kHexDumpWidth > context->fileSize) ? context->fileSize - i : kHexDumpWidth;
-      chunks.push_back(std::make_pair(ptr, size));
-    }
-
-    // print the chunks
-    for (auto &chunk : chunks) {
-      // print the address
-      printf("%08X: ", (u32)(chunk.first - context->fileBuffer));
-
-      for (size_t i = 0; i < chunk.second; i++) {
-        printf("%02X ", chunk.first[i]);
-      }
-
-      // print the placeholder characters if the chunk is less then kHexDumpWidth bytes
-      for (size_t i = chunk.second; i < kHexDumpWidth; i++) {
-        printf(".. ");
-      }
-
-      // print the characters
-      printf("      ");
-      for (size_t i = 0; i < chunk.second; i++) {
-        if (isprint(chunk.first[i])) {
-          printf("%c", chunk.first[i]);
-        } else {
-          printf(".");
-        }
+    craneCountRead(context, bytes);
+  }
+}
+
+// returns false when the command was cancelled part way through
+static bool printHexRows(CraneContext *context, const u8 *data, size_t size,
+                         u64 address) {
+  // a hex dump looks like this:
+  /*
+   *
+   * 4C 6F 72 65 6D 20 49 73 70 75            Lorem Ipsu
+   * 6D 20 44 6F 6C 6F 72 20 53 69            m Dolor Si
+   * 74 20 41 6D 65 74 .. .. .. ..            t Amet....
+   *                   |                            ^^^^ placeholder characters for
+   *                   |                                 non-printable chars
+   *                   ^^ this means that there
+   *                      is a gap of 4 bytes
+   *
+   */
+
+  // print the data in chunks of kHexDumpWidth bytes,
+  // anything less then kHexDumpWidth bytes is padded with placeholders
+  for (size_t offset = 0; offset < size; offset += kHexDumpWidth) {
+    if ((offset / kHexDumpWidth) % kHexDumpCheckRows == 0) {
+      if (craneShouldStop(context)) {
+        countScanned(context, offset);
+        return false;
       }
+      craneReportProgress(context, offset, size);
+    }
 
-      // placeholder characters for filling the gap
-      for (size_t i = chunk.second; i < kHexDumpWidth; i++) {
+    const u8 *chunk = data + offset;
+    size_t chunkSize = (offset + kHexDumpWidth > size) ? size - offset : kHexDumpWidth;
+
+    // print the address
+    printf("%08llX: ", address + offset);
+
+    for (size_t i = 0; i < chunkSize; i++) {
+      printf("%02X ", chunk[i]);
+    }
+
+    // print the placeholder characters if the chunk is less then kHexDumpWidth bytes
+    for (size_t i = chunkSize; i < kHexDumpWidth; i++) {
+      printf(".. ");
+    }
+
+    // print the characters
+    printf("      ");
+    for (size_t i = 0; i < chunkSize; i++) {
+      if (isprint(chunk[i])) {
+        printf("%c", chunk[i]);
+      } else {
         printf(".");
       }
+    }
 
-      printf("\n");
+    // placeholder characters for filling the gap
+    for (size_t i = chunkSize; i < kHexDumpWidth; i++) {
+      printf(".");
     }
-  } else {
+
+    printf("\n");
+  }
+
+  countScanned(context, size);
+  return true;
+}
+
+static void printHole(u64 start, u64 end) {
+  printf("%08llX: %s-- hole, %llu bytes of zeros up to %08llX --%s\n", start, kColorBlue,
+         end - start, end, kColorReset);
+}
+
+contributableCommand(dump) {
+  std::string format = "hex";
+  if (command->arguments.size() > 0) {
+    format = command->arguments[0]->value;
+  }
+
+  if (format != "hex") {
     printf("Unknown format '%s'\n", format.c_str());
+    return 1;
+  }
 
-    if (context->interfaceMode != CraneInterfaceMode::Edit) {
-      delete[] context->fileBuffer;
-      context->fileBuffer = nullptr;
-      context->fileSize = 0;
+  // spans from a previous pipeline stage are dumped at their original offsets
+  if (context->pipe && context->pipe->hasInput) {
+    printf("Dumping %zu spans (%zu bytes) as %s:\n\n", context->pipe->input.size(),
+           context->pipe->inputSize(), format.c_str());
+
+    for (size_t i = 0; i < context->pipe->input.size(); i++) {
+      CraneSpan &span = context->pipe->input[i];
+      if (i > 0) {
+        printf("\n");
+      }
+      if (!printHexRows(context, span.data, span.size, span.offset)) {
+        return 1;
+      }
     }
 
+    // what was shown is passed on unchanged, so dump can sit mid-pipeline
+    context->pipe->output = context->pipe->input;
+    return 0;
+  }
+
+  printf("Dumping file '%s' (%s) as %s:\n\n", context->openedFile->alias.c_str(),
+         context->openedFile->path.c_str(), format.c_str());
+
+  CraneView *view = context->views->acquire(context);
+  if (view == nullptr) {
+    printf("Failed to read file '%s'\n", context->openedFile->path.c_str());
     return 1;
   }
 
-  // clean up
+  context->views->prefetch(view, 0, context->views->size(view), CraneViewAccessSequential);
+
+  // holes in the file on disk are summed up in a line each, edits may have
+  // filled them in edit mode
+  std::vector<CraneExtent> ranges = {{0, context->views->size(view)}};
   if (context->interfaceMode != CraneInterfaceMode::Edit) {
-    delete[] context->fileBuffer;
-    context->fileBuffer = nullptr;
-    context->fileSize = 0;
+    ranges = context->openedFile->storage->extents.data;
   }
 
-  return 0;
+  bool finished = true;
+  u64 cursor = 0;
+  for (auto &range : ranges) {
+    if (range.offset > cursor) {
+      printHole(cursor, range.offset);
+    }
+
+    u64 end = range.offset + range.size;
+    CraneViewSegment segment;
+    for (u64 offset = range.offset;
+         finished && offset < end && context->views->segment(view, offset, &segment);
+         offset += segment.size) {
+      finished = printHexRows(context, segment.data, std::min<u64>(segment.size, end - offset),
+                              segment.offset);
+    }
+    cursor = end;
+  }
+
+  if (finished && context->interfaceMode != CraneInterfaceMode::Edit &&
+      context->openedFile->storage->extents.fileSize > cursor) {
+    printHole(cursor, context->openedFile->storage->extents.fileSize);
+  }
+
+  context->views->release(view);
+  return finished ? 0 : 1;
+}
+
+// scripts don't need to see the whole file again after every edit
+static void refreshHexView(CraneContext *context) {
+  if (!context->isInteractive) {
+    return;
+  }
+
+  CraneCommand dumpCommand("dump", {"hex"});
+  dump(&dumpCommand, context);
+}
+
+/**
+ * The open file with ranges of the file at `path` spliced into it. Those are
+ * read when that file is saved, so until then the file at `path` is kept as it
+ * is: it can't be edited, saved or have macros applied to it.
+ */
+static CraneOpenFile *splicedInto(CraneContext *context, const std::string &path) {
+  struct stat fileStat;
+  if (stat(path.c_str(), &fileStat) != 0) {
+    return nullptr;
+  }
+
+  for (auto &other : context->session->fileMap) {
+    if (other.second->storage->pieces.references(fileStat)) {
+      return other.second;
+    }
+  }
+  return nullptr;
+}
+
+static bool isSplicedInto(CraneContext *context, const std::string &path) {
+  CraneOpenFile *other = splicedInto(context, path);
+  if (other != nullptr) {
+    printf("Ranges of '%s' are spliced into '%s', 'save' that first\n", path.c_str(),
+           other->alias.c_str());
+  }
+  return other != nullptr;
+}
+
+// ends the edit session of `file`, dropping whatever wasn't saved
+static void endEditSession(CraneContext *context, CraneOpenFile *file) {
+  if (file->isEditInPlace) {
+    munmap(file->editBuffer, file->editSize);
+    printf("Edits made in place are already in the file\n");
+  } else {
+    delete[] file->editBuffer;
+  }
+
+  file->isEditing = false;
+  file->isEditInPlace = false;
+  file->editBuffer = nullptr;
+  file->editSize = 0;
+  file->storage->pieces.clear();
+
+  // unsaved edits are dropped with the pages holding them, and edits made in
+  // place leave the pages of every file open at that path behind
+  for (auto &other : context->session->fileMap) {
+    if (other.second->path == file->path) {
+      other.second->storage->pages.invalidate();
+      other.second->storage->extents.map(other.second->path);
+    }
+  }
+
+  // close the file and reopen it in read-only binary mode
+  fclose(file->handle);
+  file->handle = fopen(file->path.c_str(), "rb");
+}
+
+// starts editing the selected file, false (with a message) when it can't be
+static bool beginEditSession(CraneContext *context, bool isInPlace) {
+  CraneOpenFile *file = context->openedFile;
+  if (file == nullptr) {
+    printf("No file is selected, refusing to enter edit mode\n");
+    return false;
+  }
+
+  // two sessions on one file would overwrite each other's edits
+  for (auto &other : context->session->fileMap) {
+    if (other.second != file && other.second->isEditing &&
+        other.second->path == file->path) {
+      printf("File '%s' is already being edited as '%s'\n", file->path.c_str(),
+             other.second->alias.c_str());
+      return false;
+    }
+  }
+
+  if (isSplicedInto(context, file->path)) {
+    return false;
+  }
+
+  // reopen the file in read/write binary mode
+  FILE *handle = fopen(file->path.c_str(), "rb+");
+  if (handle == nullptr) {
+    printf("Failed to open file '%s' for editing\n", file->path.c_str());
+    return false;
+  }
+
+  // nothing is read up front, edits are kept in the file's pages (see
+  // "pagecache.hpp") until one of them needs the whole file
+  struct stat fileStat;
+  if (fstat(fileno(handle), &fileStat) != 0) {
+    printf("Failed to open file '%s' for editing\n", file->path.c_str());
+    fclose(handle);
+    return false;
+  }
+
+  // or they go straight into the file through a shared mapping, which is why
+  // they can't change its size
+  void *mapped = nullptr;
+  if (isInPlace) {
+    if (fileStat.st_size == 0) {
+      printf("File '%s' is empty, there's nothing to edit in place\n",
+             file->path.c_str());
+      fclose(handle);
+      return false;
+    }
+
+    mapped = mmap(nullptr, fileStat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fileno(handle), 0);
+    if (mapped == MAP_FAILED) {
+      printf("Failed to map file '%s' for editing\n", file->path.c_str());
+      perror("mmap");
+      fclose(handle);
+      return false;
+    }
+    file->storage->pages.invalidate();
+  }
+
+  fclose(file->handle);
+  file->handle = handle;
+  file->isEditing = true;
+  file->isEditInPlace = isInPlace;
+  file->editBuffer = (u8 *)mapped;
+  file->editSize = fileStat.st_size;
+  return true;
 }
 
 contributableCommand(mode) {
   if (command->arguments.size() == 0) {
+    if (context->interfaceMode == CraneInterfaceMode::Edit) {
+      endEditSession(context, context->openedFile);
+    }
     context->interfaceMode = CraneInterfaceMode::Normal;
     return 0;
   }
 
-  std::string mode = command->arguments[0]->value;
+  std::string mode(command->arguments[0]->value);
   CraneInterfaceMode oldMode = context->interfaceMode;
+  CraneInterfaceMode newMode;
+  bool isInPlace = false;
 
   if (mode == "normal") {
-    context->interfaceMode = CraneInterfaceMode::Normal;
+    newMode = CraneInterfaceMode::Normal;
   } else if (mode == "edit") {
-    context->interfaceMode = CraneInterfaceMode::Edit;
+    newMode = CraneInterfaceMode::Edit;
+  } else if (mode == "edit-inplace") {
+    newMode = CraneInterfaceMode::Edit;
+    isInPlace = true;
   } else if (mode == "template") {
-    context->interfaceMode = CraneInterfaceMode::Template;
+    newMode = CraneInterfaceMode::Template;
   } else {
     printf("Unknown mode '%s'\n", mode.c_str());
     return 1;
   }
 
-  if (context->interfaceMode == oldMode) {
-    printf("Mode is already '%s'\n", mode.c_str());
+  if (newMode == oldMode) {
+    if (newMode == CraneInterfaceMode::Edit &&
+        isInPlace != context->openedFile->isEditInPlace) {
+      printf("Already editing, switch to 'normal' before '%s'\n", mode.c_str());
+    } else {
+      printf("Mode is already '%s'\n", mode.c_str());
+    }
     return 1;
   }
 
-  // initialise the current mode if needed
-  if (context->interfaceMode == CraneInterfaceMode::Edit) {
-    if (context->openedFile == nullptr) {
-      printf("No file is selected, refusing to enter edit mode\n");
-      context->interfaceMode = oldMode;
-      return 1;
-    }
-
-    // reopen the file in read/write binary mode
-    fclose(context->openedFile->handle);
-    context->openedFile->handle = fopen(context->openedFile->path.c_str(), "rb+");
-    if (context->openedFile->handle == nullptr) {
-      printf("Failed to open file '%s' for editing\n", context->openedFile->path.c_str());
-      context->interfaceMode = oldMode;
+  // the selected file's session starts or ends, the others are left alone
+  if (newMode == CraneInterfaceMode::Edit) {
+    if (!beginEditSession(context, isInPlace)) {
       return 1;
     }
-
-    if (context->fileBuffer != nullptr) {
-      delete[] context->fileBuffer;
-      context->fileBuffer = nullptr;
-      context->fileSize = 0;
-    }
-
-    // read file size
-    fseek(context->openedFile->handle, 0, SEEK_END);
-    context->fileSize = ftell(context->openedFile->handle);
-    fseek(context->openedFile->handle, 0, SEEK_SET);
-
-    // read the file
-    context->fileBuffer = new u8[context->fileSize];
-    fread(context->fileBuffer, 1, context->fileSize, context->openedFile->handle);
-  } else {
-    if (context->fileBuffer != nullptr) {
-      delete[] context->fileBuffer;
-      context->fileBuffer = nullptr;
-      context->fileSize = 0;
-    }
-
-    // close the file and reopen it in read-only binary mode
-    fclose(context->openedFile->handle);
-    context->openedFile->handle = fopen(context->openedFile->path.c_str(), "rb");
+  } else if (oldMode == CraneInterfaceMode::Edit) {
+    endEditSession(context, context->openedFile);
   }
 
+  context->interfaceMode = newMode;
   printf("Mode changed to '%s'\n", mode.c_str());
 
   return 0;
 }
 
+// files open at a path that was just written drop what they cached of it. When a
+// new file took the path they let go of the old one too
+static void refreshOpenFiles(CraneContext *context, const std::string &path,
+                             bool isReplaced) {
+  for (auto &file : context->session->fileMap) {
+    if (file.second->path != path) {
+      continue;
+    }
+    if (isReplaced) {
+      const char *mode = file.second->isEditing ? "rb+" : "rb";
+      FILE *reopened = fopen(path.c_str(), mode);
+      if (reopened != nullptr) {
+        fclose(file.second->handle);
+        file.second->handle = reopened;
+      }
+      file.second->storage->pages.reopen();
+    } else {
+      file.second->storage->pages.invalidate();
+    }
+    file.second->storage->extents.map(path);
+  }
+}
+
 contributableCommand(save) {
   if (context->interfaceMode != CraneInterfaceMode::Edit) {
     printf("Not in edit mode\n");
     return 1;
   }
 
-  printf("Saving file '%s' (%s)\n", context->openedFile->alias.c_str(),
-         context->openedFile->path.c_str());
+  CraneOpenFile *file = context->openedFile;
+  if (isSplicedInto(context, file->path)) {
+    return 1;
+  }
+  printf("Saving file '%s' (%s)\n", file->alias.c_str(), file->path.c_str());
+
+  craneTraceSpan(context, "write file");
+  FILE *handle = file->handle;
+
+  // edits made in place are in the file already, they only need to reach the disk
+  if (file->isEditInPlace) {
+    if (msync(file->editBuffer, file->editSize, MS_SYNC) != 0) {
+      printf("Failed to write file\n");
+      perror("msync");
+      return 1;
+    }
+    return 0;
+  }
 
-  // overwrite the entire file
-  fseek(context->openedFile->handle, 0, SEEK_SET);
+  // spliced ranges are copied from their files, the rest goes around them
+  uint64_t written = 0;
+  if (file->storage->pieces.isActive()) {
+    bool isReplaced = false;
+    if (!file->storage->pieces.save(fileno(handle), &isReplaced, &written)) {
+      printf("Failed to write file\n");
+      perror("copy_file_range");
+      return 1;
+    }
+    craneCountWritten(context, written);
+    file->storage->pieces.clear();
+
+    refreshOpenFiles(context, file->path, isReplaced);
+    return 0;
+  }
+
+  // only the pages that were edited are written back
+  if (file->editBuffer == nullptr) {
+    if (!file->storage->pages.flush(fileno(handle), file->editSize, file->storage->extents,
+                                    &written)) {
+      printf("Failed to write file\n");
+      perror("pwrite");
+      return 1;
+    }
+    craneCountWritten(context, written);
+    file->storage->extents.map(file->path);
+    return 0;
+  }
 
-  if (fwrite(context->fileBuffer, 1, context->fileSize, context->openedFile->handle) !=
-      context->fileSize) {
+  // overwrite the entire file except for blocks of zeros where it had holes,
+  // anything past its new end is cut off
+  if (!craneWriteSparse(fileno(handle), file->editBuffer, file->editSize, 0,
+                        &file->storage->extents, 0, &written) ||
+      ftruncate(fileno(handle), file->editSize) != 0) {
     printf("Failed to write file\n");
-    perror("fwrite");
+    perror("pwrite");
     return 1;
   }
+  craneCountWritten(context, written);
+  file->storage->pages.invalidate();
+  file->storage->extents.map(file->path);
 
   return 0;
 }
@@ -389,14 +679,49 @@ bool isHex(std::string &s) {
   return true;
 }
 
+// a file edited in place is mapped at its size, nothing can move its bytes
+static bool rejectResize(CraneContext *context) {
+  if (!context->openedFile->isEditInPlace) {
+    return false;
+  }
+
+  printf("Can't change the size of '%s' while editing it in place, use 'mode edit'\n",
+         context->openedFile->path.c_str());
+  return true;
+}
+
+// edits go through a view, so the host can keep them in the file's pages and
+// the macro being recorded sees them
+static bool editBytes(CraneContext *context, u64 offset, u64 removed, const void *bytes,
+                      u64 size) {
+  CraneView *view = context->views->acquire(context);
+  CraneViewEdit *edit = view != nullptr ? context->views->beginEdit(view) : nullptr;
+  if (edit == nullptr) {
+    context->views->release(view);
+    printf("Failed to edit file '%s'\n", context->openedFile->path.c_str());
+    return false;
+  }
+
+  context->views->replace(edit, offset, removed, bytes, size);
+  int res = context->views->commit(edit);
+  context->views->release(view);
+
+  if (res != 0) {
+    printf("Failed to edit file '%s'\n", context->openedFile->path.c_str());
+    return false;
+  }
+  return true;
+}
+
 contributableCommand(byteAt) {
-  std::string addrString = command->arguments[0]->value;
-  size_t addr = strtoul(addrString.c_str(), nullptr, 0);
+  std::string addrString(command->arguments[0]->value);
+  u64 addr = strtoull(addrString.c_str(), nullptr, 0);
 
   if (context->interfaceMode == CraneInterfaceMode::Edit &&
       command->arguments.size() > 1) {
-    std::string valueString = command->arguments[1]->value;
+    std::string valueString(command->arguments[1]->value);
     std::string format = "hex";
+    u8 value;
 
     // check if the value is a valid hex number
     if (!isHex(valueString)) {
@@ -415,14 +740,7 @@ contributableCommand(byteAt) {
         return 1;
       }
 
-      u8 value = strtoul(valueString.c_str(), nullptr, 16);
-
-      if (addr >= context->fileSize) {
-        printf("Address out of bounds\n");
-        return 1;
-      }
-
-      context->fileBuffer[addr] = value;
+      value = strtoul(valueString.c_str(), nullptr, 16);
     } else if (format == "decimal") {
       if (!isdigit(valueString[0])) {
         printf("Invalid decimal value '%s'\n", valueString.c_str());
@@ -434,40 +752,38 @@ contributableCommand(byteAt) {
         return 1;
       }
 
-      u8 value = strtoul(valueString.c_str(), nullptr, 10);
+      unsigned long decimal = strtoul(valueString.c_str(), nullptr, 10);
 
-      if (value > 255) {
+      if (decimal > 255) {
         printf("Decimal value '%s' is too large (max 255)\n", valueString.c_str());
         return 1;
       }
 
-      if (addr >= context->fileSize) {
-        printf("Address out of bounds\n");
-        return 1;
-      }
-
-      context->fileBuffer[addr] = value;
+      value = decimal;
     } else if (format == "ascii") {
       if (valueString.size() != 1) {
         printf("Invalid ASCII value '%s'\n", valueString.c_str());
         return 1;
       }
 
-      if (addr >= context->fileSize) {
-        printf("Address out of bounds\n");
-        return 1;
-      }
-
-      context->fileBuffer[addr] = valueString[0];
+      value = valueString[0];
     } else {
       printf("Unknown format '%s'\n", format.c_str());
       return 1;
     }
 
-    printf("Value at 0x%zX set to %s\n", addr, valueString.c_str());
+    if (addr >= context->openedFile->editSize) {
+      printf("Address out of bounds\n");
+      return 1;
+    }
+
+    if (!editBytes(context, addr, 1, &value, 1)) {
+      return 1;
+    }
 
-    // update the hex view
-    dump(new CraneCommand("dump", {new CraneArgument("hex")}), context);
+    printf("Value at 0x%llX set to %s\n", addr, valueString.c_str());
+
+    refreshHexView(context);
 
     return 0;
   }
@@ -478,24 +794,22 @@ contributableCommand(byteAt) {
            kColorYellow, kColorReset);
   }
 
-  if (context->interfaceMode != CraneInterfaceMode::Edit) {
-    // read the file size
-    fseek(context->openedFile->handle, 0, SEEK_END);
-    context->fileSize = ftell(context->openedFile->handle);
-    fseek(context->openedFile->handle, 0, SEEK_SET);
-
-    // read the file
-    context->fileBuffer = new u8[context->fileSize];
-    fread(context->fileBuffer, 1, context->fileSize, context->openedFile->handle);
+  // a single byte is read through a view instead of loading the whole file
+  CraneView *view = context->views->acquire(context);
+  if (view == nullptr) {
+    printf("Failed to read file '%s'\n", context->openedFile->path.c_str());
+    return 1;
   }
 
-  if (addr >= context->fileSize) {
+  u8 value;
+  bool isInBounds = context->views->read(view, addr, &value, 1) == 1;
+  context->views->release(view);
+
+  if (!isInBounds) {
     printf("Address out of bounds\n");
     return 1;
   }
 
-  u8 value = context->fileBuffer[addr];
-
   printf("%02X (%d)", value, value);
 
   if (isprint(value)) {
@@ -504,13 +818,6 @@ contributableCommand(byteAt) {
 
   printf("\n");
 
-  if (context->interfaceMode != CraneInterfaceMode::Edit) {
-    // free the file buffer
-    delete[] context->fileBuffer;
-    context->fileBuffer = nullptr;
-    context->fileSize = 0;
-  }
-
   return 0;
 }
 
@@ -520,85 +827,176 @@ contributableCommand(insert) {
     return 1;
   }
 
-  std::string addrString = command->arguments[0]->value;
-  size_t addr = strtoul(addrString.c_str(), nullptr, 0);
+  std::string addrString(command->arguments[0]->value);
+  u64 addr = strtoull(addrString.c_str(), nullptr, 0);
 
-  if (addr >= context->fileSize) {
+  if (addr >= context->openedFile->editSize) {
     printf("Address out of bounds\n");
     return 1;
   }
 
-  std::string valueString = command->arguments[1]->value;
-  size_t length = valueString.size();
+  if (rejectResize(context)) {
+    return 1;
+  }
+
+  // moving the rest of the file along needs all of it in memory
+  std::string valueString(command->arguments[1]->value);
+  if (!editBytes(context, addr, 0, valueString.data(), valueString.size())) {
+    return 1;
+  }
 
-  size_t newLength = context->fileSize + length;
-  u8 *newBuffer = new u8[newLength];
+  refreshHexView(context);
 
-  // copy the old data before the address
-  memcpy(newBuffer, context->fileBuffer, addr);
+  return 0;
+}
 
-  // copy the new data
-  memcpy(newBuffer + addr, valueString.c_str(), length);
+/**
+ * Puts `size` bytes of the file at `path` at `offset` of the selected file
+ * without reading them, they're copied from the file when it's saved (see
+ * "pieces.hpp"). Ranges of the edited file itself come from its current
+ * contents, edits included.
+ */
+static bool insertRange(CraneContext *context, const std::string &path, u64 offset,
+                        u64 size, u64 at) {
+  CraneOpenFile *file = context->openedFile;
+  if (at > file->editSize) {
+    printf("Address out of bounds\n");
+    return false;
+  }
 
-  // copy the old data after the address, if any
-  if (addr + length < context->fileSize) {
-    memcpy(newBuffer + addr + length, context->fileBuffer + addr + length,
-           context->fileSize - addr - length);
+  if (rejectResize(context)) {
+    return false;
   }
 
-  // free the old buffer
-  delete[] context->fileBuffer;
-  context->fileBuffer = newBuffer;
-  context->fileSize = newLength;
+  // macros replay bytes, a reference to a file on this machine means nothing there
+  if (context->recordingMacro != nullptr) {
+    printf("Splices can't be recorded into macro '%s'\n",
+           context->recordingMacro->name.c_str());
+    return false;
+  }
 
-  // update the hex view
-  dump(new CraneCommand("dump", {new CraneArgument("hex")}), context);
+  struct stat sourceStat;
+  struct stat fileStat;
+  if (stat(path.c_str(), &sourceStat) != 0 || S_ISDIR(sourceStat.st_mode)) {
+    printf("Failed to open file '%s'\n", path.c_str());
+    return false;
+  }
+  bool isSelf = fstat(fileno(file->handle), &fileStat) == 0 &&
+                fileStat.st_dev == sourceStat.st_dev &&
+                fileStat.st_ino == sourceStat.st_ino;
+
+  // another file's unsaved edits only exist in its own session, and later ones
+  // would change what was spliced
+  for (auto &other : context->session->fileMap) {
+    struct stat otherStat;
+    if (!isSelf && other.second->isEditing &&
+        stat(other.second->path.c_str(), &otherStat) == 0 &&
+        otherStat.st_dev == sourceStat.st_dev && otherStat.st_ino == sourceStat.st_ino) {
+      printf("File '%s' is being edited as '%s', 'save' it and switch to 'normal' "
+             "first\n",
+             path.c_str(), other.second->alias.c_str());
+      return false;
+    }
+  }
 
-  return 0;
+  u64 sourceSize = isSelf ? file->editSize : (u64)sourceStat.st_size;
+  if (offset > sourceSize || size > sourceSize - offset) {
+    printf("Range out of bounds, '%s' is %llu bytes\n", path.c_str(), sourceSize);
+    return false;
+  }
+
+  std::shared_ptr<CranePieceSource> source;
+  if (!isSelf) {
+    source = std::make_shared<CranePieceSource>(path);
+    if (source->fd < 0) {
+      printf("Failed to open file '%s'\n", path.c_str());
+      return false;
+    }
+  }
+
+  // whatever was edited so far becomes the first piece
+  if (!file->storage->pieces.isActive()) {
+    file->storage->pieces.begin(&file->storage->pages, file->path, file->editSize,
+                                file->editBuffer);
+    file->editBuffer = nullptr;
+  }
+
+  std::vector<CranePiece> inserted = {
+      {CranePieceKind::File, offset, size, source, nullptr}};
+  if (isSelf) {
+    inserted = file->storage->pieces.slice(offset, size);
+  }
+  file->storage->pieces.insert(at, inserted);
+  file->editSize = file->storage->pieces.size();
+  printf("Inserted %llu bytes of '%s' at 0x%llx (now %llu bytes)\n", size, path.c_str(),
+         at, file->editSize);
+
+  return true;
 }
 
-contributableCommand(write) {
+contributableCommand(spliceFile) {
   if (context->interfaceMode != CraneInterfaceMode::Edit) {
     printf("Not in edit mode\n");
     return 1;
   }
 
-  std::string addrString = command->arguments[0]->value;
-  size_t addr = strtoul(addrString.c_str(), nullptr, 0);
+  std::string sourceAlias(command->arguments[0]->value);
+  auto source = context->session->fileMap.find(sourceAlias);
+  if (source == context->session->fileMap.end()) {
+    printf("File '%s' is not open\n", sourceAlias.c_str());
+    return 1;
+  }
 
-  std::string valueString = command->arguments[1]->value;
-  size_t length = valueString.size();
+  std::string offsetString(command->arguments[1]->value);
+  std::string sizeString(command->arguments[2]->value);
+  std::string addrString(command->arguments[3]->value);
+  u64 offset = strtoull(offsetString.c_str(), nullptr, 0);
+  u64 size = strtoull(sizeString.c_str(), nullptr, 0);
+  u64 addr = strtoull(addrString.c_str(), nullptr, 0);
+  return insertRange(context, source->second->path, offset, size, addr) ? 0 : 1;
+}
 
-  size_t newLength = context->fileSize;
-  if (addr + length > newLength) {
-    newLength = addr + length;
+contributableCommand(insertFile) {
+  if (context->interfaceMode != CraneInterfaceMode::Edit) {
+    printf("Not in edit mode\n");
+    return 1;
   }
 
-  u8 *newBuffer = new u8[newLength];
+  std::string path(command->arguments[0]->value);
+  std::string addrString(command->arguments[1]->value);
+  u64 addr = strtoull(addrString.c_str(), nullptr, 0);
 
-  // copy the old data before the address
-  memcpy(newBuffer, context->fileBuffer, addr);
+  struct stat sourceStat;
+  if (stat(path.c_str(), &sourceStat) != 0) {
+    printf("File '%s' does not exist\n", path.c_str());
+    return 1;
+  }
+
+  return insertRange(context, path, 0, sourceStat.st_size, addr) ? 0 : 1;
+}
 
-  if (addr > context->fileSize) {
-    // fill the new data with zeros
-    memset(newBuffer + context->fileSize, 0, addr - context->fileSize);
+contributableCommand(writeString) {
+  if (context->interfaceMode != CraneInterfaceMode::Edit) {
+    printf("Not in edit mode\n");
+    return 1;
   }
 
-  // copy the new data
-  memcpy(newBuffer + addr, valueString.c_str(), length);
+  std::string addrString(command->arguments[0]->value);
+  u64 addr = strtoull(addrString.c_str(), nullptr, 0);
 
-  // copy the old data after the address, if any
-  if (addr + length < context->fileSize) {
-    memcpy(newBuffer + addr + length, context->fileBuffer + addr + length,
-           context->fileSize - addr - length);
+  // writing past the end grows the file, the gap reads as zeros
+  std::string valueString(command->arguments[1]->value);
+  if (addr + valueString.size() > context->openedFile->editSize &&
+      rejectResize(context)) {
+    return 1;
   }
 
-  delete[] context->fileBuffer;
-  context->fileBuffer = newBuffer;
-  context->fileSize = newLength;
+  if (!editBytes(context, addr, valueString.size(), valueString.data(),
+                 valueString.size())) {
+    return 1;
+  }
 
-  // update the hex view
-  dump(new CraneCommand("dump", {new CraneArgument("hex")}), context);
+  refreshHexView(context);
 
   return 0;
 }
@@ -609,11 +1007,11 @@ contributableCommand(writeHex) {
     return 1;
   }
 
-  std::string addrString = command->arguments[0]->value;
+  std::string addrString(command->arguments[0]->value);
 
   std::vector<std::string> values;
   for (size_t i = 1; i < command->arguments.size(); i++) {
-    values.push_back(command->arguments[i]->value);
+    values.emplace_back(command->arguments[i]->value);
   }
 
   std::string valueString = "";
@@ -628,43 +1026,1127 @@ contributableCommand(writeHex) {
     valueString += valueByte;
   }
 
-  return write(new CraneCommand("write", {new CraneArgument(addrString),
-                                          new CraneArgument(valueString)}),
-               context);
+  CraneCommand writeCommand("write", {addrString, valueString});
+  return writeString(&writeCommand, context);
 }
 
-contributableCommand(truncate) {
+contributableCommand(truncateFile) {
   if (context->interfaceMode != CraneInterfaceMode::Edit) {
     printf("Not in edit mode\n");
     return 1;
   }
 
-  std::string addrString = command->arguments[0]->value;
-  size_t addr = strtoul(addrString.c_str(), nullptr, 0);
+  std::string addrString(command->arguments[0]->value);
+  u64 addr = strtoull(addrString.c_str(), nullptr, 0);
 
-  if (addr >= context->fileSize) {
+  if (addr >= context->openedFile->editSize) {
     printf("Address out of bounds\n");
     return 1;
   }
 
-  size_t truncSize = context->fileSize - addr;
-  size_t oldSize = context->fileSize;
-  size_t newLength = addr;
-
-  u8 *newBuffer = new u8[newLength];
-
-  // copy the old data before the address
-  memcpy(newBuffer, context->fileBuffer, addr);
+  if (rejectResize(context)) {
+    return 1;
+  }
 
-  // free the old buffer
-  delete[] context->fileBuffer;
-  context->fileBuffer = newBuffer;
-  context->fileSize = newLength;
+  u64 oldSize = context->openedFile->editSize;
+  if (!editBytes(context, addr, kCraneViewToEnd, nullptr, 0)) {
+    return 1;
+  }
 
-  printf("Truncated %zu bytes from %zu bytes (now %zu bytes)\n", truncSize, oldSize, newLength);
+  printf("Truncated %llu bytes from %llu bytes (now %llu bytes)\n", oldSize - addr, oldSize,
+         context->openedFile->editSize);
 
-  // update the hex view
-  dump(new CraneCommand("dump", {new CraneArgument("hex")}), context);
+  refreshHexView(context);
+
+  return 0;
+}
+
+// Records are sorted by (key, index) pairs rather than moving whole records on
+// every radix pass, then gathered once into the scratch arena and written back as
+// a single edit.
+#define kRadixBits 8
+#define kRadixBuckets (1 << kRadixBits)
+#define kRadixMinChunk 65536
+
+static u64 readRecordKey(const u8 *ptr, size_t width, bool bigEndian) {
+  if (width == 4) {
+    u32 key;
+    memcpy(&key, ptr, 4);
+    return bigEndian ? __builtin_bswap32(key) : key;
+  }
+
+  u64 key;
+  memcpy(&key, ptr, 8);
+  return bigEndian ? __builtin_bswap64(key) : key;
+}
+
+// runs fn(0) .. fn(taskCount - 1) on the shared scheduler and waits for them
+template <typename Fn>
+static void runParallel(CraneContext *context, size_t taskCount, Fn fn) {
+  context->scheduler->parallelFor(0, taskCount, 1, [&](u64 begin, u64 end) {
+    for (u64 t = begin; t < end; t++) {
+      fn(t);
+    }
+  });
+}
+
+contributableCommand(sortRecords) {
+  if (context->interfaceMode != CraneInterfaceMode::Edit) {
+    printf("Not in edit mode\n");
+    return 1;
+  }
+
+  size_t offset = strtoull(command->arguments[0]->value.data(), nullptr, 0);
+  size_t count = strtoull(command->arguments[1]->value.data(), nullptr, 0);
+  size_t recordSize = strtoull(command->arguments[2]->value.data(), nullptr, 0);
+  size_t keyOffset = strtoull(command->arguments[3]->value.data(), nullptr, 0);
+  std::string keyType(command->arguments[4]->value);
+
+  size_t keyWidth;
+  bool bigEndian;
+  if (keyType == "u32" || keyType == "u32le" || keyType == "u32be") {
+    keyWidth = 4;
+  } else if (keyType == "u64" || keyType == "u64le" || keyType == "u64be") {
+    keyWidth = 8;
+  } else {
+    printf("Unknown key type '%s' (expected u32, u64, u32be or u64be)\n",
+           keyType.c_str());
+    return 1;
+  }
+  bigEndian = keyType.size() == 5 && keyType.substr(3) == "be";
+
+  if (recordSize == 0 || keyOffset + keyWidth > recordSize) {
+    printf("Key at +%zu (%zu bytes) does not fit in a %zu byte record\n", keyOffset,
+           keyWidth, recordSize);
+    return 1;
+  }
+
+  if (count > 0xFFFFFFFF) {
+    printf("Too many records (max %u)\n", 0xFFFFFFFF);
+    return 1;
+  }
+
+  if (offset > context->openedFile->editSize ||
+      (count != 0 && recordSize > (context->openedFile->editSize - offset) / count)) {
+    printf("Address out of bounds\n");
+    return 1;
+  }
+
+  if (count < 2) {
+    printf("Nothing to sort\n");
+    return 0;
+  }
+
+  size_t tableSize = count * recordSize;
+  size_t threadCount = context->scheduler->threadCount();
+  threadCount = std::min(threadCount, (count + kRadixMinChunk - 1) / kRadixMinChunk);
+  size_t chunk = (count + threadCount - 1) / threadCount;
+
+  // scratch arena: two key arrays, two index arrays, the table and its sorted copy
+  size_t arenaSize = 2 * count * sizeof(u64) + 2 * count * sizeof(u32) + 2 * tableSize;
+  u8 *arena = new (std::nothrow) u8[arenaSize];
+  if (arena == nullptr) {
+    printf("Failed to allocate %zu bytes of scratch space\n", arenaSize);
+    return 1;
+  }
+
+  u64 *keys = (u64 *)arena;
+  u64 *keysAlt = keys + count;
+  u32 *indices = (u32 *)(keysAlt + count);
+  u32 *indicesAlt = indices + count;
+  u8 *table = (u8 *)(indicesAlt + count);
+  u8 *sorted = table + tableSize;
+
+  // only the table is read, the rest of the file can stay in its pages
+  {
+    craneTraceSpan(context, "read records");
+    CraneView *view = context->views->acquire(context);
+    bool isRead = view != nullptr &&
+                  context->views->read(view, offset, table, tableSize) == tableSize;
+    context->views->release(view);
+    if (!isRead) {
+      printf("Failed to read records at 0x%zX\n", offset);
+      delete[] arena;
+      return 1;
+    }
+  }
+
+  size_t passCount = keyWidth;
+  std::vector<size_t> histograms(threadCount * kRadixBuckets);
+  std::vector<size_t> digitCounts(threadCount * passCount * kRadixBuckets);
+
+  // extract the keys and count every digit in a single read of the table, a pass
+  // whose digit is identical across all records can be skipped entirely
+  craneTraceBegin(context, "extract keys");
+  runParallel(context, threadCount, [&](size_t t) {
+    size_t *counts = &digitCounts[t * passCount * kRadixBuckets];
+    size_t end = std::min(count, (t + 1) * chunk);
+    for (size_t i = t * chunk; i < end; i++) {
+      u64 key = readRecordKey(table + i * recordSize + keyOffset, keyWidth, bigEndian);
+      keys[i] = key;
+      indices[i] = (u32)i;
+      for (size_t pass = 0; pass < passCount; pass++) {
+        counts[pass * kRadixBuckets + ((key >> (pass * kRadixBits)) & 0xFF)]++;
+      }
+    }
+  });
+
+  craneTraceEnd(context, "extract keys");
+
+  for (size_t pass = 0; pass < passCount; pass++) {
+    bool isTrivial = false;
+    for (size_t bucket = 0; bucket < kRadixBuckets && !isTrivial; bucket++) {
+      size_t total = 0;
+      for (size_t t = 0; t < threadCount; t++) {
+        total += digitCounts[(t * passCount + pass) * kRadixBuckets + bucket];
+      }
+      isTrivial = total == count;
+    }
+
+    if (isTrivial) {
+      continue;
+    }
+
+    size_t shift = pass * kRadixBits;
+    char passName[32];
+    snprintf(passName, sizeof(passName), "radix pass %zu", pass);
+    craneTraceSpan(context, passName);
+
+    runParallel(context, threadCount, [&](size_t t) {
+      size_t *hist = &histograms[t * kRadixBuckets];
+      std::fill(hist, hist + kRadixBuckets, 0);
+      size_t end = std::min(count, (t + 1) * chunk);
+      for (size_t i = t * chunk; i < end; i++) {
+        hist[(keys[i] >> shift) & 0xFF]++;
+      }
+    });
+
+    // turn the per-thread histograms into per-thread scatter offsets,
+    // ordered by bucket first so the sort stays stable
+    size_t position = 0;
+    for (size_t bucket = 0; bucket < kRadixBuckets; bucket++) {
+      for (size_t t = 0; t < threadCount; t++) {
+        size_t bucketCount = histograms[t * kRadixBuckets + bucket];
+        histograms[t * kRadixBuckets + bucket] = position;
+        position += bucketCount;
+      }
+    }
+
+    runParallel(context, threadCount, [&](size_t t) {
+      size_t *hist = &histograms[t * kRadixBuckets];
+      size_t end = std::min(count, (t + 1) * chunk);
+      for (size_t i = t * chunk; i < end; i++) {
+        size_t dest = hist[(keys[i] >> shift) & 0xFF]++;
+        keysAlt[dest] = keys[i];
+        indicesAlt[dest] = indices[i];
+      }
+    });
+
+    std::swap(keys, keysAlt);
+    std::swap(indices, indicesAlt);
+  }
+
+  craneTraceBegin(context, "gather records");
+  runParallel(context, threadCount, [&](size_t t) {
+    size_t end = std::min(count, (t + 1) * chunk);
+    for (size_t i = t * chunk; i < end; i++) {
+      memcpy(sorted + i * recordSize, table + (size_t)indices[i] * recordSize,
+             recordSize);
+    }
+  });
+
+  craneTraceEnd(context, "gather records");
+
+  // one overwrite of the table, kept in dirty pages and seen by a recording macro
+  bool isEdited = editBytes(context, offset, tableSize, sorted, tableSize);
+  delete[] arena;
+  if (!isEdited) {
+    return 1;
+  }
+
+  printf("Sorted %zu records of %zu bytes at 0x%zX by %s key at +%zu\n", count,
+         recordSize, offset, keyType.c_str(), keyOffset);
+  return 0;
+}
+
+// Macros
+//
+// Edits are recorded into a CraneMacro as they happen and compiled into a plan
+// when recording stops. Replaying a plan reads each target once and writes it
+// once, or only patches the changed bytes when the plan doesn't move anything.
+
+static int applyMacroToPath(CraneContext *context, CraneMacro *macro,
+                            const std::string &path) {
+  craneTraceSpan(context, path.c_str());
+  if (macro->isInPlace()) {
+    int fd = ::open(path.c_str(), O_WRONLY);
+    if (fd < 0) {
+      printf("Failed to open file '%s'\n", path.c_str());
+      return 1;
+    }
+
+    size_t patched = 0;
+    for (auto &operation : macro->plan) {
+      if (pwrite(fd, operation.bytes.data(), operation.bytes.size(), operation.offset) !=
+          (ssize_t)operation.bytes.size()) {
+        printf("Failed to write file '%s'\n", path.c_str());
+        perror("pwrite");
+        ::close(fd);
+        return 1;
+      }
+      patched += operation.bytes.size();
+      craneCountWritten(context, operation.bytes.size());
+    }
+
+    ::close(fd);
+    printf("  %s: patched %zu bytes in place\n", path.c_str(), patched);
+    return 0;
+  }
+
+  FILE *handle = fopen(path.c_str(), "rb");
+  if (handle == nullptr) {
+    printf("Failed to open file '%s'\n", path.c_str());
+    return 1;
+  }
+
+  fseek(handle, 0, SEEK_END);
+  size_t inputSize = ftell(handle);
+  fseek(handle, 0, SEEK_SET);
+
+  u8 *input = new u8[inputSize];
+  size_t readSize = fread(input, 1, inputSize, handle);
+  fclose(handle);
+  craneCountRead(context, readSize);
+
+  if (readSize != inputSize) {
+    printf("Failed to read file '%s'\n", path.c_str());
+    delete[] input;
+    return 1;
+  }
+
+  size_t outputSize = macro->outputSize(inputSize);
+  u8 *output = new u8[outputSize];
+  macro->apply(input, inputSize, output);
+  delete[] input;
+
+  // the new file is all hole, blocks of zeros where the target had holes are left
+  // that way. It only takes the path once it's complete, a failure leaves the
+  // target as it was
+  CraneExtentMap holes;
+  holes.map(path);
+  uint64_t written = 0;
+  CraneReplacement replacement(path);
+  if (!replacement.open() ||
+      !craneWriteSparse(replacement.fd, output, outputSize, 0, &holes, 0, &written) ||
+      ftruncate(replacement.fd, outputSize) != 0 || !replacement.commit()) {
+    printf("Failed to write file '%s'\n", path.c_str());
+    delete[] output;
+    return 1;
+  }
+
+  delete[] output;
+  craneCountWritten(context, written);
+  printf("  %s: %zu -> %zu bytes\n", path.c_str(), inputSize, outputSize);
+  return 0;
+}
+
+static void printMacroPlan(CraneMacro *macro) {
+  printf("Macro '%s' (%zu edits, %zu operations):\n", macro->name.c_str(),
+         macro->editCount, macro->plan.size());
+
+  for (auto &operation : macro->plan) {
+    printf("  0x%08llX: ", operation.offset);
+    if (operation.removed == kMacroToEnd) {
+      printf("truncate");
+      if (!operation.bytes.empty()) {
+        printf(", then append %zu bytes", operation.bytes.size());
+      }
+    } else if (operation.removed == operation.bytes.size()) {
+      printf("write %zu bytes", operation.bytes.size());
+    } else if (operation.removed == 0) {
+      printf("insert %zu bytes", operation.bytes.size());
+    } else if (operation.bytes.empty()) {
+      printf("remove %llu bytes", operation.removed);
+    } else {
+      printf("replace %llu bytes with %zu bytes", operation.removed,
+             operation.bytes.size());
+    }
+    printf("\n");
+  }
+}
+
+contributableCommand(macro) {
+  std::string action(command->arguments[0]->value);
+
+  if (action == "list") {
+    printf("All Macros:\n");
+    for (auto &entry : context->session->macroMap) {
+      printf("  %s (%zu operations)\n", entry.first.c_str(), entry.second->plan.size());
+    }
+    if (context->recordingMacro != nullptr) {
+      printf("  %s (recording)\n", context->recordingMacro->name.c_str());
+    }
+    return 0;
+  }
+
+  if (action == "stop") {
+    if (context->recordingMacro == nullptr) {
+      printf("No macro is being recorded\n");
+      return 1;
+    }
+
+    CraneMacro *macro = context->recordingMacro;
+    context->recordingMacro = nullptr;
+    macro->compile();
+
+    // re-recording a macro replaces it
+    if (context->session->macroMap.count(macro->name) != 0) {
+      delete context->session->macroMap[macro->name];
+    }
+    context->session->macroMap[macro->name] = macro;
+
+    printMacroPlan(macro);
+    return 0;
+  }
+
+  if (command->arguments.size() < 2) {
+    printf("Usage: macro <record|run|show|delete> <name> [files...] or macro "
+           "<stop|list>\n");
+    return 1;
+  }
+
+  std::string name(command->arguments[1]->value);
+
+  if (action == "record") {
+    if (context->recordingMacro != nullptr) {
+      printf("Already recording macro '%s'\n", context->recordingMacro->name.c_str());
+      return 1;
+    }
+
+    context->recordingMacro = new CraneMacro(name);
+    printf("Recording macro '%s', use 'macro stop' to finish\n", name.c_str());
+    return 0;
+  }
+
+  auto macroRes = context->session->macroMap.find(name);
+  if (macroRes == context->session->macroMap.end()) {
+    printf("Macro '%s' not found\n", name.c_str());
+    return 1;
+  }
+  CraneMacro *macro = macroRes->second;
+
+  if (action == "show") {
+    printMacroPlan(macro);
+    return 0;
+  }
+
+  if (action == "delete") {
+    delete macro;
+    context->session->macroMap.erase(macroRes);
+    printf("Deleted macro '%s'\n", name.c_str());
+    return 0;
+  }
+
+  if (action != "run") {
+    printf("Unknown macro action '%s'\n", action.c_str());
+    return 1;
+  }
+
+  if (context->recordingMacro != nullptr) {
+    printf("Cannot run a macro while recording one\n");
+    return 1;
+  }
+
+  // without targets the plan is applied to the edit buffer
+  if (command->arguments.size() == 2) {
+    if (context->interfaceMode != CraneInterfaceMode::Edit) {
+      printf("Not in edit mode, give files to apply macro '%s' to\n", name.c_str());
+      return 1;
+    }
+
+    if (!macro->isInPlace() && rejectResize(context)) {
+      return 1;
+    }
+
+    // replayed last to first, so every operation's offsets are still the
+    // original ones, overwrite-only plans stay in the file's pages
+    CraneView *view = context->views->acquire(context);
+    CraneViewEdit *edit = view != nullptr ? context->views->beginEdit(view) : nullptr;
+    if (edit == nullptr) {
+      context->views->release(view);
+      printf("Failed to edit file '%s'\n", context->openedFile->path.c_str());
+      return 1;
+    }
+
+    for (auto it = macro->plan.rbegin(); it != macro->plan.rend(); it++) {
+      context->views->replace(edit, it->offset,
+                              it->removed == kMacroToEnd ? kCraneViewToEnd : it->removed,
+                              it->bytes.data(), it->bytes.size());
+    }
+
+    int res = context->views->commit(edit);
+    context->views->release(view);
+    if (res != 0) {
+      printf("Failed to edit file '%s'\n", context->openedFile->path.c_str());
+      return 1;
+    }
+
+    printf("Applied macro '%s' to '%s'\n", name.c_str(),
+           context->openedFile->alias.c_str());
+    refreshHexView(context);
+    return 0;
+  }
+
+  printf("Applying macro '%s' to %zu files:\n", name.c_str(),
+         command->arguments.size() - 2);
+
+  int result = 0;
+  for (size_t i = 2; i < command->arguments.size(); i++) {
+    std::string target(command->arguments[i]->value);
+
+    // open files can be given by alias
+    auto fileRes = context->session->fileMap.find(target);
+    if (fileRes != context->session->fileMap.end()) {
+      target = fileRes->second->path;
+    }
+
+    bool isEdited = false;
+    for (auto &file : context->session->fileMap) {
+      isEdited |= file.second->isEditing && file.second->path == target;
+    }
+
+    if (isEdited) {
+      printf("  %s: is being edited, select it and run the macro without files to apply "
+             "it\n",
+             target.c_str());
+      result = 1;
+      continue;
+    }
+
+    if (isSplicedInto(context, target)) {
+      result = 1;
+      continue;
+    }
+
+    if (applyMacroToPath(context, macro, target) != 0) {
+      result = 1;
+    }
+
+    // open files keep pages and extents of what the target used to contain
+    refreshOpenFiles(context, target, !macro->isInPlace());
+  }
+
+  return result;
+}
+
+// Pipeline commands
+//
+// These consume the byte spans handed over by the previous stage of a pipeline
+// ('range 0 64 | xor FF | hash') or, when they come first, the whole selected
+// file. Spans reference the edit buffer or a mapping of the file directly, only
+// 'hash' and 'find' stream a file they scan on their own. Edits kept in pages
+// or pieces are read a segment at a time instead of being loaded.
+
+// long scans check for cancellation and report progress once per chunk
+#define kScanChunkSize (16 << 20)
+
+static CranePipe &commandPipe(CraneContext *context, CranePipe &fallback) {
+  return context->pipe ? *context->pipe : fallback;
+}
+
+static bool commandSpans(CraneContext *context, CranePipe &pipe,
+                         std::vector<CraneSpan> &spans) {
+  if (pipe.hasInput) {
+    spans = pipe.input;
+    return true;
+  }
+
+  if (context->openedFile == nullptr) {
+    printf("%serr%s: No file open (E0006)\n", kColorRed, kColorReset);
+    return false;
+  }
+
+  const u8 *data;
+  size_t size;
+  if (!pipe.selectedBytes(context, &data, &size)) {
+    printf("Failed to map file '%s'\n", context->openedFile->path.c_str());
+    return false;
+  }
+
+  spans = {{data, size, 0}};
+  return true;
+}
+
+static bool streamsSelectedEdits(CraneContext *context, CranePipe &pipe) {
+  return !pipe.hasInput && context->openedFile != nullptr &&
+         !pipe.isSelectedContiguous(context);
+}
+
+/**
+ * Calls `consume` with every span a command reads, its input or the selected
+ * file, until it returns false. `total` is set to their combined size first.
+ * Streamed edits come a segment at a time, so a span isn't valid past its call.
+ */
+template <typename Fn>
+static bool eachCommandSpan(CraneContext *context, CranePipe &pipe, size_t &total,
+                            Fn consume) {
+  if (streamsSelectedEdits(context, pipe)) {
+    total = context->openedFile->editSize;
+    if (!pipe.selectedSegments(context, consume)) {
+      printf("Failed to read file '%s'\n", context->openedFile->path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  std::vector<CraneSpan> spans;
+  if (!commandSpans(context, pipe, spans)) {
+    return false;
+  }
+
+  total = 0;
+  for (auto &span : spans) {
+    total += span.size;
+  }
+  for (auto &span : spans) {
+    if (!consume(span)) {
+      break;
+    }
+  }
+  return true;
+}
+
+// a whole-file scan outside of edit mode reads the file front to back through a
+// read stream (see "readstream.hpp") instead of faulting in a mapping of it
+static bool streamsSelectedFile(CraneContext *context, CranePipe &pipe) {
+  return !pipe.hasInput && context->openedFile != nullptr &&
+         context->interfaceMode != CraneInterfaceMode::Edit &&
+         context->session->readOptions.engine != CraneReadEngine::Mapped;
+}
+
+static bool parseHexBytes(std::string_view text, std::string &out) {
+  if (text.size() % 2 != 0 || text.empty()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < text.size(); i += 2) {
+    if (!isxdigit((unsigned char)text[i]) || !isxdigit((unsigned char)text[i + 1])) {
+      return false;
+    }
+    out += (char)strtoul(std::string(text.substr(i, 2)).c_str(), nullptr, 16);
+  }
+
+  return true;
+}
+
+contributableCommand(range) {
+  CranePipe fallback;
+  CranePipe &pipe = commandPipe(context, fallback);
+
+  u64 offset = strtoull(command->arguments[0]->value.data(), nullptr, 0);
+  u64 length = strtoull(command->arguments[1]->value.data(), nullptr, 0);
+
+  // only the range of streamed edits is read
+  if (streamsSelectedEdits(context, pipe)) {
+    u64 fileSize = context->openedFile->editSize;
+    if (offset > fileSize) {
+      printf("Address out of bounds\n");
+      return 1;
+    }
+
+    u64 size = std::min<u64>(length, fileSize - offset);
+    u8 *bytes = pipe.allocate(size);
+    if (pipe.readSelected(context, offset, bytes, size) != size) {
+      printf("Failed to read file '%s'\n", context->openedFile->path.c_str());
+      return 1;
+    }
+    pipe.emit(bytes, size, offset);
+    return 0;
+  }
+
+  std::vector<CraneSpan> spans;
+  if (!commandSpans(context, pipe, spans)) {
+    return 1;
+  }
+
+  if (!pipe.hasInput && offset > spans[0].size) {
+    printf("Address out of bounds\n");
+    return 1;
+  }
+
+  // the range is taken relative to each input span and clamped to it
+  for (auto &span : spans) {
+    if (offset >= span.size) {
+      continue;
+    }
+
+    size_t size = std::min<u64>(length, span.size - offset);
+    pipe.emit(span.data + offset, size, span.offset + offset);
+  }
+
+  return 0;
+}
+
+// the tail of the previous block, for matches that cross into the next one
+struct CraneFindSeam {
+  std::string bytes;
+  u64 offset = 0;
+};
+
+// matches in a streamed file point at one copy of the pattern, the blocks they
+// were found in are reused
+static void findInBlock(CranePipe &pipe, const u8 *data, u64 size, u64 offset,
+                        const std::string &pattern, const u8 *bytes,
+                        CraneFindSeam &seam) {
+  if (!seam.bytes.empty()) {
+    size_t tailSize = seam.bytes.size();
+    seam.bytes.append((const char *)data, std::min<u64>(size, pattern.size() - 1));
+    for (size_t at = seam.bytes.find(pattern); at != std::string::npos && at < tailSize;
+         at = seam.bytes.find(pattern, at + 1)) {
+      pipe.emit(bytes, pattern.size(), seam.offset + at);
+    }
+  }
+
+  const u8 *cursor = data;
+  const u8 *limit = data + size;
+  while (cursor < limit) {
+    const u8 *match =
+        (const u8 *)memmem(cursor, limit - cursor, pattern.data(), pattern.size());
+    if (match == nullptr) {
+      break;
+    }
+    pipe.emit(bytes, pattern.size(), offset + (match - data));
+    cursor = match + 1;
+  }
+
+  size_t keep = std::min<u64>(size, pattern.size() - 1);
+  seam.bytes.assign((const char *)limit - keep, keep);
+  seam.offset = offset + size - keep;
+}
+
+static int findInRange(CraneContext *context, CranePipe &pipe, const CraneExtent &range,
+                       const std::string &pattern, const u8 *bytes) {
+  CraneReadStream stream(context->openedFile->path, range.offset, range.size,
+                         context->session->readOptions);
+
+  CraneFindSeam seam;
+  CraneReadBlock block;
+  while (stream.next(&block)) {
+    if (craneShouldStop(context)) {
+      return 1;
+    }
+    craneReportProgress(context, block.offset,
+                        context->openedFile->storage->extents.fileSize);
+    craneTraceSpan(context, "find block");
+
+    findInBlock(pipe, block.data, block.size, block.offset, pattern, bytes, seam);
+    countScanned(context, block.size);
+  }
+
+  if (stream.hasFailed()) {
+    printf("Failed to read file '%s'\n", context->openedFile->path.c_str());
+    return 1;
+  }
+
+  return 0;
+}
+
+static int findInStream(CraneContext *context, CranePipe &pipe, std::string_view text,
+                        const std::string &pattern) {
+  u8 *bytes = pipe.allocate(pattern.size());
+  memcpy(bytes, pattern.data(), pattern.size());
+
+  // edits kept in pages or pieces are searched a segment at a time
+  if (streamsSelectedEdits(context, pipe)) {
+    CraneFindSeam seam;
+    u64 total = context->openedFile->editSize;
+    bool isRead = pipe.selectedSegments(context, [&](const CraneSpan &span) {
+      if (craneShouldStop(context)) {
+        return false;
+      }
+      craneReportProgress(context, span.offset, total);
+      findInBlock(pipe, span.data, span.size, span.offset, pattern, bytes, seam);
+      countScanned(context, span.size);
+      return true;
+    });
+
+    if (!isRead) {
+      printf("Failed to read file '%s'\n", context->openedFile->path.c_str());
+      return 1;
+    } else if (craneShouldStop(context)) {
+      return 1;
+    }
+
+    if (pipe.output.empty()) {
+      printf("No matches for '%.*s'\n", (int)text.size(), text.data());
+    }
+    return 0;
+  }
+
+  // a pattern with anything but zeros in it can only match where there's data,
+  // overlapping the holes around it by less than its length
+  CraneExtentMap &extents = context->openedFile->storage->extents;
+  std::vector<CraneExtent> ranges;
+  if (craneIsZero((const u8 *)pattern.data(), pattern.size())) {
+    ranges.push_back({0, extents.fileSize});
+  } else {
+    u64 margin = pattern.size() - 1;
+    for (auto &extent : extents.data) {
+      u64 start = extent.offset > margin ? extent.offset - margin : 0;
+      u64 end = std::min<u64>(extent.offset + extent.size + margin, extents.fileSize);
+      if (!ranges.empty() && ranges.back().offset + ranges.back().size >= start) {
+        ranges.back().size = end - ranges.back().offset;
+      } else {
+        ranges.push_back({start, end - start});
+      }
+    }
+  }
+
+  for (auto &range : ranges) {
+    if (findInRange(context, pipe, range, pattern, bytes) != 0) {
+      return 1;
+    }
+  }
+
+  if (pipe.output.empty()) {
+    printf("No matches for '%.*s'\n", (int)text.size(), text.data());
+  }
+
+  return 0;
+}
+
+contributableCommand(find) {
+  CranePipe fallback;
+  CranePipe &pipe = commandPipe(context, fallback);
+
+  std::string pattern;
+  if (!parseHexBytes(command->arguments[0]->value, pattern)) {
+    printf("Invalid hex pattern '%s'\n", command->arguments[0]->value.data());
+    return 1;
+  }
+
+  if (streamsSelectedFile(context, pipe) || streamsSelectedEdits(context, pipe)) {
+    return findInStream(context, pipe, command->arguments[0]->value, pattern);
+  }
+
+  std::vector<CraneSpan> spans;
+  if (!commandSpans(context, pipe, spans)) {
+    return 1;
+  }
+
+  u64 total = 0;
+  for (auto &span : spans) {
+    total += span.size;
+  }
+
+  // chunks are searched in parallel, each reports the matches starting inside
+  // it and reads up to one pattern length past its end so none are missed
+  std::atomic<u64> done(0);
+  for (auto &span : spans) {
+    std::vector<u64> matches = context->scheduler->parallelReduce<std::vector<u64>>(
+        0, span.size, kScanChunkSize, {},
+        [&](u64 begin, u64 end) {
+          std::vector<u64> found;
+          if (craneShouldStop(context)) {
+            return found;
+          }
+          craneTraceSpan(context, "find chunk");
+
+          const u8 *cursor = span.data + begin;
+          const u8 *limit = span.data + std::min<u64>(span.size, end + pattern.size() - 1);
+          while (cursor < limit) {
+            const u8 *match = (const u8 *)memmem(cursor, limit - cursor, pattern.data(),
+                                                 pattern.size());
+            if (match == nullptr || (u64)(match - span.data) >= end) {
+              break;
+            }
+            found.push_back(match - span.data);
+            cursor = match + 1;
+          }
+
+          craneReportProgress(context, done += end - begin, total);
+          return found;
+        },
+        [](std::vector<u64> all, const std::vector<u64> &found) {
+          all.insert(all.end(), found.begin(), found.end());
+          return all;
+        });
+
+    if (craneShouldStop(context)) {
+      return 1;
+    }
+    countScanned(context, span.size);
+
+    for (u64 offset : matches) {
+      pipe.emit(span.data + offset, pattern.size(), span.offset + offset);
+    }
+  }
+
+  if (pipe.output.empty()) {
+    printf("No matches for '%s'\n", command->arguments[0]->value.data());
+  }
+
+  return 0;
+}
+
+contributableCommand(xorBytes) {
+  CranePipe fallback;
+  CranePipe &pipe = commandPipe(context, fallback);
+
+  std::string key;
+  if (!parseHexBytes(command->arguments[0]->value, key)) {
+    printf("Invalid hex key '%s'\n", command->arguments[0]->value.data());
+    return 1;
+  }
+
+  // transforms are the only stages that produce new bytes, the key continues
+  // across the segments of streamed edits
+  bool isStreamed = streamsSelectedEdits(context, pipe);
+  size_t total;
+  u64 done = 0;
+  bool isRead = eachCommandSpan(context, pipe, total, [&](const CraneSpan &span) {
+    u8 *out = pipe.allocate(span.size);
+    size_t phase = isStreamed ? done % key.size() : 0;
+    for (size_t i = 0; i < span.size; i++) {
+      out[i] = span.data[i] ^ (u8)key[(phase + i) % key.size()];
+    }
+    done += span.size;
+    countScanned(context, span.size);
+    pipe.emit(out, span.size, span.offset);
+    return true;
+  });
+
+  return isRead ? 0 : 1;
+}
+
+struct CraneCrcTables {
+  u32 table[8][256];
+
+  CraneCrcTables() {
+    for (u32 i = 0; i < 256; i++) {
+      u32 crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+      }
+      table[0][i] = crc;
+    }
+
+    for (u32 i = 0; i < 256; i++) {
+      for (int slice = 1; slice < 8; slice++) {
+        u32 prev = table[slice - 1][i];
+        table[slice][i] = (prev >> 8) ^ table[0][prev & 0xFF];
+      }
+    }
+  }
+};
+
+// CRC-32 (IEEE), eight bytes per step, assumes a little endian host
+static u32 crc32Update(u32 crc, const u8 *data, size_t size) {
+  static const CraneCrcTables tables;
+  auto &t = tables.table;
+
+  crc = ~crc;
+  while (size >= 8) {
+    u32 one, two;
+    memcpy(&one, data, 4);
+    memcpy(&two, data + 4, 4);
+    one ^= crc;
+    crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^
+          t[4][one >> 24] ^ t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^
+          t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+    data += 8;
+    size -= 8;
+  }
+
+  while (size--) {
+    crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
+
+static u64 fnv1aUpdate(u64 hash, const u8 *data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Multiplies polynomials modulo the CRC-32 polynomial, bit reflected like the
+// register. Feeding n zero bytes multiplies the register by x^(8n), so a hole
+// is hashed in O(log n) steps instead of byte by byte.
+static u32 crc32MultiplyModP(u32 a, u32 b) {
+  u32 product = 0;
+  for (u32 mask = 1U << 31; mask != 0; mask >>= 1) {
+    if (a & mask) {
+      product ^= b;
+    }
+    b = (b >> 1) ^ (0xEDB88320 & -(b & 1));
+  }
+  return product;
+}
+
+static u32 crc32Zeros(u32 crc, u64 count) {
+  // x^8, squared for every bit of the count
+  u32 power = 1U << 23;
+  u32 shift = 1U << 31;
+  for (; count != 0; count >>= 1) {
+    if (count & 1) {
+      shift = crc32MultiplyModP(power, shift);
+    }
+    power = crc32MultiplyModP(power, power);
+  }
+  return ~crc32MultiplyModP(shift, ~crc);
+}
+
+// xoring a zero byte changes nothing, so n of them multiply by the prime n times
+static u64 fnv1aZeros(u64 hash, u64 count) {
+  u64 power = 0x100000001b3ULL;
+  for (; count != 0; count >>= 1) {
+    if (count & 1) {
+      hash *= power;
+    }
+    power *= power;
+  }
+  return hash;
+}
+
+contributableCommand(hash) {
+  CranePipe fallback;
+  CranePipe &pipe = commandPipe(context, fallback);
+
+  std::string algorithm = "crc32";
+  if (command->arguments.size() > 0) {
+    algorithm = command->arguments[0]->value;
+  }
+
+  if (algorithm != "crc32" && algorithm != "fnv1a") {
+    printf("Unknown hash '%s' (expected crc32 or fnv1a)\n", algorithm.c_str());
+    return 1;
+  }
+
+  u32 crc = 0;
+  u64 fnv = 0xcbf29ce484222325ULL;
+  auto update = [&](const u8 *data, size_t size) {
+    if (algorithm == "crc32") {
+      crc = crc32Update(crc, data, size);
+    } else {
+      fnv = fnv1aUpdate(fnv, data, size);
+    }
+    countScanned(context, size);
+  };
+
+  auto skipZeros = [&](u64 count) {
+    if (algorithm == "crc32") {
+      crc = crc32Zeros(crc, count);
+    } else {
+      fnv = fnv1aZeros(fnv, count);
+    }
+  };
+
+  size_t total = 0;
+  if (streamsSelectedFile(context, pipe)) {
+    // only the data is read, holes are hashed as the zeros they read as
+    CraneExtentMap &extents = context->openedFile->storage->extents;
+    total = extents.fileSize;
+
+    u64 cursor = 0;
+    for (auto &extent : extents.data) {
+      skipZeros(extent.offset - cursor);
+
+      CraneReadStream stream(context->openedFile->path, extent.offset, extent.size,
+                             context->session->readOptions);
+      CraneReadBlock block;
+      while (stream.next(&block)) {
+        if (craneShouldStop(context)) {
+          return 1;
+        }
+        craneReportProgress(context, block.offset, total);
+        update(block.data, block.size);
+      }
+
+      if (stream.hasFailed() || stream.size() != extent.size) {
+        printf("Failed to read file '%s'\n", context->openedFile->path.c_str());
+        return 1;
+      }
+      cursor = extent.offset + extent.size;
+    }
+    skipZeros(total - cursor);
+  } else {
+    // multiple spans are hashed as if they were concatenated
+    size_t done = 0;
+    bool isRead = eachCommandSpan(context, pipe, total, [&](const CraneSpan &span) {
+      for (size_t offset = 0; offset < span.size; offset += kScanChunkSize) {
+        if (craneShouldStop(context)) {
+          return false;
+        }
+        craneReportProgress(context, done + offset, total);
+        update(span.data + offset, std::min<size_t>(kScanChunkSize, span.size - offset));
+      }
+      done += span.size;
+      return true;
+    });
+
+    if (!isRead || craneShouldStop(context)) {
+      return 1;
+    }
+  }
+
+  if (algorithm == "crc32") {
+    printf("crc32: %08X (%zu bytes)\n", crc, total);
+  } else {
+    printf("fnv1a: %016llX (%zu bytes)\n", fnv, total);
+  }
+
+  return 0;
+}
+
+contributableCommand(exportSpans) {
+  CranePipe fallback;
+  CranePipe &pipe = commandPipe(context, fallback);
+
+  std::string path(command->arguments[0]->value);
+
+  FILE *out = fopen(path.c_str(), "wb");
+  if (!out) {
+    printf("Failed to open file '%s'\n", path.c_str());
+    return 1;
+  }
+
+  size_t total = 0;
+  size_t done = 0;
+  bool isWritten = true;
+  bool isRead = eachCommandSpan(context, pipe, total, [&](const CraneSpan &span) {
+    for (size_t offset = 0; offset < span.size; offset += kScanChunkSize) {
+      if (craneShouldStop(context)) {
+        return false;
+      }
+      craneReportProgress(context, done + offset, total);
+
+      size_t size = std::min<size_t>(kScanChunkSize, span.size - offset);
+      if (fwrite(span.data + offset, 1, size, out) != size) {
+        printf("Failed to write file\n");
+        perror("fwrite");
+        isWritten = false;
+        return false;
+      }
+      countScanned(context, size);
+      craneCountWritten(context, size);
+    }
+    done += span.size;
+    return true;
+  });
+
+  fclose(out);
+  if (!isRead || !isWritten) {
+    return 1;
+  } else if (craneShouldStop(context)) {
+    remove(path.c_str());
+    return 1;
+  }
+
+  printf("Exported %zu bytes to '%s'\n", total, path.c_str());
 
   return 0;
 }
@@ -675,42 +2157,590 @@ contributableCommand(templateNew) {
     return 1;
   }
 
-  std::string name = command->arguments[0]->value;
+  std::string name(command->arguments[0]->value);
+  std::string source(command->arguments[1]->value);
+
+  if (context->session->templateMap.find(name) != context->session->templateMap.end()) {
+    printf("Template '%s' already exists\n", name.c_str());
+    return 1;
+  }
+
+  std::string error;
+  craneTraceBegin(context, "compile template");
+  CraneTemplate *tmpl = CraneTemplate::compile(name, source, error);
+  craneTraceEnd(context, "compile template");
+  if (tmpl == nullptr) {
+    printf("Failed to compile template '%s': %s\n", name.c_str(), error.c_str());
+    return 1;
+  }
+
+  context->session->templateMap[name] = tmpl;
+  printf("Created template '%s' with %zu fields\n", name.c_str(), tmpl->fields.size());
+
+  return 0;
+}
+
+contributableCommand(templateLoad) {
+  if (context->interfaceMode != CraneInterfaceMode::Template) {
+    printf("Not in template mode\n");
+    return 1;
+  }
+
+  std::string name(command->arguments[0]->value);
+  std::string path(command->arguments[1]->value);
+
+  if (context->session->templateMap.find(name) != context->session->templateMap.end()) {
+    printf("Template '%s' already exists\n", name.c_str());
+    return 1;
+  }
+
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    printf("Failed to open file '%s'\n", path.c_str());
+    return 1;
+  }
+
+  std::string source;
+  char chunk[4096];
+  size_t read;
+  while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    source.append(chunk, read);
+  }
+  fclose(file);
+  craneCountRead(context, source.size());
+
+  std::string error;
+  craneTraceBegin(context, "compile template");
+  CraneTemplate *tmpl = CraneTemplate::compile(name, source, error);
+  craneTraceEnd(context, "compile template");
+  if (tmpl == nullptr) {
+    printf("Failed to compile template '%s': %s\n", name.c_str(), error.c_str());
+    return 1;
+  }
+
+  context->session->templateMap[name] = tmpl;
+  printf("Loaded template '%s' with %zu fields from '%s'\n", name.c_str(),
+         tmpl->fields.size(), path.c_str());
+
+  return 0;
+}
+
+contributableCommand(templateDelete) {
+  if (context->interfaceMode != CraneInterfaceMode::Template) {
+    printf("Not in template mode\n");
+    return 1;
+  }
+
+  std::string name(command->arguments[0]->value);
+
+  auto tmplRes = context->session->templateMap.find(name);
+  if (tmplRes == context->session->templateMap.end()) {
+    printf("Template '%s' does not exist\n", name.c_str());
+    return 1;
+  }
+
+  delete tmplRes->second;
+  context->session->templateMap.erase(tmplRes);
+  printf("Deleted template '%s'\n", name.c_str());
+
+  return 0;
+}
+
+contributableCommand(templates) {
+  printf("All Templates:\n");
+  for (auto &entry : context->session->templateMap) {
+    CraneTemplate *tmpl = entry.second;
+    printf("  %s (%zu fields", tmpl->name.c_str(), tmpl->fields.size());
+    if (tmpl->isFixedSize) {
+      printf(", %llu bytes", tmpl->fixedSize);
+    }
+    printf(")\n");
+  }
+
+  return 0;
+}
+
+#define kTemplateArrayPreview 8
+#define kTemplateStringPreview 64
+#define kTemplatePageRows 32
+
+static std::string formatTemplateElement(CraneTemplateField &field, const u8 *bytes) {
+  char out[64];
+  double asDouble;
+  u64 value = craneTemplateDecode(field, bytes, &asDouble);
+
+  if (!field.isInteger()) {
+    snprintf(out, sizeof(out), "%g", asDouble);
+  } else if (field.isSigned()) {
+    snprintf(out, sizeof(out), "%lld", (long long)value);
+  } else if (field.isArray) {
+    snprintf(out, sizeof(out), "0x%llX", value);
+  } else {
+    snprintf(out, sizeof(out), "0x%llX (%llu)", value, value);
+  }
+
+  return out;
+}
+
+static bool formatTemplateField(CraneTemplateInstance &instance, size_t index,
+                                std::string &out) {
+  CraneTemplateField &field = instance.tmpl->fields[index];
+  CraneTemplateInstance::Layout &layout = instance.layouts[index];
+
+  if (field.type == CraneTemplateType::Char && field.isArray) {
+    u64 length = std::min<u64>(layout.count, kTemplateStringPreview);
+    std::string bytes(length, '\0');
+    if (!instance.source->read(layout.offset, &bytes[0], length)) {
+      return false;
+    }
+
+    out = "\"";
+    for (char c : bytes) {
+      if (c == '\0') {
+        break;
+      }
+      out += isprint(c) ? c : '.';
+    }
+    out += layout.count > length ? "\"..." : "\"";
+    return true;
+  }
+
+  if (!field.isArray) {
+    u8 bytes[8];
+    if (!instance.source->read(layout.offset, bytes, field.size)) {
+      return false;
+    }
+    out = formatTemplateElement(field, bytes);
+    return true;
+  }
+
+  u64 shown = std::min<u64>(layout.count, kTemplateArrayPreview);
+  std::vector<u8> bytes(shown * field.size);
+  if (!instance.source->read(layout.offset, bytes.data(), bytes.size())) {
+    return false;
+  }
+
+  out = "[";
+  for (u64 i = 0; i < shown; i++) {
+    out += (i ? ", " : "") + formatTemplateElement(field, &bytes[i * field.size]);
+  }
+  out += layout.count > shown ? ", ...]" : "]";
+  return true;
+}
+
+contributableCommand(templateApply) {
+  std::string name(command->arguments[0]->value);
+
+  auto tmplRes = context->session->templateMap.find(name);
+  if (tmplRes == context->session->templateMap.end()) {
+    printf("Template '%s' does not exist\n", name.c_str());
+    return 1;
+  }
+
+  CraneTemplate *tmpl = tmplRes->second;
+  u64 base = 0;
+  u64 first = 0;
+  u64 rows = kTemplatePageRows;
+  if (command->arguments.size() > 1) {
+    base = strtoull(command->arguments[1]->value.data(), nullptr, 0);
+  }
+  if (command->arguments.size() > 2) {
+    first = strtoull(command->arguments[2]->value.data(), nullptr, 0);
+  }
+  if (command->arguments.size() > 3) {
+    rows = strtoull(command->arguments[3]->value.data(), nullptr, 0);
+  }
+
+  // only the bytes of displayed fields (and whatever their layout depends on)
+  // are read
+  CraneTemplateSource source(context);
+
+  if (base >= source.size) {
+    printf("Address out of bounds\n");
+    return 1;
+  }
+
+  CraneTemplateInstance instance(tmpl, &source, base);
+  u64 last = std::min<u64>(tmpl->fields.size(), first + rows);
+
+  printf("Template '%s' at 0x%llX in '%s' (fields %llu-%llu of %zu):\n\n",
+         tmpl->name.c_str(), base, context->openedFile->alias.c_str(), first,
+         last ? last - 1 : 0, tmpl->fields.size());
+
+  for (u64 i = first; i < last; i++) {
+    CraneTemplateField &field = tmpl->fields[i];
+
+    if (!instance.resolve(i)) {
+      printf("%serr%s: %s\n", kColorRed, kColorReset, instance.error.c_str());
+      return 1;
+    }
+
+    CraneTemplateInstance::Layout &layout = instance.layouts[i];
+    if (!layout.isPresent) {
+      continue;
+    }
+
+    std::string type = CraneTemplateTypeNames[static_cast<int>(field.type)];
+    if (field.size > 1) {
+      type += field.bigEndian ? "be" : "le";
+    }
+    if (field.isArray) {
+      type += "[" + std::to_string(layout.count) + "]";
+    }
+
+    std::string value;
+    if (!formatTemplateField(instance, i, value)) {
+      value = "<out of bounds>";
+    }
+
+    printf("  %08llX: %-16s %-12s %s\n", layout.offset, field.name.c_str(), type.c_str(),
+           value.c_str());
+  }
+
+  if (last < tmpl->fields.size()) {
+    printf("\n(use 'applytemplate %s 0x%llX %llu' to show more)\n", tmpl->name.c_str(),
+           base, last);
+  }
+
+  return 0;
+}
+
+/**
+ * Columnar extraction: a fixed-size template is stamped over `count` records and
+ * the chosen fields are gathered into one contiguous column each, a block of
+ * records at a time. The gathers are plain strided loops over a fixed element
+ * type so the compiler can vectorise the loads and byte swaps.
+ */
+#define kColumnBlockRecords 65536
+#define kColumnFlushSize (1 << 20)
+// every column holds a block of records, so large arrays are refused
+#define kColumnMaxColumns 256
+
+struct CraneColumn {
+  std::string name;
+  CraneTemplateField *field;
+  u64 recordOffset;
+  std::vector<u8> block;
+};
+
+template <typename T, typename Swap>
+static void gatherColumn(const u8 *records, size_t stride, size_t count, T *out,
+                         Swap swap) {
+  for (size_t i = 0; i < count; i++) {
+    T value;
+    memcpy(&value, records + i * stride, sizeof(T));
+    out[i] = swap(value);
+  }
+}
+
+static void gatherColumn(CraneColumn &column, const u8 *records, size_t stride,
+                         size_t count) {
+  const u8 *base = records + column.recordOffset;
+  void *out = column.block.data();
+  bool swap = column.field->bigEndian;
+
+  switch (column.field->size) {
+  case 1:
+    gatherColumn(base, stride, count, (u8 *)out, [](u8 v) { return v; });
+    break;
+  case 2:
+    if (swap) {
+      gatherColumn(base, stride, count, (u16 *)out,
+                   [](u16 v) { return (u16)__builtin_bswap16(v); });
+    } else {
+      gatherColumn(base, stride, count, (u16 *)out, [](u16 v) { return v; });
+    }
+    break;
+  case 4:
+    if (swap) {
+      gatherColumn(base, stride, count, (u32 *)out,
+                   [](u32 v) { return (u32)__builtin_bswap32(v); });
+    } else {
+      gatherColumn(base, stride, count, (u32 *)out, [](u32 v) { return v; });
+    }
+    break;
+  case 8:
+    if (swap) {
+      gatherColumn(base, stride, count, (u64 *)out,
+                   [](u64 v) { return (u64)__builtin_bswap64(v); });
+    } else {
+      gatherColumn(base, stride, count, (u64 *)out, [](u64 v) { return v; });
+    }
+    break;
+  }
+}
+
+static char *formatUnsigned(char *out, u64 value) {
+  char digits[20];
+  int length = 0;
+  do {
+    digits[length++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+
+  while (length) {
+    *out++ = digits[--length];
+  }
+  return out;
+}
+
+static char *formatColumnValue(char *out, CraneColumn &column, size_t index) {
+  CraneTemplateField &field = *column.field;
+  const u8 *ptr = column.block.data() + index * field.size;
+
+  // columns are already in native byte order
+  u64 raw = 0;
+  switch (field.size) {
+  case 1: raw = *ptr; break;
+  case 2: { u16 v; memcpy(&v, ptr, 2); raw = v; break; }
+  case 4: { u32 v; memcpy(&v, ptr, 4); raw = v; break; }
+  case 8: memcpy(&raw, ptr, 8); break;
+  }
+
+  if (field.type == CraneTemplateType::F32) {
+    float f;
+    u32 bits = (u32)raw;
+    memcpy(&f, &bits, 4);
+    return out + sprintf(out, "%.9g", f);
+  } else if (field.type == CraneTemplateType::F64) {
+    double d;
+    memcpy(&d, &raw, 8);
+    return out + sprintf(out, "%.17g", d);
+  }
+
+  if (field.isSigned()) {
+    if (field.size < 8) {
+      u64 signBit = 1ULL << (field.size * 8 - 1);
+      raw = (raw ^ signBit) - signBit;
+    }
+
+    if ((long long)raw < 0) {
+      *out++ = '-';
+      raw = -raw;
+    }
+  }
+
+  return formatUnsigned(out, raw);
+}
+
+contributableCommand(extractColumns) {
+  std::string name(command->arguments[0]->value);
+  u64 base = strtoull(command->arguments[1]->value.data(), nullptr, 0);
+  u64 count = strtoull(command->arguments[2]->value.data(), nullptr, 0);
+  std::string fieldList(command->arguments[3]->value);
+  std::string format(command->arguments[4]->value);
+  std::string path(command->arguments[5]->value);
+
+  auto tmplRes = context->session->templateMap.find(name);
+  if (tmplRes == context->session->templateMap.end()) {
+    printf("Template '%s' does not exist\n", name.c_str());
+    return 1;
+  }
+
+  CraneTemplate *tmpl = tmplRes->second;
+  if (!tmpl->isFixedSize || tmpl->fixedSize == 0) {
+    printf("Template '%s' has data-dependent fields and can't be used as an array\n",
+           name.c_str());
+    return 1;
+  }
+
+  if (format != "csv" && format != "raw") {
+    printf("Unknown format '%s' (expected csv or raw)\n", format.c_str());
+    return 1;
+  }
+
+  // resolve the requested fields, fixed arrays are expanded into one column per
+  // element
+  std::vector<std::string> names;
+  if (fieldList == "*") {
+    for (auto &field : tmpl->fields) {
+      names.push_back(field.name);
+    }
+  } else {
+    size_t start = 0;
+    while (start <= fieldList.size()) {
+      size_t end = fieldList.find(',', start);
+      if (end == std::string::npos) {
+        end = fieldList.size();
+      }
+      names.push_back(fieldList.substr(start, end - start));
+      start = end + 1;
+    }
+  }
+
+  std::vector<CraneColumn> columns;
+  for (auto &fieldName : names) {
+    int index = tmpl->findField(fieldName);
+    if (index < 0) {
+      printf("Template '%s' has no field '%s'\n", name.c_str(), fieldName.c_str());
+      return 1;
+    }
+
+    CraneTemplateField &field = tmpl->fields[index];
+    if (field.count > kColumnMaxColumns - columns.size()) {
+      printf("Too many columns, at most %d can be extracted ('%s' has %llu elements)\n",
+             kColumnMaxColumns, fieldName.c_str(), field.count);
+      return 1;
+    }
+
+    for (u64 i = 0; i < field.count; i++) {
+      std::string columnName =
+          field.isArray ? fieldName + "[" + std::to_string(i) + "]" : fieldName;
+      columns.push_back(
+          {columnName, &field, field.staticOffset + i * field.size, std::vector<u8>()});
+    }
+  }
+
+  u64 stride = tmpl->fixedSize;
+  CraneTemplateSource source(context);
+  if (base > source.size || count > (source.size - base) / stride) {
+    printf("Address out of bounds\n");
+    return 1;
+  }
+
+  FILE *out = fopen(path.c_str(), "wb");
+  if (!out) {
+    printf("Failed to open file '%s'\n", path.c_str());
+    return 1;
+  }
+
+  size_t blockRecords = std::min<u64>(count, kColumnBlockRecords);
+  for (auto &column : columns) {
+    column.block.resize(blockRecords * column.field->size);
+  }
+
+  std::vector<u8> records;
+  std::string text;
+  if (format == "csv") {
+    for (size_t i = 0; i < columns.size(); i++) {
+      text += (i ? "," : "") + columns[i].name;
+    }
+    text += "\n";
+  }
+
+  // raw output is column-major, every column gets its own region of the file
+  std::vector<u64> columnStarts;
+  u64 rawSize = 0;
+  for (auto &column : columns) {
+    columnStarts.push_back(rawSize);
+    rawSize += count * column.field->size;
+  }
+
+  bool failed = false;
+  bool cancelled = false;
+  for (u64 done = 0; done < count && !failed; done += blockRecords) {
+    if (craneShouldStop(context)) {
+      cancelled = true;
+      break;
+    }
+    craneReportProgress(context, done, count);
+
+    size_t n = std::min<u64>(blockRecords, count - done);
+
+    {
+      craneTraceSpan(context, "read records");
+      records.resize(n * stride);
+      if (!source.read(base + done * stride, records.data(), records.size())) {
+        printf("Failed to read records at 0x%llX\n", base + done * stride);
+        failed = true;
+        break;
+      }
+    }
+
+    {
+      craneTraceSpan(context, "gather columns");
+      for (auto &column : columns) {
+        gatherColumn(column, records.data(), stride, n);
+      }
+    }
+
+    if (format == "raw") {
+      for (size_t c = 0; c < columns.size() && !failed; c++) {
+        size_t bytes = n * columns[c].field->size;
+        failed = fseeko(out, columnStarts[c] + done * columns[c].field->size, SEEK_SET) ||
+                 fwrite(columns[c].block.data(), 1, bytes, out) != bytes;
+        craneCountWritten(context, bytes);
+      }
+      continue;
+    }
+
+    char row[32];
+    for (size_t i = 0; i < n; i++) {
+      for (size_t c = 0; c < columns.size(); c++) {
+        char *end = formatColumnValue(row, columns[c], i);
+        *end++ = c + 1 == columns.size() ? '\n' : ',';
+        text.append(row, end - row);
+      }
+
+      if (text.size() >= kColumnFlushSize) {
+        failed = fwrite(text.data(), 1, text.size(), out) != text.size();
+        craneCountWritten(context, text.size());
+        text.clear();
+      }
+    }
+  }
+
+  if (!failed && !cancelled && !text.empty()) {
+    failed = fwrite(text.data(), 1, text.size(), out) != text.size();
+    craneCountWritten(context, text.size());
+  }
+
+  if (cancelled) {
+    fclose(out);
+    remove(path.c_str());
+    return 1;
+  }
+
+  if (fclose(out) != 0 || failed) {
+    printf("Failed to write columns to '%s'\n", path.c_str());
+    return 1;
+  }
+
+  printf("Extracted %zu columns from %llu records of %llu bytes into '%s'\n",
+         columns.size(), count, stride, path.c_str());
+
+  if (format == "raw") {
+    for (size_t c = 0; c < columns.size(); c++) {
+      printf("  %08llX: %-16s %s x %llu\n", columnStarts[c], columns[c].name.c_str(),
+             CraneTemplateTypeNames[static_cast<int>(columns[c].field->type)], count);
+    }
+  }
 
-  // if (context->templateMap.find(name) != context->templateMap.end()) {
-  //   printf("Template '%s' already exists\n", name.c_str());
-  //   return 1;
-  // }
+  return 0;
 }
 
 extern "C" CraneContributedCommands *crane_init() {
   CraneContributedCommands *contrib = new CraneContributedCommands();
 
-  auto openEntry = contributeCommand(contrib, "open", open, false);
+  auto openEntry = contributeCommand(contrib, "open", openFile, false);
   openEntry->addArgument("path", false, CraneArgumentType::String);
   openEntry->addArgument("alias", false, CraneArgumentType::String);
   openEntry->setCommandDescription("Opens a new file with a given path and alias");
 
-  auto selEntry = contributeCommand(contrib, "select", select, false);
-  selEntry->addArgument("alias", true, CraneArgumentType::String);
+  auto selEntry = contributeCommand(contrib, "select", selectFile, false);
+  selEntry->addArgument("alias", true, CraneArgumentType::File);
   selEntry->setCommandDescription("Selects a file with a given alias");
 
-  auto closeEntry = contributeCommand(contrib, "close", close, false);
-  closeEntry->addArgument("alias", true, CraneArgumentType::String);
+  auto closeEntry = contributeCommand(contrib, "close", closeFile, false);
+  closeEntry->addArgument("alias", true, CraneArgumentType::File);
   closeEntry->setCommandDescription(
       "Closes a file with a given alias or the currently selected file");
 
   auto filesEntry = contributeCommand(contrib, "files", files, false);
   filesEntry->setCommandDescription("Lists all open files");
+  filesEntry->setSafePerFile();
 
   auto dumpEntry = contributeCommand(contrib, "dump", dump, false);
   dumpEntry->addArgument("format", true, CraneArgumentType::String);
-  dumpEntry->setCommandDescription("Dumps the currently selected file");
+  dumpEntry->setCommandDescription("Dumps the currently selected file or the input");
   dumpEntry->setRequiresOpenFile();
+  dumpEntry->setAcceptsInput();
+  dumpEntry->setSafePerFile();
 
   auto modeEntry = contributeCommand(contrib, "mode", mode, false);
   modeEntry->addArgument("mode", true, CraneArgumentType::String);
-  modeEntry->setCommandDescription("Changes the file editing mode");
+  modeEntry->setCommandDescription(
+      "Changes the file editing mode (normal, edit, edit-inplace or template)");
 
   // Edit mode commands
 
@@ -721,33 +2751,144 @@ extern "C" CraneContributedCommands *crane_init() {
   byteAtEntry->addArgument("offset", false, CraneArgumentType::Number);
   byteAtEntry->setCommandDescription("Prints the byte at a given offset");
   byteAtEntry->setRequiresOpenFile();
+  byteAtEntry->setSafePerFile();
 
   auto insertEntry = contributeCommand(contrib, "insert", insert, true);
   insertEntry->addArgument("offset", false, CraneArgumentType::Number);
   insertEntry->addArgument("value", false, CraneArgumentType::String);
   insertEntry->setCommandDescription("Inserts a string at a given offset");
   insertEntry->setRequiresOpenFile();
-
-  auto writeEntry = contributeCommand(contrib, "write", write, true);
+  insertEntry->setSafePerFile();
+
+  auto spliceEntry = contributeCommand(contrib, "splice", spliceFile, true);
+  spliceEntry->addArgument("source", false, CraneArgumentType::File);
+  spliceEntry->addArgument("sourceOffset", false, CraneArgumentType::Number);
+  spliceEntry->addArgument("length", false, CraneArgumentType::Number);
+  spliceEntry->addArgument("offset", false, CraneArgumentType::Number);
+  spliceEntry->setCommandDescription(
+      "Inserts a range of another open file at a given offset, copied when saved");
+  spliceEntry->setRequiresOpenFile();
+
+  auto insertFileEntry = contributeCommand(contrib, "insertfile", insertFile, true);
+  insertFileEntry->addArgument("path", false, CraneArgumentType::String);
+  insertFileEntry->addArgument("offset", false, CraneArgumentType::Number);
+  insertFileEntry->setCommandDescription(
+      "Inserts a whole file at a given offset, copied when saved");
+  insertFileEntry->setRequiresOpenFile();
+
+  auto writeEntry = contributeCommand(contrib, "write", writeString, true);
   writeEntry->addArgument("offset", false, CraneArgumentType::Number);
   writeEntry->addArgument("value", false, CraneArgumentType::String);
   writeEntry->setCommandDescription("Writes a string at a given offset");
   writeEntry->setRequiresOpenFile();
+  writeEntry->setSafePerFile();
 
   auto writeHexEntry = contributeCommand(contrib, "writehex", writeHex, true);
   writeHexEntry->addArgument("offset", false, CraneArgumentType::Number);
   writeHexEntry->setCommandDescription("Writes a list of hex bytes at a given offset");
+  writeHexEntry->setSafePerFile();
 
-  auto truncateEntry = contributeCommand(contrib, "truncate", truncate, true);
+  auto truncateEntry = contributeCommand(contrib, "truncate", truncateFile, true);
   truncateEntry->addArgument("offset", false, CraneArgumentType::Number);
   truncateEntry->setCommandDescription("Truncates the file at a given offset, removing all data after it");
+  truncateEntry->setSafePerFile();
+
+  auto sortRecordsEntry = contributeCommand(contrib, "sortrecords", sortRecords, false);
+  sortRecordsEntry->addArgument("offset", false, CraneArgumentType::Number);
+  sortRecordsEntry->addArgument("count", false, CraneArgumentType::Number);
+  sortRecordsEntry->addArgument("recordSize", false, CraneArgumentType::Number);
+  sortRecordsEntry->addArgument("keyOffset", false, CraneArgumentType::Number);
+  sortRecordsEntry->addArgument("keyType", false, CraneArgumentType::String);
+  sortRecordsEntry->setCommandDescription(
+      "Sorts a table of fixed-size records in place by a u32/u64 key");
+  sortRecordsEntry->setRequiresOpenFile();
+  sortRecordsEntry->setSafePerFile();
+
+  // Macro commands
+
+  auto macroEntry = contributeCommand(contrib, "macro", macro, true);
+  macroEntry->addArgument("action", false, CraneArgumentType::String);
+  macroEntry->addArgument("name", true, CraneArgumentType::String);
+  macroEntry->setCommandDescription(
+      "Records edits with 'record'/'stop' and replays them with 'run <name> [files...]'");
+
+  // Pipeline commands
+
+  auto rangeEntry = contributeCommand(contrib, "range", range, false);
+  rangeEntry->addArgument("offset", false, CraneArgumentType::Number);
+  rangeEntry->addArgument("length", false, CraneArgumentType::Number);
+  rangeEntry->setCommandDescription(
+      "Passes a range of the file (or of each input span) to the next command");
+  rangeEntry->setAcceptsInput();
+  rangeEntry->setSafePerFile();
+
+  auto findEntry = contributeCommand(contrib, "find", find, false);
+  findEntry->addArgument("pattern", false, CraneArgumentType::String);
+  findEntry->setCommandDescription("Finds every occurrence of a hex byte pattern");
+  findEntry->setAcceptsInput();
+  findEntry->setSafePerFile();
+
+  auto xorEntry = contributeCommand(contrib, "xor", xorBytes, false);
+  xorEntry->addArgument("key", false, CraneArgumentType::String);
+  xorEntry->setCommandDescription("XORs the input with a repeating hex key");
+  xorEntry->setAcceptsInput();
+  xorEntry->setSafePerFile();
+
+  auto hashEntry = contributeCommand(contrib, "hash", hash, false);
+  hashEntry->addArgument("algorithm", true, CraneArgumentType::String);
+  hashEntry->setCommandDescription("Hashes the input or the selected file (crc32, fnv1a)");
+  hashEntry->setAcceptsInput();
+  hashEntry->setSafePerFile();
+
+  auto exportEntry = contributeCommand(contrib, "export", exportSpans, false);
+  exportEntry->addArgument("path", false, CraneArgumentType::String);
+  exportEntry->setCommandDescription("Writes the input or the selected file to a path");
+  exportEntry->setAcceptsInput();
+  exportEntry->setSafePerFile();
 
   // Template mode commands
 
   auto templateEntry = contributeCommand(contrib, "newtemplate", templateNew, false);
   templateEntry->addArgument("name", false, CraneArgumentType::String);
+  templateEntry->addArgument("definition", false, CraneArgumentType::String);
   templateEntry->setCommandDescription("Creates a new template with a given name");
 
+  auto loadTemplateEntry = contributeCommand(contrib, "loadtemplate", templateLoad, false);
+  loadTemplateEntry->addArgument("name", false, CraneArgumentType::String);
+  loadTemplateEntry->addArgument("path", false, CraneArgumentType::String);
+  loadTemplateEntry->setCommandDescription("Creates a new template from a definition file");
+
+  auto delTemplateEntry = contributeCommand(contrib, "deltemplate", templateDelete, false);
+  delTemplateEntry->addArgument("name", false, CraneArgumentType::String);
+  delTemplateEntry->setCommandDescription("Deletes a template with a given name");
+
+  auto templatesEntry = contributeCommand(contrib, "templates", templates, false);
+  templatesEntry->setCommandDescription("Lists all templates");
+  templatesEntry->setSafePerFile();
+
+  auto applyTemplateEntry =
+      contributeCommand(contrib, "applytemplate", templateApply, false);
+  applyTemplateEntry->addArgument("name", false, CraneArgumentType::String);
+  applyTemplateEntry->addArgument("offset", true, CraneArgumentType::Number);
+  applyTemplateEntry->addArgument("first", true, CraneArgumentType::Number);
+  applyTemplateEntry->addArgument("count", true, CraneArgumentType::Number);
+  applyTemplateEntry->setCommandDescription(
+      "Decodes the selected file with a template, a page of fields at a time");
+  applyTemplateEntry->setRequiresOpenFile();
+  applyTemplateEntry->setSafePerFile();
+
+  auto columnsEntry = contributeCommand(contrib, "columns", extractColumns, false);
+  columnsEntry->addArgument("template", false, CraneArgumentType::String);
+  columnsEntry->addArgument("offset", false, CraneArgumentType::Number);
+  columnsEntry->addArgument("count", false, CraneArgumentType::Number);
+  columnsEntry->addArgument("fields", false, CraneArgumentType::String);
+  columnsEntry->addArgument("format", false, CraneArgumentType::String);
+  columnsEntry->addArgument("path", false, CraneArgumentType::String);
+  columnsEntry->setCommandDescription(
+      "Extracts template fields of a record array into columns as csv or raw");
+  columnsEntry->setRequiresOpenFile();
+  columnsEntry->setSafePerFile();
+
   return contrib;
 }
 
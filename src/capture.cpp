@@ -0,0 +1,65 @@
+#include "capture.hpp"
+#include <cstdio>
+#include <mutex>
+
+static thread_local std::string *capturedOutput = nullptr;
+static FILE *consoleOutput = nullptr;
+static FILE *captureStream = nullptr;
+static size_t captureDepth = 0;
+static std::mutex captureLock;
+
+static ssize_t writeCapture(void *, const char *data, size_t size) {
+  if (capturedOutput != nullptr) {
+    capturedOutput->append(data, size);
+  } else {
+    fwrite(data, 1, size, consoleOutput);
+    fflush(consoleOutput);
+  }
+  return size;
+}
+
+#if kUsingCraneDarwin
+static int writeCaptureDarwin(void *cookie, const char *data, int size) {
+  return (int)writeCapture(cookie, data, size);
+}
+#endif
+
+void craneCaptureBegin() {
+  std::lock_guard<std::mutex> guard(captureLock);
+  if (captureDepth++ != 0) {
+    return;
+  }
+
+  fflush(stdout);
+#if kUsingCraneDarwin
+  captureStream = funopen(nullptr, nullptr, writeCaptureDarwin, nullptr, nullptr);
+#else
+  cookie_io_functions_t functions = {nullptr, writeCapture, nullptr, nullptr};
+  captureStream = fopencookie(nullptr, "w", functions);
+#endif
+  if (captureStream == nullptr) {
+    return;
+  }
+
+  // unbuffered, so every write happens on the thread that printed it
+  setvbuf(captureStream, nullptr, _IONBF, 0);
+  consoleOutput = stdout;
+  stdout = captureStream;
+}
+
+void craneCaptureEnd() {
+  std::lock_guard<std::mutex> guard(captureLock);
+  if (--captureDepth != 0 || captureStream == nullptr) {
+    return;
+  }
+
+  stdout = consoleOutput;
+  fclose(captureStream);
+  captureStream = nullptr;
+}
+
+std::string *craneCaptureInto(std::string *output) {
+  std::string *previous = capturedOutput;
+  capturedOutput = output;
+  return previous;
+}
@@ -0,0 +1,237 @@
+#include "jobs.hpp"
+#include "macros.hpp"
+#include "prompt.hpp"
+#include "storage.hpp"
+#include "templates.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+
+static std::string describeCommand(CraneCommand *command) {
+  std::string out;
+
+  for (CraneCommand *stage = command; stage != nullptr; stage = stage->next) {
+    if (stage != command) {
+      out += " | ";
+    }
+
+    out += stage->name;
+    for (auto argument : stage->arguments) {
+      bool needsQuotes = argument->value.find(' ') != std::string_view::npos;
+      out += needsQuotes ? " \"" : " ";
+      out += argument->value;
+      out += needsQuotes ? "\"" : "";
+    }
+  }
+
+  return out;
+}
+
+static CraneContext *forkContext(CraneContext *context) {
+  CraneContext *copy = new CraneContext(*context);
+  copy->isInteractive = false;
+  copy->openedFile = nullptr;
+  copy->pipe = nullptr;
+  copy->recordingMacro = nullptr;
+  // modules loaded from the prompt must not change the registry under the job
+  copy->session = new CraneSession(*context->session);
+  copy->session->fileMap.clear();
+
+  // the prompt can delete or redefine these while the job still reads them
+  for (auto &entry : copy->session->templateMap) {
+    entry.second = new CraneTemplate(*entry.second);
+  }
+  for (auto &entry : copy->session->macroMap) {
+    entry.second = new CraneMacro(*entry.second);
+  }
+
+  for (auto &file : context->session->fileMap) {
+    FILE *handle = fopen(file.second->path.c_str(), "rb");
+    if (handle == nullptr) {
+      continue;
+    }
+
+    CraneOpenFile *openFile = craneNewOpenFile(file.second->path, file.first, handle);
+    copy->session->fileMap[file.first] = openFile;
+    if (context->openedFile == file.second) {
+      copy->openedFile = openFile;
+    }
+  }
+
+  return copy;
+}
+
+static void releaseContext(CraneContext *context) {
+  for (auto &file : context->session->fileMap) {
+    fclose(file.second->handle);
+    craneDeleteOpenFile(file.second);
+  }
+  for (auto &entry : context->session->templateMap) {
+    delete entry.second;
+  }
+  for (auto &entry : context->session->macroMap) {
+    delete entry.second;
+  }
+
+  delete context->session;
+  delete context;
+}
+
+CraneJobPool::CraneJobPool(CraneJobRunner runner)
+  : runner(runner), nextId(1), stopping(false) {
+  if (pipe(notifyPipe) != 0) {
+    notifyPipe[0] = notifyPipe[1] = -1;
+    return;
+  }
+
+  // a full pipe only means there's already a wakeup pending
+  fcntl(notifyPipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(notifyPipe[1], F_SETFL, O_NONBLOCK);
+}
+
+CraneJobPool::~CraneJobPool() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+    for (auto job : jobs) {
+      job->cancel();
+    }
+  }
+
+  queued.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  for (auto job : jobs) {
+    delete job;
+  }
+
+  if (notifyPipe[0] >= 0) {
+    close(notifyPipe[0]);
+    close(notifyPipe[1]);
+  }
+}
+
+CraneJob *CraneJobPool::submit(CraneCommand *command, CraneContext *context) {
+  std::lock_guard<std::mutex> guard(lock);
+
+  CraneJob *job = new CraneJob(nextId++, describeCommand(command));
+  job->command = command;
+  job->context = forkContext(context);
+  job->context->job = job;
+
+  jobs.push_back(job);
+  queue.push_back(job);
+  craneTraceCounter(context, "queued jobs", queue.size());
+
+  // workers are only started once something runs in the background
+  if (workers.empty()) {
+    size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < threadCount; i++) {
+      workers.emplace_back(&CraneJobPool::work, this);
+    }
+  }
+
+  queued.notify_one();
+  return job;
+}
+
+void CraneJobPool::work() {
+  craneNameThread("jobs");
+
+  while (true) {
+    CraneJob *job;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      queued.wait(guard, [this] { return stopping || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+
+      job = queue.front();
+      queue.erase(queue.begin());
+      craneTraceCounter(job->context, "queued jobs", queue.size());
+    }
+
+    job->state.store(CraneJobState::Running);
+    job->result = job->isCancelled() ? -1 : runner(job->command, job->context);
+
+    releaseContext(job->context);
+    delete job->command;
+    job->context = nullptr;
+    job->command = nullptr;
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      job->state.store(CraneJobState::Finished);
+    }
+    finished.notify_all();
+
+    if (notifyPipe[1] >= 0) {
+      char wakeup = 'j';
+      (void)!write(notifyPipe[1], &wakeup, 1);
+    }
+  }
+}
+
+std::vector<CraneJob *> CraneJobPool::snapshot() {
+  std::lock_guard<std::mutex> guard(lock);
+  return jobs;
+}
+
+CraneJob *CraneJobPool::find(u32 id) {
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto job : jobs) {
+    if (job->id == id) {
+      return job;
+    }
+  }
+  return nullptr;
+}
+
+std::vector<CraneJob *> CraneJobPool::collectFinished() {
+  // drain the wakeups, the job list is the source of truth
+  char wakeups[64];
+  while (notifyPipe[0] >= 0 && read(notifyPipe[0], wakeups, sizeof(wakeups)) > 0) {
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  std::vector<CraneJob *> done;
+  auto it = std::stable_partition(jobs.begin(), jobs.end(), [](CraneJob *job) {
+    return job->state.load() != CraneJobState::Finished;
+  });
+  done.assign(it, jobs.end());
+  jobs.erase(it, jobs.end());
+
+  return done;
+}
+
+bool CraneJobPool::wait(CraneJob *job, CraneContext *waiter) {
+  std::unique_lock<std::mutex> guard(lock);
+
+  auto isDone = [this, job] {
+    if (job != nullptr) {
+      return job->state.load() == CraneJobState::Finished;
+    }
+
+    for (auto other : jobs) {
+      if (other->state.load() != CraneJobState::Finished) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // woken periodically to notice Ctrl-C on the waiting command
+  while (!isDone()) {
+    if (craneShouldStop(waiter)) {
+      return false;
+    }
+    finished.wait_for(guard, std::chrono::milliseconds(100));
+  }
+
+  return true;
+}
@@ -10,15 +10,44 @@
  * Loading the library is provided by Crane (AKA Crane Core):
  *
  * load </path/to/contributedLibrary>
+ *
+ * Modules should read the selected file through `context->views` (see "view.hpp")
+ * rather than the file handle, open files and the session keep the rest of their
+ * state behind pointers only the host uses. `crane_version` has to return the
+ * version of the headers the module was built against, modules older than
+ * `kCraneMinimumVersion` or newer than the host aren't loaded.
+ *
+ * Binary structures can be declared with `CraneLayout` (see "layout.hpp", which
+ * is included by "contributions.hpp") to get checked, zero-overhead accessors.
+ *
+ * Commands that want to use more than one thread should use the shared
+ * `context->scheduler` (see "scheduler.hpp") rather than starting their own.
+ *
+ * Every command is timed for `stats`, commands doing their own file I/O should
+ * count it with `craneCountRead`/`craneCountWritten` (see "stats.hpp"). Phases
+ * worth seeing in a `trace` can be marked with `craneTraceSpan` ("trace.hpp").
  */
 
+#include "capture.hpp"
 #include "commands.hpp"
 #include "config.hpp"
 #include "context.hpp"
 #include "contributions.hpp"
+#include "jobs.hpp"
+#include "manifest.hpp"
 #include "prompt.hpp"
+#include "scheduler.hpp"
+#include "server.hpp"
+#include "spans.hpp"
+#include "stats.hpp"
+#include "storage.hpp"
+#include "trace.hpp"
+#include "view.hpp"
+#include <chrono>
+#include <csignal>
 #include <cstring>
 #include <dlfcn.h>
+#include <poll.h>
 #include <readline/readline.h>
 #include <termios.h>
 #include <unistd.h>
@@ -33,104 +62,141 @@ static char *kCraneStagingLocation = (char *)"extern/staging.so";
 #endif
 
 int Crane_load(CraneCommand *command, CraneContext *context);
+int Crane_reload(CraneCommand *command, CraneContext *context);
 int Crane_QMark(CraneCommand *command, CraneContext *context);
 int Crane_help(CraneCommand *command, CraneContext *context);
 int Crane_explain(CraneCommand *command, CraneContext *context);
+int Crane_jobs(CraneCommand *command, CraneContext *context);
+int Crane_wait(CraneCommand *command, CraneContext *context);
+int Crane_cancel(CraneCommand *command, CraneContext *context);
+int Crane_stats(CraneCommand *command, CraneContext *context);
+int Crane_trace(CraneCommand *command, CraneContext *context);
+int Crane_io(CraneCommand *command, CraneContext *context);
+int Crane_group(CraneCommand *command, CraneContext *context);
+int Crane_foreach(CraneCommand *command, CraneContext *context);
+
+int dispatchCommand(CraneCommand *command, CraneContext *context);
+static int openModule(CraneContext *context, const std::string &fileToLoad,
+                      bool refreshManifest);
 
 static CraneContext *context;
+static CraneJobPool *jobPool;
+
+// Ctrl-C cancels the command in the foreground, or discards the line at the prompt
+static std::atomic<CraneJob *> foregroundJob(nullptr);
+static volatile sig_atomic_t interrupted = 0;
+static bool shouldExit = false;
+// set while serving with --serve, Ctrl-C and SIGTERM stop it
+static CraneServer *server = nullptr;
 
 char *commandCompletionEngine(const char *text, int state) {
-  // static int index;
-  // static std::vector<CraneCommandEntry *> commands;
-  // CraneCommandEntry *command;
-
-  // if (state == 0) {
-  //   index = 0;
-  //   commands.clear();
-  //   for (auto &entry : context->commandMap) {
-  //     commands.push_back(entry.second);
-  //   }
-  // }
-
-  // if (strlen(text) == 0) {
-  //   return nullptr;
-  // }
-
-  // while ((command = commands[index++])) {
-  //   if (strncmp(command->name.c_str(), text, strlen(text)) == 0) {
-  //     return strdup(command->name.c_str());
-  //   }
-  // }
-
-  // TODO: Implement this
+  static std::vector<std::pair<std::string, CraneCommandEntry *>> matches;
+  static size_t index;
+
+  if (state == 0) {
+    index = 0;
+    matches = context->session->commandMap.complete(text);
+  }
+
+  if (index < matches.size()) {
+    return strdup(matches[index++].first.c_str());
+  }
+
   return nullptr;
 }
 
 char *argumentCompletionEngine(const char *text, int state) {
-  // static char *opts[] = {(char *)"true", (char *)"false"};
-  // static int index = 0;
-  // char *opt;
+  static const char *opts[] = {"true", "false", nullptr};
+  static int index;
+  const char *opt;
+
+  if (state == 0) {
+    index = 0;
+  }
+
+  while ((opt = opts[index++])) {
+    if (strncmp(opt, text, strlen(text)) == 0) {
+      return strdup(opt);
+    }
+  }
+
+  return nullptr;
+}
 
-  // if (!state)
-  //   index = 0;
+char *fileAliasCompletionEngine(const char *text, int state) {
+  static std::map<std::string, CraneOpenFile *>::iterator it;
+
+  if (state == 0) {
+    it = context->session->fileMap.lower_bound(text);
+  }
 
-  // while ((opt = opts[index++])) {
-  //   if (strncmp(opt, text, strlen(text)) == 0)
-  //     return strdup(opt);
-  // }
+  if (it != context->session->fileMap.end() &&
+      strncmp(it->first.c_str(), text, strlen(text)) == 0) {
+    return strdup((it++)->first.c_str());
+  }
 
-  // TODO: Implement this
   return nullptr;
 }
 
 char **completionGenerator(const char *text, int start, int end) {
   rl_attempted_completion_over = 1;
 
-  CraneCommand *command = CraneCommand::parseCommand(context, text);
+  if (start == 0) {
+    return rl_completion_matches(text, commandCompletionEngine);
+  }
+
+  // everything before the word being completed decides what is expected
+  CraneCommand *command =
+      CraneCommand::parseCommand(context, std::string_view(rl_line_buffer, start));
   if (!command) {
-    free(command);
     return nullptr;
   }
 
-  if (command->arguments.size() == 0) {
-    return rl_completion_matches(text, commandCompletionEngine);
-  } else {
-    CraneCommandEntry *possibleCommand = context->commandMap[command->name];
-    if (!possibleCommand) {
-      return nullptr;
-    }
+  char **matches = nullptr;
+  CraneCommandEntry *possibleCommand = context->session->commandMap.find(command->name);
+  size_t argumentIndex = command->arguments.size();
 
-    if (possibleCommand->argumentCount() <= command->arguments.size()) {
-      return nullptr;
-    }
-
-    if (possibleCommand->arguments[command->arguments.size()]->type ==
-        CraneArgumentType::String) {
+  if (possibleCommand && possibleCommand->argumentCount() > argumentIndex) {
+    CraneArgumentType type = possibleCommand->arguments[argumentIndex]->type;
+    if (type == CraneArgumentType::String) {
       rl_attempted_completion_over = 0; // Re-enable file completion
-    } else if (possibleCommand->arguments[command->arguments.size()]->type ==
-               CraneArgumentType::Boolean) {
-      return rl_completion_matches(text, argumentCompletionEngine);
+    } else if (type == CraneArgumentType::Boolean) {
+      matches = rl_completion_matches(text, argumentCompletionEngine);
+    } else if (type == CraneArgumentType::File) {
+      matches = rl_completion_matches(text, fileAliasCompletionEngine);
     }
-
-    return nullptr;
   }
+
+  delete command;
+  return matches;
 }
 
 void cleanup() {
   // Cleanup Steps
-  if (context->openedFile != NULL)
-    fclose(context->openedFile->handle);
-  for (auto &fileEntry : context->fileMap) {
+  // (background jobs are cancelled first, they may still be reading files)
+  delete jobPool;
+  jobPool = nullptr;
+  delete context->scheduler;
+  context->scheduler = nullptr;
+  delete context->stats;
+  context->stats = nullptr;
+  delete context->tracer;
+  context->tracer = nullptr;
+
+  // (the selected file is also in the file map, so it's closed below)
+  for (auto &fileEntry : context->session->fileMap) {
     fclose(fileEntry.second->handle);
   }
-  for (auto &sharedEntry : context->sharedHandleMap) {
-    dlclose(sharedEntry.second);
+  for (auto &sharedEntry : context->session->sharedHandleMap) {
+    // modules registered from a manifest may never have been opened
+    if (sharedEntry.second != nullptr) {
+      dlclose(sharedEntry.second);
+    }
   }
 
   // NOTE: This caused a segfault (but not during program run but after which is
   // odd).
   // deleteMap(context->dynHandleMap);
-  // free(context->commandMap);
   // free(context);
 }
 
@@ -145,6 +211,254 @@ void printHelp() {
   printf("    --staging [/path/to/staging]   Sets the location of the Staging\n"
          "                                   module and/or loads the staging "
          "module\n");
+  printf("    -c \"<commands>\"                Runs commands separated by ';' or "
+         "newlines\n"
+         "                                   without a prompt, then exits\n");
+  printf("    -f <script|->                  Runs the commands in a script (or "
+         "stdin)\n"
+         "                                   without a prompt, then exits\n");
+  printf("    --serve <socket>               Keeps the session (open files, modules)\n"
+         "                                   resident for clients on a Unix socket,\n"
+         "                                   after running -c or -f\n");
+  printf("    --connect <socket>             Sends -c, -f or typed commands to a\n"
+         "                                   server instead of running them\n");
+  printf("\n");
+  printf("Commands ending with '&' run in the background, see 'jobs', 'wait' and\n"
+         "'cancel'. Ctrl-C cancels the command running in the foreground.\n");
+}
+
+static void handleInterrupt(int) {
+  CraneJob *job = foregroundJob.load();
+  if (job != nullptr) {
+    job->cancel();
+  } else {
+    interrupted = 1;
+  }
+}
+
+static void handleServerSignal(int) {
+  if (server != nullptr) {
+    server->stop();
+  }
+}
+
+static const char *describeJobResult(CraneJob *job) {
+  if (job->isCancelled()) {
+    return "Cancelled";
+  }
+  return job->result == 0 ? "Done" : "Failed";
+}
+
+// returns the result of the first job that failed, if any
+static int reportFinishedJobs(bool atPrompt) {
+  std::vector<CraneJob *> done = jobPool->collectFinished();
+  if (done.empty()) {
+    return 0;
+  }
+
+  if (atPrompt) {
+    rl_clear_visible_line();
+  }
+
+  int result = 0;
+  for (auto job : done) {
+    printf("[%u] %s (%d) %s\n", job->id, describeJobResult(job), job->result,
+           job->description.c_str());
+    if (result == 0 && job->result != 0) {
+      result = job->result;
+    }
+    delete job;
+  }
+
+  if (atPrompt) {
+    rl_forced_update_display();
+  }
+
+  return result;
+}
+
+/**
+ * Runs a parsed line and takes ownership of it. Lines ending with '&' are
+ * queued on the job pool, anything else runs right away with a job of its own
+ * so Ctrl-C can cancel it.
+ */
+static int runLine(CraneCommand *command, CraneContext *context) {
+  if (command->isBackground) {
+    if (context->interfaceMode == CraneInterfaceMode::Edit) {
+      printf("Background jobs can't run in edit mode\n");
+      delete command;
+      return 1;
+    }
+
+    CraneJob *job = jobPool->submit(command, context);
+    printf("[%u] %s\n", job->id, job->description.c_str());
+    return 0;
+  }
+
+  CraneJob job(0, "");
+  context->job = &job;
+  foregroundJob.store(&job);
+
+  int res = dispatchCommand(command, context);
+
+  foregroundJob.store(nullptr);
+  context->job = nullptr;
+  delete command;
+
+  if (job.isCancelled()) {
+    printf("Cancelled\n");
+  }
+
+  return res;
+}
+
+/**
+ * Batch mode: commands are split on unquoted ';' and newlines and dispatched
+ * without readline or prompt generation. Execution stops at the first command
+ * that fails and its result becomes the exit code.
+ */
+static int runBatchCommands(std::string_view commands, bool &shouldExit) {
+  for (auto line : CraneCommand::splitLines(commands)) {
+    CraneCommand *command = CraneCommand::parseCommand(context, line);
+    if (command == nullptr) {
+      context->lastCommandResult = -1;
+      return context->lastCommandResult;
+    }
+
+    if (command->name == "exit") {
+      delete command;
+      shouldExit = true;
+      return 0;
+    }
+
+    context->lastCommandResult = runLine(command, context);
+
+    if (context->lastCommandResult != 0) {
+      return context->lastCommandResult;
+    }
+  }
+
+  return 0;
+}
+
+static int runBatchScript(const char *path) {
+  FILE *input = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (!input) {
+    printf("%serr%s: Failed to open script '%s'\n", kColorRed, kColorReset, path);
+    return 1;
+  }
+
+  static char inputBuffer[1 << 16];
+  setvbuf(input, inputBuffer, _IOFBF, sizeof(inputBuffer));
+
+  char *line = nullptr;
+  size_t capacity = 0;
+  ssize_t length;
+  bool shouldExit = false;
+  int result = 0;
+
+  while (!shouldExit && (length = getline(&line, &capacity, input)) > 0) {
+    result = runBatchCommands(std::string_view(line, length), shouldExit);
+    if (result != 0) {
+      break;
+    }
+  }
+
+  free(line);
+  if (input != stdin) {
+    fclose(input);
+  }
+
+  return result;
+}
+
+// set once a question took readline out of callback mode, see `confirmAtPrompt`
+static bool isPromptSuspended = false;
+
+/**
+ * Commands run from inside the callback readline hands lines to, where a
+ * nested `readline` isn't allowed. The callback is removed for the question and
+ * installed again by `handleLine` once the command is done.
+ */
+static bool confirmAtPrompt(CraneContext *, const char *question) {
+  if (!isPromptSuspended) {
+    rl_callback_handler_remove();
+    isPromptSuspended = true;
+  }
+
+  char *answer = readline(question);
+  bool isConfirmed = answer != nullptr && (answer[0] == 'y' || answer[0] == 'Y');
+  free(answer);
+  return isConfirmed;
+}
+
+static void handleLine(char *line) {
+  CraneCommand *command = CraneCommand::fromLine(context, line);
+
+  if (command != nullptr && command->name == "exit") {
+    delete command;
+    shouldExit = true;
+    rl_callback_handler_remove();
+    return;
+  }
+
+  if (command != nullptr && !command->name.empty()) {
+    context->lastCommandResult = runLine(command, context);
+  } else {
+    delete command;
+  }
+
+  reportFinishedJobs(false);
+  if (isPromptSuspended) {
+    isPromptSuspended = false;
+    rl_callback_handler_install(generatePrompt(context).c_str(), handleLine);
+  } else {
+    rl_set_prompt(generatePrompt(context).c_str());
+  }
+}
+
+/**
+ * The prompt uses readline's callback interface so it can wait on stdin and
+ * on the job pool at the same time, finished jobs are reported as soon as they
+ * are done instead of after the next line.
+ */
+static void runInteractive() {
+  struct sigaction action = {};
+  action.sa_handler = handleInterrupt;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+
+  rl_catch_signals = 0;
+  context->confirm = confirmAtPrompt;
+  rl_callback_handler_install(generatePrompt(context).c_str(), handleLine);
+
+  while (!shouldExit) {
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {jobPool->notifyFd(), POLLIN, 0}};
+    int ready = poll(fds, 2, -1);
+
+    if (interrupted) {
+      interrupted = 0;
+      rl_callback_sigcleanup();
+      rl_replace_line("", 0);
+      rl_crlf();
+      rl_on_new_line();
+      rl_redisplay();
+      continue;
+    }
+
+    if (ready <= 0) {
+      continue;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      reportFinishedJobs(true);
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP)) {
+      rl_callback_read_char();
+    }
+  }
 }
 
 int main(int argc, char **argv) {
@@ -154,28 +468,96 @@ int main(int argc, char **argv) {
   bool noCore = false;
   bool coreOverride = false;
   bool stagingOverride = false;
+  const char *batchCommands = nullptr;
+  const char *batchScript = nullptr;
+  const char *serveSocket = nullptr;
+  const char *connectSocket = nullptr;
   context = new CraneContext();
+  context->session = new CraneSession();
 
   CraneCommandEntry *loadCommand = new CraneCommandEntry("load", Crane_load, false);
   loadCommand->setCommandDescription("Loads a module from a dynamic library");
   loadCommand->addArgument("module", false, CraneArgumentType::String);
-  context->commandMap.emplace("load", loadCommand);
+  context->session->commandMap.insert("load", loadCommand);
+
+  CraneCommandEntry *reloadCommand = new CraneCommandEntry("reload", Crane_reload, false);
+  reloadCommand->setCommandDescription("Reloads a module from disk, keeping open files");
+  reloadCommand->addArgument("module", false, CraneArgumentType::String);
+  context->session->commandMap.insert("reload", reloadCommand);
 
-  context->commandMap.emplace("?", new CraneCommandEntry("?", Crane_QMark, false));
-  context->commandMap["?"]->setCommandDescription(
-      "Prints the result of the last command");
+  CraneCommandEntry *qmarkCommand = new CraneCommandEntry("?", Crane_QMark, false);
+  qmarkCommand->setCommandDescription("Prints the result of the last command");
+  qmarkCommand->setSafePerFile();
+  context->session->commandMap.insert("?", qmarkCommand);
 
   CraneCommandEntry *helpCommand = new CraneCommandEntry("help", Crane_help, true);
   helpCommand->setCommandDescription("Prints help information for commands");
   helpCommand->addArgument("command", true, CraneArgumentType::String);
-  context->commandMap.emplace("help", helpCommand);
+  helpCommand->setSafePerFile();
+  context->session->commandMap.insert("help", helpCommand);
 
   CraneCommandEntry *explainCommand =
       new CraneCommandEntry("explain", Crane_explain, false);
   explainCommand->setCommandDescription("Prints the description of an error");
   explainCommand->addArgument("error", false,
                               CraneArgumentType::String); // E0001, E0002, etc
-  context->commandMap.emplace("explain", explainCommand);
+  explainCommand->setSafePerFile();
+  context->session->commandMap.insert("explain", explainCommand);
+
+  CraneCommandEntry *jobsCommand = new CraneCommandEntry("jobs", Crane_jobs, false);
+  jobsCommand->setCommandDescription("Lists background jobs and their progress");
+  context->session->commandMap.insert("jobs", jobsCommand);
+
+  CraneCommandEntry *waitCommand = new CraneCommandEntry("wait", Crane_wait, false);
+  waitCommand->setCommandDescription("Waits for a background job (or all of them)");
+  waitCommand->addArgument("job", true, CraneArgumentType::Number);
+  context->session->commandMap.insert("wait", waitCommand);
+
+  CraneCommandEntry *cancelCommand = new CraneCommandEntry("cancel", Crane_cancel, false);
+  cancelCommand->setCommandDescription("Cancels a background job, or 'all' of them");
+  cancelCommand->addArgument("job", false, CraneArgumentType::String);
+  context->session->commandMap.insert("cancel", cancelCommand);
+
+  CraneCommandEntry *statsCommand = new CraneCommandEntry("stats", Crane_stats, false);
+  statsCommand->setCommandDescription(
+      "Shows timings and counters per command, 'reset' clears them");
+  statsCommand->addArgument("command", true, CraneArgumentType::String);
+  context->session->commandMap.insert("stats", statsCommand);
+
+  CraneCommandEntry *traceCommand = new CraneCommandEntry("trace", Crane_trace, false);
+  traceCommand->setCommandDescription(
+      "Records a trace ('start', 'stop') and writes it as Chrome JSON ('dump <file>')");
+  traceCommand->addArgument("action", true, CraneArgumentType::String);
+  traceCommand->addArgument("file", true, CraneArgumentType::String);
+  context->session->commandMap.insert("trace", traceCommand);
+
+  CraneCommandEntry *ioCommand = new CraneCommandEntry("io", Crane_io, false);
+  ioCommand->setCommandDescription(
+      "Shows or sets how scans read files ('engine', 'depth', 'block', 'direct')");
+  ioCommand->addArgument("setting", true, CraneArgumentType::String);
+  ioCommand->addArgument("value", true, CraneArgumentType::String);
+  context->session->commandMap.insert("io", ioCommand);
+
+  CraneCommandEntry *groupCommand = new CraneCommandEntry("group", Crane_group, true);
+  groupCommand->setCommandDescription(
+      "Names a set of open files ('add', 'remove', 'delete', 'list') for 'foreach'");
+  groupCommand->addArgument("action", true, CraneArgumentType::String);
+  groupCommand->addArgument("name", true, CraneArgumentType::String);
+  context->session->commandMap.insert("group", groupCommand);
+
+  CraneCommandEntry *foreachCommand =
+      new CraneCommandEntry("foreach", Crane_foreach, true);
+  foreachCommand->setCommandDescription(
+      "Runs a command on every file of a group at once, showing what each printed");
+  foreachCommand->addArgument("group", false, CraneArgumentType::String);
+  foreachCommand->addArgument("command", false, CraneArgumentType::String);
+  context->session->commandMap.insert("foreach", foreachCommand);
+
+  context->scheduler = new CraneScheduler();
+  context->views = craneHostViewApi();
+  context->stats = new CraneStats();
+  context->tracer = new CraneTracer();
+  jobPool = new CraneJobPool(dispatchCommand);
 
   for (int i = 1; i < argc; i++) {
     if (std::string(argv[i]) == "--no-core") {
@@ -194,8 +576,8 @@ int main(int argc, char **argv) {
         return 1;
       }
 
-      int result = loadCommand->handler(
-          new CraneCommand("load", {new CraneArgument(kCraneStagingLocation)}), context);
+      CraneCommand loadModule("load", {kCraneStagingLocation});
+      int result = loadCommand->handler(&loadModule, context);
       if (result != 0) {
         printf("%serr%s: Staging library not found in '%s'\n", kColorRed, kColorReset,
                kCraneStagingLocation);
@@ -217,14 +599,47 @@ int main(int argc, char **argv) {
         return 1;
       }
 
-      int result = loadCommand->handler(
-          new CraneCommand("load", {new CraneArgument(kCraneCoreLocation)}), context);
+      CraneCommand loadModule("load", {kCraneCoreLocation});
+      int result = loadCommand->handler(&loadModule, context);
       if (result != 0) {
         printf("%serr%s: Core library not found in '%s'\n", kColorRed, kColorReset,
                kCraneCoreLocation);
         return 1;
       }
       coreOverride = true; // avoid loading the core module again
+    } else if (std::string(argv[i]) == "-c" || std::string(argv[i]) == "-f") {
+      if (batchCommands || batchScript) {
+        printf("Error: only one of -c or -f can be used\n");
+        return 1;
+      }
+
+      if (i + 1 >= argc) {
+        printf("Error: %s requires an argument\n", argv[i]);
+        return 1;
+      }
+
+      if (argv[i][1] == 'c') {
+        batchCommands = argv[++i];
+      } else {
+        batchScript = argv[++i];
+      }
+    } else if (std::string(argv[i]) == "--serve" ||
+               std::string(argv[i]) == "--connect") {
+      if (serveSocket || connectSocket) {
+        printf("Error: only one of --serve or --connect can be used\n");
+        return 1;
+      }
+
+      if (i + 1 >= argc) {
+        printf("Error: %s requires a socket path\n", argv[i]);
+        return 1;
+      }
+
+      if (argv[i][2] == 's') {
+        serveSocket = argv[++i];
+      } else {
+        connectSocket = argv[++i];
+      }
     } else if (std::string(argv[i]) == "--help") {
       printHelp();
       return 0;
@@ -234,117 +649,281 @@ int main(int argc, char **argv) {
     }
   }
 
+  // the client runs nothing itself, the server has the modules
+  if (connectSocket) {
+    return craneConnect(connectSocket, batchCommands, batchScript);
+  }
+
   if (!noCore && !coreOverride) {
-    loadCommand->handler(new CraneCommand("load", {new CraneArgument("Core")}), context);
+    CraneCommand loadCore("load", {"Core"});
+    loadCommand->handler(&loadCore, context);
   }
 
-  while (true) {
-    CraneCommand *command = CraneCommand::fromUser(context);
+  if (serveSocket) {
+    context->isInteractive = false;
 
-    if (command == nullptr) {
-      continue;
+    // -c and -f set the session up first, opening the files to keep resident
+    int result = 0;
+    if (batchCommands || batchScript) {
+      result = batchCommands ? runBatchCommands(batchCommands, shouldExit)
+                             : runBatchScript(batchScript);
+      jobPool->wait(nullptr, context);
+      result = result != 0 ? result : reportFinishedJobs(false);
     }
-
-    if (command->name == "exit") {
-      break;
+    if (result != 0 || shouldExit) {
+      return result;
     }
 
-    auto cmdRes = context->commandMap.find(command->name);
-    if (cmdRes == context->commandMap.end()) {
-      context->lastCommandResult = -1;
-      printf("%serr%s: Command '%s' not found (E0001)\n", kColorRed, kColorReset,
-             command->name.c_str());
-      continue;
+    server = new CraneServer(context, dispatchCommand);
+
+    struct sigaction action = {};
+    action.sa_handler = handleServerSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    result = server->serve(serveSocket);
+    delete server;
+    server = nullptr;
+    return result;
+  }
+
+  if (batchCommands || batchScript) {
+    context->isInteractive = false;
+
+    int result = batchCommands ? runBatchCommands(batchCommands, shouldExit)
+                               : runBatchScript(batchScript);
+
+    // scripts finish their background jobs before exiting
+    jobPool->wait(nullptr, context);
+    int jobResult = reportFinishedJobs(false);
+    return result != 0 ? result : jobResult;
+  }
+
+  runInteractive();
+
+  return 0;
+}
+
+static int runCommand(CraneCommand *command, CraneContext *context) {
+  CraneCommandEntry *cmd = context->session->commandMap.find(command->name);
+  if (cmd == nullptr) {
+    printf("%serr%s: Command '%s' not found (E0001)\n", kColorRed, kColorReset,
+           command->name.data());
+    return -1;
+  }
+
+  if (cmd->handler == nullptr && !cmd->module.empty()) {
+    std::string module = cmd->module;
+    if (openModule(context, module, false) != 0) {
+      return -1;
     }
 
-    CraneCommandEntry *cmd = cmdRes->second;
+    cmd = context->session->commandMap.find(command->name);
+    if (cmd == nullptr || cmd->handler == nullptr) {
+      printf("%serr%s: The module '%s' no longer provides '%s' (E0004)\n", kColorRed,
+             kColorReset, module.c_str(), command->name.data());
+      return -1;
+    }
+  }
 
-    if (cmd->isVariadic) {
+  if (cmd->isVariadic) {
+    if (command->arguments.size() < cmd->adjustedArgumentCount()) {
+      printf("%serr%s: Too few arguments for command '%s' (E0002)\n", kColorRed,
+             kColorReset, command->name.data());
+      return -1;
+    }
+  } else {
+    if (cmd->hasOptionalArgs()) {
       if (command->arguments.size() < cmd->adjustedArgumentCount()) {
-        context->lastCommandResult = -1;
         printf("%serr%s: Too few arguments for command '%s' (E0002)\n", kColorRed,
-               kColorReset, command->name.c_str());
-        continue;
+               kColorReset, command->name.data());
+        return -1;
+      } else if (command->arguments.size() > cmd->argumentCount()) {
+        printf("%serr%s: Too many arguments for command '%s' (E0002)\n", kColorRed,
+               kColorReset, command->name.data());
+        return -1;
       }
     } else {
-      if (cmd->hasOptionalArgs()) {
-        if (command->arguments.size() < cmd->adjustedArgumentCount()) {
-          context->lastCommandResult = -1;
-          printf("%serr%s: Too few arguments for command '%s' (E0002)\n", kColorRed,
-                 kColorReset, command->name.c_str());
-          continue;
-        } else if (command->arguments.size() > cmd->argumentCount()) {
-          context->lastCommandResult = -1;
-          printf("%serr%s: Too many arguments for command '%s' (E0002)\n", kColorRed,
-                 kColorReset, command->name.c_str());
-          continue;
-        }
-      } else {
-        if (command->arguments.size() != cmd->argumentCount()) {
-          context->lastCommandResult = -1;
-          printf("%serr%s: Invalid number of arguments for command '%s' (E0002)\n",
-                 kColorRed, kColorReset, command->name.c_str());
-          continue;
-        }
+      if (command->arguments.size() != cmd->argumentCount()) {
+        printf("%serr%s: Invalid number of arguments for command '%s' (E0002)\n",
+               kColorRed, kColorReset, command->name.data());
+        return -1;
       }
     }
+  }
 
-    if (cmd->requiresOpenFile && !context->openedFile) {
-      context->lastCommandResult = -1;
-      printf("%serr%s: No file open (E0006)\n", kColorRed, kColorReset);
-      continue;
-    }
+  if (cmd->requiresOpenFile && !context->openedFile) {
+    printf("%serr%s: No file open (E0006)\n", kColorRed, kColorReset);
+    return -1;
+  }
 
+  if (context->isInteractive) {
     printf("\n");
-    int res = cmd->handler(command, context);
-    context->lastCommandResult = res;
+  }
 
-    if (res != 0) {
-      // TODO: add error messages
-      // printf("%serr%s: some error occurred with: '%s'\n", kColorRed,
-      // kColorReset, command->name.c_str());
-    }
+  craneTraceSpan(context, cmd->name.c_str());
+  CraneStatsProbe probe(context);
+  int res = cmd->handler(command, context);
+  probe.finish(context, cmd->name, res);
+
+  if (res != 0) {
+    // TODO: add error messages
+    // printf("%serr%s: some error occurred with: '%s'\n", kColorRed,
+    // kColorReset, command->name.c_str());
+  }
 
+  if (context->isInteractive) {
     printf("\n");
   }
 
-  return 0;
+  return res;
 }
 
-int Crane_load(CraneCommand *command, CraneContext *context) {
-  std::string fileToLoad = command->arguments[0]->value;
+#define kPipeSummarySpans 16
+
+int dispatchCommand(CraneCommand *command, CraneContext *context) {
+  // every stage after the first has to be able to consume spans
+  for (CraneCommand *stage = command->next; stage != nullptr; stage = stage->next) {
+    CraneCommandEntry *cmd = context->session->commandMap.find(stage->name);
+    if (cmd != nullptr && !cmd->acceptsInput) {
+      printf("%serr%s: Command '%s' can't take input from a pipe (E0007)\n", kColorRed,
+             kColorReset, stage->name.data());
+      return -1;
+    }
+  }
+
+  CranePipe pipe;
+  context->pipe = &pipe;
+
+  int res = 0;
+  for (CraneCommand *stage = command; stage != nullptr && res == 0; stage = stage->next) {
+    if (stage != command) {
+      pipe.advance();
+    }
 
-  if (fileToLoad == "Core") {
-    fileToLoad = kCraneCoreLocation;
-  } else if (fileToLoad == "Staging") {
-    fileToLoad = kCraneStagingLocation;
+    res = runCommand(stage, context);
   }
 
-  if (access(fileToLoad.c_str(), R_OK) != 0) {
-    printf("%serr%s: The module '%s' doesn't exist. (E0003)\n", kColorRed, kColorReset,
-           fileToLoad.c_str());
-    return 1;
+  // spans left over at the end of the line are summarised
+  if (res == 0 && !pipe.output.empty()) {
+    size_t total = 0;
+    for (auto &span : pipe.output) {
+      total += span.size;
+    }
+
+    printf("%zu span%s, %zu bytes:\n", pipe.output.size(),
+           pipe.output.size() == 1 ? "" : "s", total);
+    for (size_t i = 0; i < pipe.output.size() && i < kPipeSummarySpans; i++) {
+      printf("  %08llX +%zu\n", pipe.output[i].offset, pipe.output[i].size);
+    }
+    if (pipe.output.size() > kPipeSummarySpans) {
+      printf("  ...\n");
+    }
   }
 
-  if (context->sharedHandleMap.find(fileToLoad) != context->sharedHandleMap.end()) {
-    printf("%swarn%s: The module '%s' has already been loaded! (W0001)\n", kColorYellow,
-           kColorReset, command->arguments[0]->value.c_str());
+  context->pipe = nullptr;
+  return res;
+}
 
-    // Despite this being an "error", the file was loaded
-    // successfully so there is no need to emit an error.
-    return 0;
+/**
+ * Registers a command provided by `module`. A command that something else
+ * already provides is only replaced when the entry asks to override it, the
+ * replaced entry is kept in `overridenEntry` and restored if the module's
+ * version of the command goes away.
+ *
+ * Stubs and older copies of the module's own commands are replaced where they
+ * are, even when another module's override hides them.
+ */
+static void registerModuleEntry(CraneContext *context, const std::string &module,
+                                CraneCommandEntry *entry) {
+  entry->module = module;
+
+  CraneCommandEntry *previous = context->session->commandMap.find(entry->name);
+  if (previous != nullptr && previous->module == module) {
+    entry->overridenEntry = previous->overridenEntry;
+    context->session->commandMap.insert(entry->name, entry);
+    return;
+  }
+
+  for (CraneCommandEntry *above = previous; above != nullptr;
+       above = above->overridenEntry) {
+    CraneCommandEntry *below = above->overridenEntry;
+    if (below != nullptr && below->module == module) {
+      entry->overridenEntry = below->overridenEntry;
+      above->overridenEntry = entry;
+      return;
+    }
+  }
+
+  if (previous != nullptr) {
+    if (!entry->shouldOverride) {
+      printf("%swarn%s: '%s' from '%s' is already provided, it wasn't loaded (W0004)\n",
+             kColorYellow, kColorReset, entry->name.c_str(), module.c_str());
+      return;
+    }
+
+    entry->overridenEntry = previous;
+  }
+
+  context->session->commandMap.insert(entry->name, entry);
+}
+
+// turns every command of `module` back into a stub, before its code is unloaded
+static void stubModuleEntries(CraneContext *context, const std::string &module) {
+  for (auto &registered : context->session->commandMap.entries()) {
+    for (CraneCommandEntry *entry = registered.second; entry != nullptr;
+         entry = entry->overridenEntry) {
+      if (entry->module == module) {
+        entry->handler = nullptr;
+      }
+    }
+  }
+}
+
+// removes the stubs of `module` that it no longer provides, restoring whatever
+// they overrode
+static void dropModuleStubs(CraneContext *context, const std::string &module) {
+  auto isStub = [&module](CraneCommandEntry *entry) {
+    return entry->handler == nullptr && entry->module == module;
+  };
+
+  for (auto &registered : context->session->commandMap.entries()) {
+    CraneCommandEntry *top = registered.second;
+    for (CraneCommandEntry *above = top; above->overridenEntry != nullptr;) {
+      CraneCommandEntry *below = above->overridenEntry;
+      if (isStub(below)) {
+        above->overridenEntry = below->overridenEntry;
+      } else {
+        above = below;
+      }
+    }
+
+    if (isStub(top)) {
+      if (top->overridenEntry != nullptr) {
+        context->session->commandMap.insert(registered.first, top->overridenEntry);
+      } else {
+        context->session->commandMap.erase(registered.first);
+      }
+    }
   }
+}
 
+/**
+ * Opens a module and registers its commands, replacing any stubs registered
+ * from its manifest (stubs are left allocated, a job's copy of the registry
+ * may still point at them).
+ */
+static int openModule(CraneContext *context, const std::string &fileToLoad,
+                      bool refreshManifest) {
+  craneTraceSpan(context, "open module");
   void *handle = dlopen(fileToLoad.c_str(), RTLD_NOW | RTLD_GLOBAL);
   if (!handle) {
     printf("%serr%s: Failed to open the module. (E0003)\n%s\n", kColorRed, kColorReset,
            dlerror());
-    dlclose(handle);
     return 1;
   }
 
-  context->sharedHandleMap.emplace(fileToLoad, handle);
-
   CraneContributionInitialiser init =
       (CraneContributionInitialiser)dlsym(handle, "crane_init");
   CraneContributionVersion version =
@@ -364,7 +943,8 @@ int Crane_load(CraneCommand *command, CraneContext *context) {
     return 1;
   }
 
-  if (version() != kCraneVersion) {
+  // the structures modules share with the host change between versions
+  if (version() < kCraneMinimumVersion || version() > kCraneVersion) {
     printf("%serr%s: The module '%s' is incompatible with this version of "
            "Crane. (E0005)\n",
            kColorRed, kColorReset, fileToLoad.c_str());
@@ -372,44 +952,145 @@ int Crane_load(CraneCommand *command, CraneContext *context) {
     return 1;
   }
 
+  context->session->sharedHandleMap[fileToLoad] = handle;
+
   CraneContributedCommands *contrib = init();
   for (int i = 0; i < contrib->contributedCommands.size(); i++) {
     if (contrib->contributedCommands[i] == NULL)
       continue;
 
-    context->commandMap[contrib->contributedCommands[i]->name] =
-        contrib->contributedCommands[i];
+    registerModuleEntry(context, fileToLoad, contrib->contributedCommands[i]);
+  }
+
+  if (refreshManifest) {
+    craneWriteManifest(fileToLoad, version(), contrib->contributedCommands);
   }
 
   return 0;
 }
 
-int Crane_QMark(CraneCommand *command, CraneContext *context) {
-  printf("%d - %s%s%s\n", context->lastCommandResult,
-         context->lastCommandResult == 0 ? kColorGreen : kColorRed,
-         context->lastCommandResult == 0 ? "Successful" : "Failed", kColorReset);
+static std::string modulePath(std::string_view name) {
+  if (name == "Core") {
+    return kCraneCoreLocation;
+  } else if (name == "Staging") {
+    return kCraneStagingLocation;
+  }
 
-  return 0;
+  return std::string(name);
 }
 
-int Crane_help(CraneCommand *command, CraneContext *context) {
-  if (command->arguments.size() == 0) {
-    printf("All available commands:\n");
-    for (auto &cmd : context->commandMap) {
-      printf("  %s%s%s -- %s\n", kColorBlue, cmd.second->name.c_str(), kColorReset,
-             cmd.second->description.c_str());
-    }
+int Crane_load(CraneCommand *command, CraneContext *context) {
+  std::string fileToLoad = modulePath(command->arguments[0]->value);
+
+  if (access(fileToLoad.c_str(), R_OK) != 0) {
+    printf("%serr%s: The module '%s' doesn't exist. (E0003)\n", kColorRed, kColorReset,
+           fileToLoad.c_str());
+    return 1;
+  }
+
+  if (context->session->sharedHandleMap.count(fileToLoad) != 0) {
+    printf("%swarn%s: The module '%s' has already been loaded! (W0001)\n", kColorYellow,
+           kColorReset, command->arguments[0]->value.data());
+
+    // Despite this being an "error", the file was loaded
+    // successfully so there is no need to emit an error.
     return 0;
   }
 
-  auto cmdRes = context->commandMap.find(command->arguments[0]->value);
-  if (cmdRes == context->commandMap.end()) {
-    printf("%serr%s: Command '%s' not found\n", kColorRed, kColorReset,
-           command->arguments[0]->value.c_str());
+  // with an up to date manifest only stubs are registered, the module is
+  // opened the first time one of its commands runs (see runCommand)
+  std::vector<CraneCommandEntry *> stubs;
+  if (craneReadManifest(fileToLoad, stubs)) {
+    for (auto stub : stubs) {
+      registerModuleEntry(context, fileToLoad, stub);
+    }
+    context->session->sharedHandleMap.emplace(fileToLoad, nullptr);
+    return 0;
+  }
+
+  return openModule(context, fileToLoad, true);
+}
+
+/**
+ * Swaps a loaded module for the version on disk without touching the rest of
+ * the session: open files, edit buffers, macros and the mode are all kept.
+ *
+ * The module's commands become stubs while its code is unloaded. If the new
+ * version fails to open they stay that way and try again when they're used,
+ * otherwise the commands it no longer provides are removed.
+ */
+int Crane_reload(CraneCommand *command, CraneContext *context) {
+  std::string fileToLoad = modulePath(command->arguments[0]->value);
+
+  auto loaded = context->session->sharedHandleMap.find(fileToLoad);
+  if (loaded == context->session->sharedHandleMap.end()) {
+    printf("%serr%s: The module '%s' isn't loaded, use 'load' instead. (E0003)\n",
+           kColorRed, kColorReset, fileToLoad.c_str());
     return 1;
   }
 
-  CraneCommandEntry *cmd = cmdRes->second;
+  // background jobs may be running the module's code
+  for (auto job : jobPool->snapshot()) {
+    if (job->state.load() != CraneJobState::Finished) {
+      printf("%serr%s: Background jobs are still running, wait for them or cancel "
+             "them first. (E0008)\n",
+             kColorRed, kColorReset);
+      return 1;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  stubModuleEntries(context, fileToLoad);
+
+  if (loaded->second != nullptr) {
+    dlclose(loaded->second);
+    loaded->second = nullptr;
+
+    void *resident = dlopen(fileToLoad.c_str(), RTLD_NOW | RTLD_NOLOAD);
+    if (resident != nullptr) {
+      dlclose(resident);
+      printf("%swarn%s: The module '%s' couldn't be unloaded, its old code is still "
+             "in use. (W0005)\n",
+             kColorYellow, kColorReset, fileToLoad.c_str());
+    }
+  }
+
+  if (openModule(context, fileToLoad, true) != 0) {
+    return 1;
+  }
+  dropModuleStubs(context, fileToLoad);
+
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("Reloaded '%s' in %.1fms\n", fileToLoad.c_str(), elapsed.count());
+  return 0;
+}
+
+int Crane_QMark(CraneCommand *command, CraneContext *context) {
+  printf("%d - %s%s%s\n", context->lastCommandResult,
+         context->lastCommandResult == 0 ? kColorGreen : kColorRed,
+         context->lastCommandResult == 0 ? "Successful" : "Failed", kColorReset);
+
+  return 0;
+}
+
+int Crane_help(CraneCommand *command, CraneContext *context) {
+  if (command->arguments.size() == 0) {
+    printf("All available commands:\n");
+    for (auto &cmd : context->session->commandMap.entries()) {
+      printf("  %s%s%s -- %s\n", kColorBlue, cmd.second->name.c_str(), kColorReset,
+             cmd.second->description.c_str());
+    }
+    return 0;
+  }
+
+  CraneCommandEntry *cmd =
+      context->session->commandMap.find(command->arguments[0]->value);
+  if (cmd == nullptr) {
+    printf("%serr%s: Command '%s' not found\n", kColorRed, kColorReset,
+           command->arguments[0]->value.data());
+    return 1;
+  }
 
   printf("%sName: %s%s\n\n", kColorBold, kColorReset, cmd->name.c_str());
   printf("%sDescription: %s\n%s\n\n", kColorBold, kColorReset, cmd->description.c_str());
@@ -424,6 +1105,589 @@ int Crane_help(CraneCommand *command, CraneContext *context) {
   return 0;
 }
 
+int Crane_jobs(CraneCommand *command, CraneContext *context) {
+  std::vector<CraneJob *> jobs = jobPool->snapshot();
+  if (jobs.empty()) {
+    printf("No background jobs\n");
+    return 0;
+  }
+
+  for (auto job : jobs) {
+    CraneJobState state = job->state.load();
+    printf("[%u] ", job->id);
+
+    if (state == CraneJobState::Queued) {
+      printf("Queued    ");
+    } else if (state == CraneJobState::Running) {
+      u64 total = job->progressTotal.load();
+      if (total != 0) {
+        printf("Running %3llu%% ", job->progressDone.load() * 100 / total);
+      } else {
+        printf("Running   ");
+      }
+    } else {
+      printf("%s (%d) ", describeJobResult(job), job->result);
+    }
+
+    printf("%s%s\n", job->description.c_str(),
+           job->isCancelled() && state != CraneJobState::Finished ? " (cancelling)" : "");
+  }
+
+  return 0;
+}
+
+int Crane_wait(CraneCommand *command, CraneContext *context) {
+  CraneJob *job = nullptr;
+  if (command->arguments.size() > 0) {
+    u32 id = strtoul(command->arguments[0]->value.data(), nullptr, 10);
+    job = jobPool->find(id);
+    if (job == nullptr) {
+      printf("No job [%u]\n", id);
+      return 1;
+    }
+  }
+
+  if (!jobPool->wait(job, context)) {
+    return 1;
+  }
+
+  return reportFinishedJobs(false);
+}
+
+int Crane_cancel(CraneCommand *command, CraneContext *context) {
+  std::string target(command->arguments[0]->value);
+
+  if (target == "all") {
+    for (auto job : jobPool->snapshot()) {
+      job->cancel();
+    }
+    return 0;
+  }
+
+  u32 id = strtoul(target.c_str(), nullptr, 10);
+  CraneJob *job = jobPool->find(id);
+  if (job == nullptr) {
+    printf("No job [%s]\n", target.c_str());
+    return 1;
+  }
+
+  job->cancel();
+  printf("Cancelling [%u] %s\n", job->id, job->description.c_str());
+  return 0;
+}
+
+static std::string formatNanoseconds(u64 nanoseconds) {
+  char out[32];
+  if (nanoseconds < 1000) {
+    snprintf(out, sizeof(out), "%lluns", nanoseconds);
+  } else if (nanoseconds < 1000000) {
+    snprintf(out, sizeof(out), "%.1fus", nanoseconds / 1e3);
+  } else if (nanoseconds < 1000000000) {
+    snprintf(out, sizeof(out), "%.1fms", nanoseconds / 1e6);
+  } else {
+    snprintf(out, sizeof(out), "%.2fs", nanoseconds / 1e9);
+  }
+  return out;
+}
+
+static std::string formatBytes(u64 bytes) {
+  static const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+  double value = bytes;
+  size_t unit = 0;
+  while (value >= 1024 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+    value /= 1024;
+    unit++;
+  }
+
+  char out[32];
+  snprintf(out, sizeof(out), unit == 0 ? "%.0f%s" : "%.1f%s", value, units[unit]);
+  return out;
+}
+
+static void printCommandStats(const std::string &name, const CraneCommandStats &stats) {
+  printf("%s%s%s: %llu call%s, %llu failed\n", kColorBold, name.c_str(), kColorReset,
+         stats.calls, stats.calls == 1 ? "" : "s", stats.failures);
+  printf("  wall     total %s, mean %s, p50 %s, p90 %s, p99 %s, max %s\n",
+         formatNanoseconds(stats.wallNanoseconds).c_str(),
+         formatNanoseconds(stats.wallNanoseconds / stats.calls).c_str(),
+         formatNanoseconds(stats.percentile(0.5)).c_str(),
+         formatNanoseconds(stats.percentile(0.9)).c_str(),
+         formatNanoseconds(stats.percentile(0.99)).c_str(),
+         formatNanoseconds(stats.maxWallNanoseconds).c_str());
+  printf("  cpu      total %s, mean %s\n", formatNanoseconds(stats.cpuNanoseconds).c_str(),
+         formatNanoseconds(stats.cpuNanoseconds / stats.calls).c_str());
+  printf("  read     %s\n", formatBytes(stats.bytesRead).c_str());
+  printf("  written  %s\n", formatBytes(stats.bytesWritten).c_str());
+  printf("  allocs   %llu (%s)\n", stats.allocations,
+         formatBytes(stats.allocatedBytes).c_str());
+
+  u64 peak = *std::max_element(stats.histogram, stats.histogram + kStatsBuckets);
+  printf("\n");
+  for (size_t bucket = 0; bucket < kStatsBuckets; bucket++) {
+    if (stats.histogram[bucket] == 0) {
+      continue;
+    }
+
+    size_t width = (stats.histogram[bucket] * 40 + peak - 1) / peak;
+    printf("  >= %9s  %s %llu\n",
+           formatNanoseconds(CraneCommandStats::bucketStart(bucket)).c_str(),
+           std::string(width, '#').c_str(), stats.histogram[bucket]);
+  }
+}
+
+int Crane_stats(CraneCommand *command, CraneContext *context) {
+  std::string target =
+      command->arguments.size() > 0 ? std::string(command->arguments[0]->value) : "";
+
+  if (target == "reset") {
+    context->stats->reset();
+    printf("Statistics cleared\n");
+    return 0;
+  }
+
+  auto commands = context->stats->snapshot();
+  if (!target.empty()) {
+    for (auto &entry : commands) {
+      if (entry.first == target) {
+        printCommandStats(entry.first, entry.second);
+        return 0;
+      }
+    }
+
+    printf("No statistics for '%s'\n", target.c_str());
+    return 1;
+  }
+
+  if (commands.empty()) {
+    printf("No commands have run yet\n");
+    return 0;
+  }
+
+  // where the time went comes first
+  std::sort(commands.begin(), commands.end(), [](auto &a, auto &b) {
+    return a.second.wallNanoseconds > b.second.wallNanoseconds;
+  });
+
+  printf("%s%-12s %7s %6s %9s %9s %9s %9s %9s %9s %9s %8s%s\n", kColorBold, "command",
+         "calls", "failed", "total", "p50", "p99", "max", "cpu", "read", "written",
+         "allocs", kColorReset);
+  for (auto &entry : commands) {
+    const CraneCommandStats &stats = entry.second;
+    printf("%-12s %7llu %6llu %9s %9s %9s %9s %9s %9s %9s %8llu\n", entry.first.c_str(),
+           stats.calls, stats.failures, formatNanoseconds(stats.wallNanoseconds).c_str(),
+           formatNanoseconds(stats.percentile(0.5)).c_str(),
+           formatNanoseconds(stats.percentile(0.99)).c_str(),
+           formatNanoseconds(stats.maxWallNanoseconds).c_str(),
+           formatNanoseconds(stats.cpuNanoseconds).c_str(),
+           formatBytes(stats.bytesRead).c_str(), formatBytes(stats.bytesWritten).c_str(),
+           stats.allocations);
+  }
+
+  return 0;
+}
+
+int Crane_trace(CraneCommand *command, CraneContext *context) {
+  CraneTracer *tracer = context->tracer;
+  std::string action =
+      command->arguments.size() > 0 ? std::string(command->arguments[0]->value) : "";
+
+  if (action.empty()) {
+    printf("Tracing is %s\n", tracer->isEnabled.load() ? "on" : "off");
+    return 0;
+  }
+
+  if (action == "start") {
+    tracer->startedAt.store(tracer->now());
+    tracer->isEnabled.store(true);
+    printf("Tracing started, 'trace dump <file>' writes what was recorded\n");
+    return 0;
+  }
+
+  if (action == "stop") {
+    tracer->isEnabled.store(false);
+    printf("Tracing stopped\n");
+    return 0;
+  }
+
+  if (action != "dump") {
+    printf("Unknown action '%s' (expected start, stop or dump)\n", action.c_str());
+    return 1;
+  }
+
+  if (command->arguments.size() < 2) {
+    printf("'trace dump' needs a file to write to\n");
+    return 1;
+  }
+
+  std::string path(command->arguments[1]->value);
+  FILE *out = fopen(path.c_str(), "w");
+  if (out == nullptr) {
+    printf("Failed to open file '%s'\n", path.c_str());
+    return 1;
+  }
+
+  u64 eventCount;
+  bool written = tracer->dump(out, &eventCount);
+  written = fclose(out) == 0 && written;
+  if (!written) {
+    printf("Failed to write file '%s'\n", path.c_str());
+    return 1;
+  }
+
+  printf("Wrote %llu events to '%s'\n", eventCount, path.c_str());
+  return 0;
+}
+
+static const char *readEngineName(CraneReadEngine engine) {
+  if (engine == CraneReadEngine::Uring) {
+    return "uring";
+  } else if (engine == CraneReadEngine::Threads) {
+    return "threads";
+  } else if (engine == CraneReadEngine::Mapped) {
+    return "mmap";
+  }
+  return "auto";
+}
+
+int Crane_io(CraneCommand *command, CraneContext *context) {
+  CraneReadOptions &options = context->session->readOptions;
+  std::string setting =
+      command->arguments.size() > 0 ? std::string(command->arguments[0]->value) : "";
+
+  if (setting.empty()) {
+    printf("engine  %s\n", readEngineName(options.engine));
+    printf("depth   %u reads in flight\n", options.queueDepth);
+    printf("block   %s\n", formatBytes(options.blockSize).c_str());
+    printf("direct  %s\n", options.isDirect ? "on" : "off");
+    return 0;
+  }
+
+  if (command->arguments.size() < 2) {
+    printf("'io %s' needs a value\n", setting.c_str());
+    return 1;
+  }
+
+  std::string value(command->arguments[1]->value);
+  if (setting == "engine") {
+    if (value == "auto") {
+      options.engine = CraneReadEngine::Auto;
+    } else if (value == "uring") {
+      options.engine = CraneReadEngine::Uring;
+    } else if (value == "threads") {
+      options.engine = CraneReadEngine::Threads;
+    } else if (value == "mmap") {
+      options.engine = CraneReadEngine::Mapped;
+    } else {
+      printf("Unknown engine '%s' (expected auto, uring, threads or mmap)\n",
+             value.c_str());
+      return 1;
+    }
+  } else if (setting == "depth") {
+    unsigned long depth = strtoul(value.c_str(), nullptr, 0);
+    if (depth == 0 || depth > 4096) {
+      printf("Invalid depth '%s' (1 to 4096)\n", value.c_str());
+      return 1;
+    }
+    options.queueDepth = depth;
+  } else if (setting == "block") {
+    // sizes can be given in KiB or MiB, reads are whole device blocks
+    char *suffix;
+    unsigned long long size = strtoull(value.c_str(), &suffix, 0);
+    if (*suffix == 'K' || *suffix == 'k') {
+      size <<= 10;
+    } else if (*suffix == 'M' || *suffix == 'm') {
+      size <<= 20;
+    }
+
+    if (size < kReadStreamAlignment || size > kReadStreamMaxBlockSize ||
+        size % kReadStreamAlignment != 0) {
+      printf("Invalid block size '%s' (4K to 64M, in 4K steps)\n", value.c_str());
+      return 1;
+    }
+    options.blockSize = size;
+  } else if (setting == "direct") {
+    if (value != "on" && value != "off") {
+      printf("Expected 'on' or 'off' for 'direct', got '%s'\n", value.c_str());
+      return 1;
+    }
+    options.isDirect = value == "on";
+  } else {
+    printf("Unknown setting '%s' (expected engine, depth, block or direct)\n",
+           setting.c_str());
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Groups name sets of open files for `foreach`. They hold aliases, a file that
+ * is closed stays in its groups and is reported as not open when it's run on.
+ */
+int Crane_group(CraneCommand *command, CraneContext *context) {
+  std::string action =
+      command->arguments.size() > 0 ? std::string(command->arguments[0]->value) : "list";
+
+  if (action == "list") {
+    if (context->session->groupMap.empty()) {
+      printf("No groups\n");
+      return 0;
+    }
+
+    printf("All Groups:\n");
+    for (auto &group : context->session->groupMap) {
+      printf("  %s (%zu files):", group.first.c_str(), group.second.size());
+      for (auto &alias : group.second) {
+        printf(" %s", alias.c_str());
+      }
+      printf("\n");
+    }
+    return 0;
+  }
+
+  if (command->arguments.size() < 2) {
+    printf("Usage: group <add|remove> <name> <files...>, group delete <name> or "
+           "group list\n");
+    return 1;
+  }
+
+  std::string name(command->arguments[1]->value);
+  if (action == "delete") {
+    if (context->session->groupMap.erase(name) == 0) {
+      printf("Group '%s' not found\n", name.c_str());
+      return 1;
+    }
+    printf("Deleted group '%s'\n", name.c_str());
+    return 0;
+  }
+
+  if (action != "add" && action != "remove") {
+    printf("Unknown group action '%s'\n", action.c_str());
+    return 1;
+  }
+
+  if (command->arguments.size() < 3) {
+    printf("Give the files to %s, by alias\n", action.c_str());
+    return 1;
+  }
+
+  int result = 0;
+  std::vector<std::string> members = context->session->groupMap[name];
+  for (size_t i = 2; i < command->arguments.size(); i++) {
+    std::string alias(command->arguments[i]->value);
+    auto position = std::find(members.begin(), members.end(), alias);
+
+    if (action == "remove") {
+      if (position == members.end()) {
+        printf("File '%s' is not in group '%s'\n", alias.c_str(), name.c_str());
+        result = 1;
+      } else {
+        members.erase(position);
+      }
+      continue;
+    }
+
+    auto file = context->session->fileMap.find(alias);
+    if (file == context->session->fileMap.end()) {
+      printf("File '%s' is not open\n", alias.c_str());
+      result = 1;
+      continue;
+    }
+
+    if (position != members.end()) {
+      continue;
+    }
+
+    // two aliases of one file would be edited at the same time
+    bool isDuplicate = false;
+    for (auto &member : members) {
+      auto other = context->session->fileMap.find(member);
+      if (other != context->session->fileMap.end() &&
+          other->second->path == file->second->path) {
+        printf("File '%s' is already in group '%s' as '%s'\n", file->second->path.c_str(),
+               name.c_str(), member.c_str());
+        isDuplicate = true;
+        result = 1;
+      }
+    }
+
+    if (!isDuplicate) {
+      members.push_back(alias);
+    }
+  }
+
+  if (members.empty()) {
+    context->session->groupMap.erase(name);
+    printf("Group '%s' is empty, it was removed\n", name.c_str());
+  } else {
+    context->session->groupMap[name] = members;
+    printf("Group '%s' has %zu files\n", name.c_str(), members.size());
+  }
+
+  return result;
+}
+
+// a file `foreach` runs on, with its result and everything it printed
+struct CraneForeachRun {
+public:
+  std::string alias;
+  CraneOpenFile *file;
+  std::string output;
+  int result;
+};
+
+// runs `line` in a context of its own where the run's file is selected
+static int runForeachFile(CraneContext *context, CraneForeachRun *run,
+                          const std::string &line) {
+  if (run->file == nullptr) {
+    printf("File '%s' is not open\n", run->alias.c_str());
+    return 1;
+  }
+
+  if (craneShouldStop(context)) {
+    return -1;
+  }
+
+  CraneContext member(*context);
+  member.isInteractive = false;
+  member.openedFile = run->file;
+  member.recordingMacro = nullptr;
+  member.pipe = nullptr;
+  if (run->file->isEditing) {
+    member.interfaceMode = CraneInterfaceMode::Edit;
+  } else if (member.interfaceMode == CraneInterfaceMode::Edit) {
+    member.interfaceMode = CraneInterfaceMode::Normal;
+  }
+
+  CraneCommand *command = CraneCommand::parseCommand(&member, line);
+  int result = command != nullptr ? dispatchCommand(command, &member) : -1;
+  delete command;
+  return result;
+}
+
+/**
+ * Runs a command on every file of a group at once, on the shared scheduler.
+ * Each file gets a context of its own in which it's the selected one, so
+ * edits go to that file's own session. What each run printed is shown per
+ * file once they're all done.
+ */
+int Crane_foreach(CraneCommand *command, CraneContext *context) {
+  std::string name(command->arguments[0]->value);
+  auto group = context->session->groupMap.find(name);
+  if (group == context->session->groupMap.end()) {
+    printf("Group '%s' not found\n", name.c_str());
+    return 1;
+  }
+
+  if (context->recordingMacro != nullptr) {
+    printf("Cannot run foreach while recording a macro\n");
+    return 1;
+  }
+
+  // a single argument is a whole line (pipes included), several are the words
+  // of one, escaped again so they come out of the parser the same
+  std::string line;
+  if (command->arguments.size() == 2) {
+    line = command->arguments[1]->value;
+  } else {
+    for (size_t i = 1; i < command->arguments.size(); i++) {
+      if (i > 1) {
+        line += ' ';
+      }
+      for (char c : command->arguments[i]->value) {
+        if (isspace((unsigned char)c) || c == '\\' || c == '"' || c == '\'' || c == '|') {
+          line += '\\';
+        }
+        line += c;
+      }
+    }
+  }
+
+  CraneCommand *parsed = CraneCommand::parseCommand(context, line);
+  if (parsed == nullptr) {
+    return 1;
+  }
+
+  if (parsed->isBackground) {
+    printf("The command 'foreach' runs can't go to the background, put '&' after "
+           "'foreach' instead\n");
+    delete parsed;
+    return 1;
+  }
+
+  // modules are opened here, runs must not change the registry under each other
+  for (CraneCommand *stage = parsed; stage != nullptr; stage = stage->next) {
+    // only commands marked safe per file run, the others change what the whole
+    // session has (open files, modules, templates, macros, groups, jobs and
+    // settings) or other files open at the same path, which runs don't see
+    CraneCommandEntry *entry = context->session->commandMap.find(stage->name);
+    if (entry == nullptr || !entry->isSafePerFile) {
+      printf("'%.*s' can't run per file, it changes more than the selected file\n",
+             (int)stage->name.size(), stage->name.data());
+      delete parsed;
+      return 1;
+    }
+
+    if (entry->handler == nullptr && !entry->module.empty() &&
+        openModule(context, entry->module, false) != 0) {
+      delete parsed;
+      return 1;
+    }
+  }
+  delete parsed;
+
+  std::vector<CraneForeachRun> runs;
+  for (auto &alias : group->second) {
+    auto file = context->session->fileMap.find(alias);
+    runs.push_back(
+        {alias, file != context->session->fileMap.end() ? file->second : nullptr, "", 0});
+  }
+
+  craneCaptureBegin();
+  {
+    CraneTaskGroup tasks(context->scheduler);
+    for (auto &run : runs) {
+      CraneForeachRun *current = &run;
+      tasks.run([context, current, &line] {
+        // a thread waiting on its own tasks may pick up another file's run
+        std::string *outer = craneCaptureInto(&current->output);
+        current->result = runForeachFile(context, current, line);
+        craneCaptureInto(outer);
+      });
+    }
+    tasks.wait();
+  }
+
+  craneCaptureEnd();
+
+  // runs may have started or ended the selected file's edit session
+  if (context->openedFile != nullptr && context->openedFile->isEditing) {
+    context->interfaceMode = CraneInterfaceMode::Edit;
+  } else if (context->interfaceMode == CraneInterfaceMode::Edit) {
+    context->interfaceMode = CraneInterfaceMode::Normal;
+  }
+
+  size_t failed = 0;
+  for (auto &run : runs) {
+    printf("%s%s%s: %s (%d)\n", kColorBold, run.alias.c_str(), kColorReset,
+           run.result == 0 ? "Done" : "Failed", run.result);
+
+    for (size_t start = 0; start < run.output.size();) {
+      size_t end = run.output.find('\n', start);
+      end = end == std::string::npos ? run.output.size() : end;
+      printf("  %.*s\n", (int)(end - start), run.output.data() + start);
+      start = end + 1;
+    }
+    failed += run.result != 0;
+  }
+
+  if (failed != 0) {
+    printf("%zu of %zu files failed\n", failed, runs.size());
+    return 1;
+  }
+  return 0;
+}
+
 static std::unordered_map<std::string, std::string> errDescMap = {
     // Errors
     {"E0001", "The given command does not exist. This is likely due to a module that"
@@ -440,16 +1704,31 @@ static std::unordered_map<std::string, std::string> errDescMap = {
     {"E0006", "The command used expected an open file but there wasn't one selected.\n"
               "Use 'select <file>' to select a file and 'files' to see a list of "
               "files"},
+    {"E0007", "A command after '|' doesn't accept input from the previous command.\n"
+              "Only commands that consume byte spans (such as 'dump', 'hash', 'find',\n"
+              "'xor', 'range' and 'export') can be used later in a pipeline"},
+    {"E0008", "A module can't be reloaded while background jobs are running, they may\n"
+              "be using its code. Use 'wait' or 'cancel' first"},
 
     // Warnings
     {"W0001", "The given module has already been loaded."},
     {"W0002", "A certain command could been executed in multiple modes "
               "but the usage per mode was mismatched.\n This doesn't "
               "trigger an error but it is recommended that you fix accordingly."},
+    {"W0003", "An edit was made while a macro was recording but it depends on the\n"
+              "contents of the file, so it can't be replayed and isn't part of the "
+              "macro."},
+    {"W0004", "A module provides a command that is already registered. The existing\n"
+              "command is kept unless the module's command is marked with\n"
+              "'setShouldOverride', in which case it comes back if the module's\n"
+              "command is removed by a 'reload'"},
+    {"W0005", "The module's library couldn't be unloaded, usually because it was built\n"
+              "with unique symbols (build it with -fno-gnu-unique when using gcc).\n"
+              "The commands were registered again from the code already in memory"},
 };
 
 int Crane_explain(CraneCommand *command, CraneContext *context) {
-  std::string errName = command->arguments[0]->value;
+  std::string errName(command->arguments[0]->value);
 
   auto errRes = errDescMap.find(errName);
   if (errRes == errDescMap.end()) {
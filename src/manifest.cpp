@@ -0,0 +1,155 @@
+#include "manifest.hpp"
+#include "config.hpp"
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+struct CraneModuleStamp {
+  long long size;
+  long long seconds;
+  long long nanoseconds;
+};
+
+static bool stampModule(const std::string &modulePath, CraneModuleStamp &stamp) {
+  struct stat moduleStat;
+  if (stat(modulePath.c_str(), &moduleStat) != 0) {
+    return false;
+  }
+
+  stamp.size = moduleStat.st_size;
+#if kUsingCraneDarwin
+  stamp.seconds = moduleStat.st_mtimespec.tv_sec;
+  stamp.nanoseconds = moduleStat.st_mtimespec.tv_nsec;
+#else
+  stamp.seconds = moduleStat.st_mtim.tv_sec;
+  stamp.nanoseconds = moduleStat.st_mtim.tv_nsec;
+#endif
+  return true;
+}
+
+static void deleteEntries(std::vector<CraneCommandEntry *> &entries) {
+  for (auto entry : entries) {
+    for (auto argument : entry->arguments) {
+      delete argument;
+    }
+    delete entry;
+  }
+  entries.clear();
+}
+
+bool craneReadManifest(const std::string &modulePath,
+                       std::vector<CraneCommandEntry *> &entries) {
+  CraneModuleStamp stamp;
+  if (!stampModule(modulePath, stamp)) {
+    return false;
+  }
+
+  FILE *manifest = fopen((modulePath + kManifestExtension).c_str(), "r");
+  if (manifest == nullptr) {
+    return false;
+  }
+
+  int format = 0;
+  int hostVersion = 0;
+  int moduleVersion = 0;
+  CraneModuleStamp written = {0, 0, 0};
+  bool isUsable =
+      fscanf(manifest, "crane-manifest %d %d\n", &format, &hostVersion) == 2 &&
+      fscanf(manifest, "module %d %lld %lld %lld\n", &moduleVersion, &written.size,
+             &written.seconds, &written.nanoseconds) == 4 &&
+      format == kManifestFormatVersion && hostVersion == kCraneVersion &&
+      moduleVersion >= kCraneMinimumVersion && moduleVersion <= kCraneVersion &&
+      written.size == stamp.size && written.seconds == stamp.seconds &&
+      written.nanoseconds == stamp.nanoseconds;
+
+  char *line = nullptr;
+  size_t capacity = 0;
+  ssize_t length;
+  CraneCommandEntry *entry = nullptr;
+
+  while (isUsable && (length = getline(&line, &capacity, manifest)) > 0) {
+    if (line[length - 1] == '\n') {
+      line[--length] = '\0';
+    }
+
+    char name[256];
+    int flags[5];
+    int type;
+
+    if (sscanf(line, "command %255s %d %d %d %d %d", name, &flags[0], &flags[1],
+               &flags[2], &flags[3], &flags[4]) == 6) {
+      entry = new CraneCommandEntry(name, nullptr, flags[0]);
+      entry->setRequiresOpenFile(flags[1]);
+      entry->setAcceptsInput(flags[2]);
+      entry->shouldOverride = flags[3];
+      entry->setSafePerFile(flags[4]);
+      entry->module = modulePath;
+      entries.push_back(entry);
+    } else if (entry != nullptr && strncmp(line, "description ", 12) == 0) {
+      entry->setCommandDescription(line + 12);
+    } else if (entry != nullptr &&
+               sscanf(line, "argument %255s %d %d", name, &flags[0], &type) == 3 &&
+               type >= 0 && type <= (int)CraneArgumentType::Number) {
+      entry->addArgument(name, flags[0], (CraneArgumentType)type);
+    } else {
+      isUsable = false;
+    }
+  }
+
+  free(line);
+  fclose(manifest);
+
+  if (!isUsable || entries.empty()) {
+    deleteEntries(entries);
+    return false;
+  }
+
+  return true;
+}
+
+void craneWriteManifest(const std::string &modulePath, int moduleVersion,
+                        const std::vector<CraneCommandEntry *> &entries) {
+  CraneModuleStamp stamp;
+  if (!stampModule(modulePath, stamp)) {
+    return;
+  }
+
+  // written next to the final name and renamed, so readers never see half of it
+  std::string manifestPath = modulePath + kManifestExtension;
+  std::string temporaryPath = manifestPath + ".tmp";
+  FILE *manifest = fopen(temporaryPath.c_str(), "w");
+  if (manifest == nullptr) {
+    // the module may live somewhere read-only, it's just loaded eagerly then
+    return;
+  }
+
+  fprintf(manifest, "crane-manifest %d %d\n", kManifestFormatVersion, kCraneVersion);
+  fprintf(manifest, "module %d %lld %lld %lld\n", moduleVersion, stamp.size, stamp.seconds,
+          stamp.nanoseconds);
+
+  for (auto entry : entries) {
+    if (entry == nullptr) {
+      continue;
+    }
+
+    fprintf(manifest, "command %s %d %d %d %d %d\n", entry->name.c_str(),
+            entry->isVariadic, entry->requiresOpenFile, entry->acceptsInput,
+            entry->shouldOverride, entry->isSafePerFile);
+
+    // descriptions are a single line in the manifest
+    std::string description = entry->description;
+    for (auto &c : description) {
+      c = c == '\n' ? ' ' : c;
+    }
+    fprintf(manifest, "description %s\n", description.c_str());
+
+    for (auto argument : entry->arguments) {
+      fprintf(manifest, "argument %s %d %d\n", argument->name.c_str(), argument->isOptional,
+              (int)argument->type);
+    }
+  }
+
+  if (fclose(manifest) != 0 || rename(temporaryPath.c_str(), manifestPath.c_str()) != 0) {
+    remove(temporaryPath.c_str());
+  }
+}
@@ -1,12 +1,20 @@
 #include "prompt.hpp"
 #include "commands.hpp"
 #include "context.hpp"
+#include "storage.hpp"
 #include <cctype>
 #include <readline/history.h>
 #include <readline/readline.h>
 #include <string>
 
 std::string generatePrompt(CraneContext *context) {
+  return generatePrompt(context->interfaceMode,
+                        context->openedFile != nullptr ? context->openedFile->alias : "",
+                        context->lastCommandResult);
+}
+
+std::string generatePrompt(CraneInterfaceMode mode, const std::string &alias,
+                           int lastResult) {
   /**
    * The expected prompt should be clean and a bit colorful:
    *
@@ -19,9 +27,9 @@ std::string generatePrompt(CraneContext *context) {
   out += "\33[2K\r";
 
   std::string interfaceColor;
-  if (context->interfaceMode == CraneInterfaceMode::Edit) {
+  if (mode == CraneInterfaceMode::Edit) {
     interfaceColor = kColorYellow;
-  } else if (context->interfaceMode == CraneInterfaceMode::Template) {
+  } else if (mode == CraneInterfaceMode::Template) {
     interfaceColor = kColorWhite;
     interfaceColor += kColorBold;
   } else {
@@ -32,151 +40,220 @@ std::string generatePrompt(CraneContext *context) {
   out += interfaceColor + "crane ";
 
   // {magenta}{openFile}?
-  if (context->openedFile != nullptr) {
-    out += std::string(kColorReset) + std::string(kColorMagenta) + "(" + context->openedFile->alias + ") ";
+  if (!alias.empty()) {
+    out += std::string(kColorReset) + std::string(kColorMagenta) + "(" + alias + ") ";
   }
 
-  out += context->lastCommandResult != 0 ? kColorRed : kColorWhite;
+  out += lastResult != 0 ? kColorRed : kColorWhite;
   out += "> " + std::string(kColorReset);
 
   return out;
 }
 
-CraneCommand *CraneCommand::parseCommand(CraneContext *context, std::string buffer) {
-  CraneCommand *command = new CraneCommand("", {});
-  std::string argumentBuffer = "";
-  bool escapeNext = false;
-  bool inString = false;
+static CraneArgumentType classifyArgument(CraneContext *context, std::string_view value) {
+  if (value == "true" || value == "false") {
+    return CraneArgumentType::Boolean;
+  }
+
+  // check if it's a number
+  bool isNumber = true;
+  bool hasDot = false;
+  for (char c : value) {
+    if (c == '.') {
+      if (hasDot) {
+        printf("Argument '%.*s' is not a number, it can only have one '.' to "
+               "denote decimals.\n",
+               (int)value.size(), value.data());
+        return CraneArgumentType::String;
+      }
+
+      hasDot = true;
+    } else if (!isdigit((unsigned char)c)) {
+      isNumber = false;
+      break;
+    }
+  }
+
+  if (isNumber) {
+    return CraneArgumentType::Number;
+  }
+
+  if (context->session->fileMap.count(std::string(value)) != 0) {
+    return CraneArgumentType::File;
+  }
+
+  return CraneArgumentType::String;
+}
+
+CraneCommand *CraneCommand::parseCommand(CraneContext *context, std::string_view buffer) {
+  CraneCommand *command = new CraneCommand();
+
+  // a trailing unescaped '&' sends the whole line to the background
+  size_t last = buffer.find_last_not_of(" \t\r\n");
+  if (last != std::string_view::npos && buffer[last] == '&' &&
+      (last == 0 || buffer[last - 1] != '\\')) {
+    command->isBackground = true;
+    buffer = buffer.substr(0, last);
+  }
+
+  // the line is copied into the arena once, tokens are then unescaped in place
+  // and NUL terminated so every argument is a view into that single copy
+  char *line = (char *)command->arena.copy(buffer).data();
+  char *end = line + buffer.size();
+  char *read = line;
   bool hasCommandName = false;
-  char lastQuote = '\0';
-  char currentChar = '\0';
-  int bufferLength = buffer.length();
-  int lastQuoteIndex = 0;
-  int i = 0;
-
-  while (bufferLength) {
-    currentChar = buffer[i++];
-    bufferLength--;
-
-    if (escapeNext) {
-      argumentBuffer.push_back(currentChar);
-      continue;
+  command->name = std::string_view(line, 0);
+
+  // each '|' starts a new pipeline stage, stages keep pointing into this line
+  CraneCommand *stage = command;
+
+  while (true) {
+    while (read < end && isspace((unsigned char)*read)) {
+      read++;
     }
 
-    if (currentChar == '\\' && !escapeNext) {
-      escapeNext = true;
+    if (read < end && *read == '|') {
+      if (!hasCommandName) {
+        printf("Expected a command before '|' at %zu\n", (size_t)(read - line + 1));
+        delete command;
+        return nullptr;
+      }
+
+      stage->next = new CraneCommand();
+      stage = stage->next;
+      stage->name = std::string_view(line, 0);
+      hasCommandName = false;
+      read++;
       continue;
     }
 
-    if (currentChar == '"' || currentChar == '\'') {
-      if (!inString) {
-        inString = true;
-        lastQuoteIndex = i;
-        lastQuote = currentChar;
+    if (read == end) {
+      if (stage != command && !hasCommandName) {
+        printf("Expected a command after '|'\n");
+        delete command;
+        return nullptr;
+      }
+      break;
+    }
+
+    // the write cursor never overtakes the read cursor
+    char *token = read;
+    char *write = read;
+    char lastQuote = '\0';
+    size_t lastQuoteIndex = 0;
+    bool wasQuoted = false;
+
+    while (read < end) {
+      char currentChar = *read;
+
+      if (currentChar == '\\' && read + 1 < end) {
+        *write++ = read[1];
+        read += 2;
         continue;
-      } else if (currentChar == lastQuote) {
-        inString = false;
+      }
 
-        if (!hasCommandName) {
-          command->name = argumentBuffer;
-          hasCommandName = true;
+      if (lastQuote != '\0') {
+        if (currentChar == lastQuote) {
+          lastQuote = '\0';
         } else {
-          command->arguments.push_back(
-              new CraneArgument(argumentBuffer, CraneArgumentType::String));
+          *write++ = currentChar;
         }
-        argumentBuffer.clear();
-      } else {
-        argumentBuffer.push_back(currentChar);
+        read++;
+        continue;
       }
-    }
 
-    if (isspace(currentChar) && !inString) {
-      if (!hasCommandName) {
-        command->name = argumentBuffer;
-        hasCommandName = true;
-      } else {
-        command->arguments.push_back(
-            new CraneArgument(argumentBuffer, CraneArgumentType::String));
+      if (currentChar == '"' || currentChar == '\'') {
+        lastQuote = currentChar;
+        lastQuoteIndex = read - line + 1;
+        wasQuoted = true;
+        read++;
+        continue;
       }
-      argumentBuffer.clear();
 
-      continue;
+      if (isspace((unsigned char)currentChar) || currentChar == '|') {
+        break;
+      }
+
+      *write++ = currentChar;
+      read++;
     }
 
-    argumentBuffer.push_back(currentChar);
-  }
+    if (lastQuote != '\0') {
+      printf("Expected closing quote (%c) to string at %zu:\n", lastQuote,
+             lastQuoteIndex);
+      printf("%.*s\n", (int)buffer.size(), buffer.data());
+      printf("%s^\n", std::string(lastQuoteIndex - 1, ' ').c_str());
+      delete command;
+      return nullptr;
+    }
 
-  if (inString) {
-    printf("Expected closing quote (%c) to string at %d:\n", lastQuote,
-           lastQuoteIndex);
-    printf("%s\n", buffer.c_str());
-    printf("%s^\n", std::string(lastQuoteIndex - 1, ' ').c_str());
-    return nullptr;
-  }
+    // a '|' right after the token is left for the next iteration, so the
+    // terminator must not overwrite it
+    bool endsAtPipe = read < end && *read == '|';
+    std::string_view value(token, write - token);
+    if (endsAtPipe && write == read) {
+      value = stage->arena.copy(value);
+    } else {
+      *write = '\0';
+      if (!endsAtPipe && read < end) {
+        read++;
+      }
+    }
 
-  if (argumentBuffer.length()) {
     if (!hasCommandName) {
-      command->name = argumentBuffer;
+      stage->name = value;
       hasCommandName = true;
-    } else {
-      command->arguments.push_back(
-          new CraneArgument(argumentBuffer, CraneArgumentType::String));
+      continue;
     }
-    argumentBuffer.clear();
+
+    CraneArgumentType type =
+        wasQuoted ? CraneArgumentType::String : classifyArgument(context, value);
+    stage->arguments.push_back(stage->arena,
+                               stage->arena.make<CraneArgument>(value, type));
   }
 
-  // classifications
+  return command;
+}
 
-  for (auto &arg : command->arguments) {
-    if (arg->value == "true" || arg->value == "false") {
-      arg->type = CraneArgumentType::Boolean;
-      continue;
-    } else if (arg->value.find(".") != std::string::npos) {
-      // check if it's a number
-      bool hasDot = false;
-      arg->type = CraneArgumentType::Number;
-      for (auto &c : arg->value) {
-        if (!isdigit(c) && c != '.') {
-          arg->type = CraneArgumentType::String;
-          break;
-        }
+std::vector<std::string_view> CraneCommand::splitLines(std::string_view commands) {
+  std::vector<std::string_view> lines;
+  size_t start = 0;
+  char quote = '\0';
 
-        if (c == '.' && !hasDot) {
-          hasDot = true;
-        } else if (c == '.' && hasDot) {
-          printf("Argument '%s' is not a number, it can only have one '.' to "
-                 "denote decimals.\n",
-                 arg->value.c_str());
-          arg->type = CraneArgumentType::String;
-          break;
-        }
-      }
-    } else {
-      arg->type = CraneArgumentType::Number;
-      for (auto &c : arg->value) {
-        if (!isdigit(c)) {
-          arg->type = CraneArgumentType::String;
-          break;
-        }
-      }
+  for (size_t i = 0; i <= commands.size(); i++) {
+    char c = i < commands.size() ? commands[i] : '\n';
 
-      if (arg->type == CraneArgumentType::String) {
-        if (context->fileMap.find(arg->value) != context->fileMap.end()) {
-          arg->type = CraneArgumentType::File;
-        }
+    if (c == '\\' && i + 1 < commands.size()) {
+      i++;
+      continue;
+    } else if (quote != '\0') {
+      quote = c == quote ? '\0' : quote;
+      if (i < commands.size()) {
+        continue;
       }
+    } else if (c == '"' || c == '\'') {
+      quote = c;
+      continue;
+    } else if (c != ';' && c != '\n') {
+      continue;
+    }
+
+    std::string_view line = commands.substr(start, i - start);
+    start = i + 1;
+
+    size_t first = line.find_first_not_of(" \t\r");
+    if (first != std::string_view::npos && line[first] != '#') {
+      lines.push_back(line);
     }
   }
 
-  return command;
+  return lines;
 }
 
-CraneCommand *CraneCommand::fromUser(CraneContext *context) {
-  std::string prompt = generatePrompt(context);
-  char *commandBuffer = readline(prompt.c_str());
-
+CraneCommand *CraneCommand::fromLine(CraneContext *context, char *commandBuffer) {
+  // end of input (e.g. Ctrl-D) leaves the REPL
   if (!commandBuffer) {
-    return nullptr;
+    return new CraneCommand("exit", {});
   }
 
   // NOTE: theres a weird bug where the prompt is
@@ -197,5 +274,8 @@ CraneCommand *CraneCommand::fromUser(CraneContext *context) {
   // if (commandBuffer && *commandBuffer)
   //   add_history(commandBuffer);
 
-  return CraneCommand::parseCommand(context, std::string(commandBuffer));
+  CraneCommand *command = CraneCommand::parseCommand(context, commandBuffer);
+  free(commandBuffer);
+
+  return command;
 }
@@ -0,0 +1,621 @@
+#include "server.hpp"
+#include "capture.hpp"
+#include "macros.hpp"
+#include "prompt.hpp"
+#include "storage.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <readline/readline.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct CraneServerClient {
+public:
+  int fd;
+  // received but not run yet, and the line a worker is running
+  std::string input;
+  std::string line;
+  // set while a worker has the client, the event loop only watches for a hangup then
+  std::atomic<bool> isBusy;
+  std::atomic<bool> isClosed;
+  bool isExiting;
+
+  // the client's own view of the session: its selected file, mode, macro and
+  // last result, everything else is the server's context's
+  CraneContext context;
+  // the selected file's alias as of the last line, for the reply
+  std::string alias;
+
+  CraneServerClient(int fd, CraneContext *server)
+    : fd(fd),
+      isBusy(false),
+      isClosed(false),
+      isExiting(false),
+      context(*server),
+      job(nullptr) {
+    context.lastCommandResult = 0;
+    context.isInteractive = false;
+    context.confirm = nullptr;
+    context.openedFile = nullptr;
+    context.recordingMacro = nullptr;
+    context.interfaceMode = CraneInterfaceMode::Normal;
+    context.pipe = nullptr;
+    context.job = nullptr;
+  }
+
+  ~CraneServerClient() {
+    delete context.recordingMacro;
+    close(fd);
+  }
+
+  // a client that hung up has the command it's running cancelled
+  inline void hangUp() {
+    std::lock_guard<std::mutex> guard(jobLock);
+    isClosed.store(true);
+    if (job != nullptr) {
+      job->cancel();
+    }
+  }
+
+  inline void setJob(CraneJob *running) {
+    std::lock_guard<std::mutex> guard(jobLock);
+    job = running;
+    if (job != nullptr && isClosed.load()) {
+      job->cancel();
+    }
+  }
+
+private:
+  std::mutex jobLock;
+  CraneJob *job;
+};
+
+// these change what the whole session has, nothing else runs next to them. splice
+// and insertfile read a second open file, and save and mode reopen or drop the
+// pages of every file open at the same path, which the selected file's lock
+// doesn't cover
+static const char *kServerSessionCommands[] = {
+    "open",         "close",       "load",  "reload",  "macro", "newtemplate",
+    "loadtemplate", "deltemplate", "group", "foreach", "io",    "trace",
+    "splice",       "insertfile",  "save",  "mode"};
+
+static bool isSessionCommand(CraneContext *context, CraneCommand *command) {
+  for (CraneCommand *stage = command; stage != nullptr; stage = stage->next) {
+    for (auto name : kServerSessionCommands) {
+      if (stage->name == name) {
+        return true;
+      }
+    }
+
+    // a stub loads its module when it first runs, which changes the registry
+    CraneCommandEntry *entry = context->session->commandMap.find(stage->name);
+    if (entry != nullptr && entry->handler == nullptr && !entry->module.empty()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// brings a client up to date with what other clients did to the session
+static void syncClient(CraneServerClient *client) {
+  CraneContext *context = &client->context;
+  bool isOpen = false;
+  for (auto &file : context->session->fileMap) {
+    isOpen = isOpen || file.second == context->openedFile;
+  }
+  if (!isOpen) {
+    context->openedFile = nullptr;
+  }
+
+  // edit sessions belong to files, whichever client started them
+  if (context->openedFile != nullptr && context->openedFile->isEditing) {
+    context->interfaceMode = CraneInterfaceMode::Edit;
+  } else if (context->interfaceMode == CraneInterfaceMode::Edit) {
+    context->interfaceMode = CraneInterfaceMode::Normal;
+  }
+}
+
+// runs a command on the client's context as the client's job
+static int runOnClient(CraneServerClient *client, CraneJobRunner runner,
+                       CraneCommand *command) {
+  CraneJob job(0, "");
+  client->context.job = &job;
+  client->setJob(&job);
+  int result = runner(command, &client->context);
+  client->setJob(nullptr);
+  client->context.job = nullptr;
+
+  CraneOpenFile *file = client->context.openedFile;
+  client->alias = file != nullptr ? file->alias : "";
+  return result;
+}
+
+static bool sendAll(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t count = write(fd, data, size);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
+CraneServer::CraneServer(CraneContext *context, CraneJobRunner runner)
+  : context(context), runner(runner), stopping(false), stopRequested(false) {
+  if (pipe(wakePipe) != 0) {
+    wakePipe[0] = wakePipe[1] = -1;
+    return;
+  }
+
+  // a full pipe only means there's already a wakeup pending
+  fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+}
+
+CraneServer::~CraneServer() {
+  if (wakePipe[0] >= 0) {
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+  }
+}
+
+void CraneServer::stop() {
+  stopRequested.store(true);
+  wake();
+}
+
+void CraneServer::wake() {
+  if (wakePipe[1] >= 0) {
+    char wakeup = 's';
+    (void)!write(wakePipe[1], &wakeup, 1);
+  }
+}
+
+int CraneServer::serve(const char *path) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printf("Socket path '%s' is too long\n", path);
+    return 1;
+  }
+  strcpy(address.sun_path, path);
+
+  // a socket left behind by a server that's gone is replaced, a live one isn't
+  struct stat socketStat;
+  if (lstat(path, &socketStat) == 0 && S_ISSOCK(socketStat.st_mode)) {
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool isLive = probe >= 0 && connect(probe, (struct sockaddr *)&address,
+                                        sizeof(address)) == 0;
+    if (probe >= 0) {
+      close(probe);
+    }
+
+    if (isLive) {
+      printf("A server is already listening on '%s'\n", path);
+      return 1;
+    }
+    unlink(path);
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || wakePipe[0] < 0) {
+    printf("%serr%s: Failed to create a socket: %s\n", kColorRed, kColorReset,
+           strerror(errno));
+    return 1;
+  }
+  fcntl(listener, F_SETFD, FD_CLOEXEC);
+
+  // only the user running the server can connect
+  mode_t mask = umask(0077);
+  int bound = bind(listener, (struct sockaddr *)&address, sizeof(address));
+  umask(mask);
+  if (bound != 0 || listen(listener, SOMAXCONN) != 0) {
+    printf("%serr%s: Failed to listen on '%s': %s\n", kColorRed, kColorReset, path,
+           strerror(errno));
+    close(listener);
+    return 1;
+  }
+
+  // a client that hangs up shows as a failed write, not a signal
+  signal(SIGPIPE, SIG_IGN);
+
+  size_t threadCount =
+      std::max<size_t>(kServerMinWorkers, std::thread::hardware_concurrency());
+  for (size_t i = 0; i < threadCount; i++) {
+    workers.emplace_back(&CraneServer::work, this);
+  }
+
+  printf("Serving on '%s' with %zu workers\n", path, threadCount);
+  fflush(stdout);
+  craneCaptureBegin();
+
+  std::vector<std::shared_ptr<CraneServerClient>> clients;
+  std::vector<struct pollfd> fds;
+  while (!stopRequested.load()) {
+    fds.clear();
+    fds.push_back({listener, POLLIN, 0});
+    fds.push_back({wakePipe[0], POLLIN, 0});
+    for (auto &client : clients) {
+      fds.push_back({client->fd, (short)(client->isBusy.load() ? 0 : POLLIN), 0});
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      char wakeups[64];
+      while (read(wakePipe[0], wakeups, sizeof(wakeups)) > 0) {
+      }
+    }
+
+    for (size_t i = 0; i < clients.size(); i++) {
+      CraneServerClient *client = clients[i].get();
+      short events = fds[i + 2].revents;
+
+      if (events & POLLIN) {
+        char buffer[1 << 16];
+        ssize_t count = read(client->fd, buffer, sizeof(buffer));
+        if (count > 0) {
+          client->input.append(buffer, count);
+        } else if (count == 0 || errno != EINTR) {
+          client->hangUp();
+        }
+      } else if (events & (POLLHUP | POLLERR | POLLNVAL)) {
+        client->hangUp();
+      }
+
+      if (client->input.size() > kServerLineLimit &&
+          client->input.find('\n') == std::string::npos) {
+        client->hangUp();
+      }
+
+      // the next line of an idle client goes to the workers
+      size_t end = client->input.find('\n');
+      if (!client->isClosed.load() && !client->isBusy.load() &&
+          end != std::string::npos) {
+        client->line = client->input.substr(0, end);
+        client->input.erase(0, end + 1);
+        client->isBusy.store(true);
+
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(clients[i]);
+        craneTraceCounter(context, "queued requests", queue.size());
+        queued.notify_one();
+      }
+    }
+
+    // a client a worker still has is released when the worker is done with it
+    clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                 [](const std::shared_ptr<CraneServerClient> &client) {
+                                   return client->isClosed.load();
+                                 }),
+                  clients.end());
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listener, nullptr, nullptr);
+      if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        clients.push_back(std::make_shared<CraneServerClient>(fd, context));
+      }
+    }
+  }
+
+  for (auto &client : clients) {
+    client->hangUp();
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  queued.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  workers.clear();
+  queue.clear();
+
+  craneCaptureEnd();
+  close(listener);
+  unlink(path);
+  printf("Stopped serving on '%s'\n", path);
+
+  return 0;
+}
+
+void CraneServer::work() {
+  craneNameThread("server");
+
+  while (true) {
+    std::shared_ptr<CraneServerClient> client;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      queued.wait(guard, [this] { return stopping || !queue.empty(); });
+      if (stopping) {
+        return;
+      }
+
+      client = queue.front();
+      queue.erase(queue.begin());
+      craneTraceCounter(context, "queued requests", queue.size());
+    }
+
+    // everything the line prints is the reply
+    std::string output;
+    std::string *outer = craneCaptureInto(&output);
+    int result = client->isClosed.load() ? -1 : runLine(client.get(), client->line);
+    craneCaptureInto(outer);
+    client->context.lastCommandResult = result;
+
+    std::string header = std::to_string(result) + " " +
+                         std::to_string((int)client->context.interfaceMode) + " " +
+                         std::to_string(output.size()) + " " + client->alias + "\n";
+    if (!sendAll(client->fd, header.data(), header.size()) ||
+        !sendAll(client->fd, output.data(), output.size())) {
+      client->hangUp();
+    } else if (client->isExiting) {
+      shutdown(client->fd, SHUT_RDWR);
+    }
+
+    client->isBusy.store(false);
+    wake();
+  }
+}
+
+int CraneServer::runLine(CraneServerClient *client, std::string_view text) {
+  int result = 0;
+
+  for (auto line : CraneCommand::splitLines(text)) {
+    CraneCommand *command;
+    {
+      // parsing looks up file aliases, and most commands run right here
+      std::shared_lock<std::shared_mutex> guard(session);
+      command = CraneCommand::parseCommand(context, line);
+      if (command == nullptr) {
+        return -1;
+      }
+
+      if (command->name == "exit") {
+        delete command;
+        client->isExiting = true;
+        return 0;
+      }
+
+      if (command->isBackground) {
+        printf("Background jobs can't be started over a connection, use another "
+               "client instead\n");
+        delete command;
+        return 1;
+      }
+
+      if (!isSessionCommand(context, command)) {
+        result = runShared(client, command);
+        delete command;
+        command = nullptr;
+      }
+    }
+
+    if (command != nullptr) {
+      result = runExclusive(client, command);
+      delete command;
+    }
+
+    if (result != 0) {
+      break;
+    }
+  }
+
+  return result;
+}
+
+/**
+ * Runs a command next to other clients' commands, on the client's own context.
+ * The caller holds the session shared.
+ */
+int CraneServer::runShared(CraneServerClient *client, CraneCommand *command) {
+  syncClient(client);
+  CraneOpenFile *file = client->context.openedFile;
+
+  // a file in an edit session takes one command at a time. Sessions only start
+  // and end in `mode`, which runs alone, so this can't change meanwhile
+  std::shared_lock<std::shared_mutex> reading;
+  std::unique_lock<std::shared_mutex> writing;
+  if (file != nullptr) {
+    std::shared_mutex *fileGuard = fileLock(file);
+    if (file->isEditing) {
+      writing = std::unique_lock<std::shared_mutex>(*fileGuard);
+    } else {
+      reading = std::shared_lock<std::shared_mutex>(*fileGuard);
+    }
+  }
+
+  return runOnClient(client, runner, command);
+}
+
+// runs a command that changes the session, with nothing else running
+int CraneServer::runExclusive(CraneServerClient *client, CraneCommand *command) {
+  std::unique_lock<std::shared_mutex> guard(session);
+  syncClient(client);
+  int result = runOnClient(client, runner, command);
+
+  // nothing holds the locks of files that were closed
+  std::lock_guard<std::mutex> locksGuard(fileLocksLock);
+  for (auto it = fileLocks.begin(); it != fileLocks.end();) {
+    bool isOpen = false;
+    for (auto &file : context->session->fileMap) {
+      isOpen = isOpen || file.second == it->first;
+    }
+    it = isOpen ? std::next(it) : fileLocks.erase(it);
+  }
+
+  return result;
+}
+
+std::shared_mutex *CraneServer::fileLock(CraneOpenFile *file) {
+  std::lock_guard<std::mutex> guard(fileLocksLock);
+  std::unique_ptr<std::shared_mutex> &fileGuard = fileLocks[file];
+  if (fileGuard == nullptr) {
+    fileGuard = std::make_unique<std::shared_mutex>();
+  }
+  return fileGuard.get();
+}
+
+struct CraneServerReply {
+public:
+  int result;
+  CraneInterfaceMode interfaceMode;
+  std::string alias;
+};
+
+// sends a line and prints what it printed, false when the connection is gone
+static bool request(int fd, FILE *replies, std::string_view line,
+                    CraneServerReply *reply) {
+  std::string message(line);
+  message += '\n';
+
+  char *header = nullptr;
+  size_t capacity = 0;
+  int modeValue = 0;
+  unsigned long long length = 0;
+  int aliasStart = 0;
+  bool isValid = sendAll(fd, message.data(), message.size()) &&
+                 getline(&header, &capacity, replies) > 0 &&
+                 sscanf(header, "%d %d %llu %n", &reply->result, &modeValue, &length,
+                        &aliasStart) == 3;
+
+  if (isValid) {
+    reply->interfaceMode = (CraneInterfaceMode)modeValue;
+    reply->alias = header + aliasStart;
+    if (!reply->alias.empty() && reply->alias.back() == '\n') {
+      reply->alias.pop_back();
+    }
+  }
+  free(header);
+
+  char buffer[1 << 16];
+  while (isValid && length > 0) {
+    size_t count = fread(buffer, 1, std::min<u64>(length, sizeof(buffer)), replies);
+    fwrite(buffer, 1, count, stdout);
+    isValid = count != 0;
+    length -= count;
+  }
+  fflush(stdout);
+
+  if (!isValid) {
+    printf("%serr%s: The server closed the connection\n", kColorRed, kColorReset);
+  }
+  return isValid;
+}
+
+static bool isExitLine(std::string_view line) {
+  size_t first = line.find_first_not_of(" \t\r");
+  size_t last = line.find_last_not_of(" \t\r");
+  return first != std::string_view::npos &&
+         line.substr(first, last - first + 1) == "exit";
+}
+
+int craneConnect(const char *path, const char *commands, const char *script) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printf("Socket path '%s' is too long\n", path);
+    return 1;
+  }
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    printf("%serr%s: No server is listening on '%s': %s\n", kColorRed, kColorReset, path,
+           strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  FILE *replies = fdopen(dup(fd), "r");
+  CraneServerReply reply = {0, CraneInterfaceMode::Normal, ""};
+
+  if (commands == nullptr && script == nullptr && isatty(STDIN_FILENO)) {
+    char *line;
+    while ((line = readline(generatePrompt(reply.interfaceMode, reply.alias,
+                                           reply.result)
+                                .c_str())) != nullptr) {
+      bool isExit = isExitLine(line);
+      bool isConnected = isExit || *line == '\0' || request(fd, replies, line, &reply);
+      free(line);
+
+      if (isExit || !isConnected) {
+        break;
+      }
+    }
+  } else {
+    // the server splits on ';' itself, lines are sent as they are
+    FILE *input = nullptr;
+    if (commands == nullptr) {
+      input = script == nullptr || strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+      if (input == nullptr) {
+        printf("%serr%s: Failed to open script '%s'\n", kColorRed, kColorReset, script);
+        reply.result = 1;
+      }
+    }
+
+    char *line = nullptr;
+    size_t capacity = 0;
+    ssize_t length;
+    std::string_view rest = commands != nullptr ? commands : "";
+    while (reply.result == 0) {
+      std::string_view text;
+      if (input != nullptr) {
+        if ((length = getline(&line, &capacity, input)) <= 0) {
+          break;
+        }
+        text = std::string_view(line, length);
+      } else if (!rest.empty()) {
+        size_t end = std::min(rest.find('\n'), rest.size());
+        text = rest.substr(0, end);
+        rest.remove_prefix(std::min(end + 1, rest.size()));
+      } else {
+        break;
+      }
+
+      if (!text.empty() && text.back() == '\n') {
+        text.remove_suffix(1);
+      }
+      if (isExitLine(text)) {
+        break;
+      }
+      if (text.find_first_not_of(" \t\r") != std::string_view::npos &&
+          !request(fd, replies, text, &reply)) {
+        reply.result = -1;
+      }
+    }
+
+    free(line);
+    if (input != nullptr && input != stdin) {
+      fclose(input);
+    }
+  }
+
+  fclose(replies);
+  close(fd);
+  return reply.result;
+}
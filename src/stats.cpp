@@ -0,0 +1,83 @@
+#include "stats.hpp"
+#include <cstdlib>
+#include <new>
+
+// allocations made by each thread, read by the probe around every command
+static thread_local u64 allocationCount = 0;
+static thread_local u64 allocatedBytes = 0;
+
+// the replacement is exported by the executable, so modules use it as well
+void *operator new(std::size_t size) {
+  allocationCount++;
+  allocatedBytes += size;
+
+  while (true) {
+    void *pointer = malloc(size == 0 ? 1 : size);
+    if (pointer != nullptr) {
+      return pointer;
+    }
+
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void operator delete(void *pointer) noexcept { free(pointer); }
+
+void operator delete[](void *pointer) noexcept { free(pointer); }
+
+void operator delete(void *pointer, std::size_t) noexcept { free(pointer); }
+
+void operator delete[](void *pointer, std::size_t) noexcept { free(pointer); }
+
+static inline u64 elapsedNanoseconds(const timespec &start, const timespec &end) {
+  return (u64)(end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+}
+
+CraneStatsProbe::CraneStatsProbe(CraneContext *context)
+  : bytesRead(0),
+    bytesWritten(0),
+    allocations(allocationCount),
+    allocatedBytes(::allocatedBytes) {
+  if (context->job != nullptr) {
+    bytesRead = context->job->bytesRead.load(std::memory_order_relaxed);
+    bytesWritten = context->job->bytesWritten.load(std::memory_order_relaxed);
+  }
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
+  clock_gettime(CLOCK_MONOTONIC, &wallStart);
+}
+
+void CraneStatsProbe::finish(CraneContext *context, const std::string &command,
+                             int result) {
+  timespec wallEnd;
+  timespec cpuEnd;
+  clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+
+  if (context->stats == nullptr) {
+    return;
+  }
+
+  CraneCommandSample sample;
+  sample.wallNanoseconds = elapsedNanoseconds(wallStart, wallEnd);
+  sample.cpuNanoseconds = elapsedNanoseconds(cpuStart, cpuEnd);
+  sample.bytesRead = 0;
+  sample.bytesWritten = 0;
+  sample.allocations = allocationCount - allocations;
+  sample.allocatedBytes = ::allocatedBytes - allocatedBytes;
+  sample.failed = result != 0;
+
+  if (context->job != nullptr) {
+    sample.bytesRead = context->job->bytesRead.load(std::memory_order_relaxed) - bytesRead;
+    sample.bytesWritten =
+        context->job->bytesWritten.load(std::memory_order_relaxed) - bytesWritten;
+  }
+
+  context->stats->record(command, sample);
+}
@@ -0,0 +1,83 @@
+#include "trace.hpp"
+#include "config.hpp"
+#include <algorithm>
+
+static void writeJsonString(FILE *out, const char *text) {
+  fputc('"', out);
+  for (const char *c = text; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', out);
+      fputc(*c, out);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(out, "\\u%04x", *c);
+    } else {
+      fputc(*c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+bool CraneTracer::dump(FILE *out, u64 *eventCount) {
+  // buffers are only ever added, a copy of the list is enough to walk them
+  std::vector<CraneTraceBuffer *> threads;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &buffer : buffers) {
+      threads.push_back(buffer.get());
+    }
+  }
+
+  u64 since = startedAt.load();
+  *eventCount = 0;
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"version\":\"Crane %s\"},"
+               "\"traceEvents\":[\n",
+          kCraneVersionString);
+  fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+               "\"args\":{\"name\":\"crane\"}}");
+
+  std::vector<CraneTraceEvent> events;
+  for (auto buffer : threads) {
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                 "\"args\":{\"name\":",
+            buffer->id);
+    writeJsonString(out, buffer->threadName.empty() ? "thread" : buffer->threadName.c_str());
+    fprintf(out, "}}");
+
+    // the owner keeps writing while we copy, anything it could have
+    // overwritten in the meantime is dropped
+    u64 end = buffer->head.load(std::memory_order_acquire);
+    u64 begin = end > kTraceBufferEvents ? end - kTraceBufferEvents : 0;
+    events.clear();
+    for (u64 index = begin; index < end; index++) {
+      events.push_back(buffer->events[index & (kTraceBufferEvents - 1)]);
+    }
+
+    u64 after = buffer->head.load(std::memory_order_acquire);
+    u64 firstValid = after >= kTraceBufferEvents ? after - kTraceBufferEvents + 1 : 0;
+    size_t skip = firstValid > begin ? std::min<u64>(firstValid - begin, events.size()) : 0;
+
+    for (size_t i = skip; i < events.size(); i++) {
+      CraneTraceEvent &event = events[i];
+      if (event.timestamp < since) {
+        continue;
+      }
+
+      fprintf(out, ",\n{\"name\":");
+      writeJsonString(out, event.name);
+      fprintf(out, ",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%.3f", event.phase,
+              buffer->id, event.timestamp / 1000.0);
+
+      if (event.phase == 'X') {
+        fprintf(out, ",\"dur\":%.3f", event.value / 1000.0);
+      } else if (event.phase == 'C') {
+        fprintf(out, ",\"args\":{\"value\":%lld}", event.value);
+      }
+      fprintf(out, "}");
+      (*eventCount)++;
+    }
+  }
+
+  fprintf(out, "\n]}\n");
+  return !ferror(out);
+}
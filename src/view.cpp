@@ -0,0 +1,434 @@
+#include "view.hpp"
+#include "context.hpp"
+#include "macros.hpp"
+#include "stats.hpp"
+#include "storage.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * A view either points at contiguous storage, the edit buffer or a mapping
+ * made by `map`, or reads the file's page cache (see "pagecache.hpp") one
+ * pinned page at a time. Paged views of a file being edited see its dirty
+ * pages, which is where edits are kept until one needs the whole file. In
+ * `mode edit-inplace` the edit buffer is a shared mapping of the file itself.
+ * A file with ranges of others spliced in is read through its pieces (see
+ * "pieces.hpp") and edits go there too.
+ */
+struct CraneView {
+  CraneContext *context;
+  // the file selected when the view was acquired
+  CraneOpenFile *file;
+  const u8 *data;
+  u64 size;
+  void *mapping;
+  bool isEditBuffer;
+  CranePageCache *pages;
+  // the page behind the last segment handed out
+  CranePage *page;
+  // a file with spliced ranges, segments not in memory are read into `scratch`
+  CranePieceTable *pieces;
+  std::unique_ptr<u8[]> scratch;
+};
+
+struct CraneViewEdit {
+  CraneView *view;
+  CraneMacro changes;
+
+  CraneViewEdit(CraneView *view) : view(view), changes("") {}
+};
+
+static bool loadEditBuffer(CraneContext *context, CraneOpenFile *file) {
+  if (file == nullptr || !file->isEditing) {
+    return false;
+  }
+
+  if (file->editBuffer != nullptr) {
+    return true;
+  }
+
+  craneTraceSpan(context, "load edit buffer");
+  u8 *buffer = new (std::nothrow) u8[file->editSize];
+  if (buffer == nullptr) {
+    return false;
+  }
+
+  CranePageCache &pages = file->storage->pages;
+  CranePieceTable &pieces = file->storage->pieces;
+  pages.advise(0, file->editSize, CraneViewAccessSequential);
+  u64 copied = pieces.isActive() ? pieces.read(0, buffer, file->editSize)
+                                 : pages.read(0, buffer, file->editSize);
+  pages.advise(0, file->editSize, CraneViewAccessNormal);
+  if (copied != file->editSize) {
+    delete[] buffer;
+    return false;
+  }
+  craneCountRead(context, copied);
+
+  // the buffer holds the edits now, `save` writes all of it
+  file->storage->pieces.clear();
+  pages.invalidate();
+  file->editBuffer = buffer;
+  return true;
+}
+
+static void releasePage(CraneView *view) {
+  if (view->page != nullptr) {
+    view->pages->release(view->page);
+    view->page = nullptr;
+  }
+}
+
+static CraneView *viewAcquire(CraneContext *context) {
+  if (context->openedFile == nullptr) {
+    return nullptr;
+  }
+
+  CraneOpenFile *file = context->openedFile;
+  CraneView *view = new CraneView{
+      context, file, nullptr, 0, nullptr, false, nullptr, nullptr, nullptr, nullptr};
+
+  if (file->isEditing) {
+    view->data = file->editBuffer;
+    view->size = file->editSize;
+    view->isEditBuffer = true;
+    if (file->storage->pieces.isActive()) {
+      view->pieces = &file->storage->pieces;
+    } else if (view->data == nullptr) {
+      view->pages = &file->storage->pages;
+    }
+    return view;
+  }
+
+  struct stat fileStat;
+  if (fstat(fileno(file->handle), &fileStat) != 0) {
+    delete view;
+    return nullptr;
+  }
+
+  view->size = fileStat.st_size;
+  view->pages = &file->storage->pages;
+  return view;
+}
+
+static void viewRelease(CraneView *view) {
+  if (view == nullptr) {
+    return;
+  }
+
+  releasePage(view);
+  if (view->mapping != nullptr) {
+    munmap(view->mapping, view->size);
+  }
+  delete view;
+}
+
+static uint64_t viewSize(const CraneView *view) { return view->size; }
+
+static int viewSegment(CraneView *view, uint64_t offset, CraneViewSegment *out) {
+  if (offset >= view->size) {
+    return 0;
+  }
+
+  if (view->data != nullptr) {
+    out->data = view->data + offset;
+    out->size = view->size - offset;
+    out->offset = offset;
+    return 1;
+  }
+
+  if (view->pieces != nullptr) {
+    if (view->scratch == nullptr) {
+      view->scratch.reset(new u8[kPageCacheSize]);
+    }
+
+    const u8 *data = nullptr;
+    u64 size = view->pieces->segment(offset, view->scratch.get(), kPageCacheSize, &data);
+    out->data = data;
+    out->size = std::min<u64>(size, view->size - offset);
+    out->offset = offset;
+    return size != 0;
+  }
+
+  releasePage(view);
+  view->page = view->pages->acquire(offset >> kPageCacheShift);
+  if (view->page == nullptr) {
+    return 0;
+  }
+
+  u64 within = offset & (kPageCacheSize - 1);
+  out->data = view->page->data.get() + within;
+  out->size = std::min<u64>(kPageCacheSize - within, view->size - offset);
+  out->offset = offset;
+  return 1;
+}
+
+static uint64_t viewRead(CraneView *view, uint64_t offset, void *out, uint64_t size) {
+  if (offset >= view->size) {
+    return 0;
+  }
+
+  uint64_t available = view->size - offset < size ? view->size - offset : size;
+  if (view->data != nullptr) {
+    memcpy(out, view->data + offset, available);
+  } else if (view->pieces != nullptr) {
+    available = view->pieces->read(offset, out, available);
+  } else {
+    available = view->pages->read(offset, out, available);
+  }
+
+  if (!view->isEditBuffer) {
+    craneCountRead(view->context, available);
+  }
+  return available;
+}
+
+static void viewPrefetch(CraneView *view, uint64_t offset, uint64_t size,
+                         CraneViewAccess access) {
+  if (offset >= view->size) {
+    return;
+  }
+
+  if (view->pages != nullptr && view->data == nullptr) {
+    view->pages->advise(offset, size, access);
+    return;
+  }
+
+  if (view->mapping == nullptr) {
+    return;
+  }
+
+  // madvise wants page aligned ranges
+  uint64_t pageSize = sysconf(_SC_PAGESIZE);
+  uint64_t start = offset & ~(pageSize - 1);
+  uint64_t end = view->size - offset < size ? view->size : offset + size;
+
+  int advice = MADV_NORMAL;
+  if (access == CraneViewAccessSequential) {
+    advice = MADV_SEQUENTIAL;
+  } else if (access == CraneViewAccessRandom) {
+    advice = MADV_RANDOM;
+  } else if (access == CraneViewAccessWillNeed) {
+    advice = MADV_WILLNEED;
+  }
+
+  madvise((u8 *)view->mapping + start, end - start, advice);
+}
+
+static int viewMap(CraneView *view, CraneViewSegment *out) {
+  if (view->data == nullptr) {
+    CraneContext *context = view->context;
+    releasePage(view);
+
+    if (view->isEditBuffer) {
+      if (!loadEditBuffer(context, view->file)) {
+        return 0;
+      }
+      view->data = view->file->editBuffer;
+    } else if (view->size != 0) {
+      // outside of edit mode the kernel pages the mapping in and out
+      int fd = fileno(view->file->handle);
+      void *mapped = mmap(nullptr, view->size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped == MAP_FAILED) {
+        return 0;
+      }
+      view->mapping = mapped;
+      view->data = (const u8 *)mapped;
+    }
+    view->pages = nullptr;
+    view->pieces = nullptr;
+  }
+
+  out->data = view->data;
+  out->size = view->size;
+  out->offset = 0;
+  return 1;
+}
+
+static CraneViewEdit *viewBeginEdit(CraneView *view) {
+  if (!view->isEditBuffer) {
+    return nullptr;
+  }
+  return new CraneViewEdit(view);
+}
+
+static int viewReplace(CraneViewEdit *edit, uint64_t offset, uint64_t removed,
+                       const void *bytes, uint64_t size) {
+  if (removed == kCraneViewToEnd) {
+    edit->changes.truncate(offset);
+    edit->changes.insert(offset, (const u8 *)bytes, size);
+    return 0;
+  }
+
+  edit->changes.replace(offset, removed, (const u8 *)bytes, size);
+  return 0;
+}
+
+// overwrites, with at most a truncation at the end, don't move any bytes and
+// can go straight into the file's pages
+static bool isPagedPlan(const CraneMacro &changes) {
+  for (size_t i = 0; i < changes.plan.size(); i++) {
+    const CraneMacroOperation &operation = changes.plan[i];
+    bool isTruncation = operation.removed == kMacroToEnd && i + 1 == changes.plan.size();
+    if (operation.removed != operation.bytes.size() && !isTruncation) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// a file edited in place keeps its size, only overwrites inside it can be made
+static bool isInPlacePlan(const CraneMacro &changes, u64 fileSize) {
+  for (auto &operation : changes.plan) {
+    if (operation.removed != operation.bytes.size() ||
+        operation.offset + operation.removed > fileSize) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool applyToPages(CraneOpenFile *file, const CraneMacro &changes) {
+  CranePageCache &pages = file->storage->pages;
+
+  for (auto &operation : changes.plan) {
+    if (operation.removed == kMacroToEnd) {
+      pages.truncate(operation.offset);
+      file->editSize = operation.offset;
+    }
+
+    if (!pages.write(operation.offset, operation.bytes.data(), operation.bytes.size())) {
+      return false;
+    }
+    file->editSize =
+        std::max<u64>(file->editSize, operation.offset + operation.bytes.size());
+  }
+
+  return true;
+}
+
+// highest offset first, so the offsets of the operations before stay valid
+static void applyToPieces(CraneOpenFile *file, const CraneMacro &changes) {
+  for (auto it = changes.plan.rbegin(); it != changes.plan.rend(); it++) {
+    u64 removed = it->removed;
+    if (removed == kMacroToEnd) {
+      file->storage->pieces.truncate(it->offset);
+      removed = 0;
+    }
+    file->storage->pieces.replace(it->offset, removed, (const u8 *)it->bytes.data(),
+                                  it->bytes.size());
+  }
+  file->editSize = file->storage->pieces.size();
+}
+
+static int viewCommit(CraneViewEdit *edit) {
+  CraneView *view = edit->view;
+  CraneContext *context = view->context;
+  CraneOpenFile *file = view->file;
+
+  // the session may have ended, or the buffer been swapped under the view,
+  // since it was acquired
+  if (!file->isEditing || (view->data != nullptr && file->editBuffer != view->data)) {
+    delete edit;
+    return 1;
+  }
+
+  CraneMacro &changes = edit->changes;
+  changes.compile();
+
+  releasePage(view);
+  bool isPieced = file->storage->pieces.isActive();
+  bool isPaged = !isPieced && file->editBuffer == nullptr && isPagedPlan(changes);
+  if (file->isEditInPlace) {
+    if (!isInPlacePlan(changes, file->editSize)) {
+      delete edit;
+      return 1;
+    }
+  } else if (isPieced) {
+    applyToPieces(file, changes);
+  } else if (isPaged) {
+    if (!applyToPages(file, changes)) {
+      delete edit;
+      return 1;
+    }
+  } else if (!loadEditBuffer(context, file)) {
+    delete edit;
+    return 1;
+  }
+
+  // a recording macro sees the same changes, highest offset first so the
+  // offsets of the ones before stay valid
+  if (context->recordingMacro != nullptr) {
+    for (auto it = changes.plan.rbegin(); it != changes.plan.rend(); it++) {
+      if (it->removed == kMacroToEnd) {
+        context->recordingMacro->truncate(it->offset);
+        if (!it->bytes.empty()) {
+          context->recordingMacro->insert(it->offset, (const u8 *)it->bytes.data(),
+                                          it->bytes.size());
+        }
+      } else {
+        context->recordingMacro->replace(it->offset, it->removed,
+                                         (const u8 *)it->bytes.data(), it->bytes.size());
+      }
+    }
+  }
+
+  // the buffer is the file's shared mapping, writing to it writes the file
+  if (file->isEditInPlace) {
+    for (auto &operation : changes.plan) {
+      memcpy(file->editBuffer + operation.offset, operation.bytes.data(),
+             operation.bytes.size());
+      craneCountWritten(context, operation.bytes.size());
+    }
+    delete edit;
+    return 0;
+  }
+
+  if (isPieced || isPaged) {
+    view->size = file->editSize;
+    delete edit;
+    return 0;
+  }
+
+  size_t outputSize = changes.outputSize(file->editSize);
+  u8 *output = new u8[outputSize];
+  changes.apply(file->editBuffer, file->editSize, output);
+
+  delete[] file->editBuffer;
+  file->editBuffer = output;
+  file->editSize = outputSize;
+  view->data = output;
+  view->size = outputSize;
+  view->pages = nullptr;
+
+  delete edit;
+  return 0;
+}
+
+static void viewAbort(CraneViewEdit *edit) { delete edit; }
+
+const CraneViewApi *craneHostViewApi() {
+  static const CraneViewApi api = {
+    kCraneViewApiVersion,
+    sizeof(CraneViewApi),
+    viewAcquire,
+    viewRelease,
+    viewSize,
+    viewSegment,
+    viewRead,
+    viewPrefetch,
+    viewBeginEdit,
+    viewReplace,
+    viewCommit,
+    viewAbort,
+    viewMap,
+  };
+
+  return &api;
+}
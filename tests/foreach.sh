@@ -0,0 +1,44 @@
+#!/bin/sh
+# `foreach` only runs commands marked safe per file, it refuses the ones that
+# change what every run shares or other files at the same path. Running
+# `deltemplate` on each file of a group used to delete the same template once
+# per file, at the same time.
+#
+# Runs from the top of the tree after `make`: sh tests/foreach.sh
+set -u
+
+crane=${CRANE:-./crane}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+for name in a b c; do
+  printf 'hello %s\n' "$name" > "$work/$name"
+done
+
+fail() {
+  echo "FAIL: $1"
+  exit 1
+}
+
+setup="open $work/a a; open $work/b b; open $work/c c; group add g a b c;
+mode template; newtemplate t \"u32 x;\""
+
+for refused in "deltemplate t" "newtemplate u \"u8 y;\"" "loadtemplate $work/a" \
+               "macro record m" "group delete g" "save" "mode edit" "stats reset" \
+               "trace start" "io engine mmap" "wait" "cancel all"; do
+  out=$("$crane" -c "$setup; foreach g $refused" 2>&1)
+  status=$?
+  [ $status -ge 128 ] && fail "foreach g $refused crashed ($status)"
+  [ $status -eq 0 ] && fail "foreach g $refused was not refused"
+  echo "$out" | grep -q "can't run per file" || fail "foreach g $refused: $out"
+done
+
+# the template survives the refused deletion and still applies per file
+out=$("$crane" -c "$setup; foreach g deltemplate t; templates" 2>&1)
+echo "$out" | grep -q "can't run per file" || fail "deltemplate t was not refused"
+
+out=$("$crane" -c "$setup; templates; mode normal; foreach g dump" 2>&1) ||
+  fail "foreach g dump failed: $out"
+[ "$(echo "$out" | grep -c 'Done (0)')" -eq 3 ] || fail "foreach g dump: $out"
+
+echo "PASS: foreach"
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Macros are recorded on one file and replayed on others through the compiled
+# plan in include/macros.hpp. Edits that overlap, land on earlier inserts or
+# follow a truncation collapse into single operations, and a target shorter
+# than the recorded file is zero filled up to the plan's writes.
+#
+# Runs from the top of the tree after `make`: sh tests/macros.sh
+set -u
+
+crane=${CRANE:-./crane}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+fail() {
+  echo "FAIL: $1"
+  exit 1
+}
+
+# record <edits> on a copy of 0123456789, then replay it on ABCDEFGHIJ and on
+# each of the extra targets
+record() {
+  printf '0123456789' > "$work/recorded"
+  printf 'ABCDEFGHIJ' > "$work/target"
+  out=$("$crane" -c "open $work/recorded r; mode edit; macro record m; $1;
+macro stop; save; macro run m $work/target $2" 2>&1) || fail "$1: $out"
+}
+
+expect() {
+  printf "$2" > "$work/expected"
+  cmp -s "$work/expected" "$1" ||
+    fail "$3: $(basename "$1") is '$(cat "$1")', expected '$(cat "$work/expected")'"
+}
+
+# overlapping writes are merged, the target is patched in place
+record "write 2 abcd; write 4 XY" ""
+expect "$work/recorded" '01abXY6789' "overlapping writes"
+expect "$work/target" 'ABabXYGHIJ' "overlapping writes"
+
+# a write over an insert and the original bytes after it replaces both
+record "insert 3 ins; write 2 zzzz" ""
+expect "$work/recorded" '01zzzz3456789' "write over insert"
+expect "$work/target" 'ABzzzzDEFGHIJ' "write over insert"
+
+# a write after a truncation keeps nothing of the target past the write
+record "truncate 5; write 3 pqrs" ""
+expect "$work/recorded" '012pqrs' "truncate then write"
+expect "$work/target" 'ABCpqrs' "truncate then write"
+
+# targets shorter than the recorded file grow to the end of the last write, in
+# place and when the plan moves bytes
+printf 'abc' > "$work/short"
+printf 'abc' > "$work/shortMoved"
+record "write 8 xy" "$work/short"
+expect "$work/short" 'abc\000\000\000\000\000xy' "shrunken target"
+
+record "insert 0 >; write 5 xy" "$work/shortMoved"
+expect "$work/shortMoved" '>abc\000xy' "shrunken target with an insert"
+
+echo "PASS: macros"
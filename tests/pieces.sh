@@ -0,0 +1,73 @@
+#!/bin/sh
+# 'splice' and 'insertfile' keep ranges of other files as pieces until 'save'
+# (include/pieces.hpp). When nothing of the edited file moved, only the new
+# pieces are written into it. Otherwise a new file is renamed over it, with
+# its permissions, and every file open at the path reopens it. Holes in
+# spliced sources stay holes.
+#
+# Runs from the top of the tree after `make`: sh tests/pieces.sh
+set -u
+
+crane=${CRANE:-./crane}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+fail() {
+  echo "FAIL: $1"
+  exit 1
+}
+
+expect() {
+  printf "$2" > "$work/expected"
+  cmp -s "$work/expected" "$1" ||
+    fail "$3: $(basename "$1") is '$(cat "$1")', expected '$(cat "$work/expected")'"
+}
+
+inode() {
+  ls -i "$1" | awk '{ print $1 }'
+}
+
+printf '0123456789' > "$work/source"
+
+# appending leaves the file's own bytes where they are, it's written in place
+printf 'hello world' > "$work/edited"
+before=$(inode "$work/edited")
+out=$("$crane" -c "open $work/source s; open $work/edited e; select e; mode edit;
+splice s 2 3 11; save" 2>&1) || fail "splice in place: $out"
+expect "$work/edited" 'hello world234' "splice in place"
+[ "$(inode "$work/edited")" = "$before" ] || fail "splice in place replaced the file"
+
+# inserting moves them, the file is replaced and keeps its permissions
+printf 'hello world' > "$work/edited"
+chmod 640 "$work/edited"
+before=$(inode "$work/edited")
+out=$("$crane" -c "open $work/edited e; open $work/edited other; select e; mode edit;
+insertfile $work/source 5; save; select other; range 0 21 | export $work/seen" 2>&1) ||
+  fail "insertfile: $out"
+expect "$work/edited" 'hello0123456789 world' "insertfile"
+[ "$(inode "$work/edited")" != "$before" ] || fail "insertfile wrote over the file"
+[ "$(ls -l "$work/edited" | cut -c1-10)" = "-rw-r-----" ] ||
+  fail "insertfile lost the permissions: $(ls -l "$work/edited")"
+expect "$work/seen" 'hello0123456789 world' "insertfile, other file at the path"
+
+# a sparse source spliced in front of the file stays sparse
+printf 'head' > "$work/sparse"
+dd if=/dev/zero of="$work/sparse" bs=1 count=0 seek=67108864 2>/dev/null
+printf 'tail' >> "$work/sparse"
+if [ "$(du -k "$work/sparse" | awk '{ print $1 }')" -lt 1024 ]; then
+  printf 'hello world' > "$work/edited"
+  out=$("$crane" -c "open $work/edited e; mode edit; insertfile $work/sparse 0;
+save" 2>&1) ||
+    fail "sparse insertfile: $out"
+
+  [ "$(du -k "$work/edited" | awk '{ print $1 }')" -lt 1024 ] ||
+    fail "sparse insertfile filled the holes: $(du -k "$work/edited")"
+  [ "$(wc -c < "$work/edited" | tr -d ' ')" -eq 67108879 ] ||
+    fail "sparse insertfile: $(wc -c < "$work/edited") bytes"
+  cmp -s -n 67108868 "$work/sparse" "$work/edited" ||
+    fail "sparse insertfile changed the source's bytes"
+  [ "$(tail -c 15 "$work/edited")" = "tailhello world" ] ||
+    fail "sparse insertfile: ends with '$(tail -c 15 "$work/edited")'"
+fi
+
+echo "PASS: pieces"